@@ -318,9 +318,11 @@ SOURCES += \
     Controller_SynchMempoolTask.cpp \
     CoTask.cpp \
     DSProof.cpp \
+    Eytzinger.cpp \
     Json/Json.cpp \
     Json/Json_Parser.cpp \
     Json/tests.cpp \
+    LatencyHistogram.cpp \
     Logger.cpp \
     main.cpp \
     Mempool.cpp \
@@ -369,7 +371,9 @@ HEADERS += \
     CostCache.h \
     CoTask.h \
     DSProof.h \
+    Eytzinger.h \
     Json/Json.h \
+    LatencyHistogram.h \
     Logger.h \
     Mempool.h \
     Merkle.h \
@@ -21,6 +21,7 @@
 #include "Compat.h"
 #include "Controller.h"
 #include "Json/Json.h"
+#include "LatencyHistogram.h"
 #include "Logger.h"
 #include "Rpa.h"
 #include "ServerMisc.h"
@@ -91,6 +92,8 @@ App::App(int argc, char *argv[])
     }
     if (options->syslogMode) {
         _logger = std::make_unique<SysLogger>(this);
+    } else if (options->logAsync) {
+        _logger = std::make_unique<AsyncConsoleLogger>(this, options->logAsyncDrop);
     }
 
     connect(this, &App::aboutToQuit, this, &App::cleanup);
@@ -525,6 +528,24 @@ void App::parseArgs()
     {
        "fast-sync", QString("<hidden>"), QString("MB")
     },
+    {
+       "utxo-ram",
+       QString("If specified, " APPNAME " will keep the entire UTXO set in RAM during initial sync, writing it to the"
+               " database only at checkpoints (see --utxo-ram-checkpoint) and at the end of initial sync. This is"
+               " intended for dedicated machines with plenty of RAM. You must specify the memory budget in MB"
+               " (minimum 256 MB). Should the in-RAM UTXO set outgrow this budget, " APPNAME " falls back to the"
+               " bounded behavior of --utxo-cache using this same amount of memory. If the process is killed between"
+               " checkpoints, the database is flagged as corrupt on next startup and must be resynched. The default"
+               " is off (0). This option only takes effect on initial sync and takes precedence over --utxo-cache.\n"),
+       QString("MB"),
+    },
+    {
+       "utxo-ram-checkpoint",
+       QString("The number of blocks between writes of the in-RAM UTXO set to the database when --utxo-ram is in"
+               " effect. Specify 0 to only write at the end of initial sync. Default: %1.\n")
+               .arg(Options::defaultUtxoRamCheckpoint),
+       QString("blocks"),
+    },
     {
         "rpa",
         QString("Explicitly enable the Reusable Payment Address index and offer the associated \"blockchain.rpa.*\" RPC"
@@ -1265,6 +1286,28 @@ void App::parseArgs()
     }
 #endif
 
+    // conf: log_async
+    if (conf.hasValue("log_async")) {
+        bool ok{};
+        const bool val = conf.boolValue("log_async", Options::defaultLogAsync, &ok);
+        if (!ok)
+            throw BadArgs("log_async: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->logAsync = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: log_async = ", val); });
+        if (val && options->syslogMode)
+            Util::AsyncOnObject(this, []{ Warning() << "log_async has no effect in syslog mode"; });
+    }
+
+    // conf: log_async_drop
+    if (conf.hasValue("log_async_drop")) {
+        bool ok{};
+        const bool val = conf.boolValue("log_async_drop", Options::defaultLogAsyncDrop, &ok);
+        if (!ok)
+            throw BadArgs("log_async_drop: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->logAsyncDrop = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: log_async_drop = ", val); });
+    }
+
     // --tls-disallow-deprecated from CLI and/or tls_disallow_deprecated from conf (tls-disallow-deprecated also supported from conf)
     if (parser.isSet("tls-disallow-deprecated") || conf.boolValue("tls_disallow_deprecated", conf.boolValue("tls-disallow-deprecated"))) {
         options->tlsDisallowDeprecated = true;
@@ -1333,6 +1376,80 @@ void App::parseArgs()
         Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: txhash_cache = ", val); });
     }
 
+    // conf: merkle_cache
+    if (conf.hasValue("merkle_cache")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const unsigned val = unsigned(conf.doubleValue("merkle_cache", Options::defaultMerkleCacheBytes / 1e6, &ok) * 1e6);
+        if (!ok || !options->isMerkleCacheBytesInRange(val))
+            throw BadArgs(QString("merkle_cache: please specify a value in the range [%1, %2]")
+                          .arg(options->merkleCacheBytesMin/1e6).arg(options->merkleCacheBytesMax/1e6));
+        options->merkleCacheBytes = val;
+        Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: merkle_cache = ", val); });
+    }
+
+    // conf: rawtx_cache
+    if (conf.hasValue("rawtx_cache")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const double mb = conf.doubleValue("rawtx_cache", Options::defaultRawTxCacheBytes / 1e6, &ok);
+        const unsigned val = unsigned(std::max(mb, 0.) * 1e6);
+        if (!ok || mb < 0. || mb * 1e6 > Options::rawTxCacheBytesMax || !options->isRawTxCacheBytesInRange(val))
+            throw BadArgs(QString("rawtx_cache: please specify 0 (disabled) or a value in the range [%1, %2]")
+                          .arg(options->rawTxCacheBytesMin/1e6).arg(options->rawTxCacheBytesMax/1e6));
+        options->rawTxCacheBytes = val;
+        Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: rawtx_cache = ", val); });
+    }
+
+    // conf: result_cache
+    if (conf.hasValue("result_cache")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const double mb = conf.doubleValue("result_cache", Options::defaultResultCacheBytes / 1e6, &ok);
+        const unsigned val = unsigned(std::max(mb, 0.) * 1e6);
+        if (!ok || mb < 0. || mb * 1e6 > Options::resultCacheBytesMax || !options->isResultCacheBytesInRange(val))
+            throw BadArgs(QString("result_cache: please specify 0 (disabled) or a value in the range [%1, %2]")
+                          .arg(options->resultCacheBytesMin/1e6).arg(options->resultCacheBytesMax/1e6));
+        options->resultCacheBytes = val;
+        Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: result_cache = ", val); });
+    }
+
+    // conf: daemon_cache
+    if (conf.hasValue("daemon_cache")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const double mb = conf.doubleValue("daemon_cache", Options::defaultDaemonCacheBytes / 1e6, &ok);
+        const unsigned val = unsigned(std::max(mb, 0.) * 1e6);
+        if (!ok || mb < 0. || mb * 1e6 > Options::daemonCacheBytesMax || !options->isDaemonCacheBytesInRange(val))
+            throw BadArgs(QString("daemon_cache: please specify 0 (disabled) or a value in the range [%1, %2]")
+                          .arg(options->daemonCacheBytesMin/1e6).arg(options->daemonCacheBytesMax/1e6));
+        options->daemonCacheBytes = val;
+        Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: daemon_cache = ", val); });
+    }
+
+    // conf: download_backlog
+    if (conf.hasValue("download_backlog")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const double mb = conf.doubleValue("download_backlog", Options::defaultDownloadBacklogBytes / 1e6, &ok);
+        if (!ok || mb * 1e6 < Options::downloadBacklogBytesMin || mb * 1e6 > Options::downloadBacklogBytesMax)
+            throw BadArgs(QString("download_backlog: please specify a value in the range [%1, %2]")
+                          .arg(Options::downloadBacklogBytesMin / 1e6).arg(Options::downloadBacklogBytesMax / 1e6));
+        const unsigned val = unsigned(mb * 1e6);
+        options->downloadBacklogBytes = val;
+        Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: download_backlog = ", val); });
+    }
+
+    // conf: headers_in_ram
+    if (conf.hasValue("headers_in_ram")) {
+        bool ok{};
+        const bool val = conf.boolValue("headers_in_ram", Options::defaultHeadersInRam, &ok);
+        if (!ok)
+            throw BadArgs("headers_in_ram: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->headersInRam = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: headers_in_ram = ", val); });
+    }
+
     // CLI: --compact-dbs
     if (parser.isSet("compact-dbs")) {
         options->compactDBs = true;
@@ -1389,6 +1506,44 @@ void App::parseArgs()
         options->utxoCache = static_cast<size_t>(bytes);
     }
 
+    // CLI: --utxo-ram (experimental)
+    // conf: utxo_ram
+    if (const auto & [key, strVal] = [&conf, &parser]() -> std::pair<QString, QString> {
+            if (parser.isSet("utxo-ram")) return {"utxo-ram", parser.value("utxo-ram")};
+            else if (conf.hasValue("utxo_ram")) return {"utxo_ram", conf.value("utxo_ram")};
+            return {};
+        }(); !key.isEmpty())
+    {
+        bool ok{};
+        const double val = strVal.toDouble(&ok);
+        if (!ok || val < 0.)
+            throw BadArgs(QString("%1: Please specify a positive numeric value in MB, or 0 to disable").arg(key));
+        const uint64_t bytes = static_cast<uint64_t>(val * 1e6);
+        if (constexpr auto limit = uint64_t(std::numeric_limits<size_t>::max()); bytes > limit)
+            throw BadArgs(QString("%3: Specified value (%1 bytes) is too large to be addressed by this machine"
+                                  " (limit is: %2 bytes)").arg(bytes).arg(qulonglong(limit)).arg(key));
+        else if (bytes > 0 && bytes < Options::minUtxoRam)
+            throw BadArgs(QString("%3: Specified value %1 is too small (minimum: %2 MB)")
+                              .arg(strVal, QString::number(Options::minUtxoRam / 1e6, 'f', 1), key));
+        options->utxoRam = static_cast<size_t>(bytes);
+        Util::AsyncOnObject(this, [bytes]{ DebugM("config: utxo_ram = ", bytes, " bytes"); });
+    }
+    // CLI: --utxo-ram-checkpoint
+    // conf: utxo_ram_checkpoint
+    if (const auto & [key, strVal] = [&conf, &parser]() -> std::pair<QString, QString> {
+            if (parser.isSet("utxo-ram-checkpoint")) return {"utxo-ram-checkpoint", parser.value("utxo-ram-checkpoint")};
+            else if (conf.hasValue("utxo_ram_checkpoint")) return {"utxo_ram_checkpoint", conf.value("utxo_ram_checkpoint")};
+            return {};
+        }(); !key.isEmpty())
+    {
+        bool ok{};
+        const unsigned val = strVal.toUInt(&ok);
+        if (!ok)
+            throw BadArgs(QString("%1: Please specify a non-negative number of blocks, or 0 to only write at the end of initial sync").arg(key));
+        options->utxoRamCheckpoint = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: utxo_ram_checkpoint = ", val); });
+    }
+
     // conf: anon_logs
     if (conf.hasValue("anon_logs")) {
         bool ok{};
@@ -1508,6 +1663,16 @@ void App::parseArgs()
         options->zmqAllowHashTx = val;
         Util::AsyncOnObject(this, [val]{ DebugM("config: zmq_allow_hashtx = ", val); });
     }
+
+    // conf: zmq_allow_rawblock
+    if (conf.hasValue("zmq_allow_rawblock")) {
+        bool ok{};
+        const bool val = conf.boolValue("zmq_allow_rawblock", Options::defaultZmqAllowRawBlock, &ok);
+        if (!ok)
+            throw BadArgs("zmq_allow_rawblock: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->zmqAllowRawBlock = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: zmq_allow_rawblock = ", val); });
+    }
 }
 
 namespace {
@@ -1528,7 +1693,7 @@ void App::start_httpServer(const Options::Interface &iface)
     std::shared_ptr<SimpleHttpServer> server(new SimpleHttpServer(iface.first, iface.second, 16384));
     httpServers.push_back(server);
     server->tryStart(); // may throw, waits for server to start
-    server->set404Message("Error: Unknown endpoint. /stats & /debug are the only valid endpoint I understand.\r\n");
+    server->set404Message("Error: Unknown endpoint. /stats, /debug & /metrics are the only valid endpoints I understand.\r\n");
     static const auto CRLF = QByteArrayLiteral("\r\n");
     server->addEndpoint("/stats",[this](SimpleHttpServer::Request &req){
         req.response.contentType = "application/json; charset=utf-8";
@@ -1543,6 +1708,11 @@ void App::start_httpServer(const Options::Interface &iface)
         stats = stats.isNull() ? QVariantList{QVariant()} : stats;
         req.response.data = Json::toUtf8(stats, false) + CRLF; // may throw -- caller will handle exception
     });
+    // Prometheus text exposition format (currently just the per-method RPC latency histograms)
+    server->addEndpoint("/metrics",[](SimpleHttpServer::Request &req){
+        req.response.contentType = "text/plain; version=0.0.4; charset=utf-8";
+        req.response.data = LatencyStats::prometheusText();
+    });
 }
 
 /* static */ App::QtLogSuppressionList App::qlSuppressions;
@@ -23,6 +23,7 @@
 #include "Controller_SynchDSPsTask.h"
 #include "Controller_SynchMempoolTask.h"
 #include "CoTask.h"
+#include "LatencyHistogram.h"
 #include "Mempool.h"
 #include "SubsMgr.h"
 #include "ThreadPool.h"
@@ -38,6 +39,7 @@
 #include <cmath>
 #include <ios>
 #include <iterator>
+#include <limits>
 #include <list>
 #include <map>
 #include <mutex>
@@ -45,6 +47,36 @@
 #include <tuple>
 #include <unordered_set>
 
+namespace {
+    /// The parts of a zmq "rawblock" notification (topic, serialized block, LE32 sequence number) that we care about.
+    struct ZmqRawBlock {
+        QByteArray rawblock;
+        QByteArray hash, prevHash; ///< in big endian byte order (which is how we also store them)
+        std::optional<uint32_t> seq;
+
+        /// Returns std::nullopt if the message is malformed (too few parts, or the block is shorter than a header).
+        static std::optional<ZmqRawBlock> fromParts(const QByteArrayList &parts) {
+            constexpr int hdrSize = BTC::GetBlockHeaderSize(), prevHashPos = 4; // header: nVersion, then hashPrevBlock
+            if (parts.size() < 2 || parts[1].size() < hdrSize) return std::nullopt;
+            ZmqRawBlock ret;
+            ret.rawblock = parts[1];
+            ret.hash = BTC::HashRev(ret.rawblock.left(hdrSize));
+            ret.prevHash = Util::reversedCopy(ret.rawblock.mid(prevHashPos, HashLen));
+            if (parts.size() >= 3 && parts[2].size() == 4)
+                ret.seq = bitcoin::ReadLE32(reinterpret_cast<const uint8_t *>(parts[2].constData()));
+            return ret;
+        }
+
+        enum class Action { Ignore, FastPath, FallBack };
+        /// Decides what to do with this block, given our current tip and whether the Controller is busy synching
+        Action action(bool busy, int tipHeight, const QByteArray &tipHash) const {
+            if (busy) return Action::FallBack; // the notification will be handled after the current synch completes
+            if (hash == tipHash) return Action::Ignore; // we already have it
+            if (tipHeight < 0 || prevHash != tipHash) return Action::FallBack; // gap or reorg
+            return Action::FastPath;
+        }
+    };
+} // namespace
 
 Controller::Controller(const std::shared_ptr<const Options> &o, const SSLCertMonitor *certMon)
     : Mgr(nullptr), polltimeMS(int(o->pollTimeSecs * 1e3)), options(o), sslCertMonitor(certMon)
@@ -133,9 +165,13 @@ void Controller::startup()
         conns += connect(bitcoindmgr.get(), &BitcoinDMgr::zmqNotificationsChanged, this, [this](BitcoinDZmqNotifications bdzmqs) {
             // NB: this only fires if ZmqSubNotifier::isAvailable() == true
             using enum ZmqTopic::Tag;
+            // If bitcoind publishes "rawblock", we use it instead of "hashblock" (the rawblock handler falls back to
+            // treating the message as a hashblock notification whenever it can't take the fast path).
+            const bool useRawBlock = options->zmqAllowRawBlock && !bdzmqs.value(ZmqTopic{RawBlock}.str()).isEmpty();
             for (const auto topic : zmqs.allTopics) {
                 if (const auto & topicAddr = bdzmqs.value(topic.str());
-                        !topicAddr.isEmpty() && /* if hashtx allowed: */ (topic.tag != HashTx || options->zmqAllowHashTx)) {
+                        !topicAddr.isEmpty() && /* if hashtx allowed: */ (topic.tag != HashTx || options->zmqAllowHashTx)
+                        && (topic.tag != RawBlock || useRawBlock) && (topic.tag != HashBlock || !useRawBlock)) {
                     auto & state = zmqs[topic];
                     state.lastKnownAddr = topicAddr;
                     DebugM("\"", topic.str(), "\" topic address: ", state.lastKnownAddr);
@@ -480,6 +516,16 @@ QString ChainInfo::toString() const
 
 using VarDLTaskResult = std::variant<PreProcessedBlockPtr, Controller::RpaOnlyModeDataPtr>;
 
+namespace {
+    /// Returns the estimated memory cost of a downloaded block waiting to be processed
+    size_t estimatedInMemoryBytes(const VarDLTaskResult &var) {
+        return std::visit(Overloaded{
+            [](const PreProcessedBlockPtr &ppb) { return ppb->estimatedThisSizeBytes; },
+            [](const Controller::RpaOnlyModeDataPtr &romd) { return romd->serializedPrefixTable.size() + sizeof(*romd); },
+        }, var);
+    }
+} // namespace
+
 struct DownloadBlocksTask : CtlTask
 {
     DownloadBlocksTask(unsigned from, unsigned to, unsigned stride, unsigned numBitcoinDClients,
@@ -505,8 +551,18 @@ struct DownloadBlocksTask : CtlTask
     const bool allowCashTokens; ///< allow special cashtoken deserialization rules (BCH only)
     const int rpaStartHeight; ///< if >= 0, rpa data will be indexed in PreProcessedBlock, starting at this height.
     std::optional<CoTask> rpaTask; ///< this gets created only at the point where current block height >= rpaStartHeight && rpaStartHeight > -1
+    /// Set by Controller::add_DLBlocksTask iff the raw tx cache is enabled. If set, the txs of the last
+    /// kRawTxCacheRecentBlocks blocks of our range are fed to the cache.
+    std::shared_ptr<Storage> rawTxCacheStorage;
+    static constexpr unsigned kRawTxCacheRecentBlocks = 6;
+    /// Set by Controller::add_DLBlocksTask for the zmq "rawblock" tip fast path: the raw block at height `from`, as
+    /// pushed to us by bitcoind. If set, do_get() uses it rather than asking bitcoind for the block.
+    QByteArray zmqRawBlock;
 
     void do_get(unsigned height);
+    /// Verifies `rawblock` against `hash`, deserializes and pre-processes it, and sends it off to the Controller.
+    /// `source` is used for logging only.
+    void processRawBlock(unsigned height, const QByteArray &hash, QByteArray rawblock, const QString &source);
 
     // basically computes expectedCt. Use expectedCt member to get the actual expected ct. this is used only by c'tor as a utility function
     static size_t nToDL(unsigned from, unsigned to, unsigned stride)  { return size_t( (((to-from)+1) + stride-1) / qMax(stride, 1U) ); }
@@ -559,6 +615,15 @@ void DownloadBlocksTask::process()
 void DownloadBlocksTask::do_get(unsigned int bnum)
 {
     if (ctl->isStopping())  return; // short-circuit early return if controller is stopping
+    if (bnum == from && !zmqRawBlock.isEmpty()) {
+        // Tip fast path: bitcoind already pushed us this block via zmq, so skip the getblockhash + getblock round-trips
+        // (and the hex decoding of the block).
+        QByteArray rawblock;
+        rawblock.swap(zmqRawBlock);
+        const auto hash = BTC::HashRev(rawblock.left(HEADER_SIZE));
+        processRawBlock(bnum, hash, std::move(rawblock), QStringLiteral("zmq rawblock"));
+        return;
+    }
     if (unsigned msec = ctl->downloadTaskRecommendedThrottleTimeMsec(bnum); msec > 0) {
         // Controller told us to back off because it is backlogged.
         // Schedule ourselves to run again soon and return.
@@ -572,142 +637,146 @@ void DownloadBlocksTask::do_get(unsigned int bnum)
         const auto hash = Util::ParseHexFast(var.toByteArray());
         if (hash.length() == HashLen) {
             submitRequest("getblock", {var, false}, [this, bnum, hash](const RPC::Message & resp){
-                try {
-                    auto rawblock = Util::ParseHexFast(resp.result().toByteArray());
-                    const auto header = rawblock.left(HEADER_SIZE); // we need a deep copy of this anyway so might as well take it now.
-                    QByteArray chkHash;
-                    if (bool sizeOk = header.length() == HEADER_SIZE; sizeOk && (chkHash = BTC::HashRev(header)) == hash) {
-                        PreProcessedBlockPtr maybe_ppb; // either this is filled
-                        Controller::RpaOnlyModeDataPtr maybe_rpaOnlyMode;  // or this is.. but not both!
-                        try {
-                            const auto cblock = BTC::Deserialize<bitcoin::CBlock>(rawblock, 0, allowSegWit, allowMimble, allowCashTokens, allowMimble /* throw if junk at end if Litecoin (catch deser. bugs) */);
-                            {
-                                VarDLTaskResult var = process_block_guts(bnum, rawblock, cblock);
-                                std::visit(
-                                    Overloaded{
-                                        [&](PreProcessedBlockPtr & p) { maybe_ppb = std::move(p); },
-                                        [&](Controller::RpaOnlyModeDataPtr & r) { maybe_rpaOnlyMode = std::move(r); }
-                                    }, var);
-                            }
-                            if (allowMimble && Debug::isEnabled()) {
-                                // Litecoin only
-                                bool doSerChk{};
-                                if (cblock.mw_blob) {
-                                    const auto n = std::min(cblock.mw_blob->size(), size_t(60));
-                                    TraceM("MimbleBlock: ", bnum, ", data_size: ", cblock.mw_blob->size(),
-                                           ", first ", n, " bytes: ",
-                                           Util::ToHexFast(QByteArray::fromRawData(reinterpret_cast<const char *>(cblock.mw_blob->data()), n)));
-                                    doSerChk = true;
-                                }
-                                if (cblock.vtx.size() >= 2 && cblock.vtx.back()->mw_blob && cblock.vtx.back()->mw_blob->size() > 1) {
-                                    const auto & tx = *cblock.vtx.back();
-                                    const auto n = std::min(tx.mw_blob->size(), size_t(60));
-                                    // We debug out in Green here to catch this very rare thing which I have never seen before
-                                    // to see if it's possible. Someday can demote this to Trace.
-                                    Debug(Log::Green) << "MimbleTxn in block: " << bnum << ", hash: " << QString::fromStdString(tx.GetId().ToString())
-                                                      << ", data_size: " << tx.mw_blob->size() << ", first " << n << " bytes: "
-                                                      << Util::ToHexFast(QByteArray::fromRawData(reinterpret_cast<const char *>(tx.mw_blob->data()), n));
-                                    doSerChk = true;
-                                }
-                                // check sanity (debug builds only)
-                                if constexpr (!isReleaseBuild()) {
-                                    if (doSerChk && rawblock != BTC::Serialize(cblock, allowSegWit, allowMimble)) {
-                                        Fatal() << "Block re-serialized to different data! FIXME!";
-                                        return;
-                                    }
-                                }
-                            } // /Litecoin only
-                        } catch (const std::ios_base::failure &e) {
-                            // deserialization error -- check if block is segwit and we are not segwit
-                            if (!allowSegWit) {
-                                try {
-                                    const auto cblock2 = BTC::DeserializeSegWit<bitcoin::CBlock>(rawblock);
-                                    // If we get here the block deserialized ok as segwit but not ok as non-segwit.
-                                    // We must assume that there is some misconfiguration e.g. the remote is BTC
-                                    // but DB is not expecting BTC. This can happen if user is using non-Satoshi
-                                    // bitcoind with BTC.  We only support /Satoshi... as uagent for BTC due to the
-                                    // way that our auto-detection works.
-                                    if (std::any_of(cblock2.vtx.begin(), cblock2.vtx.end(),
-                                                    [](const auto &tx){ return tx->HasWitness(); }))
-                                        throw InternalError("SegWit block encountered for non-SegWit coin."
-                                                            " If you wish to use BTC, please delete the datadir and"
-                                                            " resynch using Bitcoin Core v0.17.0 or later.");
-                                } catch (const std::ios_base::failure &) { /* ignore -- block is bad as segwit too. */}
-                            }
-                            throw; // outer catch clause will handle printing the message
+                processRawBlock(bnum, hash, Util::ParseHexFast(resp.result().toByteArray()), resp.method);
+            });
+        } else {
+            Warning() << resp.method << ": at height " << bnum << " hash not valid (decoded size: " << hash.length() << ")";
+            errorCode = int(bnum);
+            errorMessage = QString("invalid hash for height %1").arg(bnum);
+            emit errored();
+        }
+    });
+}
+
+void DownloadBlocksTask::processRawBlock(unsigned bnum, const QByteArray &hash, QByteArray rawblock, const QString &source)
+{
+    try {
+        const auto header = rawblock.left(HEADER_SIZE); // we need a deep copy of this anyway so might as well take it now.
+        QByteArray chkHash;
+        if (bool sizeOk = header.length() == HEADER_SIZE; sizeOk && (chkHash = BTC::HashRev(header)) == hash) {
+            PreProcessedBlockPtr maybe_ppb; // either this is filled
+            Controller::RpaOnlyModeDataPtr maybe_rpaOnlyMode;  // or this is.. but not both!
+            try {
+                const auto cblock = BTC::Deserialize<bitcoin::CBlock>(rawblock, 0, allowSegWit, allowMimble, allowCashTokens, allowMimble /* throw if junk at end if Litecoin (catch deser. bugs) */);
+                {
+                    VarDLTaskResult var = process_block_guts(bnum, rawblock, cblock);
+                    std::visit(
+                        Overloaded{
+                            [&](PreProcessedBlockPtr & p) { maybe_ppb = std::move(p); },
+                            [&](Controller::RpaOnlyModeDataPtr & r) { maybe_rpaOnlyMode = std::move(r); }
+                        }, var);
+                }
+                if (allowMimble && Debug::isEnabled()) {
+                    // Litecoin only
+                    bool doSerChk{};
+                    if (cblock.mw_blob) {
+                        const auto n = std::min(cblock.mw_blob->size(), size_t(60));
+                        TraceM("MimbleBlock: ", bnum, ", data_size: ", cblock.mw_blob->size(),
+                               ", first ", n, " bytes: ",
+                               Util::ToHexFast(QByteArray::fromRawData(reinterpret_cast<const char *>(cblock.mw_blob->data()), n)));
+                        doSerChk = true;
+                    }
+                    if (cblock.vtx.size() >= 2 && cblock.vtx.back()->mw_blob && cblock.vtx.back()->mw_blob->size() > 1) {
+                        const auto & tx = *cblock.vtx.back();
+                        const auto n = std::min(tx.mw_blob->size(), size_t(60));
+                        // We debug out in Green here to catch this very rare thing which I have never seen before
+                        // to see if it's possible. Someday can demote this to Trace.
+                        Debug(Log::Green) << "MimbleTxn in block: " << bnum << ", hash: " << QString::fromStdString(tx.GetId().ToString())
+                                          << ", data_size: " << tx.mw_blob->size() << ", first " << n << " bytes: "
+                                          << Util::ToHexFast(QByteArray::fromRawData(reinterpret_cast<const char *>(tx.mw_blob->data()), n));
+                        doSerChk = true;
+                    }
+                    // check sanity (debug builds only)
+                    if constexpr (!isReleaseBuild()) {
+                        if (doSerChk && rawblock != BTC::Serialize(cblock, allowSegWit, allowMimble)) {
+                            Fatal() << "Block re-serialized to different data! FIXME!";
+                            return;
                         }
-                        assert(bool(maybe_ppb) + bool(maybe_rpaOnlyMode) == 1);
+                    }
+                } // /Litecoin only
+            } catch (const std::ios_base::failure &e) {
+                // deserialization error -- check if block is segwit and we are not segwit
+                if (!allowSegWit) {
+                    try {
+                        const auto cblock2 = BTC::DeserializeSegWit<bitcoin::CBlock>(rawblock);
+                        // If we get here the block deserialized ok as segwit but not ok as non-segwit.
+                        // We must assume that there is some misconfiguration e.g. the remote is BTC
+                        // but DB is not expecting BTC. This can happen if user is using non-Satoshi
+                        // bitcoind with BTC.  We only support /Satoshi... as uagent for BTC due to the
+                        // way that our auto-detection works.
+                        if (std::any_of(cblock2.vtx.begin(), cblock2.vtx.end(),
+                                        [](const auto &tx){ return tx->HasWitness(); }))
+                            throw InternalError("SegWit block encountered for non-SegWit coin."
+                                                " If you wish to use BTC, please delete the datadir and"
+                                                " resynch using Bitcoin Core v0.17.0 or later.");
+                    } catch (const std::ios_base::failure &) { /* ignore -- block is bad as segwit too. */}
+                }
+                throw; // outer catch clause will handle printing the message
+            }
+            assert(bool(maybe_ppb) + bool(maybe_rpaOnlyMode) == 1);
 
-                        // Grab some stats
-                        const size_t numTxns = maybe_ppb ? maybe_ppb->txInfos.size()
-                                                         : maybe_rpaOnlyMode->nTx,
-                                     numIns  = maybe_ppb ? maybe_ppb->inputs.size()
-                                                         : maybe_rpaOnlyMode->nIns,
-                                     numOuts = maybe_ppb ? maybe_ppb->outputs.size()
-                                                         : maybe_rpaOnlyMode->nOuts;
+            // Grab some stats
+            const size_t numTxns = maybe_ppb ? maybe_ppb->txInfos.size()
+                                             : maybe_rpaOnlyMode->nTx,
+                         numIns  = maybe_ppb ? maybe_ppb->inputs.size()
+                                             : maybe_rpaOnlyMode->nIns,
+                         numOuts = maybe_ppb ? maybe_ppb->outputs.size()
+                                             : maybe_rpaOnlyMode->nOuts;
 
-                        if (TRACE) Trace() << "block " << bnum << " size: " << rawblock.size() << " nTx: " << numTxns;
+            if (TRACE) Trace() << "block " << bnum << " size: " << rawblock.size() << " nTx: " << numTxns;
 
-                        rawblock.clear(); // free memory right away (needed for ScaleNet huge blocks)
+            rawblock.clear(); // free memory right away (needed for ScaleNet huge blocks)
 
-                        // . <--- NOTE: rawblock not to be used beyond this point (it is now empty)
+            // . <--- NOTE: rawblock not to be used beyond this point (it is now empty)
 
-                        // update some stats for /stats endpoint
-                        nTx += numTxns;
-                        nOuts += numOuts;
-                        nIns += numIns;
+            // update some stats for /stats endpoint
+            nTx += numTxns;
+            nOuts += numOuts;
+            nIns += numIns;
 
-                        const size_t index = height2Index(bnum);
-                        ++goodCt;
-                        q_ct = qMax(q_ct-1, 0);
-                        lastProgress = double(index) / double(expectedCt);
-                        if (!(bnum % 1000) && bnum) {
-                            emit progress(lastProgress);
-                        }
-                        if (TRACE) Trace() << resp.method << ": header for height: " << bnum << " len: " << header.length();
-
-                        // send the result off to the Controller
-                        if (maybe_ppb) {
-                            // send the block off to the Controller thread for further processing and for save to db
-                            emit ctl->putBlock(this, maybe_ppb);
-                        } else {
-                            // RPA-only indexing mode, send the serialized RPA prefix table data to the Controller thread
-                            emit ctl->putRpaIndex(this, maybe_rpaOnlyMode);
-                        }
+            const size_t index = height2Index(bnum);
+            ++goodCt;
+            q_ct = qMax(q_ct-1, 0);
+            lastProgress = double(index) / double(expectedCt);
+            if (!(bnum % 1000) && bnum) {
+                emit progress(lastProgress);
+            }
+            if (TRACE) Trace() << source << ": header for height: " << bnum << " len: " << header.length();
 
-                        if (goodCt >= expectedCt) {
-                            // flag state to maybeDone to do checks when process() called again
-                            maybeDone = true;
-                            AGAIN();
-                            return;
-                        }
-                        while (goodCt + unsigned(q_ct) < expectedCt && q_ct < max_q) {
-                            // queue multiple at once
-                            AGAIN();
-                            ++q_ct;
-                        }
-                    } else if (!sizeOk) {
-                        Warning() << resp.method << ": at height " << bnum << " header not valid (decoded size: " << header.length() << ")";
-                        errorCode = int(bnum);
-                        errorMessage = QString("bad size for height %1").arg(bnum);
-                        emit errored();
-                    } else {
-                        Warning() << resp.method << ": at height " << bnum << " header not valid (expected hash: " << hash.toHex() << ", got hash: " << chkHash.toHex() << ")";
-                        errorCode = int(bnum);
-                        errorMessage = QString("hash mismatch for height %1").arg(bnum);
-                        emit errored();
-                    }
-                } catch (const std::exception &e) {
-                    Fatal() << QString("Caught exception processing block %1: %2").arg(bnum).arg(e.what());
-                }
-            });
+            // send the result off to the Controller
+            if (maybe_ppb) {
+                // send the block off to the Controller thread for further processing and for save to db
+                emit ctl->putBlock(this, maybe_ppb);
+            } else {
+                // RPA-only indexing mode, send the serialized RPA prefix table data to the Controller thread
+                emit ctl->putRpaIndex(this, maybe_rpaOnlyMode);
+            }
+
+            if (goodCt >= expectedCt) {
+                // flag state to maybeDone to do checks when process() called again
+                maybeDone = true;
+                AGAIN();
+                return;
+            }
+            while (goodCt + unsigned(q_ct) < expectedCt && q_ct < max_q) {
+                // queue multiple at once
+                AGAIN();
+                ++q_ct;
+            }
+        } else if (!sizeOk) {
+            Warning() << source << ": at height " << bnum << " header not valid (decoded size: " << header.length() << ")";
+            errorCode = int(bnum);
+            errorMessage = QString("bad size for height %1").arg(bnum);
+            emit errored();
         } else {
-            Warning() << resp.method << ": at height " << bnum << " hash not valid (decoded size: " << hash.length() << ")";
+            Warning() << source << ": at height " << bnum << " header not valid (expected hash: " << hash.toHex() << ", got hash: " << chkHash.toHex() << ")";
             errorCode = int(bnum);
-            errorMessage = QString("invalid hash for height %1").arg(bnum);
+            errorMessage = QString("hash mismatch for height %1").arg(bnum);
             emit errored();
         }
-    });
+    } catch (const std::exception &e) {
+        Fatal() << QString("Caught exception processing block %1: %2").arg(bnum).arg(e.what());
+    }
 }
 
 // This has been refactored out of do_get() above to offer polymorphic subclasses the ability to also leverage
@@ -726,6 +795,13 @@ VarDLTaskResult DownloadBlocksTask::process_block_guts(unsigned bnum, const QByt
 
     auto ppb = PreProcessedBlock::makeShared(bnum, size_t(rawblock.size()), cblock, rpaTaskIfEnabledForThisBlock);
 
+    // Feed the raw tx cache with the txs of blocks near the tip (the ones clients are likely to ask about). We skip
+    // this for MimbleWimble (Litecoin) since its txs may not re-serialize exactly as bitcoind would serve them.
+    if (rawTxCacheStorage && !allowMimble && bnum + kRawTxCacheRecentBlocks > to) {
+        for (const auto & tx : cblock.vtx)
+            rawTxCacheStorage->rawTxCachePut(BTC::Hash2ByteArrayRev(tx->GetHashRef()), BTC::Serialize(*tx, allowSegWit));
+    }
+
     if (UNLIKELY(rpaIsEnabledForThisBlock && bnum == unsigned(rpaStartHeight))) {
         Util::AsyncOnObject(ctl, [height = rpaStartHeight]{
             // We do this in the Controller thread to make the log look pretty, since all other logging
@@ -807,6 +883,8 @@ void Controller::printMempoolStatusToLog(size_t newSize, size_t numAddresses, do
 
 struct Controller::StateMachine
 {
+    explicit StateMachine(uint64_t downloadBacklogBytes) : dlBacklog(downloadBacklogBytes) {}
+
     enum State : uint8_t {
         Begin=0, WaitingForChainInfo,
         GetBlocks, DownloadingBlocks, FinishedDL, // regular full synch forward, PreProcessedBlockPtr instances created in dlResults table
@@ -828,6 +906,60 @@ struct Controller::StateMachine
 
     std::atomic<unsigned> dlResultsHtNext = 0;  ///< the next unprocessed block height we need to process in series
 
+    /// Memory-budgeted download backlog. Download tasks are throttled (see downloadTaskRecommendedThrottleTimeMsec)
+    /// once the blocks waiting in dlResults cost more than `budget` bytes, or once they get more than `budget` bytes'
+    /// worth of (average-sized) blocks ahead of the block being processed. The budget follows the measured throughput
+    /// of the addBlock stage so that there is always about kTargetSecs of work queued up for it, but it never exceeds
+    /// the configured maximum (download_backlog). Only the Controller thread writes to this; download tasks read it.
+    struct DLBacklog {
+        static constexpr uint64_t kMinBudget = 16'000'000; ///< never throttle below this, regardless of throughput
+        static constexpr double kTargetSecs = 10.0, ///< how many seconds of work to keep queued for the addBlock stage
+                                kAlpha = 0.05; ///< EWMA smoothing factor for the measurements below
+        const uint64_t maxBudget;
+        std::atomic_uint64_t bytes = 0u; ///< estimated in-memory size of everything in dlResults
+        std::atomic_uint64_t budget; ///< the current budget, in [kMinBudget, maxBudget]; starts at maxBudget
+        std::atomic_uint64_t avgItemBytes = 0u; ///< EWMA of the in-memory size of a downloaded block
+        std::atomic_uint64_t nThrottled = 0u; ///< stats: the number of times a download was told to back off
+        double avgAddBytes = 0.0, avgAddSecs = 0.0; ///< EWMAs of the size and addBlock time of each processed block
+
+        explicit DLBacklog(uint64_t max) : maxBudget(std::max(max, kMinBudget)), budget(maxBudget) {}
+
+        void added(uint64_t n) {
+            bytes += n;
+            const auto avg = avgItemBytes.load();
+            avgItemBytes = avg ? uint64_t(double(avg) + kAlpha * (double(n) - double(avg))) : n;
+        }
+        void consumed(uint64_t n, double secs) {
+            bytes -= std::min(n, bytes.load());
+            avgAddBytes = avgAddSecs > 0.0 ? avgAddBytes + kAlpha * (double(n) - avgAddBytes) : double(n);
+            avgAddSecs = avgAddSecs > 0.0 ? avgAddSecs + kAlpha * (secs - avgAddSecs) : secs;
+            if (avgAddSecs > 0.0)
+                budget = std::clamp(uint64_t(bytesPerSec() * kTargetSecs), kMinBudget, maxBudget);
+        }
+        double bytesPerSec() const { return avgAddSecs > 0.0 ? avgAddBytes / avgAddSecs : 0.0; }
+        /// How many heights past the one being processed downloads may currently get to
+        uint64_t windowBlocks() const {
+            const auto avg = avgItemBytes.load();
+            return avg ? std::max<uint64_t>(budget.load() / avg, 1u) : std::numeric_limits<uint64_t>::max();
+        }
+        /// Returns how long the download of height `bnum` should back off for (0 = not at all), given that `next` is
+        /// the height the addBlock stage is waiting for. Thread-safe.
+        unsigned throttleMsec(unsigned bnum, unsigned next, size_t concurrency) {
+            // Never hold back the heights that the addBlock stage is about to need, or we could stall it.
+            if (bnum < next + unsigned(concurrency))
+                return 0u;
+            const uint64_t ahead = bnum - next;
+            if (bytes.load() < budget.load() && ahead <= windowBlocks())
+                return 0u;
+            ++nThrottled;
+            // Make the backoff time be from 10ms to 50ms, depending on how far in the future this block height is from
+            // what we are processing.  The hope is that this enforces some order on future block arrivals and also
+            // prevents excessive polling for blocks that are too far ahead of us.
+            return unsigned(std::min<uint64_t>(10u + 5u * (ahead / concurrency), 50u));
+        }
+    };
+    DLBacklog dlBacklog;
+
     // todo: tune this
     const size_t DL_CONCURRENCY = std::max<size_t>(Util::getNPhysicalProcessors(), 1u);
 
@@ -868,33 +1000,9 @@ struct Controller::StateMachine
 unsigned Controller::downloadTaskRecommendedThrottleTimeMsec(unsigned bnum) const
 {
     std::shared_lock g(smLock); // this lock guarantees that 'sm' won't be deleted from underneath us
-    if (sm) {
-        int maxBackLog = 1000; // <--- TODO: have this be a more dynamic value based on current average blocksize.
-        if (sm->net == BTC::Net::MainNet) {
-            // mainnet
-            if (bnum > 150'000) // beyond this height the blocks are starting to be big enough that we want to not eat memory.
-                maxBackLog = 250;
-            else if (bnum > 550'000 && !isSegWitCoin()) // beyond this height we may start to see 32MB blocks in the future
-                maxBackLog = 100;
-        } else if (sm->net == BTC::ScaleNet) {
-            if (bnum > 10'000)
-                maxBackLog = 10; // on ScaleNet, after block 10,000 -- we may start to hit big blocks.
-        } else if (sm->net == BTC::TestNet4 || sm->net == BTC::ChipNet) {
-            // nothing, use 1000 always, testnet4 & chipnet have 2MB blocks.
-        } else {
-            // testnet
-            if (bnum > 1'300'000) // beyond this height 32MB blocks may be common, esp. in the future
-                maxBackLog = isSegWitCoin() ? 250 : 100;
-        }
-
-        const int diff = int(bnum) - int(sm->dlResultsHtNext.load()); // note: dlResultsHtNext is not guarded by the lock but it is an atomic value, so that's fine.
-        if ( diff > maxBackLog ) {
-            // Make the backoff time be from 10ms to 50ms, depending on how far in the future this block height is from
-            // what we are processing.  The hope is that this enforces some order on future block arrivals and also
-            // prevents excessive polling for blocks that are too far ahead of us.
-            return std::min(10u + 5u*unsigned(diff - maxBackLog - 1), 50u); // TODO: also have this be tuneable
-        }
-    }
+    if (sm)
+        // note: dlResultsHtNext is not guarded by the lock but it is an atomic value, so that's fine.
+        return sm->dlBacklog.throttleMsec(bnum, sm->dlResultsHtNext.load(), sm->DL_CONCURRENCY);
     return 0u;
 }
 
@@ -909,7 +1017,7 @@ void Controller::rmTask(CtlTask *t)
 
 bool Controller::isTaskDeleted(CtlTask *t) const { return tasks.count(t) == 0; }
 
-CtlTask * Controller::add_DLBlocksTask(unsigned int from, unsigned int to, size_t nTasks, bool isRpaOnlyMode)
+CtlTask * Controller::add_DLBlocksTask(unsigned int from, unsigned int to, size_t nTasks, bool isRpaOnlyMode, QByteArray zmqRawBlock)
 {
     const int rpaStartHeight = storage->getConfiguredRpaStartHeight(); // -1 here means "rpa disabled"
     DownloadBlocksTask *t = [&]() -> DownloadBlocksTask * {
@@ -920,6 +1028,9 @@ CtlTask * Controller::add_DLBlocksTask(unsigned int from, unsigned int to, size_
             return newTask<DownloadBlocksTask>(false, unsigned(from), unsigned(to), unsigned(nTasks),
                                                options->bdNClients, rpaStartHeight, this);
     }();
+    if (!isRpaOnlyMode && storage->isRawTxCacheEnabled())
+        t->rawTxCacheStorage = storage;
+    t->zmqRawBlock = std::move(zmqRawBlock);
     // notify BitcoinDMgr that we are in a block download when the first task starts
     connect(t, &CtlTask::started, this, [this]{
         const auto nTasksExtant = ++nDLBlocksTasks;
@@ -1072,7 +1183,7 @@ void Controller::process(bool beSilentIfUpToDate)
     //DebugM("Process called...");
     if (!sm) {
         std::lock_guard g(smLock);
-        sm = std::make_unique<StateMachine>();
+        sm = std::make_unique<StateMachine>(options->downloadBacklogBytes);
     }
     using State = StateMachine::State;
     if (sm->state == State::Begin) {
@@ -1442,7 +1553,9 @@ void Controller::on_putCommon(CtlTask *task, const T &p, const int expectedState
                expectedStateName, "\" (", int(expectedState), ") but rather is: \"", sm->stateStr(), "\" (", int(sm->state), ")");
         return;
     }
-    sm->dlResults[p->height] = p;
+    VarDLTaskResult var = p;
+    sm->dlBacklog.added(estimatedInMemoryBytes(var));
+    sm->dlResults[p->height] = std::move(var);
     process_DownloadingBlocks();
 }
 
@@ -1524,6 +1637,7 @@ void Controller::process_DownloadingBlocks()
         auto varDlResult = std::move(it->second);
         ++sm->dlResultsHtNext;
         sm->dlResults.erase(it); // remove immediately from q
+        const Tic t0;
         const bool ok =
         std::visit(Overloaded{
             [this](const PreProcessedBlockPtr &ppb){
@@ -1555,6 +1669,7 @@ void Controller::process_DownloadingBlocks()
             },
         }, varDlResult);
         if (!ok) return;
+        sm->dlBacklog.consumed(estimatedInMemoryBytes(varDlResult), t0.secs());
         ++ct;
 
         if (sm->dlResultsHtNext > sm->endHeight) {
@@ -1747,6 +1862,18 @@ auto Controller::stats() const -> Stats
         } else {
             m2["BackLog"] = QVariant(); // null
         }
+        {
+            const auto & backlog = sm->dlBacklog;
+            const auto toMB = [](double bytes) { return QString("%1 MB").arg(QString::number(bytes / 1e6, 'f', 3)); };
+            QVariantMap m3;
+            m3["in-memory (est.)"] = toMB(backlog.bytes.load());
+            m3["budget"] = toMB(backlog.budget.load());
+            m3["budget (max)"] = toMB(backlog.maxBudget);
+            m3["addBlock throughput"] = toMB(backlog.bytesPerSec()) + "/sec";
+            m3["window (blocks)"] = backlog.avgItemBytes.load() ? QVariant(qulonglong(backlog.windowBlocks())) : QVariant();
+            m3["throttled (count)"] = qulonglong(backlog.nThrottled.load());
+            m2["Download budget"] = m3;
+        }
         m["StateMachine"] = m2;
     } else
         m["StateMachine"] = QVariant(); // null
@@ -1769,6 +1896,10 @@ auto Controller::stats() const -> Stats
                 QVariantMap m3;
                 m3["address"] = state.lastKnownAddr;
                 m3["notifications"] = static_cast<qulonglong>(state.notifCt);
+                if (topic.tag == ZmqTopic::Tag::RawBlock) {
+                    m3["tip fast path"] = static_cast<qulonglong>(zmqs.rawBlockFastPathCt);
+                    m3["fell back to polling"] = static_cast<qulonglong>(zmqs.rawBlockFallbackCt);
+                }
                 m2[topic.str()] = m3;
             }
         }
@@ -1782,6 +1913,10 @@ auto Controller::stats() const -> Stats
     st["SubsMgr"] = storage->subs()->statsSafe(kDefaultTimeout/2);
     st["SubsMgr (DSPs)"] = storage->dspSubs()->statsSafe(kDefaultTimeout/4);
     st["SubsMgr (Txs)"] = storage->txSubs()->statsSafe(kDefaultTimeout/4);
+    // Per-method RPC latency histograms (usec), broken down by phase
+    st["RPC Latency"] = LatencyStats::stats();
+    // Per-method counts of requests served by joining an identical in-flight request
+    st["RPC Coalescing"] = ServerBase::coalescingStats();
     // Config (Options) map
     st["Config"] = options->toMap();
     { // Process memory usage
@@ -1843,6 +1978,7 @@ auto Controller::debug(const StatsParams &p) const -> Stats // from StatsMixin
         m["block_height"] = qlonglong(stats.block_height);
         m["block_hash"] = QString::fromLatin1(stats.block_hash.toHex());
         m["utxo_db_ct"] = qlonglong(stats.utxo_db_ct);
+        m["utxo_db_bucket_ct"] = qlonglong(stats.utxo_db_bucket_ct);
         m["utxo_db_size_bytes"] = qlonglong(stats.utxo_db_size_bytes);
         m["utxo_db_shasum"] = QString::fromLatin1(stats.utxo_db_shasum.toHex());
         m["shunspent_db_ct"] = qlonglong(stats.shunspent_db_ct);
@@ -1918,6 +2054,12 @@ void Controller::zmqTopicStart(ZmqTopic t)
             Warning() << "zmqNotifier \"" << t.str() << "\": " << errMsg;
         });
         conns += connect(state.notifier.get(), &ZmqSubNotifier::gotMessage, this, [this, t](const QString &topic, const QByteArrayList &parts) {
+            if (t.tag == ZmqTopic::Tag::RawBlock) {
+                if (auto *state = zmqs.find(t)) [[likely]]
+                    ++state->notifCt;
+                on_zmqRawBlock(parts); // may take the tip fast path, or end up calling on_Poll()
+                return;
+            }
             std::optional<std::pair<ZmqTopic, QByteArray>> optPair;
             if (Debug::isEnabled()) {
                 Debug d;
@@ -1992,11 +2134,59 @@ void Controller::zmqStopAll(bool cleanup)
     }
 }
 
+void Controller::on_zmqRawBlock(const QByteArrayList &parts)
+{
+    auto optRb = ZmqRawBlock::fromParts(parts);
+    if (UNLIKELY(!optRb)) {
+        Error() << "Unexpected format: got zmq rawblock notification but it is missing the block!";
+        return;
+    }
+    auto & rb = *optRb;
+    DebugM("got zmq rawblock notification: ", Util::ToHexFast(rb.hash), ", size: ", rb.rawblock.size(),
+           rb.seq ? QString(", seq: %1").arg(*rb.seq) : QString());
+    const auto [tip, tipHash] = storage->latestTip();
+    switch (rb.action(sm || stopFlag, tip, tipHash)) {
+    case ZmqRawBlock::Action::Ignore:
+        DebugM("zmq rawblock matches our latest tip, ignoring ...");
+        return;
+    case ZmqRawBlock::Action::FallBack:
+        // We are busy (on_Poll() then remembers the notification and re-polls bitcoind when the current synch is
+        // done), or there is a gap or a reorg, which the regular polling path sorts out. Either way, this behaves
+        // exactly as if we got a "hashblock" notification for this block.
+        ++zmqs.rawBlockFallbackCt;
+        on_Poll(std::pair{ZmqTopic{ZmqTopic::Tag::HashBlock}, std::move(rb.hash)});
+        return;
+    case ZmqRawBlock::Action::FastPath:
+        break;
+    }
+    // Tip fast path: set up the state machine the way State::GetBlocks would for a 1-block download, but hand the task
+    // the block we already have. Once the block is added, we go back to State::Begin as usual, which checks in with
+    // bitcoind (to catch any further blocks) and then synchs the mempool.
+    ++zmqs.rawBlockFastPathCt;
+    stopTimer(pollTimerName);
+    {
+        std::lock_guard g(smLock);
+        sm = std::make_unique<StateMachine>(options->downloadBacklogBytes);
+    }
+    const unsigned height = unsigned(tip) + 1u;
+    sm->ht = sm->nHeaders = int(height);
+    sm->startedTs = sm->lastProgTs = Util::getTimeSecs();
+    sm->dlResultsHtNext = sm->startheight = height;
+    sm->endHeight = height;
+    Log() << "Block height " << height << ", got new block via zmq ...";
+    emit synchronizing();
+    // NB: never RPA-only mode here: that mode is only for re-indexing past blocks (State::DownloadingBlocks_RPA), during
+    // which `sm` is set, so we fell back above. A new tip block is always fully processed (RPA data included).
+    add_DLBlocksTask(height, height, 1, false, std::move(rb.rawblock));
+    sm->state = StateMachine::State::DownloadingBlocks; // we will be called back by the download task in on_putBlock()
+}
+
 const char *Controller::ZmqPvt::Topic::str() const noexcept
 {
     switch (tag) {
     case HashBlock: return "hashblock";
     case HashTx: return "hashtx";
+    case RawBlock: return "rawblock";
     }
     return "unknown";
 }
@@ -2030,3 +2220,263 @@ void Controller::dumpScriptHashes(const QString &fileName)
           <<" (" << QString::number(outFile.size()/1e6, 'f', 3) << " MB)";
     emit dumpScriptHashesComplete();
 }
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+#include "tests/Tests.h"
+
+#if defined(ENABLE_ZMQ)
+#define ZMQ_CPP11
+#include "zmq/zmq.hpp"
+#endif
+
+#include <QTemporaryDir>
+
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+namespace {
+    struct TestBlock { QByteArray raw, hash; };
+
+    /// Returns a chain of `n` (coinbase-only) serialized blocks on top of `prevHash` (big endian, may be empty)
+    std::vector<TestBlock> makeChain(size_t n, const QByteArray &prevHash, int salt) {
+        std::vector<TestBlock> ret;
+        bitcoin::uint256 prev;
+        if (!prevHash.isEmpty()) {
+            const auto le = Util::reversedCopy(prevHash);
+            std::copy(le.begin(), le.end(), prev.begin());
+        }
+        for (size_t i = 0; i < n; ++i) {
+            bitcoin::CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout.SetNull();
+            tx.vin[0].scriptSig = bitcoin::CScript() << int64_t(i) << int64_t(salt);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = 50 * bitcoin::COIN;
+            tx.vout[0].scriptPubKey = bitcoin::CScript() << bitcoin::OP_TRUE;
+            bitcoin::CBlock block;
+            block.nVersion = 4;
+            block.hashPrevBlock = prev;
+            block.nTime = 1'700'000'000u + uint32_t(i) * 600u;
+            block.nBits = 0x207fffffu;
+            block.vtx.push_back(bitcoin::MakeTransactionRef(std::move(tx)));
+            block.hashMerkleRoot = block.vtx.front()->GetHashRef();
+            prev = block.GetHash();
+            ret.push_back({BTC::Serialize(block), BTC::Hash2ByteArrayRev(prev)});
+        }
+        return ret;
+    }
+
+    QByteArrayList mkParts(const QByteArray &raw, uint32_t seq) {
+        QByteArray seqBytes(4, Qt::Uninitialized);
+        bitcoin::WriteLE32(reinterpret_cast<uint8_t *>(seqBytes.data()), seq);
+        return {QByteArrayLiteral("rawblock"), raw, seqBytes};
+    }
+
+    TEST_SUITE(zmqrawblock)
+    TEST_CASE(messages) {
+        // a chain, a competing block for height 2 (reorg), and a block that skips height 4 (gap)
+        const auto chain = makeChain(4, {}, 0);
+        const auto fork = makeChain(1, chain[1].hash, 1);
+        const auto afterGap = makeChain(1, makeChain(1, chain[3].hash, 2).front().hash, 3);
+        std::vector<QByteArrayList> replay;
+        uint32_t seq = 0;
+        for (const auto & blocks : {chain, fork, afterGap})
+            for (const auto & b : blocks)
+                replay.push_back(mkParts(b.raw, seq++));
+
+        // Optionally, replay them through a local zmq publisher to exercise the ZmqSubNotifier end of things too
+        std::vector<QByteArrayList> received;
+#if defined(ENABLE_ZMQ)
+        {
+            zmq::context_t ctx;
+            zmq::socket_t pub(ctx, zmq::socket_type::pub);
+            pub.bind("tcp://127.0.0.1:*");
+            const auto endpoint = QString::fromStdString(pub.get(zmq::sockopt::last_endpoint));
+            std::mutex mut;
+            std::condition_variable cond;
+            ZmqSubNotifier notifier;
+            QObject::connect(&notifier, &ZmqSubNotifier::gotMessage, &notifier, [&](const QString &, const QByteArrayList &parts) {
+                std::unique_lock g(mut);
+                received.push_back(parts);
+                cond.notify_all();
+            }, Qt::DirectConnection);
+            TEST_CHECK_MESSAGE(notifier.start(endpoint, "rawblock"), "notifier started");
+            const auto publish = [&pub](const QByteArrayList &parts) {
+                for (int i = 0; i < parts.size(); ++i)
+                    pub.send(zmq::const_buffer(parts[i].constData(), size_t(parts[i].size())),
+                             i + 1 < parts.size() ? zmq::send_flags::sndmore : zmq::send_flags::none);
+            };
+            std::unique_lock g(mut);
+            // the subscription takes a moment to propagate; publish throwaway messages until one gets through
+            for (int i = 0; received.empty() && i < 100; ++i) {
+                g.unlock();
+                publish({QByteArrayLiteral("rawblock"), QByteArrayLiteral("hello")});
+                g.lock();
+                cond.wait_for(g, std::chrono::milliseconds(50), [&]{ return !received.empty(); });
+            }
+            TEST_CHECK_MESSAGE(!received.empty(), "subscription is up");
+            received.clear();
+            g.unlock();
+            for (const auto & parts : replay)
+                publish(parts);
+            g.lock();
+            cond.wait_for(g, std::chrono::seconds(10), [&]{ return received.size() >= replay.size(); });
+            g.unlock();
+            notifier.stop();
+            TEST_CHECK_MESSAGE(received.size() == replay.size(), "received all published blocks");
+        }
+#else
+        Log() << "Compiled without zmq support, testing the zmq rawblock message handling only";
+        received = replay;
+#endif
+
+        // what on_zmqRawBlock gets out of each message (see controller_paths for what it then does with them)
+        for (size_t i = 0; i < received.size(); ++i) {
+            const auto rb = ZmqRawBlock::fromParts(received[i]);
+            TEST_CHECK_MESSAGE(rb.has_value(), "parse");
+            if (!rb) continue;
+            TEST_CHECK_MESSAGE(rb->rawblock == replay[i][1] && rb->seq == i, "block data and sequence number");
+            const auto cblock = BTC::Deserialize<bitcoin::CBlock>(rb->rawblock);
+            TEST_CHECK_MESSAGE(rb->hash == BTC::Hash2ByteArrayRev(cblock.GetHash()), "block hash");
+            TEST_CHECK_MESSAGE(rb->prevHash == BTC::Hash2ByteArrayRev(cblock.hashPrevBlock), "prev block hash");
+        }
+        TEST_CHECK_MESSAGE(!ZmqRawBlock::fromParts({QByteArrayLiteral("rawblock")}), "reject missing block");
+        TEST_CHECK_MESSAGE(!ZmqRawBlock::fromParts({QByteArrayLiteral("rawblock"), QByteArray(79, 'x')}), "reject short block");
+    };
+    TEST_CASE(controller_paths) { Controller::zmqRawBlockTest(); };
+    TEST_SUITE_END()
+
+    TEST_SUITE(dlbacklog)
+    TEST_CASE(budget_and_throttle) { Controller::dlBacklogTest(); };
+    TEST_SUITE_END()
+
+} // namespace
+
+/* static */
+void Controller::dlBacklogTest()
+{
+    using DLBacklog = StateMachine::DLBacklog;
+    constexpr size_t conc = 4; // DL_CONCURRENCY
+    constexpr uint64_t MB = 1'000'000;
+    TEST_CHECK_MESSAGE(DLBacklog(MB).budget == DLBacklog::kMinBudget, "a tiny configured backlog is raised to the minimum");
+
+    DLBacklog b(500 * MB);
+    TEST_CHECK(b.budget == 500 * MB);
+    TEST_CHECK_MESSAGE(b.throttleMsec(100'000, 0, conc) == 0u, "nothing is throttled before any block was downloaded");
+
+    // 10 downloaded 1 MB blocks waiting: window is 500 blocks
+    for (int i = 0; i < 10; ++i) b.added(MB);
+    TEST_CHECK(b.bytes == 10 * MB && b.windowBlocks() == 500u);
+    const unsigned next = 1000;
+    TEST_CHECK(b.throttleMsec(next + 400, next, conc) == 0u);
+    const auto farAhead = b.throttleMsec(next + 501, next, conc);
+    TEST_CHECK_MESSAGE(farAhead >= 10u && farAhead <= 50u, "heights beyond the window back off for 10-50 msec");
+    TEST_CHECK(b.throttleMsec(next + 100'000, next, conc) == 50u);
+
+    // a slow addBlock stage (1 MB/sec): the budget drops to 10 secs worth, but never below the minimum
+    b.consumed(MB, 1.0);
+    TEST_CHECK(b.bytes == 9 * MB && b.budget == DLBacklog::kMinBudget && b.windowBlocks() == 16u);
+    TEST_CHECK(b.throttleMsec(next + 16, next, conc) == 0u && b.throttleMsec(next + 17, next, conc) > 0u);
+
+    // over budget: everything but the heights about to be needed backs off
+    for (int i = 0; i < 10; ++i) b.added(MB);
+    TEST_CHECK(b.bytes >= b.budget);
+    TEST_CHECK(b.throttleMsec(next + unsigned(conc), next, conc) > 0u);
+    TEST_CHECK_MESSAGE(b.throttleMsec(next, next, conc) == 0u && b.throttleMsec(next + unsigned(conc) - 1u, next, conc) == 0u,
+                       "the heights the addBlock stage is about to need are never held back");
+    TEST_CHECK(b.nThrottled == 4u);
+
+    // a fast addBlock stage (~1 GB/sec): the budget goes back up to the configured maximum
+    for (int i = 0; i < 200; ++i) b.consumed(MB, 0.001);
+    TEST_CHECK(b.bytes == 0u && b.budget == 500 * MB);
+    TEST_CHECK(b.throttleMsec(next + 400, next, conc) == 0u);
+}
+
+/* static */
+void Controller::zmqRawBlockTest()
+{
+    using State = StateMachine::State;
+    QTemporaryDir tmpDir;
+    if (!tmpDir.isValid()) throw Exception("Failed to create a temporary directory");
+    auto opts = std::make_shared<Options>();
+    opts->datadir = tmpDir.path();
+    opts->db.maxMem = Options::DBOpts::maxMemMin;
+    opts->rpa.enabledSpec = Options::Rpa::EnabledSpec::Disabled;
+    Controller ctl(opts, nullptr); // never started: tasks are created but never run unless we run them below
+    ctl.didReceiveCoinDetectionFromBitcoinDMgr = true; // so that a fall back goes on to ask bitcoind for the chain info
+    ctl.storage = std::make_shared<Storage>(opts);
+    ctl.storage->startup();
+
+    // the db has blocks 0 and 1 of this chain
+    const auto chain = makeChain(4, {}, 0);
+    for (unsigned h = 0; h < 2u; ++h) {
+        const auto cblock = BTC::Deserialize<bitcoin::CBlock>(chain[h].raw);
+        ctl.storage->addBlock(PreProcessedBlock::makeShared(h, size_t(chain[h].raw.size()), cblock, nullptr), true, 0, false);
+    }
+    TEST_CHECK(ctl.storage->latestTip().first == 1);
+    const auto dlTasks = [&ctl] {
+        std::vector<DownloadBlocksTask *> ret;
+        for (const auto & [t, uptr] : ctl.tasks)
+            if (auto *dl = dynamic_cast<DownloadBlocksTask *>(t)) ret.push_back(dl);
+        return ret;
+    };
+    const auto reset = [&ctl] {
+        ctl.tasks.clear();
+        std::lock_guard g(ctl.smLock);
+        ctl.sm.reset();
+    };
+
+    // our own tip: ignored
+    ctl.on_zmqRawBlock(mkParts(chain[1].raw, 0));
+    TEST_CHECK_MESSAGE(!ctl.sm && ctl.tasks.empty() && !ctl.zmqs.rawBlockFastPathCt && !ctl.zmqs.rawBlockFallbackCt,
+                       "a rawblock for our tip is ignored");
+
+    // the next block, while idle: the tip fast path hands the block to a (full, not RPA-only) 1-block download task
+    ctl.on_zmqRawBlock(mkParts(chain[2].raw, 1));
+    TEST_CHECK(ctl.zmqs.rawBlockFastPathCt == 1u && !ctl.zmqs.rawBlockFallbackCt);
+    TEST_CHECK(ctl.sm && ctl.sm->state == State::DownloadingBlocks && ctl.sm->startheight == 2u && ctl.sm->endHeight == 2u);
+    auto tasks = dlTasks();
+    TEST_CHECK_MESSAGE(tasks.size() == 1u && ctl.tasks.size() == 1u, "exactly 1 download task, and nothing asks bitcoind");
+    if (tasks.size() == 1u) {
+        auto *t = tasks.front();
+        TEST_CHECK(t->from == 2u && t->to == 2u && t->zmqRawBlock == chain[2].raw);
+        TEST_CHECK_MESSAGE(!dynamic_cast<DownloadBlocksTask_SynchRpa *>(t), "the fast path task is not an RPA-only one");
+        // what the task does when it runs: the block goes straight to the Controller (with no bitcoind there to ask)
+        PreProcessedBlockPtr got;
+        auto conn = connect(&ctl, &Controller::putBlock, &ctl, [&](CtlTask *, PreProcessedBlockPtr p) { got = p; },
+                            Qt::DirectConnection);
+        t->do_get(2);
+        disconnect(conn);
+        TEST_CHECK_MESSAGE(got && got->height == 2u && BTC::Hash2ByteArrayRev(got->header.GetHash()) == chain[2].hash
+                           && t->zmqRawBlock.isEmpty() && t->goodCt == 1u, "the task hands over the zmq block");
+    }
+    reset();
+
+    // a block that doesn't connect to our tip (we missed one): falls back to polling bitcoind, no download task
+    ctl.on_zmqRawBlock(mkParts(chain[3].raw, 2));
+    TEST_CHECK(ctl.zmqs.rawBlockFastPathCt == 1u && ctl.zmqs.rawBlockFallbackCt == 1u);
+    TEST_CHECK_MESSAGE(ctl.sm && ctl.sm->state == State::WaitingForChainInfo && dlTasks().empty() && ctl.tasks.size() == 1u,
+                       "a gap falls back to asking bitcoind for the chain info");
+    reset();
+
+    // the next block again, but while an RPA-only re-index is underway: falls back, and is remembered for later
+    {
+        std::lock_guard g(ctl.smLock);
+        ctl.sm = std::make_unique<StateMachine>(opts->downloadBacklogBytes);
+    }
+    ctl.sm->state = State::DownloadingBlocks_RPA;
+    auto *rpaTask = ctl.add_DLBlocksTask(0, 1, 1, true);
+    ctl.on_zmqRawBlock(mkParts(chain[2].raw, 3));
+    TEST_CHECK(ctl.zmqs.rawBlockFastPathCt == 1u && ctl.zmqs.rawBlockFallbackCt == 2u);
+    tasks = dlTasks();
+    TEST_CHECK_MESSAGE(tasks.size() == 1u && tasks.front() == rpaTask && static_cast<DownloadBlocksTask *>(rpaTask)->zmqRawBlock.isEmpty(),
+                       "no fast path task during an RPA-only re-index, and the re-index task is not given the block");
+    TEST_CHECK_MESSAGE(ctl.sm->state == State::DownloadingBlocks_RPA && ctl.sm->mostRecentZmqHashBlockNotif == chain[2].hash,
+                       "the block is remembered for when the re-index is done");
+    reset();
+}
+#endif // ENABLE_TESTS
@@ -26,6 +26,8 @@
 #include "Storage.h"
 #include "SrvMgr.h"
 
+#include <QByteArrayList>
+
 #include <atomic>
 #include <concepts> // for std::derived_from
 #include <functional> // for std::hash
@@ -188,7 +190,9 @@ private:
     std::unordered_map<CtlTask *, std::unique_ptr<CtlTask>, Util::PtrHasher> tasks;
     int nDLBlocksTasks = 0;
 
-    CtlTask * add_DLBlocksTask(unsigned from, unsigned to, size_t nTasks, bool isRpaOnlyMode);
+    /// If `zmqRawBlock` is not empty, it is the raw block at height `from` (zmq "rawblock" tip fast path), which the
+    /// task will use rather than downloading that block.
+    CtlTask * add_DLBlocksTask(unsigned from, unsigned to, size_t nTasks, bool isRpaOnlyMode, QByteArray zmqRawBlock = {});
     void process_DownloadingBlocks();
     bool process_VerifyAndAddBlock(PreProcessedBlockPtr); ///< helper called from within DownloadingBlocks state -- makes sure block is sane and adds it to db
     void process_PrintProgress(const QString &verb, unsigned height, size_t nTx, size_t nIns, size_t nOuts, size_t nSH,
@@ -217,17 +221,18 @@ private:
     /// If --dump-sh was specified on CLI, this will execute at startup() time right after storage has been loaded. May throw.
     void dumpScriptHashes(const QString &fileName);
 
-    /// Stores ZMQ notification state for "hashblock" and "hashtx" ZMQ topics from remote bitcoind.
+    /// Stores ZMQ notification state for "hashblock", "hashtx" and "rawblock" ZMQ topics from remote bitcoind.
     struct ZmqPvt {
         struct Topic {
-            enum class Tag : uint8_t { HashBlock, HashTx };
+            enum class Tag : uint8_t { HashBlock, HashTx, RawBlock };
             const Tag tag;
-            // returns: "hashblock" or "hashtx"
+            // returns: "hashblock", "hashtx" or "rawblock"
             const char *str() const noexcept;
             constexpr auto operator<=>(const Topic &) const noexcept = default;
         };
         using enum Topic::Tag;
-        static constexpr const Topic allTopics[] = { {HashBlock}, {HashTx}  /* very spammy, disabled unless zmq_allow_hashtx = true in config */ };
+        static constexpr const Topic allTopics[] = { {HashBlock}, {HashTx}  /* very spammy, disabled unless zmq_allow_hashtx = true in config */,
+                                                     {RawBlock} /* if available, supersedes hashblock, unless zmq_allow_rawblock = false in config */ };
         static constexpr size_t nTopics() noexcept { return std::size(allTopics); }
         struct TopicHasher {
             std::hash<int> hasher;
@@ -249,6 +254,10 @@ private:
 
         std::unordered_map<Topic, TopicState, TopicHasher> map{nTopics()};
 
+        /// "rawblock" notifications that were added to the db directly (tip fast path), and ones that instead fell back
+        /// to the regular polling path (because we were busy, or the block did not connect to our tip).
+        size_t rawBlockFastPathCt = 0u, rawBlockFallbackCt = 0u;
+
         TopicState & operator[](Topic t); // must define in Controller.cpp translation unit due to incomplete ZmqSubNotifier type
         TopicState *find(Topic t) noexcept { if (auto it = map.find(t); it != map.end()) return &it->second; return nullptr; }
 
@@ -277,6 +286,11 @@ private:
     /// Stops all notifiers that are running. If cleanup==true also deletes all notifier instances.
     void zmqStopAll(bool cleanup = false);
 
+    /// Called for each zmq "rawblock" notification. If we are idle and the block connects to our tip, it is added
+    /// straight away via a DownloadBlocksTask that needs no bitcoind round-trips (the tip fast path). Otherwise (we are
+    /// busy, or there is a gap or a reorg), this just behaves like a "hashblock" notification for the block.
+    void on_zmqRawBlock(const QByteArrayList &parts);
+
     /// Litecoin only: Ignore these txhashes from mempool (don't download them). This gets cleared each time
     /// before the first SynchMempool after we receive a new block, then is persisted for all the SynchMempools
     /// for that block, until a new block arrives, then is cleared again.
@@ -303,6 +317,17 @@ protected:
     /// Also called if we received a zmq hashblock or hashtx notification (in which case it will be called with the valid
     /// header or tx hash, already in big endian byte order).
     void on_Poll(std::optional<std::pair<ZmqTopic, QByteArray>> zmqNotifOpt = std::nullopt);
+
+#ifdef ENABLE_TESTS
+public:
+    /// Checks that the download backlog budget follows the measured addBlock throughput (within its bounds), and when
+    /// download tasks are told to back off.
+    static void dlBacklogTest();
+    /// Feeds zmq "rawblock" notifications to on_zmqRawBlock on a Controller with a real Storage (but no bitcoind), and
+    /// checks the path each one takes: the tip fast path (down to the DownloadBlocksTask handing over the block),
+    /// falling back to polling on a gap, and falling back while an RPA-only re-index is underway.
+    static void zmqRawBlockTest();
+#endif
 };
 
 /// Abstract base class for our private internal tasks. Concrete implementations are in Controller.cpp.
@@ -279,6 +279,7 @@ void SynchMempoolTask::process()
                 auto [mempool, lock] = storage->mutableMempool(); // grab mempool struct exclusively
                 mempool.clear();
             }
+            storage->resultCacheClear();
             redoFromStart();
         } catch (const std::exception & e) {
             Error() << "Caught exception when processing mempool tx's: " << e.what();
@@ -353,8 +354,11 @@ void SynchMempoolTask::doGetRawMempool()
                 res = mempool.dropTxs(affected, droppedTxs, TRACE);
             } // release lock
 
+            storage->resultCacheInvalidate(affected); // drop now-stale cached get_history, etc results
             // update this set too for txSubsMgr
             txidsAffected.insert(droppedTxs.begin(), droppedTxs.end());
+            // dropped without being confirmed (confirmed txs are removed from the mempool by Storage::addBlock)
+            storage->rawTxCacheRemove(droppedTxs);
 
             // do bookkeeping, maybe print debug log
             {
@@ -510,6 +514,7 @@ void SynchMempoolTask::doDLNextTx()
 
             txidsAffected.insert(tx->hash);
             txsWaitingForResponse.erase(tx->hash);
+            storage->rawTxCachePut(tx->hash, txdata); // no-op if rawtx_cache is disabled
             precache->submitWork(txref);
             // keep going (do a direct call for better performance, rather than calling AGAIN)
             process();
@@ -628,6 +633,9 @@ void SynchMempoolTask::processResults()
         updateLastProgress(0.80);
         return mempool.addNewTxs(scriptHashesAffected, txsDownloaded, getFromCache, TRACE); // may throw
     }();
+    // Drop now-stale cached get_history, etc results. Note this set may also contain scripthashes from a previous
+    // (retried) pass, which is harmless.
+    storage->resultCacheInvalidate(scriptHashesAffected);
     dspTxsAffected.merge(std::move(res.dspTxsAffected));
     if ((res.oldSize != res.newSize || res.elapsedMsec > 1e3) && Debug::isEnabled()) {
         Controller::printMempoolStatusToLog(res.newSize, res.newNumAddresses, res.elapsedMsec, true, true);
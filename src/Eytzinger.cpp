@@ -0,0 +1,127 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2024 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "Eytzinger.h"
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+#include "Common.h"
+#include "Util.h"
+
+#include "tests/Tests.h"
+
+#include <QRandomGenerator>
+
+#include <map>
+
+namespace {
+    /// Returns a realistic-looking list of block txNum0s: `nBlocks` strictly increasing values, with block sizes
+    /// growing (on average) as the chain gets older, as they do on real chains.
+    std::vector<uint64_t> makeTxNum0s(size_t nBlocks) {
+        std::vector<uint64_t> ret;
+        ret.reserve(nBlocks);
+        uint64_t txNum = 0;
+        auto *rng = QRandomGenerator::global();
+        for (size_t i = 0; i < nBlocks; ++i) {
+            ret.push_back(txNum);
+            txNum += 1u + rng->bounded(quint32(1u + 2u * (i * 500u / std::max<size_t>(nBlocks, 1u))));
+        }
+        return ret;
+    }
+
+    int64_t refLastLessOrEqual(const std::vector<uint64_t> &v, uint64_t key) {
+        return int64_t(std::upper_bound(v.begin(), v.end(), key) - v.begin()) - 1;
+    }
+
+    TEST_SUITE(eytzinger)
+    TEST_CASE(matches_upper_bound) {
+        auto *rng = QRandomGenerator::global();
+        // all small sizes (all tree shapes), then some larger ones
+        std::vector<size_t> sizes;
+        for (size_t n = 0; n <= 70; ++n) sizes.push_back(n);
+        for (size_t n : {127u, 128u, 129u, 1000u, 4095u, 65537u}) sizes.push_back(n);
+        for (const size_t n : sizes) {
+            const auto v = makeTxNum0s(n);
+            const EytzingerArray<uint64_t> ea(v.data(), v.size());
+            TEST_CHECK_MESSAGE(ea.size() == n, QString("size mismatch for n = %1").arg(n).toStdString());
+            const uint64_t maxKey = v.empty() ? 10u : v.back() + 10u;
+            // every key in range (for small n), else random keys, plus all the exact values
+            std::vector<uint64_t> keys;
+            if (maxKey <= 4096u) for (uint64_t k = 0; k <= maxKey; ++k) keys.push_back(k);
+            else for (int i = 0; i < 4096; ++i) keys.push_back(rng->bounded(quint64(maxKey)));
+            keys.insert(keys.end(), v.begin(), v.end());
+            // count the mismatches rather than check each key, so that a failure doesn't report thousands of times
+            size_t nBad = 0;
+            for (const auto k : keys)
+                nBad += ea.lastLessOrEqual(k) != refLastLessOrEqual(v, k);
+            TEST_CHECK_MESSAGE(nBad == 0u, QString("EytzingerArray: %1 mismatches for n = %2").arg(nBad).arg(n).toStdString());
+            // the merge-pass helper, over sorted keys
+            std::sort(keys.begin(), keys.end());
+            int64_t idx = -1;
+            nBad = 0;
+            for (const auto k : keys) {
+                idx = gallopLastLessOrEqual(v.data(), v.size(), idx, k);
+                nBad += idx != refLastLessOrEqual(v, k);
+            }
+            TEST_CHECK_MESSAGE(nBad == 0u, QString("gallopLastLessOrEqual: %1 mismatches for n = %2").arg(nBad).arg(n).toStdString());
+        }
+    };
+    TEST_SUITE_END()
+
+    void bench() {
+        constexpr size_t nBlocks = 4'000'000, nLookups = 2'000'000;
+        Log() << "Building a " << nBlocks << "-block txNum0 layout ...";
+        const auto v = makeTxNum0s(nBlocks);
+        std::map<uint64_t, unsigned> m;
+        for (size_t i = 0; i < v.size(); ++i) m.emplace_hint(m.end(), v[i], unsigned(i));
+        Tic t0;
+        const EytzingerArray<uint64_t> ea(v.data(), v.size());
+        Log() << "EytzingerArray build: " << t0.msecStr() << " msec, " << ea.byteSize() << " bytes";
+
+        std::vector<uint64_t> keys(nLookups);
+        for (auto & k : keys) k = QRandomGenerator::global()->bounded(quint64(v.back() + 1u));
+
+        const auto runAll = [&](const char *what) {
+            int64_t sum;
+            t0 = Tic();
+            sum = 0;
+            for (const auto k : keys) sum += std::prev(m.upper_bound(k))->second;
+            Log() << what << " std::map::upper_bound: " << t0.msecStr() << " msec (" << sum << ")";
+            t0 = Tic();
+            sum = 0;
+            for (const auto k : keys) sum += refLastLessOrEqual(v, k);
+            Log() << what << " std::upper_bound: " << t0.msecStr() << " msec (" << sum << ")";
+            t0 = Tic();
+            sum = 0;
+            for (const auto k : keys) sum += ea.lastLessOrEqual(k);
+            Log() << what << " EytzingerArray: " << t0.msecStr() << " msec (" << sum << ")";
+            return sum;
+        };
+        runAll("random:");
+        std::sort(keys.begin(), keys.end());
+        const auto expect = runAll("sorted:");
+        t0 = Tic();
+        int64_t sum = 0, idx = -1;
+        for (const auto k : keys) sum += (idx = gallopLastLessOrEqual(v.data(), v.size(), idx, k));
+        Log() << "sorted: gallopLastLessOrEqual merge pass: " << t0.msecStr() << " msec (" << sum << ")";
+        if (sum != expect) throw Exception("Merge pass result mismatch");
+    }
+
+    const auto bench_ = App::registerBench("eytzinger", &bench);
+} // namespace
+#endif // ENABLE_TESTS
@@ -0,0 +1,104 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2024 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// A read-only copy of a sorted array of keys, laid out in Eytzinger (BFS, or implicit binary heap) order. A search
+/// walks down the implicit tree with no data-dependent branches, and the next few levels it will touch can be
+/// prefetched ahead of time, which makes it several times faster than std::upper_bound over a large sorted array (and
+/// very much faster than a node-based std::map) once the array no longer fits in cache.
+///
+/// Not thread-safe for writing; concurrent readers are fine.
+template <typename T>
+class EytzingerArray {
+public:
+    EytzingerArray() = default;
+    /// Builds from the first `n` items of `sorted`, which must be sorted ascending.
+    EytzingerArray(const T *sorted, size_t n) { build(sorted, n); }
+
+    void build(const T *sorted, size_t n) {
+        if (n > size_t(UINT32_MAX)) n = size_t(UINT32_MAX); // ranks are 32-bit; callers never get near this
+        nItems = n;
+        keys.assign(n + 1u, T{});
+        ranks.assign(n + 1u, 0u);
+        uint32_t i = 0;
+        fill(sorted, i, 1u);
+    }
+    void clear() { nItems = 0; keys.clear(); ranks.clear(); }
+
+    size_t size() const { return nItems; }
+    bool empty() const { return !nItems; }
+
+    /// Returns the index (into the sorted array we were built from) of the last item that is <= key, or -1 if all
+    /// items are > key (or if empty). That is: std::upper_bound(sorted, sorted + n, key) - sorted - 1.
+    int64_t lastLessOrEqual(const T &key) const {
+        const T *const k0 = keys.data();
+        size_t k = 1u;
+        while (k <= nItems) {
+#if defined(__GNUC__) || defined(__clang__)
+            // prefetch the descendants of k that are 4 levels down (nodes 16k .. 16k+15), which are contiguous
+            if (const size_t pf = k * kPrefetchMult; pf <= nItems)
+                __builtin_prefetch(k0 + pf);
+#endif
+            k = 2u * k + size_t(k0[k] <= key);
+        }
+        // k encodes the path taken. Strip the trailing right turns, plus the last left turn, to get to the node where
+        // we last went left: that's the first item > key. If we never went left, all items are <= key.
+        k >>= unsigned(std::countr_one(k)) + 1u;
+        return k ? int64_t(ranks[k]) - 1 : int64_t(nItems) - 1;
+    }
+
+    /// Approximate memory footprint in bytes
+    size_t byteSize() const { return sizeof(*this) + keys.capacity() * sizeof(T) + ranks.capacity() * sizeof(uint32_t); }
+
+private:
+    static constexpr size_t kPrefetchMult = 16u;
+
+    size_t nItems = 0;
+    std::vector<T> keys; ///< 1-based: keys[0] is unused, the children of node k are 2k and 2k+1
+    std::vector<uint32_t> ranks; ///< 1-based: the index of keys[k] in the original sorted array
+
+    void fill(const T *sorted, uint32_t &i, size_t k) {
+        // in-order traversal of the implicit tree assigns the sorted items in order (recursion depth is log2(n))
+        if (k > nItems) return;
+        fill(sorted, i, 2u * k);
+        keys[k] = sorted[i];
+        ranks[k] = i++;
+        fill(sorted, i, 2u * k + 1u);
+    }
+};
+
+/// Given a sorted array `v` of size `sz`, and an index `from` such that v[from] <= key (or from == -1), returns the
+/// index of the last item <= key (i.e. upper_bound - 1). Uses exponential ("galloping") search forward from `from`, so
+/// it costs O(log d), where d is the distance moved. Intended for mapping a sorted sequence of keys in 1 merge pass.
+template <typename T>
+int64_t gallopLastLessOrEqual(const T *v, size_t sz, int64_t from, const T &key) {
+    size_t lo = size_t(from + 1), hi = lo, step = 1u;
+    while (hi < sz && v[hi] <= key) {
+        lo = hi + 1u;
+        hi += step;
+        step <<= 1u;
+    }
+    return int64_t(std::upper_bound(v + lo, v + std::min(hi, sz), key) - v) - 1;
+}
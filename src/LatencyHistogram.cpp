@@ -0,0 +1,237 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2024 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "LatencyHistogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+uint64_t LatencyHistogram::percentile(double p) const noexcept
+{
+    const uint64_t c = count();
+    if (!c) return 0u;
+    p = std::clamp(p, 0.0, 100.0);
+    const uint64_t target = std::max<uint64_t>(1u, uint64_t(std::ceil(p / 100.0 * double(c))));
+    uint64_t cum = 0u;
+    for (unsigned i = 0; i < NumBuckets; ++i) {
+        cum += buckets[i].load(std::memory_order_relaxed);
+        if (cum >= target)
+            return std::min(bucketUpperBound(i), max());
+    }
+    return max(); // may happen if we raced with a writer
+}
+
+QVariantMap LatencyHistogram::toMap() const
+{
+    return QVariantMap{
+        { "count", qulonglong(count()) },
+        { "mean", std::round(mean() * 10.0) / 10.0 },
+        { "p50", qulonglong(percentile(50.0)) },
+        { "p90", qulonglong(percentile(90.0)) },
+        { "p99", qulonglong(percentile(99.0)) },
+        { "p99.9", qulonglong(percentile(99.9)) },
+        { "max", qulonglong(max()) },
+    };
+}
+
+void LatencyHistogram::appendPrometheus(QByteArray &out, const QByteArray &name, const QByteArray &labels) const
+{
+    // Coarse, fixed boundaries (usec), 50us to 10s
+    static constexpr std::array<uint64_t, 17> kBoundaries = {
+        50, 100, 250, 500, 1'000, 2'500, 5'000, 10'000, 25'000, 50'000, 100'000, 250'000, 500'000,
+        1'000'000, 2'500'000, 5'000'000, 10'000'000,
+    };
+    const QByteArray sep = labels.isEmpty() ? QByteArray() : QByteArrayLiteral(",");
+    uint64_t cum = 0u;
+    unsigned i = 0;
+    for (const uint64_t le : kBoundaries) {
+        for ( ; i < NumBuckets && bucketUpperBound(i) <= le; ++i)
+            cum += buckets[i].load(std::memory_order_relaxed);
+        out += name + "_bucket{" + labels + sep + "le=\"" + QByteArray::number(double(le) / 1e6, 'g', 6) + "\"} "
+               + QByteArray::number(qulonglong(cum)) + "\n";
+    }
+    for ( ; i < NumBuckets; ++i)
+        cum += buckets[i].load(std::memory_order_relaxed);
+    out += name + "_bucket{" + labels + sep + "le=\"+Inf\"} " + QByteArray::number(qulonglong(cum)) + "\n";
+    const QByteArray braced = labels.isEmpty() ? QByteArray() : "{" + labels + "}";
+    out += name + "_sum" + braced + " " + QByteArray::number(double(sum()) / 1e6, 'g', 12) + "\n";
+    // Use the bucket total rather than count() so that _count always agrees with the +Inf bucket
+    out += name + "_count" + braced + " " + QByteArray::number(qulonglong(cum)) + "\n";
+}
+
+void LatencyHistogram::reset() noexcept
+{
+    for (auto & b : buckets)
+        b.store(0u, std::memory_order_relaxed);
+    n.store(0u, std::memory_order_relaxed);
+    total.store(0u, std::memory_order_relaxed);
+    maxVal.store(0u, std::memory_order_relaxed);
+}
+
+namespace LatencyStats {
+    namespace {
+        std::shared_mutex mut;
+        std::map<QString, std::unique_ptr<MethodHistograms>> registry; ///< guarded by mut
+    } // namespace
+
+    const char *phaseName(Phase p) noexcept
+    {
+        switch (p) {
+        case Parse: return "parse";
+        case Queue: return "queue";
+        case Work: return "work";
+        case Serialize: return "serialize";
+        case Write: return "write";
+        case NumPhases: break;
+        }
+        return "unknown";
+    }
+
+    MethodHistograms * forMethod(const QString &method)
+    {
+        {
+            std::shared_lock g(mut);
+            if (auto it = registry.find(method); it != registry.end())
+                return it->second.get();
+        }
+        std::unique_lock g(mut);
+        auto & ptr = registry[method];
+        if (!ptr) ptr = std::make_unique<MethodHistograms>();
+        return ptr.get();
+    }
+
+    QVariantMap stats(const QString &method)
+    {
+        QVariantMap ret;
+        std::shared_lock g(mut);
+        for (const auto & [name, hists] : registry) {
+            if (!method.isEmpty() && name != method) continue;
+            QVariantMap m;
+            for (unsigned i = 0; i < NumPhases; ++i)
+                if ((*hists)[i].count()) // omit phases that never applied to this method (e.g. "queue" for sync methods)
+                    m[phaseName(Phase(i))] = (*hists)[i].toMap();
+            ret[name] = m;
+        }
+        return ret;
+    }
+
+    QByteArray prometheusText()
+    {
+        static const QByteArray name = "fulcrum_rpc_latency_seconds";
+        QByteArray out = "# HELP " + name + " RPC request latency by method and processing phase.\n"
+                         "# TYPE " + name + " histogram\n";
+        std::shared_lock g(mut);
+        for (const auto & [method, hists] : registry) {
+            for (unsigned i = 0; i < NumPhases; ++i) {
+                if (!(*hists)[i].count()) continue;
+                const QByteArray labels = "method=\"" + method.toUtf8() + "\",phase=\"" + phaseName(Phase(i)) + "\"";
+                (*hists)[i].appendPrometheus(out, name, labels);
+            }
+        }
+        return out;
+    }
+
+    void reset()
+    {
+        std::shared_lock g(mut); // shared is enough; the histograms themselves are atomic
+        for (auto & [name, hists] : registry)
+            for (auto & h : *hists)
+                h.reset();
+    }
+} // namespace LatencyStats
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+#include "Common.h"
+#include "Json/Json.h"
+#include "Util.h"
+
+#include "tests/Tests.h"
+
+#include <QRandomGenerator>
+
+#include <thread>
+#include <vector>
+
+namespace {
+    TEST_SUITE(latencyhistogram)
+    TEST_CASE(buckets_record_merge) {
+
+        // bucket boundaries must tile [0, 2^32) with no gaps or overlaps, and bucketIndex must agree with them
+        uint64_t expectLower = 0u;
+        for (unsigned i = 0; i < LatencyHistogram::NumBuckets; ++i) {
+            const auto lo = LatencyHistogram::bucketLowerBound(i), hi = LatencyHistogram::bucketUpperBound(i);
+            TEST_CHECK_MESSAGE(lo == expectLower, "contiguous buckets");
+            TEST_CHECK_MESSAGE(LatencyHistogram::bucketIndex(lo) == i && LatencyHistogram::bucketIndex(hi) == i, "index/bounds agree");
+            TEST_CHECK_MESSAGE(lo < 16u || double(hi - lo + 1u) / double(lo) <= 1.0 / 16.0, "relative error <= 1/16");
+            expectLower = hi + 1u;
+        }
+        TEST_CHECK_MESSAGE(expectLower == uint64_t(1) << LatencyHistogram::MaxBits, "buckets cover 32 bits");
+        TEST_CHECK_MESSAGE(LatencyHistogram::bucketIndex(~uint64_t(0)) == LatencyHistogram::NumBuckets - 1u, "clamp");
+
+        // percentiles against a sorted reference
+        {
+            LatencyHistogram h;
+            std::vector<uint64_t> vals;
+            for (int i = 0; i < 100'000; ++i) {
+                const uint64_t v = QRandomGenerator::global()->bounded(quint64(2'000'000));
+                vals.push_back(v);
+                h.record(qint64(v));
+            }
+            std::sort(vals.begin(), vals.end());
+            TEST_CHECK_MESSAGE(h.count() == vals.size() && h.max() == vals.back(), "count and max");
+            for (const double p : {1.0, 50.0, 90.0, 99.0, 99.9, 100.0}) {
+                const auto idx = std::max<size_t>(1u, size_t(std::ceil(p / 100.0 * vals.size()))) - 1u;
+                const auto exact = vals[idx], approx = h.percentile(p);
+                TEST_CHECK_MESSAGE(LatencyHistogram::bucketIndex(exact) == LatencyHistogram::bucketIndex(approx), "percentile bucket");
+            }
+            QByteArray prom;
+            h.appendPrometheus(prom, "x", "");
+            TEST_CHECK_MESSAGE(prom.contains("x_bucket{le=\"+Inf\"} 100000\n") && prom.contains("x_count 100000\n"), "prometheus");
+            h.reset();
+            TEST_CHECK_MESSAGE(h.count() == 0u && h.percentile(50.0) == 0u, "reset");
+        }
+
+        // concurrent recording loses nothing
+        {
+            auto *hists = LatencyStats::forMethod("test.method");
+            TEST_CHECK_MESSAGE(hists == LatencyStats::forMethod("test.method"), "stable registry pointer");
+            constexpr int nThreads = 8, nPer = 50'000;
+            std::vector<std::thread> thrs;
+            for (int t = 0; t < nThreads; ++t)
+                thrs.emplace_back([hists, t]{
+                    for (int i = 0; i < nPer; ++i)
+                        (*hists)[LatencyStats::Work].record(i % 1000 + t);
+                });
+            for (auto & thr : thrs) thr.join();
+            TEST_CHECK_MESSAGE((*hists)[LatencyStats::Work].count() == uint64_t(nThreads) * nPer, "concurrent count");
+            const auto m = LatencyStats::stats("test.method");
+            TEST_CHECK_MESSAGE(m.size() == 1 && m.value("test.method").toMap().contains("work")
+                && !m.value("test.method").toMap().contains("queue"), "stats map");
+            Log() << "stats: " << Json::toUtf8(m, true);
+            LatencyStats::reset();
+        }
+    };
+    TEST_SUITE_END()
+
+} // namespace
+#endif // ENABLE_TESTS
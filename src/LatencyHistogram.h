@@ -0,0 +1,129 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2024 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QVariantMap>
+#include <QtGlobal>
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+/// A lock-free, fixed-size, log-linear ("HDR-style") histogram of durations in microseconds.
+///
+/// Values below 16 are stored exactly. Above that, each power-of-2 range is split into 16 linear sub-buckets, so any
+/// recorded value is reported with at most ~6.25% relative error. Values >= 2^32 usec (~71 minutes) are clamped into
+/// the last bucket. Recording is a handful of relaxed atomic increments, so it is safe and cheap to call from any
+/// thread. Readers may observe a histogram that is mid-update (count and buckets may disagree by a few samples);
+/// this is fine for the statistical purposes this class is meant for.
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned SubBucketBits = 4, SubBuckets = 1u << SubBucketBits;
+    static constexpr unsigned MaxBits = 32; ///< values >= 2^MaxBits are clamped
+    static constexpr unsigned NumBuckets = SubBuckets + (MaxBits - SubBucketBits) * SubBuckets; // = 464
+
+    void record(qint64 usec) noexcept {
+        const uint64_t v = usec > 0 ? uint64_t(usec) : 0u;
+        buckets[bucketIndex(v)].fetch_add(1u, std::memory_order_relaxed);
+        n.fetch_add(1u, std::memory_order_relaxed);
+        total.fetch_add(v, std::memory_order_relaxed);
+        for (uint64_t m = maxVal.load(std::memory_order_relaxed); v > m
+             && !maxVal.compare_exchange_weak(m, v, std::memory_order_relaxed); ) {}
+    }
+
+    uint64_t count() const noexcept { return n.load(std::memory_order_relaxed); }
+    uint64_t sum() const noexcept { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const noexcept { return maxVal.load(std::memory_order_relaxed); }
+    double mean() const noexcept { const auto c = count(); return c ? double(sum()) / double(c) : 0.0; }
+
+    /// Returns the value at percentile p (0.0 - 100.0). The returned value is the largest value that maps to the
+    /// bucket in which the percentile falls (clamped to max()), or 0 if the histogram is empty.
+    uint64_t percentile(double p) const noexcept;
+
+    /// Returns a map of: "count", "mean", "p50", "p90", "p99", "p99.9", "max" (all in usec). Suitable for /stats.
+    QVariantMap toMap() const;
+
+    /// Appends Prometheus text exposition lines for this histogram (`<name>_bucket{<labels>,le="..."}`, `<name>_sum`,
+    /// `<name>_count`) to `out`. Units are seconds, per Prometheus convention. `labels` should be of the form
+    /// `key="val",key2="val2"` (may be empty). A fixed set of coarse `le` boundaries is used so that the series set
+    /// is stable across scrapes; a sample is counted in a boundary only if its whole internal bucket lies at or below
+    /// it (so cumulative counts may lag the true value by at most one internal bucket's worth of samples).
+    void appendPrometheus(QByteArray &out, const QByteArray &name, const QByteArray &labels) const;
+
+    void reset() noexcept;
+
+    static constexpr unsigned bucketIndex(uint64_t v) noexcept {
+        if (v < SubBuckets) return unsigned(v);
+        if (v >= uint64_t(1) << MaxBits) v = (uint64_t(1) << MaxBits) - 1u;
+        const unsigned shift = unsigned(std::bit_width(v)) - 1u - SubBucketBits;
+        return SubBuckets + shift * SubBuckets + unsigned((v >> shift) & (SubBuckets - 1u));
+    }
+    /// Smallest value mapping to bucket `idx`
+    static constexpr uint64_t bucketLowerBound(unsigned idx) noexcept {
+        if (idx < SubBuckets) return idx;
+        const unsigned shift = (idx - SubBuckets) / SubBuckets, sub = (idx - SubBuckets) % SubBuckets;
+        return uint64_t(SubBuckets + sub) << shift;
+    }
+    /// Largest value mapping to bucket `idx`
+    static constexpr uint64_t bucketUpperBound(unsigned idx) noexcept {
+        if (idx < SubBuckets) return idx;
+        const unsigned shift = (idx - SubBuckets) / SubBuckets, sub = (idx - SubBuckets) % SubBuckets;
+        return (uint64_t(SubBuckets + sub + 1u) << shift) - 1u;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, NumBuckets> buckets{};
+    std::atomic<uint64_t> n{0u}, total{0u}, maxVal{0u};
+};
+
+/// App-wide registry of per-RPC-method latency histograms, broken down by request-processing phase. Entries are
+/// created on first use and are never deleted, so the returned pointers are valid for the lifetime of the process.
+/// The set of keys is bounded since only methods that made it past RPC::ConnectionBase's method-table check are
+/// ever recorded. All functions here are thread-safe.
+namespace LatencyStats {
+    enum Phase : unsigned {
+        Parse,      ///< JSON parse + RPC::Message construction (client thread)
+        Queue,      ///< time spent waiting in the ThreadPool queue (generic_do_async only)
+        Work,       ///< time spent executing the request (worker thread for async, client thread for sync)
+        Serialize,  ///< result -> JSON bytes
+        Write,      ///< handing the bytes to the socket
+        NumPhases
+    };
+    const char *phaseName(Phase p) noexcept;
+
+    using MethodHistograms = std::array<LatencyHistogram, NumPhases>;
+
+    /// Returns the histograms for `method`, creating them if needed. Never returns nullptr.
+    MethodHistograms * forMethod(const QString &method);
+
+    /// Returns a map of method -> phase -> LatencyHistogram::toMap(), for /stats and the admin "latency" RPC.
+    /// If `method` is not empty, only that method is returned.
+    QVariantMap stats(const QString &method = {});
+
+    /// Returns the Prometheus text exposition format rendering of all histograms, for the /metrics endpoint.
+    QByteArray prometheusText();
+
+    /// Clears all recorded samples (the method entries themselves remain)
+    void reset();
+} // namespace LatencyStats
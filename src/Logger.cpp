@@ -18,12 +18,18 @@
 //
 #include "Common.h"
 #include "Logger.h"
+#include "Util.h"
 
 #include <QCoreApplication>
 #include <QTimer>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #ifdef Q_OS_UNIX
 #  include <stdio.h>   // fileno
@@ -48,18 +54,18 @@ namespace {
     }
 }
 
-Logger::Logger(QObject *parent) : QObject(parent)
+Logger::Logger(QObject *parent, Qt::ConnectionType connType) : QObject(parent)
 {
     connect(this, &Logger::log, this, [this](int level, const QString &line){
         // we do it in a closure because in this c'tor gotLine isn't defined yet (pure virtual)
         gotLine(level, line);
-    });
+    }, connType);
 }
 
 Logger::~Logger() {}
 
-ConsoleLogger::ConsoleLogger(QObject *p, bool stdOut_)
-    : Logger(p), stdOut(stdOut_), isATty(calcIsATty(stdOut_))
+ConsoleLogger::ConsoleLogger(QObject *p, bool stdOut_, Qt::ConnectionType connType)
+    : Logger(p, connType), stdOut(stdOut_), isATty(calcIsATty(stdOut_))
 {}
 
 /* static */
@@ -121,3 +127,309 @@ void SysLogger::gotLine(int level, const QString &l)
     loggerCommon(level, l);
 }
 #endif
+
+struct AsyncLineWriter::Pvt
+{
+    static constexpr size_t kMaxBatchBytes = 256 * 1024;
+    static constexpr auto kIdleWait = std::chrono::milliseconds(100); ///< safety net; producers normally wake us
+
+    /// Ring slot. `seq` == position: free for the producer holding that ticket; `seq` == position + 1: holds a line.
+    /// (Dmitry Vyukov's bounded queue; we only ever have 1 consumer.)
+    struct Slot {
+        std::atomic<size_t> seq;
+        QByteArray line;
+    };
+
+    std::FILE * const out;
+    const bool dropWhenFull;
+    const size_t mask, maxBytes;
+    std::unique_ptr<Slot[]> slots;
+
+    alignas(64) std::atomic<size_t> enqPos = 0; ///< next ticket to hand out to a producer
+    alignas(64) std::atomic<size_t> nWritten = 0; ///< lines written so far == the consumer's dequeue position
+    std::atomic<size_t> bytesQueued = 0;
+    std::atomic<uint64_t> nDropped = 0, nDroppedUnreported = 0;
+
+    std::atomic_bool stopFlag = false, writerSleeping = false;
+    std::mutex mut; ///< guards nothing but the cv waits
+    std::condition_variable writerCond;
+    std::condition_variable flushCond; ///< notified each time the writer advances nWritten (freeing up ring slots)
+    std::thread thread;
+
+    Pvt(std::FILE *out, bool dropWhenFull, size_t capacity, size_t maxBytes)
+        : out(out), dropWhenFull(dropWhenFull), mask(capacity - 1u), maxBytes(maxBytes), slots(new Slot[capacity])
+    {
+        if (!capacity || (capacity & mask)) throw BadArgs("AsyncLineWriter: capacity must be a power of 2");
+        for (size_t i = 0; i < capacity; ++i)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        thread = std::thread([this]{ run(); });
+    }
+
+    bool tryPush(QByteArray &line) {
+        const size_t nBytes = size_t(line.size());
+        if (bytesQueued.fetch_add(nBytes, std::memory_order_relaxed) + nBytes > maxBytes && nBytes <= maxBytes) {
+            bytesQueued.fetch_sub(nBytes, std::memory_order_relaxed);
+            return false;
+        }
+        size_t pos = enqPos.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot & slot = slots[pos & mask];
+            const auto dif = std::ptrdiff_t(slot.seq.load(std::memory_order_acquire)) - std::ptrdiff_t(pos);
+            if (dif == 0) {
+                if (enqPos.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed)) {
+                    slot.line = std::move(line);
+                    slot.seq.store(pos + 1u, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                bytesQueued.fetch_sub(nBytes, std::memory_order_relaxed);
+                return false; // full
+            } else
+                pos = enqPos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool hasLine(size_t deqPos) const {
+        return slots[deqPos & mask].seq.load(std::memory_order_acquire) == deqPos + 1u;
+    }
+
+    void wakeWriter() {
+        // pairs with the fence in run(): either we see the writer sleeping, or it sees our line before it sleeps
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (writerSleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard g(mut);
+            writerCond.notify_one();
+        }
+    }
+
+    void run() {
+        Util::ThreadName::Set("AsyncLog");
+        QByteArray batch;
+        batch.reserve(int(kMaxBatchBytes) + 4096);
+        size_t deqPos = nWritten.load(std::memory_order_relaxed);
+        for (;;) {
+            size_t n = 0;
+            if (const auto nd = nDroppedUnreported.exchange(0, std::memory_order_relaxed))
+                batch += QStringLiteral("*** %1 log line(s) dropped: log queue full ***\n").arg(nd).toUtf8();
+            while (size_t(batch.size()) < kMaxBatchBytes && hasLine(deqPos + n)) {
+                Slot & slot = slots[(deqPos + n) & mask];
+                batch += slot.line;
+                batch += '\n';
+                bytesQueued.fetch_sub(size_t(slot.line.size()), std::memory_order_relaxed);
+                slot.line = QByteArray();
+                slot.seq.store(deqPos + n + mask + 1u, std::memory_order_release); // hand the slot back to producers
+                ++n;
+            }
+            if (!batch.isEmpty()) {
+                std::fwrite(batch.constData(), 1, size_t(batch.size()), out);
+                std::fflush(out);
+                batch.clear();
+            }
+            if (n) {
+                deqPos += n;
+                nWritten.store(deqPos, std::memory_order_release);
+                std::lock_guard g(mut);
+                flushCond.notify_all();
+                continue;
+            }
+            // nothing to do; sleep until a producer wakes us
+            std::unique_lock g(mut);
+            writerSleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!hasLine(deqPos)) {
+                // check stopFlag last: we must not exit with lines queued
+                if (stopFlag.load(std::memory_order_acquire)) return;
+                writerCond.wait_for(g, kIdleWait);
+            }
+            writerSleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+};
+
+AsyncLineWriter::AsyncLineWriter(std::FILE *out, bool dropWhenFull, size_t capacity, size_t maxBytes)
+    : p(std::make_unique<Pvt>(out, dropWhenFull, capacity, maxBytes))
+{}
+
+AsyncLineWriter::~AsyncLineWriter()
+{
+    p->stopFlag.store(true, std::memory_order_release);
+    {
+        std::lock_guard g(p->mut);
+        p->writerCond.notify_one();
+    }
+    p->thread.join();
+}
+
+bool AsyncLineWriter::push(QByteArray line, bool important)
+{
+    while (!p->tryPush(line)) {
+        if (p->dropWhenFull && !important) {
+            p->nDropped.fetch_add(1, std::memory_order_relaxed);
+            p->nDroppedUnreported.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        // block: sleep until the writer has written something (and so made room), then try again
+        const size_t written = p->nWritten.load(std::memory_order_acquire);
+        p->wakeWriter();
+        std::unique_lock g(p->mut);
+        // the timeout is a safety net: we may have seen the ring "full" of bytes reserved by other producers' tryPush
+        // calls that then backed out, in which case the writer has nothing to write and won't notify us
+        p->flushCond.wait_for(g, Pvt::kIdleWait, [&]{ return p->nWritten.load(std::memory_order_acquire) != written; });
+    }
+    p->wakeWriter();
+    return true;
+}
+
+void AsyncLineWriter::flush()
+{
+    const size_t target = p->enqPos.load(std::memory_order_acquire); // every ticket handed out so far
+    p->wakeWriter();
+    std::unique_lock g(p->mut);
+    p->flushCond.wait(g, [&]{ return p->nWritten.load(std::memory_order_acquire) >= target; });
+}
+
+uint64_t AsyncLineWriter::droppedCount() const { return p->nDropped.load(std::memory_order_relaxed); }
+
+AsyncConsoleLogger::AsyncConsoleLogger(QObject *parent, bool dropWhenFull, bool stdOut_)
+    // gotLine() is thread-safe, so have it run on the thread doing the logging, rather than queue it to our thread
+    : ConsoleLogger(parent, stdOut_, Qt::DirectConnection), writer(stdOut_ ? stdout : stderr, dropWhenFull)
+{}
+
+AsyncConsoleLogger::~AsyncConsoleLogger() {} // `writer` d'tor writes out anything still queued
+
+void AsyncConsoleLogger::gotLine(int level, const QString &l)
+{
+    writer.push(l.toUtf8(), level != Debug && level != Info);
+    if (level == Fatal)
+        writer.flush();
+    loggerCommon(level, l);
+}
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+#include "tests/Tests.h"
+
+#include <QByteArrayList>
+
+#include <vector>
+
+namespace {
+    QByteArrayList readAllLines(std::FILE *f) {
+        std::fflush(f);
+        std::rewind(f);
+        QByteArray data;
+        char buf[65536];
+        for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)) > 0; )
+            data.append(buf, int(n));
+        if (data.endsWith('\n')) data.chop(1);
+        return data.isEmpty() ? QByteArrayList{} : data.split('\n');
+    }
+
+    TEST_SUITE(asynclog)
+    TEST_CASE(async_line_writer) {
+        constexpr int nThreads = 8, nPer = 20'000;
+
+        // block mode, with a tiny ring: nothing is lost and each producer's lines stay in order
+        {
+            std::FILE *f = std::tmpfile();
+            if (!f) throw Exception("tmpfile() failed");
+            {
+                AsyncLineWriter w(f, false, 64, 4096);
+                std::vector<std::thread> thrs;
+                for (int t = 0; t < nThreads; ++t)
+                    thrs.emplace_back([&w, t]{
+                        for (int i = 0; i < nPer; ++i) w.push(QByteArray::number(t) + " " + QByteArray::number(i), false);
+                    });
+                for (auto & thr : thrs) thr.join();
+                TEST_CHECK_MESSAGE(w.droppedCount() == 0u, "no drops in block mode");
+                // flush() must not return before everything pushed so far is in the file
+                for (int i = 0; i < 1000; ++i) w.push("flushed", false);
+                w.flush();
+                TEST_CHECK_MESSAGE(readAllLines(f).size() == nThreads * nPer + 1000, "flush writes everything queued");
+                std::fseek(f, 0, SEEK_END);
+                w.push("last", true);
+            } // d'tor must drain
+            const auto lines = readAllLines(f);
+            TEST_CHECK_MESSAGE(lines.size() == nThreads * nPer + 1001 && lines.back() == "last", "d'tor drains");
+            std::vector<int> next(nThreads, 0);
+            for (const auto & l : lines) {
+                const auto parts = l.split(' ');
+                if (parts.size() != 2) continue;
+                const int t = parts[0].toInt(), i = parts[1].toInt();
+                TEST_CHECK_MESSAGE(t >= 0 && t < nThreads && next[t]++ == i, "per-producer order");
+            }
+            std::fclose(f);
+        }
+
+        // drop mode: unimportant lines may be dropped, but are always accounted for; important ones never are
+        {
+            std::FILE *f = std::tmpfile();
+            if (!f) throw Exception("tmpfile() failed");
+            uint64_t dropped{};
+            {
+                AsyncLineWriter w(f, true, 16, 1024);
+                std::vector<std::thread> thrs;
+                for (int t = 0; t < nThreads; ++t)
+                    thrs.emplace_back([&w]{
+                        for (int i = 0; i < nPer; ++i) w.push(i % 100 ? "dbg" : "important", !(i % 100));
+                    });
+                for (auto & thr : thrs) thr.join();
+                dropped = w.droppedCount();
+            }
+            size_t nDbg = 0, nImportant = 0;
+            uint64_t nReported = 0;
+            for (const auto & l : readAllLines(f)) {
+                if (l == "dbg") ++nDbg;
+                else if (l == "important") ++nImportant;
+                else if (l.startsWith("*** ")) nReported += l.mid(4).split(' ').value(0).toULongLong();
+            }
+            Log() << "drop mode: " << dropped << " of " << nThreads * nPer << " lines dropped";
+            TEST_CHECK_MESSAGE(nImportant == size_t(nThreads * nPer / 100), "important lines never dropped");
+            TEST_CHECK_MESSAGE(nDbg + dropped + nImportant == size_t(nThreads * nPer), "written + dropped == pushed");
+            TEST_CHECK_MESSAGE(nReported == dropped, "drops are reported");
+            std::fclose(f);
+        }
+    };
+    TEST_SUITE_END()
+
+    /// Time spent on the logging threads: a synchronous fwrite + fflush per line vs. AsyncLineWriter::push
+    void bench() {
+        constexpr int nThreads = 4, nPer = 250'000;
+        const QByteArray line(120, 'x');
+        std::FILE *f = std::tmpfile();
+        if (!f) throw Exception("tmpfile() failed");
+        const auto run = [&](const char *what, auto && writeLine) {
+            std::vector<std::thread> thrs;
+            std::atomic<qint64> nanos = 0;
+            for (int t = 0; t < nThreads; ++t)
+                thrs.emplace_back([&]{
+                    const auto t0 = Util::getTimeNS();
+                    for (int i = 0; i < nPer; ++i) writeLine(line);
+                    nanos += Util::getTimeNS() - t0;
+                });
+            for (auto & thr : thrs) thr.join();
+            Log() << what << ": " << QString::number(double(nanos.load()) / (nThreads * nPer), 'f', 1)
+                  << " nsec per line on the logging thread";
+        };
+        std::mutex mut;
+        run("sync fwrite+fflush", [&](const QByteArray &l) {
+            std::lock_guard g(mut); // as the main thread serializes ConsoleLogger writes
+            std::fwrite(l.constData(), 1, size_t(l.size()), f);
+            std::fwrite("\n", 1, 1, f);
+            std::fflush(f);
+        });
+        {
+            const auto t0 = Util::getTimeNS();
+            {
+                AsyncLineWriter w(f, false);
+                run("AsyncLineWriter", [&w](const QByteArray &l) { w.push(l, false); });
+            }
+            Log() << "AsyncLineWriter total incl. drain: " << QString::number((Util::getTimeNS() - t0) / 1e6, 'f', 1) << " msec";
+        }
+        std::fclose(f);
+    }
+
+    const auto bench_ = App::registerBench("asynclog", &bench);
+} // namespace
+#endif // ENABLE_TESTS
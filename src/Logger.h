@@ -18,15 +18,23 @@
 //
 #pragma once
 
+#include <QByteArray>
 #include <QObject>
 #include <QString>
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+
 /** Abstract base class for a line-based logger */
 class Logger : public QObject
 {
     Q_OBJECT
 public:
-    explicit Logger(QObject *parent = nullptr);
+    /// `connType` is how the `log` signal reaches gotLine(). The default queues lines from other threads to the thread
+    /// this object lives in; loggers whose gotLine() is thread-safe may pass Qt::DirectConnection instead.
+    explicit Logger(QObject *parent = nullptr, Qt::ConnectionType connType = Qt::AutoConnection);
     virtual ~Logger();
 
     enum Level {
@@ -46,17 +54,58 @@ public slots:
 class ConsoleLogger : public Logger
 {
 public:
-    explicit ConsoleLogger(QObject *parent = nullptr, bool stdOut = true);
+    explicit ConsoleLogger(QObject *parent = nullptr, bool stdOut = true, Qt::ConnectionType connType = Qt::AutoConnection);
 
     bool isaTTY() const override { return isATty; }
     void gotLine(int level, const QString &) override;
 
-private:
+protected:
     const bool stdOut;
+private:
     const bool isATty;
     static bool calcIsATty(bool stdOut);
 };
 
+/// Writes lines to a FILE from a dedicated thread. Lines are pushed onto a bounded, lock-free MPSC ring buffer (bounded
+/// both in number of lines and in bytes), and the writer thread drains it in batches, with 1 fwrite + fflush per batch.
+/// Destruction writes out everything queued before stopping the thread.
+class AsyncLineWriter
+{
+public:
+    static constexpr size_t DefaultCapacity = 16384; ///< max lines queued; must be a power of 2
+    static constexpr size_t DefaultMaxBytes = 16 * 1024 * 1024; ///< max line bytes queued
+
+    /// If `dropWhenFull` is true, push() drops lines (other than `important` ones) while the ring is full, rather than
+    /// wait for the writer to make room.
+    AsyncLineWriter(std::FILE *out, bool dropWhenFull, size_t capacity = DefaultCapacity, size_t maxBytes = DefaultMaxBytes);
+    ~AsyncLineWriter();
+
+    /// Thread-safe. Queues `line` (a newline is appended on write). Returns false if the line was dropped.
+    bool push(QByteArray line, bool important);
+    /// Thread-safe. Returns once every line queued before this call has been written and flushed.
+    void flush();
+    /// The total number of lines dropped so far
+    uint64_t droppedCount() const;
+
+private:
+    struct Pvt;
+    std::unique_ptr<Pvt> p;
+};
+
+/// A ConsoleLogger that never writes on the calling thread; see AsyncLineWriter. Fatal lines wait for everything
+/// queued before them (themselves included) to be written before the app is told to exit.
+class AsyncConsoleLogger : public ConsoleLogger
+{
+public:
+    explicit AsyncConsoleLogger(QObject *parent = nullptr, bool dropWhenFull = false, bool stdOut = true);
+    ~AsyncConsoleLogger() override;
+
+    void gotLine(int level, const QString &) override;
+
+private:
+    AsyncLineWriter writer;
+};
+
 /// On Windows this just prints to stdout. On Unix, calls syslog()
 class SysLogger : public ConsoleLogger
 {
@@ -33,23 +33,46 @@ void Mempool::clear() {
     hashXTxs.clear();
     dsps.clear(); // <-- this always frees capacity
     if (optPrefixTable) optPrefixTable->clear();
+    feeRateBuckets.clear();
     txs.rehash(0); // this should free previous capacity
     hashXTxs.rehash(0);
 }
 
+std::optional<unsigned> Mempool::feeRateOf(const Tx &tx)
+{
+    if (tx.fee < bitcoin::Amount::zero()) return std::nullopt; // skip negative fees (coinbase txn, etc)
+    return unsigned(tx.fee / bitcoin::Amount::satoshi()) // sats
+           / std::max(tx.vsizeBytes, 1u); // per vbyte
+}
+
+void Mempool::feeRateBucketsAdd(const Tx &tx)
+{
+    if (const auto feeRate = feeRateOf(tx)) {
+        auto & bucket = feeRateBuckets[*feeRate];
+        bucket.vsizeBytes += tx.vsizeBytes; // accumulate size by feeRate
+        ++bucket.nTxs;
+    }
+}
+
+void Mempool::feeRateBucketsRemove(const Tx &tx)
+{
+    const auto feeRate = feeRateOf(tx);
+    if (!feeRate) return;
+    auto it = feeRateBuckets.find(*feeRate);
+    if (UNLIKELY(it == feeRateBuckets.end() || !it->second.nTxs)) {
+        Error() << __func__ << ": tx " << tx.hash.toHex() << " with fee rate " << *feeRate << " not in any bucket! FIXME!";
+        return;
+    }
+    it->second.vsizeBytes -= tx.vsizeBytes;
+    if (!--it->second.nTxs) feeRateBuckets.erase(it); // drop empty buckets so they don't affect the compaction below
+}
+
 auto Mempool::calcCompactFeeHistogram(unsigned binSizeBytes) const -> FeeHistogramVec
 {
     // This algorithm is taken from:
     // https://github.com/spesmilo/electrumx/blob/bbd985a95db63cada13254bb766f174e9ab674d0/electrumx/server/mempool.py#L154
+    // The per-feeRate sizes it starts from are maintained incrementally in `feeRateBuckets`.
     FeeHistogramVec ret;
-    std::map<unsigned, unsigned, std::greater<unsigned>> histogram; // sorted map, descending order by key
-
-    for (const auto & [txid, tx] : txs) {
-        if (tx->fee < bitcoin::Amount::zero()) continue; // skip negative fees (coinbase txn, etc)
-        const auto feeRate = unsigned(tx->fee / bitcoin::Amount::satoshi()) // sats
-                             / std::max(tx->vsizeBytes, 1u); // per vbyte
-        histogram[feeRate] += tx->vsizeBytes; // accumulate size by feeRate
-    }
 
     // Now, compact the bins
     ret.reserve(8);
@@ -57,7 +80,8 @@ auto Mempool::calcCompactFeeHistogram(unsigned binSizeBytes) const -> FeeHistogr
     double binSize = static_cast<double>(binSizeBytes);
     std::optional<unsigned> prevFeeRate;
 
-    for (const auto & [feeRate, size] : histogram) {
+    for (const auto & [feeRate, bucket] : feeRateBuckets) {
+        const unsigned size = bucket.vsizeBytes;
         // If there is a big lump of txns at this specific size,
         // add the previous item now (if not added already)
         if (double(size) > 2.0 * binSize && prevFeeRate && cumSize > 0) {
@@ -268,6 +292,8 @@ auto Mempool::addNewTxs(ScriptHashesAffectedSet & scriptHashesAffected,
         // we do this once for each new tx we see.. and it can end up saving tons of space. Note the below structures
         // are either fixed in size or will only ever shrink as the mempool evolves so this is a good time to do this.
         tx->hashXs.rehash(tx->hashXs.size());
+
+        feeRateBucketsAdd(*tx); // the fee is final now that all the inputs have been credited
     }
 
     // now, sort and uniqueify data structures made temporarily inconsistent above (have dupes, are out-of-order)
@@ -453,6 +479,7 @@ auto Mempool::dropTxs(ScriptHashesAffectedSet & scriptHashesAffectedOut, TxHashS
         }
 
         ret.rpaRmCt += rmTxRpaAssociations(tx);
+        feeRateBucketsRemove(*tx);
 
         // and finally remove this tx from `txs` now, while we have its iterator .. this is faster
         // than doing the remove later, since we already have the iterator now!
@@ -634,6 +661,7 @@ auto Mempool::confirmedInBlock(ScriptHashesAffectedSet & scriptHashesAffectedOut
                 dspTxids.insert(txid);
             }
             ret.rpaRmCt += rmTxRpaAssociations(tx);
+            feeRateBucketsRemove(*tx);
             // and erase NOW!
             itTxs = txs.erase(itTxs); // in this branch: removed, take next it and continue
             continue;
@@ -875,9 +903,12 @@ QVariantMap Mempool::dump() const
 #include "RPC.h"
 #include "Util.h"
 
+#include "tests/Tests.h"
+
 #include "bitcoin/streams.h"
 #include "bitcoin/transaction.h"
 
+#include <QRandomGenerator>
 #include <QThread>
 
 #include <atomic>
@@ -953,6 +984,10 @@ bool Mempool::deepCompareEqual(const Mempool &o, QString *estr) const
         if (estr) *estr = "MempoolPrefixTable members differ";
         return false;
     }
+    if (feeRateBuckets != o.feeRateBuckets) {
+        if (estr) *estr = "FeeRateBuckets members differ";
+        return false;
+    }
     // couldn't find an inequality, return true
     return true;
 }
@@ -1674,6 +1709,160 @@ namespace {
         }
     }
 
+    /// Builds a synthetic mempool (with chains of unconfirmed txs, a spread of fee rates & sizes, and some negative
+    /// fee txs) and checks that the incrementally maintained fee histogram always matches the original full-scan
+    /// algorithm as txs are added, dropped, and confirmed.
+    TEST_SUITE(mempool_feehist)
+    TEST_CASE(incremental_matches_full_scan) {
+        // The original algorithm, which built the per-feeRate map by visiting every tx
+        auto referenceHistogram = [](const Mempool &mp, unsigned binSizeBytes) {
+            Mempool::FeeHistogramVec ret;
+            std::map<unsigned, unsigned, std::greater<unsigned>> histogram;
+            for (const auto & [txid, tx] : mp.txs) {
+                if (tx->fee < bitcoin::Amount::zero()) continue;
+                const auto feeRate = unsigned(tx->fee / bitcoin::Amount::satoshi()) / std::max(tx->vsizeBytes, 1u);
+                histogram[feeRate] += tx->vsizeBytes;
+            }
+            unsigned cumSize = 0;
+            double binSize = static_cast<double>(binSizeBytes);
+            std::optional<unsigned> prevFeeRate;
+            for (const auto & [feeRate, size] : histogram) {
+                if (double(size) > 2.0 * binSize && prevFeeRate && cumSize > 0) {
+                    ret.emplace_back(*prevFeeRate, cumSize);
+                    cumSize = 0;
+                    binSize *= 1.1;
+                }
+                cumSize += size;
+                if (cumSize > binSize) {
+                    ret.emplace_back(feeRate, cumSize);
+                    cumSize = 0;
+                    binSize *= 1.1;
+                }
+                prevFeeRate = feeRate;
+            }
+            return ret;
+        };
+        auto checkEquivalent = [&](const Mempool &mp, const char *when) {
+            for (const unsigned binSize : {1u, 500u, 30'000u, 250'000u}) {
+                const auto expected = referenceHistogram(mp, binSize), got = mp.calcCompactFeeHistogram(binSize);
+                TEST_CHECK_MESSAGE(expected == got, QString("histogram equivalence %1, binSize %2").arg(when).arg(binSize).toStdString());
+            }
+            Log() << when << ": " << mp.txs.size() << " txs, " << mp.feeRateBuckets.size() << " fee rate buckets, "
+                  << mp.calcCompactFeeHistogram().size() << " histogram items, ok";
+        };
+
+        auto *rgen = QRandomGenerator::global();
+        auto randHash = [rgen] {
+            bitcoin::uint256 h;
+            rgen->fillRange(reinterpret_cast<quint32 *>(h.begin()), h.size() / sizeof(quint32));
+            return h;
+        };
+        std::unordered_map<TXO, TXOInfo> confirmedCoins;
+        auto getTXOInfo = [&confirmedCoins](const TXO &txo) -> std::optional<TXOInfo> {
+            if (auto it = confirmedCoins.find(txo); it != confirmedCoins.end()) return it->second;
+            return std::nullopt;
+        };
+        struct Coin { bitcoin::COutPoint outpoint; bitcoin::Amount amount; };
+        std::vector<Coin> mempoolCoins; // unspent outputs of txs we put in the mempool
+
+        Mempool mempool;
+        auto addBatch = [&](size_t nTxs, bool allowMempoolParents) {
+            if (!allowMempoolParents) mempoolCoins.clear();
+            Mempool::NewTxsMap batch;
+            for (size_t i = 0; i < nTxs; ++i) {
+                bitcoin::CMutableTransaction mtx;
+                bitcoin::Amount inTotal;
+                for (unsigned j = 0, nIn = 1u + rgen->bounded(3u); j < nIn; ++j) {
+                    if (!mempoolCoins.empty() && rgen->bounded(3u) == 0u) {
+                        // spend an unconfirmed output, making a chain
+                        const size_t k = rgen->bounded(quint32(mempoolCoins.size()));
+                        mtx.vin.emplace_back(mempoolCoins[k].outpoint);
+                        inTotal += mempoolCoins[k].amount;
+                        mempoolCoins[k] = mempoolCoins.back();
+                        mempoolCoins.pop_back();
+                    } else {
+                        const bitcoin::COutPoint op(bitcoin::TxId(randHash()), rgen->bounded(4u));
+                        TXOInfo info;
+                        info.amount = int64_t(1'000'000u + rgen->bounded(100'000'000u)) * bitcoin::Amount::satoshi();
+                        info.hashX = BTC::HashXFromCScript(bitcoin::CScript() << bitcoin::CScriptNum(int64_t(rgen->bounded(200u))));
+                        info.confirmedHeight = 1;
+                        info.txNum = 1;
+                        confirmedCoins[TXO{BTC::Hash2ByteArrayRev(op.GetTxId()), IONum(op.GetN())}] = info;
+                        mtx.vin.emplace_back(op);
+                        inTotal += info.amount;
+                    }
+                }
+                // mostly positive fees over a wide range of rates, with the occasional negative fee
+                const int64_t fee = rgen->bounded(30u) == 0u ? -int64_t(rgen->bounded(1000u)) : int64_t(rgen->bounded(50'000u));
+                const unsigned nOut = 1u + rgen->bounded(3u);
+                const int64_t perOut = (inTotal / bitcoin::Amount::satoshi() - fee) / nOut;
+                for (unsigned j = 0; j < nOut; ++j)
+                    mtx.vout.emplace_back(perOut * bitcoin::Amount::satoshi(),
+                                          bitcoin::CScript() << bitcoin::CScriptNum(int64_t(rgen->bounded(200u))));
+                // OP_RETURN padding to spread out the tx sizes (and thus fee rates)
+                mtx.vout.emplace_back(bitcoin::Amount::zero(), bitcoin::CScript() << bitcoin::OP_RETURN
+                                                                   << std::vector<uint8_t>(rgen->bounded(400u), 0x42));
+                const auto ctx = bitcoin::MakeTransactionRef(std::move(mtx));
+                auto tx = std::make_shared<Mempool::Tx>();
+                tx->hash = BTC::Hash2ByteArrayRev(ctx->GetHashRef());
+                tx->sizeBytes = tx->vsizeBytes = unsigned(ctx->GetTotalSize());
+                for (unsigned j = 0; j < nOut; ++j)
+                    mempoolCoins.push_back({bitcoin::COutPoint(ctx->GetId(), j), perOut * bitcoin::Amount::satoshi()});
+                batch.emplace(std::piecewise_construct, std::forward_as_tuple(tx->hash), std::forward_as_tuple(tx, ctx));
+            }
+            Mempool::ScriptHashesAffectedSet shset;
+            mempool.addNewTxs(shset, batch, getTXOInfo);
+        };
+
+        addBatch(2'000, true);
+        checkEquivalent(mempool, "after add");
+        addBatch(2'000, true);
+        checkEquivalent(mempool, "after 2nd add");
+
+        {
+            // drop a random subset (dropTxs also drops their descendants)
+            Mempool::TxHashSet toDrop;
+            for (const auto & [txid, tx] : mempool.txs)
+                if (rgen->bounded(10u) == 0u) toDrop.insert(txid);
+            Mempool::ScriptHashesAffectedSet shset;
+            const auto sizeBefore = mempool.txs.size();
+            mempool.dropTxs(shset, toDrop);
+            TEST_CHECK_MESSAGE(mempool.txs.size() == sizeBefore - toDrop.size(), "dropTxs dropped the expected number of txs");
+            checkEquivalent(mempool, "after drop");
+        }
+        {
+            // confirm a random subset of the txs that have no unconfirmed parents
+            Mempool::TxHashNumMap confirmed;
+            TxNum txNum = 100;
+            for (const auto & [txid, tx] : mempool.txs)
+                if (!tx->hasUnconfirmedParentTx && rgen->bounded(4u) == 0u) confirmed.emplace(txid, ++txNum);
+            Mempool::ScriptHashesAffectedSet shset;
+            const auto sizeBefore = mempool.txs.size();
+            mempool.confirmedInBlock(shset, confirmed, 2);
+            TEST_CHECK_MESSAGE(mempool.txs.size() == sizeBefore - confirmed.size(), "confirmedInBlock removed the expected number of txs");
+            checkEquivalent(mempool, "after confirm");
+        }
+
+        addBatch(1'000, false); // the coins we were tracking may have been dropped or confirmed, so spend only fresh ones
+        checkEquivalent(mempool, "after 3rd add");
+
+        {
+            // the buckets must be exactly what a rebuild from scratch would produce
+            Mempool rebuilt;
+            for (const auto & [txid, tx] : mempool.txs)
+                if (tx->fee >= bitcoin::Amount::zero()) {
+                    auto & b = rebuilt.feeRateBuckets[unsigned(tx->fee / bitcoin::Amount::satoshi()) / std::max(tx->vsizeBytes, 1u)];
+                    b.vsizeBytes += tx->vsizeBytes;
+                    ++b.nTxs;
+                }
+            TEST_CHECK_MESSAGE(rebuilt.feeRateBuckets == mempool.feeRateBuckets, "buckets equal a rebuild from scratch");
+        }
+
+        mempool.clear();
+        TEST_CHECK_MESSAGE(mempool.feeRateBuckets.empty() && mempool.calcCompactFeeHistogram().empty(), "clear() empties the histogram");
+    };
+    TEST_SUITE_END()
+
     static const auto bench_ = App::registerBench("mempool", &bench);
 }
 #endif
@@ -29,6 +29,7 @@
 
 #include <QVariantMap>
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <optional>
@@ -127,11 +128,24 @@ struct Mempool
     using HashXTxMap = std::unordered_map<HashX, std::vector<TxRef>, HashHasher>;
 
 
+    /// The txs at a particular fee rate, see FeeRateBuckets below
+    struct FeeRateBucket {
+        unsigned vsizeBytes = 0; ///< sum of the vsizes of the txs at this fee rate
+        unsigned nTxs = 0;
+        bool operator==(const FeeRateBucket &) const = default;
+    };
+    /// feeRate (sats/vB, truncated) -> bucket, sorted by descending fee rate. Covers all txs with a non-negative fee.
+    using FeeRateBuckets = std::map<unsigned, FeeRateBucket, std::greater<unsigned>>;
+
+
     // -- Data members of struct Mempool --
     TxMap txs;
     HashXTxMap hashXTxs;
     std::optional<Rpa::MempoolPrefixTable> optPrefixTable; ///< only has_value() if RPA is enabled. For mempool RPA queries.
     DSPs dsps;
+    /// Kept up-to-date as txs are added & removed by addNewTxs(), dropTxs(), confirmedInBlock() & clear(), so that
+    /// calcCompactFeeHistogram() needn't visit every tx.
+    FeeRateBuckets feeRateBuckets;
 
 
     // -- Add to mempool
@@ -222,11 +236,11 @@ struct Mempool
         unsigned feeRate = 0; // in sats/B, quotient truncated to uint.
         unsigned cumulativeSize = 0; // bin size, cumulative bytes
         FeeHistogramItem(unsigned fr, unsigned cs) : feeRate{fr}, cumulativeSize{cs} {}
+        bool operator==(const FeeHistogramItem &) const = default;
     };
     using FeeHistogramVec = std::vector<FeeHistogramItem>;
-    /// This function is potentially going to take a couple of ms at worst on very large mempools.  Even a 1.5k tx
-    /// mempool takes under 1 ms on average hardware, so it's very fast. Storage calls this in refreshMempoolHistogram
-    /// from a periodic background task kicked off in Controller.
+    /// This is O(number of distinct fee rates) since it works off of `feeRateBuckets` rather than visiting every tx.
+    /// Storage calls this in refreshMempoolHistogram from a periodic background task kicked off in Controller.
     FeeHistogramVec calcCompactFeeHistogram(unsigned binSize = 30'000 /* binSize in bytes */) const;
 
     // -- Dump (for JSONesque debug support)
@@ -269,6 +283,13 @@ private:
     /// Internal to do RPA book-keeping for a tx removal, called by confirmedInBlock() and dropTxs()
     size_t rmTxRpaAssociations(const TxRef &tx);
 
+    /// Internal: returns the fee rate bucket key for tx, or nullopt if the tx does not count towards the histogram
+    static std::optional<unsigned> feeRateOf(const Tx &tx);
+    /// Internal: fee rate bucket book-keeping. Called by addNewTxs() once a tx's fee is known, and by
+    /// confirmedInBlock() and dropTxs() just before a tx is removed.
+    void feeRateBucketsAdd(const Tx &tx);
+    void feeRateBucketsRemove(const Tx &tx);
+
 #ifdef ENABLE_TESTS
 public:
     /// Returns true if this compares equal to `other`, does a deep compare of the underlying
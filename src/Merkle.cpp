@@ -19,6 +19,7 @@
 #include "Merkle.h"
 #include "Util.h"
 
+#include "bitcoin/crypto/sha256.h"
 #include "bitcoin/hash.h"
 #include "bitcoin/uint256.h"
 
@@ -28,6 +29,20 @@
 
 namespace Merkle {
 
+    void hashPairs(const bitcoin::uint256 *in, size_t nIn, bitcoin::uint256 *out)
+    {
+        static_assert(sizeof(bitcoin::uint256) == 32u && alignof(bitcoin::uint256) == 1u,
+                      "uint256 arrays must be packed arrays of 32-byte hashes for SHA256D64 to work on them");
+        const size_t nPairs = nIn / 2u;
+        // 1 call for all the pairs, so that the multi-way (SSE4/AVX2/SHA-NI) D64 kernels, if available, may be used
+        bitcoin::SHA256D64(out->data(), in->data(), nPairs);
+        if (nIn & 0x1u) {
+            // odd: last hash is paired with itself
+            const auto & last = in[nIn - 1u];
+            out[nPairs] = bitcoin::Hash(last.begin(), last.end(), last.begin(), last.end());
+        }
+    }
+
     BranchAndRootPair branchAndRoot(const HashVec &hashVec, unsigned index, const std::optional<unsigned> & optLen)
     {
         BranchAndRootPair ret;
@@ -63,14 +78,11 @@ namespace Merkle {
         }
 
         constexpr auto recomputeHashes = [](UHashVec & hashes) {
-            UHashVec hv;
-            const unsigned sz = unsigned(hashes.size());
-            hv.reserve( (sz / 2u) + 1u );
-            for (unsigned i = 0; i < sz; i+=2u) {
-                const auto &a = hashes[i], &b = hashes[i+1u];
-                hv.emplace_back(bitcoin::Hash(a.begin(), a.end(), b.begin(), b.end()));
-            }
-            hashes.swap(hv);
+            // the output level fits in the first half of the input, and SHA256D64 reads each input pair before it
+            // writes that pair's output, so we may do this in-place
+            const size_t sz = hashes.size();
+            hashPairs(hashes.data(), sz, hashes.data());
+            hashes.resize((sz + 1u) / 2u);
         };
 
         for (unsigned i = 0; i < length; ++i) {
@@ -140,6 +152,86 @@ namespace Merkle {
     }
 
 
+    Tree::Tree(const HashVec &hashes)
+    {
+        using uint256 = bitcoin::uint256;
+        if (hashes.empty())
+            throw BadArgs(QString("%1: hashes cannot be empty").arg(__func__));
+        auto & leaves = levels.emplace_back();
+        leaves.reserve(hashes.size());
+        for (const auto & h : hashes) {
+            if (static_cast<size_t>(h.size()) != uint256::size())
+                throw BadArgs(QString("%1: encountered a hash that is not of size %2").arg(__func__).arg(uint256::size()));
+            std::memcpy(leaves.emplace_back(uint256::Uninitialized).data(), h.data(), uint256::size());
+        }
+        levels.reserve(branchLength(unsigned(hashes.size())) + 1u);
+        while (levels.back().size() > 1u) {
+            const auto & cur = levels.back();
+            std::vector<uint256> next((cur.size() + 1u) / 2u);
+            hashPairs(cur.data(), cur.size(), next.data()); // odd-sized levels pair their last hash with itself
+            levels.push_back(std::move(next)); // NB: invalidates `cur`
+        }
+        const auto & leafLevel = levels.front();
+        sortedLeafIndices.resize(leafLevel.size());
+        for (uint32_t i = 0; i < sortedLeafIndices.size(); ++i) sortedLeafIndices[i] = i;
+        std::sort(sortedLeafIndices.begin(), sortedLeafIndices.end(), [&leafLevel](uint32_t a, uint32_t b) {
+            return leafLevel[a] < leafLevel[b];
+        });
+    }
+
+    Hash Tree::leaf(unsigned index) const
+    {
+        if (index >= size())
+            throw BadArgs(QString("%1: index out of range").arg(__func__));
+        const auto & h = levels.front()[index];
+        return Hash(reinterpret_cast<const char *>(h.data()), QByteArray::size_type(h.size()));
+    }
+
+    Hash Tree::root() const
+    {
+        const auto & h = levels.back().front();
+        return Hash(reinterpret_cast<const char *>(h.data()), QByteArray::size_type(h.size()));
+    }
+
+    BranchAndRootPair Tree::branchAndRoot(unsigned index) const
+    {
+        if (index >= size())
+            throw BadArgs(QString("%1: index out of range").arg(__func__));
+        BranchAndRootPair ret;
+        auto & branch = ret.first;
+        branch.reserve(levels.size() - 1u);
+        for (size_t i = 0; i + 1u < levels.size(); ++i, index >>= 1u) {
+            const auto & lvl = levels[i];
+            const auto & h = lvl[std::min<size_t>(index ^ 1u, lvl.size() - 1u)]; // sibling, or self if last of odd level
+            branch.emplace_back(reinterpret_cast<const char *>(h.data()), QByteArray::size_type(h.size()));
+        }
+        ret.second = root();
+        return ret;
+    }
+
+    std::optional<unsigned> Tree::find(const Hash &hash) const
+    {
+        std::optional<unsigned> ret;
+        if (static_cast<size_t>(hash.size()) != bitcoin::uint256::size())
+            return ret;
+        const auto & leafLevel = levels.front();
+        bitcoin::uint256 needle{bitcoin::uint256::Uninitialized};
+        std::memcpy(needle.data(), hash.constData(), needle.size());
+        auto it = std::lower_bound(sortedLeafIndices.begin(), sortedLeafIndices.end(), needle,
+                                   [&leafLevel](uint32_t idx, const bitcoin::uint256 &h) { return leafLevel[idx] < h; });
+        if (it != sortedLeafIndices.end() && leafLevel[*it] == needle)
+            ret = *it;
+        return ret;
+    }
+
+    size_t Tree::byteSize() const
+    {
+        size_t ret = sizeof(*this) + sortedLeafIndices.capacity() * sizeof(uint32_t);
+        for (const auto & lvl : levels)
+            ret += sizeof(lvl) + lvl.capacity() * sizeof(bitcoin::uint256);
+        return ret;
+    }
+
     Cache::Cache(const GetHashesFunc & f)
         : getHashesFunc(f)
     {
@@ -1544,6 +1636,23 @@ namespace {
                 throw Exception("Calculated merkle root does not match expected value!");
         }
         Log() << "merkle root verified ok " << txs2.size() << " times";
+
+        // Merkle::Tree must produce exactly the same branches & roots as Merkle::branchAndRoot, for all tree shapes
+        for (const auto * hv : {&txs, &txs2}) {
+            for (size_t n = 1; n <= hv->size(); n += (n < 40 ? 1 : 37)) {
+                const Merkle::HashVec sub(hv->begin(), hv->begin() + n);
+                const Merkle::Tree tree(sub);
+                for (unsigned i = 0; i < n; ++i) {
+                    if (tree.branchAndRoot(i) != Merkle::branchAndRoot(sub, i))
+                        throw Exception(QString("Merkle::Tree branch mismatch for n = %1, index = %2").arg(n).arg(i));
+                    if (tree.find(sub[i]) != i)
+                        throw Exception(QString("Merkle::Tree find failed for n = %1, index = %2").arg(n).arg(i));
+                }
+            }
+        }
+        if (Merkle::Tree(txs2).find(QByteArray(HashLen, '\0')))
+            throw Exception("Merkle::Tree found a hash that is not in the tree!");
+        Log() << "Merkle::Tree verified ok";
     }
     void bench() {
         const size_t num = 64000;
@@ -1558,6 +1667,43 @@ namespace {
         const Tic t0;
         auto pair2 = Merkle::branchAndRoot(txs, 0);
         Log() << "Merkle took: " << t0.msecStr(4) << " msec";
+        const Tic t1;
+        const Merkle::Tree tree(txs);
+        Log() << "Merkle::Tree build took: " << t1.msecStr(4) << " msec (" << tree.byteSize() << " bytes)";
+        const Tic t2;
+        for (size_t i = 0; i < txs.size(); ++i)
+            pair2 = tree.branchAndRoot(*tree.find(txs[i]));
+        Log() << "Merkle::Tree find + branch for all " << txs.size() << " leaves took: " << t2.msecStr(4) << " msec";
+
+        // Batched SHA256D64 vs. 1-at-a-time hashing of pairs, for a tree of 1M leaves (roughly the size of the header
+        // tree that Merkle::Cache::initialize builds on startup)
+        Log() << "Using sha256: " << QString::fromStdString(bitcoin::SHA256AutoDetect());
+        std::vector<bitcoin::uint256> leaves(1'000'000);
+        for (auto & h : leaves)
+            QRandomGenerator::global()->fillRange(reinterpret_cast<uint32_t *>(h.data()), h.size() / sizeof(uint32_t));
+        const Tic t3;
+        auto lvl = leaves;
+        while (lvl.size() > 1u) {
+            std::vector<bitcoin::uint256> next;
+            next.reserve((lvl.size() + 1u) / 2u);
+            for (size_t i = 0; i < lvl.size(); i += 2u) {
+                const auto &a = lvl[i], &b = lvl[std::min(i + 1u, lvl.size() - 1u)];
+                next.emplace_back(bitcoin::Hash(a.begin(), a.end(), b.begin(), b.end()));
+            }
+            lvl.swap(next);
+        }
+        const auto serialRoot = lvl.front();
+        Log() << "1M leaves, serial bitcoin::Hash: " << t3.msecStr(4) << " msec";
+        const Tic t4;
+        lvl = leaves;
+        while (lvl.size() > 1u) {
+            Merkle::hashPairs(lvl.data(), lvl.size(), lvl.data());
+            lvl.resize((lvl.size() + 1u) / 2u);
+        }
+        Log() << "1M leaves, batched Merkle::hashPairs: " << t4.msecStr(4) << " msec (speedup: "
+              << QString::number(t3.msec<double>() / std::max(t4.msec<double>(), 1e-3), 'f', 2) << "x)";
+        if (lvl.front() != serialRoot)
+            throw Exception("Merkle::hashPairs produced a different root than serial hashing!");
     }
     static const auto test_ = App::registerTest("merkle", &test);
     static const auto bench_ = App::registerBench("merkle", &bench);
@@ -24,6 +24,7 @@
 #include <QByteArray>
 
 #include <cmath>
+#include <cstdint>
 #include <optional>
 #include <shared_mutex>
 #include <utility>
@@ -60,6 +61,12 @@ namespace Merkle
     /// Throws an Exception subclass on error (out-of-range index or length, bad hashes, etc).
     BranchAndRootPair branchAndRoot(const HashVec &hashes, unsigned index, const std::optional<unsigned> & length = {});
 
+    /// Computes the next merkle level up from the `nIn` hashes in `in`, writing (nIn + 1) / 2 hashes to `out`. If
+    /// nIn is odd, the last hash is paired with itself. All the pairs are hashed with 1 call to
+    /// bitcoin::SHA256D64, which uses the fastest multi-way double-SHA256 kernel available on this CPU. `out` may
+    /// be the same as `in` (but must not otherwise overlap it).
+    void hashPairs(const bitcoin::uint256 *in, size_t nIn, bitcoin::uint256 *out);
+
     /// Convenient alias -- return just the merkle root of a non-empty vector of hashes. May throw.
     inline Hash root(const HashVec & hashes, const std::optional<unsigned> & length = {}) {
         return branchAndRoot(hashes, 0, length).second;
@@ -85,6 +92,31 @@ namespace Merkle
     */
     BranchAndRootPair branchAndRootFromLevel(const HashVec & level, const HashVec & leafHashes, unsigned index, unsigned depthHigher);
 
+    /// A fully-computed merkle tree which keeps every level, plus a sorted index of its leaves. Once constructed,
+    /// extracting the branch for any leaf costs O(log n) hash copies (no hashing), and finding the position of a leaf
+    /// costs O(log n) comparisons. Used by Storage to cache the trees of recently-requested blocks. Immutable after
+    /// construction, so it may be shared between threads.
+    class Tree {
+    public:
+        /// Builds the tree for `hashes` (bitcoind memory order). Throws BadArgs if `hashes` is empty or contains a
+        /// hash that is not 32 bytes.
+        explicit Tree(const HashVec &hashes);
+
+        unsigned size() const { return unsigned(levels.front().size()); } ///< number of leaves
+        Hash leaf(unsigned index) const; ///< throws BadArgs if out of range
+        Hash root() const;
+        /// Identical in result to Merkle::branchAndRoot(hashes, index). Throws BadArgs if index is out of range.
+        BranchAndRootPair branchAndRoot(unsigned index) const;
+        /// Returns the position of the leaf equal to `hash` (bitcoind memory order), if any.
+        std::optional<unsigned> find(const Hash &hash) const;
+        /// Approximate memory footprint in bytes
+        size_t byteSize() const;
+
+    private:
+        std::vector<std::vector<bitcoin::uint256>> levels; ///< levels[0] are the leaves, levels.back() is {root}
+        std::vector<uint32_t> sortedLeafIndices; ///< indices into levels[0], sorted by leaf hash
+    };
+
     /// EX work-alike merkle cache. We do it this way because pretty much the protocol demands this approach.
     /// The public methods of this class are all thread-safe (except for the constructor).
     class Cache {
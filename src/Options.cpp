@@ -173,6 +173,10 @@ QVariantMap Options::toMap() const
     m["db_use_fsync"] = db.useFsync;
     // ts-format
     m["ts-format"] = logTimestampModeString();
+    // log_async
+    m["log_async"] = logAsync;
+    // log_async_drop
+    m["log_async_drop"] = logAsyncDrop;
     // tls-disallow-deprecated
     m["tls-disallow-deprecated"] = tlsDisallowDeprecated;
     // simdjson
@@ -185,8 +189,23 @@ QVariantMap Options::toMap() const
     m["max_reorg"] = maxReorg;
     // txhash_cache
     m["txhash_cache"] = txHashCacheBytes / 1e6; // this comes in as a MB value from config, so spit it back out in the same MB unit
+    // merkle_cache
+    m["merkle_cache"] = merkleCacheBytes / 1e6; // MB, as above
+    // rawtx_cache
+    m["rawtx_cache"] = rawTxCacheBytes / 1e6; // MB, as above
+    // result_cache
+    m["result_cache"] = resultCacheBytes / 1e6; // MB, as above
+    // daemon_cache
+    m["daemon_cache"] = daemonCacheBytes / 1e6; // MB, as above
+    // download_backlog
+    m["download_backlog"] = downloadBacklogBytes / 1e6; // MB, as above
+    // headers_in_ram
+    m["headers_in_ram"] = headersInRam;
     // max_batch
     m["max_batch"] = maxBatch;
+    // utxo_ram
+    m["utxo_ram"] = utxoRam / 1e6; // this comes in as a MB value from config, so spit it back out in the same MB unit
+    m["utxo_ram_checkpoint"] = utxoRamCheckpoint;
     // anon_logs
     m["anon_logs"] = anonLogs;
     // pidfile
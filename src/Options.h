@@ -212,6 +212,17 @@ public:
     LogTimestampMode logTimestampMode = defaultLogTimeStampMode;
     QString logTimestampModeString() const;
 
+    // config: log_async
+    /// If true (and not in syslog mode), log lines are written to the console by a dedicated thread rather than by the
+    /// thread doing the logging.
+    static constexpr bool defaultLogAsync = false;
+    bool logAsync = defaultLogAsync;
+    // config: log_async_drop
+    /// If true, and log_async is enabled, Info/Debug lines are dropped (and counted) while the log queue is full,
+    /// rather than blocking the thread doing the logging until there is room. Warnings and errors are never dropped.
+    static constexpr bool defaultLogAsyncDrop = false;
+    bool logAsyncDrop = defaultLogAsyncDrop;
+
     // CLI: --tls-disallow-deprecated, config: tls-disallow-deprecated
     bool tlsDisallowDeprecated = false;
 
@@ -255,6 +266,56 @@ public:
     static constexpr bool isTxHashCacheBytesInRange(unsigned n) { return n >= txHashCacheBytesMin && n <= txHashCacheBytesMax; }
     unsigned txHashCacheBytes = defaultTxHashCacheBytes;
 
+    // config: merkle_cache
+    /// Corresponds to the number of bytes we give the per-block merkle tree cache (lruHeight2MerkleTree in Storage.cpp),
+    /// which is used by get_merkle and id_from_pos. Separate from txhash_cache so as not to shrink the caches in there.
+    static constexpr unsigned defaultMerkleCacheBytes = 32'000'000, ///< 32 MB default
+                              merkleCacheBytesMax = 2'000'000'000, ///< 2GB max
+                              merkleCacheBytesMin = 4'000'000; ///< 4 MB minimum
+    static constexpr bool isMerkleCacheBytesInRange(unsigned n) { return n >= merkleCacheBytesMin && n <= merkleCacheBytesMax; }
+    unsigned merkleCacheBytes = defaultMerkleCacheBytes;
+
+    // config: rawtx_cache
+    /// If > 0, the number of bytes to give the txHash -> raw tx cache in Storage.cpp, which is used to answer
+    /// non-verbose blockchain.transaction.get requests without asking bitcoind. 0 is off.
+    static constexpr unsigned defaultRawTxCacheBytes = 0,
+                              rawTxCacheBytesMax = 2'000'000'000, ///< 2GB max
+                              rawTxCacheBytesMin = 10'000'000; ///< 10 MB minimum (if not 0)
+    static constexpr bool isRawTxCacheBytesInRange(unsigned n) { return !n || (n >= rawTxCacheBytesMin && n <= rawTxCacheBytesMax); }
+    unsigned rawTxCacheBytes = defaultRawTxCacheBytes;
+
+    // config: result_cache
+    /// If > 0, the number of bytes to give the (scripthash, query) -> result cache in Storage.cpp, which is used to
+    /// answer repeated get_history & listunspent requests for the same scripthash without recomputing them. 0 is off.
+    static constexpr unsigned defaultResultCacheBytes = 0,
+                              resultCacheBytesMax = 2'000'000'000, ///< 2GB max
+                              resultCacheBytesMin = 10'000'000; ///< 10 MB minimum (if not 0)
+    static constexpr bool isResultCacheBytesInRange(unsigned n) { return !n || (n >= resultCacheBytesMin && n <= resultCacheBytesMax); }
+    unsigned resultCacheBytes = defaultResultCacheBytes;
+
+    // config: daemon_cache
+    /// If > 0, the number of bytes to give the cache of bitcoind replies to idempotent passthrough calls
+    /// (DaemonResponseCache in Servers.cpp), e.g. blockchain.estimatefee and blockchain.transaction.get. 0 is off.
+    static constexpr unsigned defaultDaemonCacheBytes = 16'000'000,
+                              daemonCacheBytesMax = 1'000'000'000, ///< 1GB max
+                              daemonCacheBytesMin = 1'000'000; ///< 1 MB minimum (if not 0)
+    static constexpr bool isDaemonCacheBytesInRange(unsigned n) { return !n || (n >= daemonCacheBytesMin && n <= daemonCacheBytesMax); }
+    unsigned daemonCacheBytes = defaultDaemonCacheBytes;
+
+    // config: download_backlog
+    /// The most memory (in bytes, estimated) that downloaded blocks waiting to be processed may use during a block
+    /// synch. The Controller adapts the actual budget to the measured block processing throughput, up to this limit.
+    static constexpr unsigned defaultDownloadBacklogBytes = 500'000'000, ///< 500 MB
+                              downloadBacklogBytesMin = 20'000'000, ///< 20 MB
+                              downloadBacklogBytesMax = 4'000'000'000; ///< 4 GB
+    unsigned downloadBacklogBytes = defaultDownloadBacklogBytes;
+
+    // config: headers_in_ram
+    /// If true, Storage keeps a copy of all block headers in memory and serves all header reads from there (rather
+    /// than from the headers file).
+    static constexpr bool defaultHeadersInRam = false;
+    bool headersInRam = defaultHeadersInRam;
+
     // CLI: --compact-dbs
     /// If specified, we compact all of the databases on startup
     bool compactDBs = false;
@@ -275,6 +336,16 @@ public:
     static constexpr size_t defaultUtxoCache = 0, minUtxoCache = 64ull * 1000ull * 1000ull; // 0 is off, otherwise 64 MB min
     size_t utxoCache = defaultUtxoCache;
 
+    // CLI: --utxo-ram (experimental)
+    /// If > 0, initial sync keeps the entire UTXO set in RAM (up to this many bytes), writing it to the DB only at
+    /// checkpoints and at the end of initial sync. 0 is off.
+    static constexpr size_t defaultUtxoRam = 0, minUtxoRam = 256ull * 1000ull * 1000ull; // 0 is off, otherwise 256 MB min
+    size_t utxoRam = defaultUtxoRam;
+    // CLI: --utxo-ram-checkpoint
+    /// The number of blocks between writes of the in-RAM UTXO set to the DB (0 = only write at the end of initial sync)
+    static constexpr unsigned defaultUtxoRamCheckpoint = 25'000;
+    unsigned utxoRamCheckpoint = defaultUtxoRamCheckpoint;
+
     // config: anon_logs
     static constexpr bool defaultAnonLogs = false;
     bool anonLogs = defaultAnonLogs; ///< if true, we hide IP addresses, Bitcoin addresses, and txid's from the Log()
@@ -317,6 +388,10 @@ public:
     // config: zmq_allow_hashtx
     static constexpr bool defaultZmqAllowHashTx = false;
     bool zmqAllowHashTx = defaultZmqAllowHashTx;
+
+    // config: zmq_allow_rawblock
+    static constexpr bool defaultZmqAllowRawBlock = true;
+    bool zmqAllowRawBlock = defaultZmqAllowRawBlock;
 };
 
 /// A class encapsulating a simple read-only config file format.  The format is similar to the bitcoin.conf format
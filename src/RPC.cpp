@@ -16,6 +16,7 @@
 // along with this program (see LICENSE.txt).  If not, see
 // <https://www.gnu.org/licenses/>.
 //
+#include "LatencyHistogram.h"
 #include "RPC.h"
 #include "Util.h"
 #include "WebSocket.h"
@@ -397,6 +398,7 @@ namespace RPC {
     }
     void ConnectionBase::_sendResult(BatchId batchId, const Message::Id & reqid, const QVariant & result)
     {
+        lastSendTimings = {};
         if (status != Connected || !socket) {
             DebugM(__func__, ":  Not connected! ", "(id: ", this->id, "), forcing on_disconnect ...");
             // the below ensures socket cleanup code runs.  This guarantees a disconnect & cleanup on bad socket state.
@@ -405,6 +407,7 @@ namespace RPC {
         }
 
         QByteArray json;
+        const qint64 t0 = Util::getTimeMicros();
         {
             Message m = Message::makeResponse(reqid, result, v1);
 
@@ -422,8 +425,10 @@ namespace RPC {
         }
         TraceM("Sending result json: ", Util::Ellipsify(json));
         ++nResultsSent;
+        const qint64 t1 = Util::getTimeMicros();
         // below send() ends up calling do_write immediately (which is connected to send)
         emit send( wrapForSend(std::move(json)) );
+        lastSendTimings = { t1 - t0, Util::getTimeMicros() - t1 };
     }
 
     bool ConnectionBase::batchResponseFilter(BatchId batchId, const Message & msg)
@@ -456,6 +461,7 @@ namespace RPC {
         Message::Id msgId;
         std::optional<ProcessObjectResult::Error> error;
         try {
+            const qint64 t0 = Util::getTimeMicros();
             const auto backend = jsonParserBackend.load(std::memory_order_relaxed);
             const Json::ParseOption parseOpt = batchPermitted ? Json::ParseOption::AcceptAnyValue
                                                               : Json::ParseOption::RequireObject;
@@ -470,6 +476,8 @@ namespace RPC {
                 if (res.error) {
                     error = std::move(res.error);
                 } else if (res.message) {
+                    if (res.message->isRequest())
+                        (*LatencyStats::forMethod(res.message->method))[LatencyStats::Parse].record(Util::getTimeMicros() - t0);
                     if (res.message->isError())
                         emit gotErrorMessage(id, *res.message);
                     else
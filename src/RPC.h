@@ -355,6 +355,12 @@ namespace RPC {
         bool isBatchPermitted() const { return batchPermitted; }
         void setBatchPermitted(bool b) { batchPermitted = b; }
 
+        /// Timings (in usec) of the most recent _sendResult() call. ServerBase reads these right after emitting
+        /// sendResult() to feed its per-method latency histograms. Both are -1 if the last result was not sent
+        /// immediately (e.g. it was collated into a batch response, or we were not connected).
+        struct SendTimings { qint64 serializeUsec = -1, writeUsec = -1; };
+        SendTimings lastSendTimings;
+
     signals:
         /// Call (emit) this to send a request to the peer. Note sending doesn't support batching.
         void sendRequest(const RPC::Message::Id & reqid, const QString &method, const QVariantList & params = {});
@@ -125,6 +125,8 @@ auto PrefixTable::ReadOnly::operator=(const ReadOnly &o) -> ReadOnly & {
     // ensure cleared so we deserialize on-demand, and so rows doesn't potentially point to o.serializedData
     for (auto & row : rows) row = PNV{};
     toc = o.toc;
+    groupInfos = o.groupInfos;
+    groups.assign(groupInfos.size(), QByteArray{});
     return *this;
 }
 
@@ -248,32 +250,35 @@ static_assert(PrefixBits == sizeof(uint16_t) * 8u && PrefixTable::numRows() - 1u
               "PrefixTable::serialize(), PrefixTable::PrefixTable(QByteArray), and PrefixTable::lazyLoadRow() assumptions.");
 
 namespace {
-std::optional<const QByteArray> emptySerialization;
+std::array<std::optional<const QByteArray>, 2> emptySerializations; // indexed by Format - 1
 std::shared_mutex emptySerializationMut;
-} // namespace
 
-QByteArray PrefixTable::serialize() const {
-    // Fast-path check for "empty" serializations. This is so that testnet synching is fast since many blocks have no
-    // inputs and thus an "empty" Rpa PrefixTable. In that case we don't bother with the below code and just return the
-    // cached serialization for an empty prefix table.
-    bool isDefEmpty = false, needToCacheEmptySer = false;
-    if (auto *rw = std::get_if<ReadWrite>(&var); rw && (isDefEmpty = rw->isDefinitelyEmpty)) {
-        std::shared_lock l(emptySerializationMut);
-        if (emptySerialization) {
-            return *emptySerialization;
-        } else {
-            needToCacheEmptySer = true;
-        }
+/// The first byte of RowGroups serializations. Legacy serializations begin with the 4-byte big endian uncompressed
+/// size that qCompress() prepends, and since that is always < 2GiB, their first byte is always < 0x80.
+constexpr uint8_t RowGroupsMagic = 0xf2;
+constexpr size_t NumGroups = 0x1u << 8u; // 256u, one per prefix0
+constexpr size_t RowsPerGroup = PrefixTable::numRows() / NumGroups;
+
+/// Writes the Legacy encoding of rows [begin, end) to `vw`: for each row, a compactsize byte length then the packed row.
+/// Returns the number of elements written.
+size_t writeRows(const PrefixTable &pt, size_t begin, size_t end, bitcoin::GenericVectorWriter<QByteArray> &vw) {
+    size_t elementCount = 0;
+    for (size_t i = begin; i < end; ++i) {
+        const auto rowData = pt.serializeRow(i, false);
+        elementCount += rowData.size() / (SerializedTxIdxBits / 8u);
+        // write compactSize + bytes
+        bitcoin::WriteCompactSize(vw, rowData.size());
+        vw << MakeUInt8Span(rowData);
     }
-    // /Fast-path
+    return elementCount;
+}
 
+QByteArray serializeLegacy(const PrefixTable &pt, size_t &elementCount) {
     QByteArray dataBuf;
-    size_t elementCount = 0;
-    constexpr size_t numUint8s = 0x1u << 8u; // 256u
     // minimal size for an empty table: more than ~64KiB
     constexpr size_t minTableSize =
-        numRows()                      // 0-byte compactsize * 65536
-        + numUint8s * sizeof(uint64_t) // 8-byte uint64_t's * 256
+        PrefixTable::numRows()         // 0-byte compactsize * 65536
+        + NumGroups * sizeof(uint64_t) // 8-byte uint64_t's * 256
         + 3u                           // 3-byte compactsize for the number of toc entries (0xfd,0x00,0x01)
         + 11u;                         // 2-byte header + 9-byte reserved space for offset of toc
     dataBuf.reserve(minTableSize);
@@ -281,23 +286,12 @@ QByteArray PrefixTable::serialize() const {
     vw << uint8_t{Rpa::PrefixBits}; // byte 0 always a 16
     vw << uint8_t{Rpa::SerializedTxIdxBits}; // byte 1 always a 32
     vw << uint8_t{} << uint64_t{}; // reserve 9 bytes at byte offset 2
-    ReadOnly::Toc toc;
+    std::vector<uint64_t> prefix0Offsets(NumGroups);
 
-    if (toc.prefix0Offsets.size() < numUint8s)
-        throw InternalError(QString("toc should have %1 rows, yet it has %2 rows! FIXME!").arg(numUint8s).arg(toc.prefix0Offsets.size()));
-
-    for (size_t i = 0u; i < numRows(); ++i) {
-        if (Prefix::pfxN<1>(i) == 0u) { // new prefix0 when prefix1 == 0x0
-            // mark the offset of this new prefix0
-            toc.prefix0Offsets[Prefix::pfxN<0>(i)] = dataBuf.size();
-        }
-
-        const auto rowData = serializeRow(i, false);
-        elementCount += rowData.size() / (SerializedTxIdxBits / 8u);
-
-        // write compactSize + bytes
-        bitcoin::WriteCompactSize(vw, rowData.size());
-        vw << MakeUInt8Span(rowData);
+    for (size_t g = 0u; g < NumGroups; ++g) {
+        // mark the offset of this new prefix0
+        prefix0Offsets[g] = dataBuf.size();
+        elementCount += writeRows(pt, g * RowsPerGroup, (g + 1u) * RowsPerGroup, vw);
     }
 
     // mark the offset of the TOC at position 2
@@ -306,22 +300,79 @@ QByteArray PrefixTable::serialize() const {
         bitcoin::WriteCompactSize(vw2, dataBuf.size()); // this compact size will always fit into the initial 9 bytes at position 2
     }
     // write the TOC
-    bitcoin::WriteCompactSize(vw, toc.prefix0Offsets.size()); // write that there are 256 entries in the toc
-    for (const uint64_t val : toc.prefix0Offsets) {
+    bitcoin::WriteCompactSize(vw, prefix0Offsets.size()); // write that there are 256 entries in the toc
+    for (const uint64_t val : prefix0Offsets) {
         vw << val; // note how we forced this to be 64-bit fixed-sized ints for fast initial lookup
     }
 
     // serialized data is compressed to save space, since for small blocks it is mostly 0's!
+    return qCompress(dataBuf);
+}
+
+/// Layout: magic byte, PrefixBits, SerializedTxIdxBits, compactsize NumGroups, then for each group a compactsize of
+/// (encoded size << 1 | compressed flag), then the encoded groups back to back. An encoded size of 0 means the group's
+/// rows are all empty. A group is the Legacy encoding of its 256 rows, zlib-compressed unless that doesn't help.
+QByteArray serializeRowGroups(const PrefixTable &pt, size_t &elementCount) {
+    std::vector<QByteArray> encoded(NumGroups);
+    std::vector<uint64_t> sizeFlags(NumGroups);
+    size_t payloadSize = 0;
+    for (size_t g = 0u; g < NumGroups; ++g) {
+        QByteArray group;
+        bitcoin::GenericVectorWriter vw(0, 0, group, 0);
+        const size_t n = writeRows(pt, g * RowsPerGroup, (g + 1u) * RowsPerGroup, vw);
+        if (!n) continue; // all rows empty: encoded size stays 0
+        elementCount += n;
+        if (QByteArray z = qCompress(group); z.size() < group.size()) {
+            encoded[g] = std::move(z);
+            sizeFlags[g] = uint64_t(encoded[g].size()) << 1u | 0x1u;
+        } else {
+            encoded[g] = std::move(group);
+            sizeFlags[g] = uint64_t(encoded[g].size()) << 1u;
+        }
+        payloadSize += encoded[g].size();
+    }
+    QByteArray ret;
+    ret.reserve(3u + 3u + NumGroups * 5u + payloadSize);
+    bitcoin::GenericVectorWriter vw(0, 0, ret, 0);
+    vw << RowGroupsMagic << uint8_t{Rpa::PrefixBits} << uint8_t{Rpa::SerializedTxIdxBits};
+    bitcoin::WriteCompactSize(vw, NumGroups);
+    for (const uint64_t val : sizeFlags)
+        bitcoin::WriteCompactSize(vw, val);
+    for (const auto & enc : encoded)
+        if (!enc.isEmpty()) vw << MakeUInt8Span(enc);
+    return ret;
+}
+} // namespace
+
+QByteArray PrefixTable::serialize(const Format format) const {
+    if (format != Format::Legacy && format != Format::RowGroups)
+        throw std::invalid_argument(QString("Unknown PrefixTable format: %1").arg(int(format)).toStdString());
+    auto & emptySerialization = emptySerializations[size_t(format) - 1u];
+    // Fast-path check for "empty" serializations. This is so that testnet synching is fast since many blocks have no
+    // inputs and thus an "empty" Rpa PrefixTable. In that case we don't bother with the below code and just return the
+    // cached serialization for an empty prefix table.
+    bool isDefEmpty = false, needToCacheEmptySer = false;
+    if (auto *rw = std::get_if<ReadWrite>(&var); rw && (isDefEmpty = rw->isDefinitelyEmpty)) {
+        std::shared_lock l(emptySerializationMut);
+        if (emptySerialization) {
+            return *emptySerialization;
+        } else {
+            needToCacheEmptySer = true;
+        }
+    }
+    // /Fast-path
+
+    size_t elementCount = 0;
     Tic t0;
-    const auto compressed = qCompress(dataBuf);
+    const auto compressed = format == Format::Legacy ? serializeLegacy(*this, elementCount)
+                                                     : serializeRowGroups(*this, elementCount);
     if constexpr (VERBOSE) {
         if (Debug::isEnabled() && (elementCount >= 100u || t0.msec() >= 5))
             Debug(Log::BrightGreen).operator()
-                ("PrefixTable: elementCount: ", elementCount,
-                 " uncompressedSize: ", dataBuf.size(), ", compressed size: ", compressed.size(),
-                 ", ratio: ", QString::asprintf("%1.3f", double(compressed.size())/double(dataBuf.size())),
+                ("PrefixTable: elementCount: ", elementCount, ", format: ", int(format),
+                 ", compressed size: ", compressed.size(),
                  ", B/entry: ", QString::asprintf("%1.2f", elementCount != 0 ? double(compressed.size())/double(elementCount) : 0.0),
-                 ", compression took: ", t0.msecStr(4), " msec");
+                 ", serialization took: ", t0.msecStr(4), " msec");
     }
 
     // Cache "empty serialization" to static var if flagged that we need to cache it and the returned value *is* the compressed "empty serialization".
@@ -335,23 +386,61 @@ QByteArray PrefixTable::serialize() const {
     return compressed;
 }
 
-PrefixTable::PrefixTable(const QByteArray &compressedSerializedData) : var(std::in_place_type<ReadOnly>) {
+auto PrefixTable::formatOf(const QByteArray &serData) -> Format {
+    return !serData.isEmpty() && uint8_t(serData.at(0)) == RowGroupsMagic ? Format::RowGroups : Format::Legacy;
+}
+
+QByteArray PrefixTable::uncompress(const QByteArray &compressedSerializedData) {
+    if (formatOf(compressedSerializedData) == Format::RowGroups) return compressedSerializedData; // decoded on-demand
     Tic t0;
+    QByteArray ret = qUncompress(compressedSerializedData);
+    if constexpr (VERBOSE) {
+        if (Debug::isEnabled() && (ret.size() > 100'000 || t0.msec() >= 1))
+            Debug(Log::BrightGreen).operator()
+                ("PrefixTable: uncompress of ", ret.size(), " bytes took: ", t0.msecStr(4), " msec");
+    }
+    if (ret.isNull()) throw std::ios_base::failure("PrefixTable: Failed to uncompress serialized data .. is the data corrupt?");
+    return ret;
+}
+
+PrefixTable PrefixTable::fromUncompressed(const QByteArray &uncompressedData) {
+    return PrefixTable(UncompressedTag{}, uncompressedData);
+}
+
+PrefixTable::PrefixTable(const QByteArray &compressedSerializedData)
+    : PrefixTable(UncompressedTag{}, uncompress(compressedSerializedData)) {}
+
+PrefixTable::PrefixTable(UncompressedTag, const QByteArray &uncompressedData) : var(std::in_place_type<ReadOnly>) {
     auto & ro = std::get<ReadOnly>(var);
     auto & toc = ro.toc;
-    Tic t1;
-    ro.serializedData = qUncompress(compressedSerializedData);
+    ro.serializedData = uncompressedData;
     const auto & serData = std::as_const(ro.serializedData);
-    t1.fin();
-    Defer d([&]{
-        if constexpr (VERBOSE) {
-            if (Debug::isEnabled() && (serData.size() > 100'000 || t1.msec() >= 1))
-                Debug(Log::BrightGreen).operator()
-                    ("PrefixTable: uncompress of ", serData.size(), " bytes took: ", t1.msecStr(4), " msec, total time: ",
-                     t0.msecStr(), " msec");
+    if (serData.isEmpty()) throw std::ios_base::failure("PrefixTable: Empty serialized data");
+    if (formatOf(serData) == Format::RowGroups) {
+        bitcoin::GenericVectorReader vr(0, 0, serData, 0);
+        uint8_t magic = 0, pbits = 0xff, dbits = 0xff;
+        vr >> magic >> pbits >> dbits;
+        if (pbits != Rpa::PrefixBits) throw std::ios_base::failure("PrefixTable: Wrong byte value at position 1");
+        if (dbits != Rpa::SerializedTxIdxBits) throw std::ios_base::failure("PrefixTable: Wrong byte value at position 2");
+        const uint64_t numGroups = bitcoin::ReadCompactSize(vr, false);
+        if (numGroups != toc.prefix0Offsets.size()) throw std::ios_base::failure("PrefixTable: Bad group count");
+        ro.groupInfos.resize(numGroups);
+        ro.groups.resize(numGroups);
+        for (auto & gi : ro.groupInfos) {
+            const uint64_t sizeFlags = bitcoin::ReadCompactSize(vr, false);
+            if ((sizeFlags >> 1u) > uint64_t(serData.size())) throw std::ios_base::failure("PrefixTable: Bad group size");
+            gi.size = uint32_t(sizeFlags >> 1u);
+            gi.compressed = sizeFlags & 0x1u;
         }
-    });
-    if (ro.serializedData.isNull()) throw std::ios_base::failure("PrefixTable: Failed to uncompress serialized data .. is the data corrupt?");
+        uint64_t offset = vr.GetPos();
+        for (size_t g = 0; g < ro.groupInfos.size(); ++g) {
+            toc.prefix0Offsets[g] = offset;
+            offset += ro.groupInfos[g].size;
+        }
+        if (offset > uint64_t(serData.size())) throw std::ios_base::failure("PrefixTable: Group sizes exceed buffer size");
+        // Note: groups are inflated on-demand by lazyLoadGroup(), which is called by lazyLoadRow()
+        return;
+    }
     {
         bitcoin::GenericVectorReader vr(0, 0, serData, 0);
         uint8_t pbits = 0xff, dbits = 0xff;
@@ -388,14 +477,16 @@ void PrefixTable::lazyLoadRow(const size_t index, const ReadOnly *ro) const {
     if (UNLIKELY(ro->rows.size() != numRows())) throw InternalError("Bad size for ro->rows(). FIXME!");
     PNV & row = ro->rows.at(index); // may throw
     if (! row.isNull()) return; // if not null, then we already been through here once, and the data is populated already (even if with a 0-sized array .isNull() will be false)
-    const auto & serData = ro->serializedData;
     const auto prefixBytes = Prefix::numToBytes(index);
     static_assert(prefixBytes.size() == 2u);
     const size_t pfx0 = prefixBytes[0];
     if (UNLIKELY(pfx0 >= ro->toc.prefix0Offsets.size()))
         throw InternalError(QString("PrefixTable serialized TOC has bad size, indexing position %1 but TOC size is %2. FIXME!")
                                 .arg(pfx0).arg(ro->toc.prefix0Offsets.size()));
-    bitcoin::GenericVectorReader vr(0, 0, serData, ro->toc.prefix0Offsets[pfx0]); // start reading at prefix0 offset
+    // Legacy: rows are read straight out of serializedData. RowGroups: rows are read out of the (decoded) group.
+    const bool isRowGroups = !ro->groupInfos.empty();
+    const auto & serData = isRowGroups ? lazyLoadGroup(pfx0, *ro) : ro->serializedData;
+    bitcoin::GenericVectorReader vr(0, 0, serData, isRowGroups ? 0u : ro->toc.prefix0Offsets[pfx0]); // start reading at prefix0 offset
     const size_t pfx1 = prefixBytes[1];
     // read forward until we hit prefix1
     for (size_t i = 0; i < pfx1; ++i) {
@@ -412,6 +503,22 @@ void PrefixTable::lazyLoadRow(const size_t index, const ReadOnly *ro) const {
     row = PNV(Span{begin, end}); // ensure data pointer is valid, even if length happens to be 0
 }
 
+const QByteArray & PrefixTable::lazyLoadGroup(const size_t prefix0, const ReadOnly &ro) const {
+    QByteArray & group = ro.groups.at(prefix0); // may throw
+    if (!group.isNull()) return group; // already decoded
+    const auto & gi = ro.groupInfos.at(prefix0);
+    if (!gi.size) {
+        static const QByteArray emptyGroup(RowsPerGroup, '\0'); // 256 0-length rows
+        return group = emptyGroup;
+    }
+    // A view into serializedData, which outlives it (it's owned by the same ReadOnly instance)
+    const auto encoded = QByteArray::fromRawData(ro.serializedData.constData() + ro.toc.prefix0Offsets[prefix0], gi.size);
+    group = gi.compressed ? qUncompress(encoded) : encoded;
+    if (size_t(group.size()) < RowsPerGroup)
+        throw std::ios_base::failure("PrefixTable: Failed to decode row group .. is the data corrupt?");
+    return group;
+}
+
 const VecTxIdx * PrefixTable::getRowPtr(size_t index) const {
     auto const *rw = std::get_if<ReadWrite>(&var);
     if (!rw) return nullptr;
@@ -475,6 +582,8 @@ size_t MempoolPrefixTable::removeForPrefixAndHash(const Prefix & prefix, const T
 #include <QRandomGenerator>
 
 #include <algorithm>
+#include <functional>
+#include <future>
 #include <map>
 #include <set>
 #include <vector>
@@ -691,6 +800,34 @@ void test()
             if (v1 != v2) throw Exception("Unser test 2 fail");
         }
         checkTableConsistency(p2, verifyTable); // run through entire table for belt-and-suspenders check
+
+        // The Legacy format must stay readable, and both formats must read back the same table
+        using Format = Rpa::PrefixTable::Format;
+        const auto legacyData = prefixTable.serialize(Format::Legacy);
+        if (Rpa::PrefixTable::formatOf(data) != Format::RowGroups || Rpa::PrefixTable::formatOf(legacyData) != Format::Legacy)
+            throw Exception("formatOf() returned the wrong format");
+        const Rpa::PrefixTable p3(legacyData);
+        if (p3 != p2 || p3.elementCount() != prefixTable.elementCount()) throw Exception("Legacy format unser test fail");
+        if (Rpa::PrefixTable::uncompress(data) != data) throw Exception("uncompress() should be a no-op for RowGroups data");
+        if (Rpa::PrefixTable::fromUncompressed(Rpa::PrefixTable::uncompress(legacyData)) != p2)
+            throw Exception("fromUncompressed() of Legacy data fail");
+        // Upgrade path: re-serializing a table read from the Legacy format yields exactly the RowGroups serialization
+        if (p3.serialize() != data) throw Exception("Legacy -> RowGroups re-serialization differs");
+        // A search touching 1 prefix0 must decode just that 1 group, so corrupting another group must not matter ...
+        const auto rowGroupsBytes = data.size();
+        QByteArray corrupt = data;
+        corrupt[rowGroupsBytes - 1] = char(~corrupt[rowGroupsBytes - 1]); // last byte belongs to the last group (0xff)
+        const Rpa::PrefixTable p4(corrupt);
+        if (p4.searchPrefix(Rpa::Prefix(0x12, 8)) != prefixTable.searchPrefix(Rpa::Prefix(0x12, 8)))
+            throw Exception("RowGroups search of an intact group fail");
+        // ... while a search of the corrupted group is detected (either at inflate time, or as a mismatch)
+        bool threw = false;
+        try {
+            threw = p4.searchPrefix(Rpa::Prefix(0xff, 8)) != prefixTable.searchPrefix(Rpa::Prefix(0xff, 8));
+        } catch (const std::exception &) { threw = true; }
+        if (!threw) throw Exception("RowGroups corruption went undetected");
+        Log() << "PrefixTable with " << prefixTable.elementCount() << " items, Legacy size: " << legacyData.size()
+              << ", RowGroups size: " << data.size();
     }
 
     Log() << "Testing PrefixTable equality ...";
@@ -986,6 +1123,8 @@ void test()
         if (pft2 != pft) throw Exception("Ser/deser cycle yielded a different table that is not equal to the original!");
         if (expected_9430 != pft2.searchPrefix(Rpa::Prefix(uint16_t(9430)))) throw Exception("Table `pft2` not as expected (check 1)");
         if (expected_0x04 != pft2.searchPrefix(Rpa::Prefix(0x04, 4), true)) throw Exception("Table `pft2` not as expected (check 2)");
+        const auto pft3 = Rpa::PrefixTable::fromUncompressed(Rpa::PrefixTable::uncompress(pft.serialize()));
+        if (!pft3.isReadOnly() || pft3 != pft) throw Exception("Table `pft3` (from uncompressed data) is not equal to the original!");
     }();
 
     Log(Log::Color::BrightWhite) << "All Rpa unit tests passed!";
@@ -993,5 +1132,75 @@ void test()
 
 static const auto test_ = App::registerTest("rpa", &test);
 
+/// Models the confirmed-history part of Storage::getRpaHistory over synthetic PrefixTables: serially, split across
+/// threads, and split across threads with the tables already fetched (i.e. all cache hits), for both formats.
+void bench()
+{
+    using Format = Rpa::PrefixTable::Format;
+    constexpr size_t nTables = 120, nQueries = 20;
+    constexpr unsigned nThreads = 4;
+    auto *rgen = QRandomGenerator::global();
+    Log() << "Building " << nTables << " synthetic PrefixTables ...";
+    std::map<Format, std::vector<QByteArray>> serialized, uncompressed;
+    std::map<Format, size_t> nBytes;
+    size_t nElements = 0;
+    for (size_t i = 0; i < nTables; ++i) {
+        Rpa::PrefixTable pt;
+        const Rpa::TxIdx nTx = 500u + rgen->bounded(4500u);
+        for (Rpa::TxIdx txIdx = 1; txIdx < nTx; ++txIdx)
+            for (unsigned j = 0, nIns = 1u + rgen->bounded(4u); j < nIns; ++j, ++nElements)
+                pt.addForPrefix(Rpa::Prefix(uint16_t(rgen->bounded(0x1'0000u))), txIdx);
+        for (const auto fmt : {Format::Legacy, Format::RowGroups}) {
+            serialized[fmt].push_back(pt.serialize(fmt));
+            uncompressed[fmt].push_back(Rpa::PrefixTable::uncompress(serialized[fmt].back()));
+            nBytes[fmt] += serialized[fmt].back().size();
+        }
+    }
+    Log() << nElements << " elements, Legacy: " << nBytes[Format::Legacy] << " bytes, RowGroups: "
+          << nBytes[Format::RowGroups] << " bytes";
+    std::vector<Rpa::Prefix> queries;
+    for (size_t i = 0; i < nQueries; ++i) queries.emplace_back(uint16_t(rgen->bounded(0x100u)), 8); // wallets use 8 bits
+
+    using Results = std::vector<Rpa::VecTxIdx>;
+    auto scan = [&](const std::vector<QByteArray> &tables, bool fromCache, const Rpa::Prefix &pfx, size_t begin,
+                    size_t end, Results &res) {
+        for (size_t i = begin; i < end; ++i)
+            res[i] = (fromCache ? Rpa::PrefixTable::fromUncompressed(tables[i]) : Rpa::PrefixTable(tables[i]))
+                         .searchPrefix(pfx, true);
+    };
+    std::optional<std::vector<Results>> expected;
+    std::optional<double> tBaseline;
+    auto run = [&](const QString &what, Format fmt, unsigned nThr, bool fromCache) {
+        const auto & tables = fromCache ? uncompressed[fmt] : serialized[fmt];
+        std::vector<Results> all;
+        Tic t0;
+        for (const auto & pfx : queries) {
+            Results res(nTables);
+            std::vector<std::future<void>> futs;
+            const size_t per = (nTables + nThr - 1u) / nThr;
+            for (size_t b = per; b < nTables; b += per)
+                futs.push_back(std::async(std::launch::async, scan, std::cref(tables), fromCache, std::cref(pfx), b,
+                                          std::min(b + per, nTables), std::ref(res)));
+            scan(tables, fromCache, pfx, 0, std::min(per, nTables), res);
+            for (auto & f : futs) f.get();
+            all.push_back(std::move(res));
+        }
+        const double ms = t0.msec<double>();
+        if (!expected) {
+            expected = all; // the first run is the baseline
+            tBaseline = ms;
+        } else if (all != *expected) throw Exception("Results mismatch for: " + what);
+        Log() << what << ": " << QString::number(ms / nQueries, 'f', 3) << " msec per query, speedup: "
+              << QString::number(*tBaseline / ms, 'f', 2) << "x";
+    };
+    for (const auto & [fmt, name] : {std::pair{Format::Legacy, "Legacy"}, std::pair{Format::RowGroups, "RowGroups"}}) {
+        run(QString("%1, serial").arg(name), fmt, 1, false);
+        run(QString("%1, parallel").arg(name), fmt, nThreads, false);
+        run(QString("%1, parallel + cached").arg(name), fmt, nThreads, true);
+    }
+}
+
+static const auto bench_ = App::registerBench("rpa", &bench);
+
 }
 #endif
@@ -165,6 +165,12 @@ static constexpr uint64_t MaxTxIdx = (uint64_t{0x1u} << SerializedTxIdxBits) - u
 /// The size of this table is always 65536, and it encapsulates a mapping of a 16-bit "prefix" to a vector of
 /// TxIdx. The table may be ReadWrite (as it is populated during block processing), or ReadOnly (lookup from DB).
 /// ReadOnly tables are lazily read on-demand from a backing byte buffer (which is intended to come from the DB).
+///
+/// There are 2 serialization formats. Both are readable; serialize() writes RowGroups unless asked otherwise:
+///  - Legacy: the whole table (all 65536 rows) is zlib-compressed as 1 blob, so reading any row inflates everything.
+///  - RowGroups: the rows are split into 256 groups of 256 rows (1 group per first prefix byte), each compressed on
+///    its own, and preceded by an index of group sizes. A search only inflates the groups covering its prefix range,
+///    which for the usual 8-bit (or longer) wallet prefix is exactly 1 group.
 class PrefixTable {
     struct ReadWrite {
         std::vector<VecTxIdx> rows{PrefixTable::numRows(), VecTxIdx{}};
@@ -180,10 +186,19 @@ class PrefixTable {
             Toc() : prefix0Offsets(size_t(1 << 8), uint64_t{}) {}
         };
 
+        /// Legacy: offsets into serializedData of the first row of each prefix0.
+        /// RowGroups: offsets into serializedData of the encoded group for each prefix0.
         Toc toc;
 
+        /// RowGroups only: per-prefix0 encoded size and whether it is compressed (size 0 means all 256 rows are empty),
+        /// plus the lazily-decoded groups themselves, in the Legacy row encoding (which `rows` then point into).
+        struct GroupInfo { uint32_t size = 0; bool compressed = false; };
+        std::vector<GroupInfo> groupInfos;
+        mutable std::vector<QByteArray> groups;
+
         ReadOnly() = default;
-        ReadOnly(const ReadOnly &o) : serializedData(o.serializedData), toc(o.toc) /* intentionally don't copy rows */ {}
+        ReadOnly(const ReadOnly &o) : serializedData(o.serializedData), toc(o.toc), groupInfos(o.groupInfos)
+        { /* intentionally don't copy rows or groups */ groups.resize(groupInfos.size()); }
         ReadOnly(ReadOnly &&) = default;
 
         ReadOnly & operator=(const ReadOnly &o);
@@ -198,9 +213,21 @@ public:
 
     PrefixTable() : var(ReadWrite{} /* Would use std::in_place_type here but older GCC fails to compile */) {}
 
-    // Construct from serialized data, turns this class into a read-only "view" into the data
+    enum class Format : uint8_t { Legacy = 1, RowGroups = 2 };
+
+    // Construct from serialized data (in either Format), turns this class into a read-only "view" into the data
     explicit PrefixTable(const QByteArray &serData);
 
+    /// Returns the Format of serialized data, as returned by serialize(). Only looks at the first byte.
+    static Format formatOf(const QByteArray &serData);
+    /// Inflates Legacy serialized (compressed) data, throwing on failure. The result may be cached and passed to
+    /// fromUncompressed() later, which then skips the (relatively expensive) decompression. RowGroups data is
+    /// returned as-is, since it is only ever inflated a group at a time, on-demand.
+    static QByteArray uncompress(const QByteArray &serData);
+    /// Construct a read-only "view" into data returned by uncompress(). Only the table of contents is parsed here, so
+    /// this is cheap. The QByteArray is implicitly shared, so many tables (in many threads) may view the same buffer.
+    static PrefixTable fromUncompressed(const QByteArray &uncompressedData);
+
     static constexpr size_t numRows() { return 0x1u << PrefixBits; }
 
     void clear() { var = ReadWrite{}; /* Would use var.emplace here but older GCC bugs out if we do that */ }
@@ -222,7 +249,7 @@ public:
 
     QByteArray serializeRow(size_t index, bool deepCopy = true) const;
 
-    QByteArray serialize() const;
+    QByteArray serialize(Format format = Format::RowGroups) const;
 
     bool operator==(const PrefixTable &o) const;
     bool operator!=(const PrefixTable &o) const { return ! this->operator==(o); }
@@ -231,9 +258,14 @@ public:
     const VecTxIdx * getRowPtr(size_t index) const;
 
 private:
+    struct UncompressedTag {};
+    PrefixTable(UncompressedTag, const QByteArray &uncompressedData);
+
     /// ReadOnly mode only: Lazy-loads row at index, if it has not already been loaded (otherwise is a no-op).
     /// ReadWrite mode: Is a no-op.
     void lazyLoadRow(size_t index, const ReadOnly *ro = nullptr) const;
+    /// RowGroups mode only: Returns the decoded group for prefix0, decoding it first if needed.
+    const QByteArray & lazyLoadGroup(size_t prefix0, const ReadOnly &ro) const;
 };
 
 static_assert(PrefixTableSize - 1u == std::numeric_limits<uint16_t>::max());
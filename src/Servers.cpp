@@ -23,6 +23,7 @@
 #include "BTC.h"
 #include "BTC_Address.h"
 #include "Compat.h"
+#include "LatencyHistogram.h"
 #include "Merkle.h"
 #include "PeerMgr.h"
 #include "Rpa.h"
@@ -38,6 +39,7 @@
 #include <QCoreApplication>
 #include <QFile>
 #include <QFileInfo>
+#include <QPointer>
 #include <QtNetwork>
 #include <QSslCertificate>
 #include <QSslKey>
@@ -47,13 +49,16 @@
 #include <QTimer>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdlib>
+#include <exception>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <shared_mutex>
 #include <type_traits>
 #include <utility>
@@ -394,8 +399,16 @@ ServerBase::ServerBase(SrvMgr *sm,
     // setup this->coin flag -- note that assumption is that storage was aleady setup properly
     if ((coin = BTC::coinFromName(storage->getCoin())) == BTC::Coin::Unknown)
         throw InternalError("ServerBase cannot be constructed without a valid \"Coin\" in the database!");
+    lifeToken->server = this;
+}
+ServerBase::~ServerBase()
+{
+    {
+        std::unique_lock g(lifeToken->mut);
+        lifeToken->server = nullptr;
+    }
+    stop();
 }
-ServerBase::~ServerBase() { stop(); }
 
 // this must be called in the thread context of this thread
 QVariant ServerBase::stats() const
@@ -682,6 +695,21 @@ void ServerBase::applyMaxBufferToAllClients(int newMax)
 }
 
 
+namespace {
+    /// Records the serialize & write timings of the reply just sent (if it was sent immediately), plus the `elapsed`
+    /// time minus those timings as the "work" phase (if `elapsed` >= 0).
+    void recordSendLatencies(LatencyStats::MethodHistograms &h, const RPC::ConnectionBase::SendTimings &st,
+                             qint64 elapsed = -1) {
+        if (st.serializeUsec >= 0) {
+            h[LatencyStats::Serialize].record(st.serializeUsec);
+            h[LatencyStats::Write].record(st.writeUsec);
+            elapsed -= st.serializeUsec + st.writeUsec;
+        }
+        if (elapsed >= 0)
+            h[LatencyStats::Work].record(elapsed);
+    }
+} // namespace
+
 void ServerBase::onMessage(IdMixin::Id clientId, RPC::BatchId batchId, const RPC::Message &m)
 {
     TraceM("onMessage: ", clientId, ", ", batchId.get(), " json: ", m.toJsonUtf8());
@@ -692,6 +720,9 @@ void ServerBase::onMessage(IdMixin::Id clientId, RPC::BatchId batchId, const RPC
         else {
             // indicate a good request, accepted request
             ++c->info.nRequestsRcv;
+            dispatchCtx = { LatencyStats::forMethod(m.method), false };
+            c->lastSendTimings = {};
+            const qint64 t0 = Util::getTimeMicros();
             try {
                 // call ptr to member -- note member is free to throw if it wants to send an error immediately
                 (this->*member)(c, batchId, m);
@@ -707,6 +738,10 @@ void ServerBase::onMessage(IdMixin::Id clientId, RPC::BatchId batchId, const RPC
                 Warning() << "Unknown exception thrown while processing RPC request \"" << m.method << "\" for client " << c->id;
                 emit c->sendError(false, RPC::ErrorCodes::Code_InternalError, "internal error: unknown", batchId, m.id);
             }
+            if (!dispatchCtx.deferred)
+                // synchronous method: the reply was already sent above, so the whole dispatch was "work" + send
+                recordSendLatencies(*dispatchCtx.hists, c->lastSendTimings, Util::getTimeMicros() - t0);
+            dispatchCtx = {};
         }
     } else {
         DebugM("Unknown client: ", clientId);
@@ -764,7 +799,7 @@ ServerBase::RPCError::~RPCError() {}
 ServerBase::RPCErrorWithDisconnect::~RPCErrorWithDisconnect() {}
 
 void ServerBase::generic_do_async(Client *c, RPC::BatchId batchId, const RPC::Message::Id &reqId,
-                                  const std::function<QVariant ()> &work, int priority)
+                                  const std::function<QVariant ()> &work, ThreadPool::Lane lane)
 {
     if (LIKELY(work)) {
         struct ResErr {
@@ -775,11 +810,16 @@ void ServerBase::generic_do_async(Client *c, RPC::BatchId batchId, const RPC::Me
         };
 
         auto reserr = std::make_shared<ResErr>(); ///< shared with lambda for both work and completion. this is how they communicate.
+        // latency histograms for the method being dispatched (may be nullptr if we were not called from onMessage)
+        LatencyStats::MethodHistograms * const hists = dispatchCtx.hists;
+        dispatchCtx.deferred = true;
+        const qint64 tSubmit = Util::getTimeMicros();
 
         (asyncThreadPool ? asyncThreadPool : ::AppThreadPool())->submitWork(
             c, // <--- all work done in client context, so if client is deleted, completion not called
-            // runs in worker thread, must not access anything other than reserr and work
-            [reserr,work]{
+            // runs in worker thread, must not access anything other than reserr, work, and hists (which is thread-safe)
+            [reserr, work, hists, tSubmit]{
+                const qint64 tStart = Util::getTimeMicros();
                 try {
                     QVariant result = work();
                     reserr->results.swap( result ); // constant-time copy
@@ -789,25 +829,385 @@ void ServerBase::generic_do_async(Client *c, RPC::BatchId batchId, const RPC::Me
                     reserr->errMsg = e.what();
                     reserr->errCode = e.code;
                 }
+                if (hists) {
+                    (*hists)[LatencyStats::Queue].record(tStart - tSubmit);
+                    (*hists)[LatencyStats::Work].record(Util::getTimeMicros() - tStart);
+                }
             },
             // completion: runs in client thread (only called if client not already deleted)
-            [c, batchId, reqId, reserr] {
+            [c, batchId, reqId, reserr, hists] {
                 if (reserr->error) {
                     emit c->sendError(reserr->doDisconnect, reserr->errCode, reserr->errMsg, batchId, reqId);
                     return;
                 }
                 // no error, send results to client
+                c->lastSendTimings = {};
                 emit c->sendResult(batchId, reqId, reserr->results);
+                if (hists) recordSendLatencies(*hists, c->lastSendTimings);
             },
             // default fail function just sends json rpc error "internal error: <message>"
             defaultTPFailFunc(c, batchId, reqId),
-            // lower is sooner, higher is later. Default 0.
-            priority
+            lane
         );
     } else
         Error() << "INTERNAL ERROR: work must be valid! FIXME!";
 }
 
+namespace {
+    /// App-wide (since identical requests may arrive on any of the servers) registry of the requests started by
+    /// ServerBase::generic_do_async_coalesced that are still in flight.
+    namespace Coalescing {
+        struct Outcome {
+            QVariant results;
+            bool error = false, doDisconnect = false;
+            QString errMsg;
+            int errCode = 0;
+            std::exception_ptr exception; ///< if error, what the work threw (if anything), so the leader can rethrow it
+        };
+        /// Called (from any thread) to answer a request that joined an in-flight one
+        using Waiter = std::function<void(const std::shared_ptr<const Outcome> &)>;
+        /// Runs a request's work, catching anything it throws into the Outcome
+        using Compute = std::function<std::shared_ptr<const Outcome>()>;
+
+        /// What it takes to run a request's work again, without its leader's client
+        struct Runner {
+            Compute compute;
+            ThreadPool *pool = nullptr;
+            ThreadPool::Lane lane = ThreadPool::Lane::Normal;
+            QPointer<QObject> owner; ///< the server that started the request; the work may not outlive it
+        };
+
+        struct InFlight {
+            const QByteArray key;
+            const uint64_t id;
+            const Runner runner;
+            const bool isRetry; ///< true if we are running the work for the waiters of a leader that never ran it
+            std::vector<Waiter> waiters; ///< guarded by `mut`
+            bool done = false; ///< guarded by `mut`
+
+            InFlight(const QByteArray &k, uint64_t id, const Runner &r, bool isRetry = false)
+                : key(k), id(id), runner(r), isRetry(isRetry) {}
+            /// If the leader's work never got to run (its client went away, the job limit was hit), the work is run
+            /// again for the waiters, on runner.pool. Only if that is not possible either (the server is gone, or it
+            /// was already a retry) do the waiters get an error.
+            ~InFlight();
+            /// Removes us from the registry and answers all of the waiters with `outcome`. Only the first call counts.
+            void finish(const std::shared_ptr<const Outcome> &outcome);
+        };
+
+        std::mutex mut;
+        /// key -> (InFlight::id, InFlight), guarded by `mut`. NB: Never release the last strong ref to an InFlight with
+        /// `mut` held, since its destructor takes `mut`.
+        QHash<QByteArray, std::pair<uint64_t, std::weak_ptr<InFlight>>> inFlight;
+        uint64_t nextId = 0; ///< guarded by `mut`
+        std::map<QString, qulonglong> nCoalesced; ///< method -> number of requests that joined an in-flight one, guarded by `mut`
+        qulonglong nRetries = 0; ///< number of requests re-run for their waiters, guarded by `mut`
+
+        InFlight::~InFlight() {
+            std::vector<Waiter> ws;
+            std::shared_ptr<InFlight> next; // NB: declared before the lock below so that it is released after it
+            {
+                std::unique_lock g(mut);
+                if (done) return;
+                done = true;
+                ws.swap(waiters);
+                const auto it = inFlight.find(key);
+                const bool registered = it != inFlight.end() && it.value().first == id;
+                if (!ws.empty() && !isRetry && runner.compute && runner.pool && runner.owner) {
+                    // hand the work and the waiters over to a successor, which identical requests may join in turn
+                    next = std::make_shared<InFlight>(key, ++nextId, runner, true);
+                    next->waiters.swap(ws);
+                    if (registered) it.value() = {next->id, next};
+                    ++nRetries;
+                } else if (registered)
+                    inFlight.erase(it);
+            }
+            if (next) {
+                // Should the pool refuse or drop this job (job limit, shutdown, server gone), `next` is released
+                // unfinished, and since it is a retry, its waiters then get the error below.
+                next->runner.pool->submitWork(next->runner.owner.data(), [next]{ next->finish(next->runner.compute()); },
+                                              {}, {}, next->runner.lane);
+                return;
+            }
+            if (ws.empty()) return;
+            auto outcome = std::make_shared<Outcome>();
+            outcome->error = true;
+            outcome->errCode = RPC::Code_InternalError;
+            outcome->errMsg = QStringLiteral("internal error: request was not processed");
+            for (const auto & w : ws)
+                w(outcome);
+        }
+
+        void InFlight::finish(const std::shared_ptr<const Outcome> &outcome) {
+            std::vector<Waiter> ws;
+            {
+                std::unique_lock g(mut);
+                if (done) return;
+                done = true;
+                if (auto it = inFlight.find(key); it != inFlight.end() && it.value().first == id)
+                    inFlight.erase(it);
+                ws.swap(waiters);
+            }
+            for (const auto & w : ws)
+                w(outcome);
+        }
+
+        /// If a request for `key` is already in flight, queues `waiter` on it and returns nullptr. Otherwise registers
+        /// and returns a new InFlight: the caller is then the leader, and must finish() it with the outcome of
+        /// runner.compute() (if it is released unfinished, the work is run again for the waiters; see ~InFlight).
+        std::shared_ptr<InFlight> join(const QByteArray &key, const QString &method, Waiter waiter, const Runner &runner) {
+            // NB: declared before the lock below so that they are released after it (see `inFlight` above)
+            std::shared_ptr<InFlight> fl, existing;
+            std::unique_lock g(mut);
+            if (auto it = inFlight.find(key); it != inFlight.end())
+                existing = it.value().second.lock();
+            if (existing && !existing->done) {
+                existing->waiters.push_back(std::move(waiter));
+                ++nCoalesced[method];
+                return nullptr;
+            }
+            fl = std::make_shared<InFlight>(key, ++nextId, runner);
+            inFlight[key] = {fl->id, fl};
+            return fl;
+        }
+    } // namespace Coalescing
+} // namespace
+
+void ServerBase::generic_do_async_coalesced(Client *c, RPC::BatchId batchId, const RPC::Message::Id &reqId,
+                                            const QString &method, const QByteArray &key, const AsyncWorkFunc &work,
+                                            ThreadPool::Lane lane)
+{
+    using Coalescing::Outcome;
+    LatencyStats::MethodHistograms * const hists = dispatchCtx.hists;
+    // answers this request if it joins an in-flight one. It may be called from any thread, possibly after we are
+    // deleted, hence `life` rather than `this`.
+    auto waiter = [life = lifeToken, clientId = c->id, batchId, reqId, hists, tSubmit = Util::getTimeMicros()]
+                  (const std::shared_ptr<const Outcome> &o) {
+        std::unique_lock g(life->mut); // keeps the server alive until the call below is enqueued
+        ServerBase * const srv = life->server;
+        if (!srv) return; // server went away while waiting
+        // if srv is deleted before this runs, Qt drops it
+        Util::AsyncOnObject(srv, [srv, clientId, batchId, reqId, hists, tSubmit, o] {
+            Client *c = srv->getClient(clientId);
+            if (!c) return; // client went away while waiting
+            if (hists) (*hists)[LatencyStats::Work].record(Util::getTimeMicros() - tSubmit);
+            if (o->error) {
+                emit c->sendError(o->doDisconnect, o->errCode, o->errMsg, batchId, reqId);
+                return;
+            }
+            c->lastSendTimings = {};
+            emit c->sendResult(batchId, reqId, o->results);
+            if (hists) recordSendLatencies(*hists, c->lastSendTimings);
+        });
+    };
+    // runs the work, for the leader or (should the leader's job never run) for the waiters; see Coalescing::InFlight
+    const Coalescing::Compute compute = [work]() -> std::shared_ptr<const Outcome> {
+        auto outcome = std::make_shared<Outcome>();
+        try {
+            outcome->results = work();
+        } catch (const RPCError &e) {
+            outcome->error = true;
+            outcome->doDisconnect = e.disconnect;
+            outcome->errMsg = e.what();
+            outcome->errCode = e.code;
+            outcome->exception = std::current_exception();
+        } catch (const std::exception &e) {
+            outcome->error = true;
+            outcome->errCode = RPC::Code_InternalError;
+            outcome->errMsg = QString("internal error: %1").arg(e.what());
+            outcome->exception = std::current_exception();
+        }
+        return outcome;
+    };
+    const auto fl = Coalescing::join(key, method, std::move(waiter),
+                                     {compute, asyncThreadPool ? asyncThreadPool : ::AppThreadPool(), lane, this});
+    if (!fl) {
+        // joined the in-flight request; we will be answered (in our thread, by client id) when it finishes
+        dispatchCtx.deferred = true;
+        return;
+    }
+    // we are the leader
+    generic_do_async(c, batchId, reqId, [fl]() -> QVariant {
+        const auto outcome = fl->runner.compute();
+        fl->finish(outcome);
+        if (outcome->exception) std::rethrow_exception(outcome->exception);
+        return outcome->results;
+    }, lane);
+}
+
+QByteArray ServerBase::scriptHashQueryKey(const HashX &sh, const QByteArray &subKey) const
+{
+    const uint64_t generation = storage->stateGeneration();
+    return sh + subKey + QByteArray(reinterpret_cast<const char *>(&generation), sizeof(generation));
+}
+
+/* static */
+QVariantMap ServerBase::coalescingStats()
+{
+    QVariantMap ret;
+    std::unique_lock g(Coalescing::mut);
+    for (const auto & [method, n] : Coalescing::nCoalesced)
+        ret[method] = n;
+    ret["(re-run for waiters)"] = Coalescing::nRetries;
+    ret["(in flight)"] = qlonglong(Coalescing::inFlight.size());
+    return ret;
+}
+
+DaemonResponseCache::DaemonResponseCache(unsigned maxBytes) : cache(maxBytes) {}
+
+/* static */
+auto DaemonResponseCache::policyFor(const QString &method) -> const Policy *
+{
+    static const std::map<QString, Policy> policies = {
+        // fee estimates: staleness of a few seconds is harmless, but a new block changes them
+        { "estimatefee",        {30'000, Dep::Tip} },
+        { "estimatesmartfee",   {30'000, Dep::Tip} },
+        // immutable for a given tip (the verbose forms of these include "confirmations")
+        { "getrawtransaction",  {600'000, Dep::Tip, true} },
+        { "getblockheader",     {600'000, Dep::Tip} },
+        { "getblock",           {600'000, Dep::Tip} },
+        { "getblockhash",       {600'000, Dep::Tip} },
+        // chain & daemon info calls, as seen via daemon.passthrough
+        { "getbestblockhash",   {10'000, Dep::Tip} },
+        { "getblockcount",      {10'000, Dep::Tip} },
+        { "getblockchaininfo",  {10'000, Dep::Tip} },
+        { "getdifficulty",      {10'000, Dep::Tip} },
+        { "getmininginfo",      {10'000, Dep::Tip} },
+        { "getnetworkinfo",     {60'000, Dep::None} },
+        { "getmempoolinfo",     {5'000, Dep::TipAndMempool} },
+        // pure functions of their params
+        { "validateaddress",    {600'000, Dep::None} },
+    };
+    if (auto it = policies.find(method); it != policies.end())
+        return &it->second;
+    return nullptr;
+}
+
+/* static */
+QByteArray DaemonResponseCache::makeKey(const QString &method, const QVariantList &params, const Policy &policy,
+                                        const State &state)
+{
+    QByteArray ret = method.toUtf8();
+    ret += '\0';
+    ret += Json::toUtf8(params, true);
+    if (policy.dep != Dep::None) {
+        ret += '\0';
+        ret += state.tipHash;
+    }
+    if (policy.dep == Dep::TipAndMempool)
+        ret += QByteArray(reinterpret_cast<const char *>(&state.generation), sizeof(state.generation));
+    return ret;
+}
+
+std::optional<RPC::Message> DaemonResponseCache::lookup(const QString &method, const QVariantList &params,
+                                                        const State &state, const qint64 nowMSec, Pending &pending)
+{
+    pending = {};
+    const Policy * const policy = policyFor(method);
+    if (!policy) return std::nullopt;
+    try {
+        pending.key = makeKey(method, params, *policy, state);
+    } catch (const std::exception &e) {
+        DebugM(__func__, ": not caching ", method, ": ", e.what()); // params not serializable, just don't cache
+        return std::nullopt;
+    }
+    pending.policy = policy;
+    if (policy->confirmedTxOnly)
+        pending.txHash = Util::ParseHexFast(params.value(0).toString().toUtf8());
+    auto ret = get(method, pending.key, nowMSec);
+    if (ret) pending = {};
+    return ret;
+}
+
+void DaemonResponseCache::maybeStore(const Pending &pending, const RPC::Message &reply, const TxHeightFunc &txHeight,
+                                     const qint64 nowMSec)
+{
+    if (pending.key.isEmpty() || !pending.policy || reply.isError()) return;
+    if (pending.policy->confirmedTxOnly) {
+        if (pending.txHash.size() != HashLen || !txHeight) return;
+        try {
+            const auto optHeight = txHeight(pending.txHash);
+            if (!optHeight || *optHeight == 0) return; // 0 = mempool
+        } catch (const std::exception &) { return; }
+    }
+    put(pending.key, reply, *pending.policy, nowMSec);
+}
+
+std::optional<RPC::Message> DaemonResponseCache::get(const QString &method, const QByteArray &key, const qint64 nowMSec)
+{
+    std::optional<RPC::Message> ret;
+    if (auto opt = cache.object(key)) {
+        if (opt->expiresMSec > nowMSec) ret = std::move(opt->reply);
+        else cache.remove(key);
+    }
+    std::unique_lock g(mut);
+    auto & [hits, misses] = hitsMisses[method];
+    ++(ret ? hits : misses);
+    return ret;
+}
+
+void DaemonResponseCache::put(const QByteArray &key, const RPC::Message &reply, const Policy &policy, const qint64 nowMSec)
+{
+    const size_t overhead = decltype(cache)::itemOverheadBytes() + size_t(key.size());
+    if (overhead >= cache.maxCost()) return;
+    const size_t cost = overhead + approxSize(reply.data, cache.maxCost() - overhead);
+    if (cost >= cache.maxCost()) return;
+    cache.insert(key, Entry{reply, nowMSec + policy.ttlMSec}, unsigned(cost));
+}
+
+/* static */
+size_t DaemonResponseCache::approxSize(const QVariant &v, const size_t limit)
+{
+    constexpr size_t kNodeBytes = 32; // QVariant + container node overhead, roughly
+    switch (Compat::GetVarType(v)) {
+    case QMetaType::QString:
+        return kNodeBytes + size_t(v.toString().size()) * sizeof(QChar);
+    case QMetaType::QByteArray:
+        return kNodeBytes + size_t(v.toByteArray().size());
+    case QMetaType::QVariantList: {
+        size_t ret = kNodeBytes;
+        for (const auto & item : v.toList()) {
+            if (ret > limit) break;
+            ret += approxSize(item, limit - ret);
+        }
+        return ret;
+    }
+    case QMetaType::QVariantMap: {
+        size_t ret = kNodeBytes;
+        const auto map = v.toMap();
+        for (auto it = map.cbegin(); it != map.cend(); ++it) {
+            ret += kNodeBytes + size_t(it.key().size()) * sizeof(QChar);
+            if (ret > limit) break;
+            ret += approxSize(it.value(), limit - ret);
+        }
+        return ret;
+    }
+    default:
+        return kNodeBytes; // numbers, bools, null
+    }
+}
+
+void DaemonResponseCache::clear()
+{
+    cache.clear();
+    std::unique_lock g(mut);
+    ++nClears;
+}
+
+QVariantMap DaemonResponseCache::stats() const
+{
+    QVariantMap ret, methods;
+    ret["Size bytes"] = qlonglong(cache.totalCost());
+    ret["max bytes"] = qlonglong(cache.maxCost());
+    ret["nItems"] = qlonglong(cache.size());
+    std::unique_lock g(mut);
+    for (const auto & [method, hm] : hitsMisses)
+        methods[method] = QVariantMap{ {"hits", hm.first}, {"misses", hm.second} };
+    ret["methods"] = methods;
+    ret["clears (new blocks)"] = nClears;
+    return ret;
+}
+
 void ServerBase::generic_async_to_bitcoind(Client *c, const RPC::BatchId batchId, const RPC::Message::Id & reqId,
                                            const QString &method,
                                            const QVariantList & params,
@@ -819,6 +1219,46 @@ void ServerBase::generic_async_to_bitcoind(Client *c, const RPC::BatchId batchId
         Warning() << __func__ << " is meant to be called from the Client thread only. The current thread is not the"
                   << " Client thread. This may cause problems if the Client is deleted while submitting the request. FIXME!";
     }
+    // Answers the client, given bitcoind's (successful) `reply`: either fresh from bitcoind or from the daemon cache
+    const auto answer = [c, batchId, reqId, successFunc](const RPC::Message & reply, LatencyStats::MethodHistograms *hists) {
+        c->lastSendTimings = {};
+        try {
+            QVariant result;
+            bool send = true;
+            if (!successFunc)
+                // if no successFunc specified, use default which just copies the result to the client.
+                result = reply.result();
+            else {
+                const auto res = successFunc(reply);
+                std::visit(Overloaded {
+                    // successFunct() returned a valid QVariant, so we auto-send a reply to the client
+                    [&](const QVariant &var) { result = var; },
+                    // successFunc() specified to not auto-send a reply to client (it will handle the reply itself)
+                    [&](const DontAutoSendReply_t &) { send = false; }
+                }, res);
+            }
+            if (send) emit c->sendResult(batchId, reqId, result);
+            if (hists) recordSendLatencies(*hists, c->lastSendTimings);
+        } catch (const RPCError &e) {
+            emit c->sendError(e.disconnect, e.code, e.what(), batchId, reqId);
+        } catch (const std::exception &e) {
+            emit c->sendError(false, RPC::ErrorCodes::Code_InternalError, e.what(), batchId, reqId);
+        }
+    };
+    // Daemon response cache: idempotent calls are answered from a recent identical reply, if we have one. This skips
+    // the throttling below too, since it costs bitcoind nothing.
+    DaemonResponseCache * const daemonCache = srvmgr->daemonResponseCache();
+    DaemonResponseCache::Pending cachePending;
+    if (daemonCache && DaemonResponseCache::policyFor(method)) {
+        // NB: the state is read before the request is submitted, so that a reply can only ever be filed under a state
+        // at least as old as the one it was produced against.
+        const DaemonResponseCache::State state{storage->latestTip().second, storage->stateGeneration()};
+        if (const auto optReply = daemonCache->lookup(method, params, state, Util::getTime(), cachePending)) {
+            // sent synchronously, so onMessage() records the send latencies for us
+            answer(*optReply, nullptr);
+            return;
+        }
+    }
     // Throttling support
     {
         const int bdReqHi = options->bdReqThrottleParams.load().hi;
@@ -846,32 +1286,20 @@ void ServerBase::generic_async_to_bitcoind(Client *c, const RPC::BatchId batchId
         }
     }
     // /Throttling support
+    // For latency histograms, the "work" phase of a bitcoind-forwarded request is the daemon round-trip time
+    LatencyStats::MethodHistograms * const hists = dispatchCtx.hists;
+    dispatchCtx.deferred = true;
+    const qint64 tSubmit = Util::getTimeMicros();
     bitcoindmgr->submitRequest(c, newId(), method, params,
         // success
-        [c, batchId, reqId, successFunc](const RPC::Message & reply) {
+        [c, answer, hists, tSubmit, daemonCache, cachePending, storage = storage](const RPC::Message & reply) {
             c->bdReqCtr -= std::min(c->bdReqCtr, 1LL); // decrease throttle counter
             --c->perIPData->bdReqCtr; // decrease bitcoind request counter (per-IP, owned by multiple threads)
-            try {
-                QVariant result;
-                bool send = true;
-                if (!successFunc)
-                    // if no successFunc specified, use default which just copies the result to the client.
-                    result = reply.result();
-                else {
-                    const auto res = successFunc(reply);
-                    std::visit(Overloaded {
-                        // successFunct() returned a valid QVariant, so we auto-send a reply to the client
-                        [&](const QVariant &var) { result = var; },
-                        // successFunc() specified to not auto-send a reply to client (it will handle the reply itself)
-                        [&](const DontAutoSendReply_t &) { send = false; }
-                    }, res);
-                }
-                if (send) emit c->sendResult(batchId, reqId, result);
-            } catch (const RPCError &e) {
-                emit c->sendError(e.disconnect, e.code, e.what(), batchId, reqId);
-            } catch (const std::exception &e) {
-                emit c->sendError(false, RPC::ErrorCodes::Code_InternalError, e.what(), batchId, reqId);
-            }
+            if (hists) (*hists)[LatencyStats::Work].record(Util::getTimeMicros() - tSubmit);
+            if (!cachePending.key.isEmpty())
+                daemonCache->maybeStore(cachePending, reply,
+                                        [&storage](const TxHash &h) { return storage->getTxHeight(h); }, Util::getTime());
+            answer(reply, hists);
         },
         // error
         [c, batchId, reqId, errorFunc](const RPC::Message & errorReply) {
@@ -1552,7 +1980,8 @@ QVariantMap ServerBase::getBalanceCommon(const HashX &sh, Storage::TokenFilterOp
 void Server::impl_get_balance(Client *c, const RPC::BatchId batchId, const RPC::Message &m, const HashX &sh,
                               const Storage::TokenFilterOption tokenFilter)
 {
-    generic_do_async(c, batchId, m.id, [sh, tokenFilter, this] {
+    const QByteArray subKey = QByteArrayLiteral("b") + char(tokenFilter); // query key: 'b' + token filter option
+    generic_do_async_coalesced(c, batchId, m.id, m.method, scriptHashQueryKey(sh, subKey), [sh, tokenFilter, this] {
         return getBalanceCommon(sh, tokenFilter);
     });
 }
@@ -1646,9 +2075,12 @@ Log() << "Server::rpc_blockchain_address_get_history " << sh.toHex();
 void Server::impl_get_history(Client *c, const RPC::BatchId batchId, const RPC::Message &m, const HashX &sh,
                               const GetHistory_FromToBH &fromTo)
 {
-    generic_do_async(c, batchId, m.id, [sh, fromTo, this] {
-        return getHistoryCommon(sh, false, fromTo);
-    });
+    // query key: 'h' + from_height + to_height (-1 if unspecified); in-memory only, so host byte order is fine
+    const std::array<uint32_t, 2> range{fromTo.first, fromTo.second.value_or(uint32_t(-1))};
+    const QByteArray subKey = QByteArrayLiteral("h") + QByteArray(reinterpret_cast<const char *>(range.data()), sizeof(range));
+    generic_do_async_coalesced(c, batchId, m.id, m.method, scriptHashQueryKey(sh, subKey), [sh, fromTo, subKey, this] {
+        return storage->resultCacheGetOrCompute(sh, subKey, [&]{ return QVariant(getHistoryCommon(sh, false, fromTo)); });
+    }, ThreadPool::Lane::Heavy);
 }
 
 void Server::rpc_blockchain_scripthash_get_mempool(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
@@ -1668,7 +2100,7 @@ void Server::rpc_blockchain_address_get_scripthash(Client *c, const RPC::BatchId
 }
 void Server::impl_get_mempool(Client *c, const RPC::BatchId batchId, const RPC::Message &m, const HashX &sh)
 {
-    generic_do_async(c, batchId, m.id, [sh, this] {
+    generic_do_async_coalesced(c, batchId, m.id, m.method, scriptHashQueryKey(sh, QByteArrayLiteral("m")), [sh, this] {
         return getHistoryCommon(sh, true);
     });
 }
@@ -1709,9 +2141,10 @@ QVariantList  ServerBase::listUnspentCommon(const HashX &sh, Storage::TokenFilte
 void Server::impl_listunspent(Client *c, const RPC::BatchId batchId, const RPC::Message &m, const HashX &sh,
                               const Storage::TokenFilterOption tokenFilter)
 {
-    generic_do_async(c, batchId, m.id, [sh, tokenFilter, this] {
-        return listUnspentCommon(sh, tokenFilter);
-    });
+    const QByteArray subKey = QByteArrayLiteral("u") + char(tokenFilter); // query key: 'u' + token filter option
+    generic_do_async_coalesced(c, batchId, m.id, m.method, scriptHashQueryKey(sh, subKey), [sh, tokenFilter, subKey, this] {
+        return storage->resultCacheGetOrCompute(sh, subKey, [&]{ return QVariant(listUnspentCommon(sh, tokenFilter)); });
+    }, ThreadPool::Lane::Heavy);
 }
 void Server::rpc_blockchain_scripthash_subscribe(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
 {
@@ -2018,6 +2451,13 @@ void Server::rpc_blockchain_transaction_get(Client *c, const RPC::BatchId batchI
             throw RPCError("Invalid verbose argument; expected boolean");
         verbose = verbArg;
     }
+    if (!verbose) {
+        // answer locally if the tx was recently seen by the mempool synch or the block downloader (rawtx_cache)
+        if (const auto optRaw = storage->rawTxCacheGet(txHash)) {
+            emit c->sendResult(batchId, m.id, Util::ToHexFast(*optRaw));
+            return;
+        }
+    }
     generic_async_to_bitcoind(c, batchId, m.id, "getrawtransaction", QVariantList{ Util::ToHexFast(txHash), verbose },
         // use the default success func, which just echoes the bitcoind reply to the client
         BitcoinDSuccessFunc(),
@@ -2060,15 +2500,14 @@ void Server::rpc_blockchain_transaction_get_confirmed_blockhash(Client *c, const
 }
 
 namespace {
-    /// Note: pos must be within the txHashes array, otherwise a BadArgs exception will be thrown.
-    /// Input txHashes should be in bitcoind memory order.
+    /// Note: pos must be within the tree, otherwise a BadArgs exception will be thrown.
     /// Output is a QVariantList already reversed and hex encoded, suitable for putting into the results map as 'merkle'.
     /// Used by the below two _id_from_pos and _get_merkle rpc methods.
-    QVariantList getMerkleForTxHashes(const std::vector<QByteArray> & txHashes, unsigned pos) {
+    QVariantList getMerkleForTree(const Merkle::Tree & tree, unsigned pos) {
         QVariantList branchList;
 
-        // next, compute the branch and root for the tx hashes which are now in bitcoind memory order
-        auto pair = Merkle::branchAndRoot(txHashes, pos);
+        // next, extract the branch and root from the tree, which is in bitcoind memory order
+        auto pair = tree.branchAndRoot(pos);
         auto & [branch, root] = pair;
 
         // now, build our results for json as a QVariantList, reversing the memory back to hex memory order, and hex encoding it.
@@ -2115,20 +2554,14 @@ void Server::rpc_blockchain_transaction_get_merkle(Client *c, const RPC::BatchId
         if (!optHeight || !*optHeight)
             throw RPCError("No confirmed transaction matching the requested hash was found");
         const auto height = *optHeight;
-        auto txHashes = storage->txHashesForBlockInBitcoindMemoryOrder(height);
+        const auto tree = storage->merkleTreeForBlock(height);
         std::reverse(txHash.begin(), txHash.end()); // we need to compare to bitcoind memory order so reverse specified hash
-        constexpr unsigned NO_POS = ~0U;
-        unsigned pos = NO_POS;
-        for (unsigned i = 0; i < txHashes.size(); ++i) {
-            if (txHashes[i] == txHash) {
-                pos = i;
-                break;
-            }
-        }
-        if (pos == NO_POS)
+        const auto optPos = tree ? tree->find(txHash) : std::nullopt;
+        if (!optPos)
             throw RPCError(QString("No transaction matching the requested hash found at height %1").arg(height));
+        const unsigned pos = *optPos;
 
-        const auto branchList = getMerkleForTxHashes(txHashes, pos);
+        const auto branchList = getMerkleForTree(*tree, pos);
 
         QVariantMap resp = {
             { "block_height" , height },
@@ -2164,17 +2597,17 @@ void Server::rpc_blockchain_transaction_id_from_pos(Client *c, const RPC::BatchI
         static const QString missingErr("No transaction at position %1 for height %2");
         if (merkle) {
             // merkle=true is a dict, see: https://electrumx.readthedocs.io/en/latest/protocol-methods.html#blockchain-transaction-id-from-pos
-            // get all hashes for the block (we need them for merkle)
-            auto txHashes = storage->txHashesForBlockInBitcoindMemoryOrder(height);
-            if (pos >= txHashes.size()) {
+            // get the merkle tree for the block (usually cached)
+            const auto tree = storage->merkleTreeForBlock(height);
+            if (!tree || pos >= tree->size()) {
                 // out of range, or block not found
                 throw RPCError(missingErr.arg(pos).arg(height));
             }
             // save the requested tx_hash now, which we will return as tx_hash of the response dictionary
             // (we need to reverse it for outputting to hex since we received it in bitcoind internal memory order).
-            const QByteArray txHashHex = Util::ToHexFast(Util::reversedCopy(txHashes[pos]));
+            const QByteArray txHashHex = Util::ToHexFast(Util::reversedCopy(tree->leaf(pos)));
 
-            const auto branchList = getMerkleForTxHashes(txHashes, pos);
+            const auto branchList = getMerkleForTree(*tree, pos);
 
             QVariantMap res = {
                 { "tx_hash" , txHashHex },
@@ -2340,7 +2773,7 @@ void Server::rpc_blockchain_rpa_get_history(Client *c, const RPC::BatchId batchI
     // process to service the request async
     generic_do_async(c, batchId, m.id, [this, prefix, fromTo] {
         return getRpaHistoryCommon(prefix, false, fromTo);
-    });
+    }, ThreadPool::Lane::Heavy);
 }
 
 // Legacy function (older EC clients that initially implemented RPA use this)
@@ -2911,6 +3344,16 @@ void AdminServer::rpc_kick(Client *c, const RPC::BatchId batchId, const RPC::Mes
     kickBanBoilerPlate(m, BanOp::Kick);
     emit c->sendResult(batchId, m.id, true);
 }
+// per-method RPC latency histograms, optionally filtered by method name. Pass `true` as the second arg to also reset.
+void AdminServer::rpc_latency(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
+{
+    const auto l = m.paramsList();
+    const QString method = l.isEmpty() || l.front().isNull() ? QString() : l.front().toString();
+    const bool reset = l.size() > 1 && l[1].toBool();
+    const auto ret = LatencyStats::stats(method);
+    if (reset) LatencyStats::reset();
+    emit c->sendResult(batchId, m.id, ret);
+}
 void AdminServer::rpc_listbanned(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
 {
     emit c->sendResult(batchId, m.id, srvmgr->adminRPC_banInfo_threadSafe());
@@ -3091,6 +3534,7 @@ HEY_COMPILER_PUT_STATIC_HERE(AdminServer::StaticData::registry){
     { {"clients",                           true,               false,    PR{0,0},                 {} },          MP(rpc_clients) },
     { {"getinfo",                           true,               false,    PR{0,0},                 {} },          MP(rpc_getinfo) },
     { {"kick",                              true,               false,    PR{1,UNLIMITED},         {} },          MP(rpc_kick) },
+    { {"latency",                           true,               false,    PR{0,2},                 {} },          MP(rpc_latency) },
     { {"listbanned",                        true,               false,    PR{0,0},                 {} },          MP(rpc_listbanned) },
     { {"loglevel",                          true,               false,    PR{1,1},                 {} },          MP(rpc_loglevel) },
     { {"maxbuffer",                         true,               false,    PR{0,1},                 {} },          MP(rpc_maxbuffer) },
@@ -3245,6 +3689,11 @@ bool Client::canAcceptBatch(RPC::BatchProcessor *batch)
 
 
 #ifdef ENABLE_TESTS
+#include "tests/Tests.h"
+
+#include <atomic>
+#include <thread>
+
 namespace {
     void bannerfile()
     {
@@ -3333,5 +3782,194 @@ namespace {
 
     static const auto test_bannerfile = App::registerTest("bannerfile", &bannerfile);
 
+    /// Stands in for bitcoind: answers a few methods, counting calls, and with results that change on every call so
+    /// that a cached reply can be told apart from a fresh one.
+    struct MockBitcoinD {
+        std::map<QString, int> nCalls;
+        std::set<QString> confirmedTxs, mempoolTxs; ///< txid hex
+        qint64 nextId = 0, serial = 0;
+
+        RPC::Message call(const QString &method, const QVariantList &params) {
+            ++nCalls[method];
+            const auto id = RPC::Message::Id(++nextId);
+            if (method == "getrawtransaction") {
+                const auto txid = params.value(0).toString();
+                if (!confirmedTxs.count(txid) && !mempoolTxs.count(txid))
+                    return RPC::Message::makeError(-5, "No such mempool or blockchain transaction", id);
+                return RPC::Message::makeResponse(id, QString("%1:%2").arg(txid).arg(++serial));
+            }
+            return RPC::Message::makeResponse(id, QVariantMap{{"method", method}, {"serial", ++serial}});
+        }
+    };
+
+    TEST_SUITE(daemoncache)
+    TEST_CASE(ttl_and_invalidation) {
+        using Cache = DaemonResponseCache;
+        MockBitcoinD bitcoind;
+        Cache cache(1'000'000);
+        Cache::State state{QByteArray(HashLen, 'a'), 1};
+        qint64 now = 1'000'000;
+        const Cache::TxHeightFunc txHeight = [&](const TxHash &h) -> std::optional<BlockHeight> {
+            const QString txid = QString::fromLatin1(h.toHex());
+            if (bitcoind.confirmedTxs.count(txid)) return 100;
+            if (bitcoind.mempoolTxs.count(txid)) return 0;
+            return std::nullopt;
+        };
+        // the same lookup/maybeStore sequence as ServerBase::generic_async_to_bitcoind, but synchronously
+        const auto request = [&](const QString &method, const QVariantList &params) {
+            Cache::Pending pending;
+            if (auto opt = cache.lookup(method, params, state, now, pending)) return *opt;
+            const auto reply = bitcoind.call(method, params);
+            cache.maybeStore(pending, reply, txHeight, now);
+            return reply;
+        };
+
+        TEST_CHECK_MESSAGE(!Cache::policyFor("sendrawtransaction") && !Cache::policyFor("getrawmempool"), "side-effecting or huge calls are never cached");
+
+        // TTL, params and tip
+        const auto r1 = request("estimatesmartfee", {2});
+        TEST_CHECK_MESSAGE(request("estimatesmartfee", {2}).result() == r1.result(), "repeat call is served from the cache");
+        TEST_CHECK_MESSAGE(bitcoind.nCalls["estimatesmartfee"] == 1, "only 1 daemon call for 2 identical requests");
+        TEST_CHECK_MESSAGE(request("estimatesmartfee", {6}).result() != r1.result(), "different params are cached separately");
+        now += Cache::policyFor("estimatesmartfee")->ttlMSec;
+        TEST_CHECK_MESSAGE(request("estimatesmartfee", {2}).result() != r1.result(), "entry expires after its TTL");
+        const auto r2 = request("estimatesmartfee", {2});
+        state.tipHash = QByteArray(HashLen, 'b');
+        TEST_CHECK_MESSAGE(request("estimatesmartfee", {2}).result() != r2.result(), "a new tip is never served an older tip's reply");
+        TEST_CHECK_MESSAGE(bitcoind.nCalls["estimatesmartfee"] == 4, "daemon called for each miss");
+
+        // mempool-dependent calls also follow the mempool/chain generation; tip-independent ones survive a new tip but not clear()
+        const auto m1 = request("getmempoolinfo", {});
+        TEST_CHECK_MESSAGE(request("getmempoolinfo", {}).result() == m1.result(), "mempool info cached within a generation");
+        ++state.generation;
+        TEST_CHECK_MESSAGE(request("getmempoolinfo", {}).result() != m1.result(), "mempool change invalidates mempool info");
+        const auto v1 = request("validateaddress", {"someaddress"});
+        state.tipHash = QByteArray(HashLen, 'c');
+        TEST_CHECK_MESSAGE(request("validateaddress", {"someaddress"}).result() == v1.result(), "validateaddress does not depend on the tip");
+        cache.clear();
+        TEST_CHECK_MESSAGE(request("validateaddress", {"someaddress"}).result() != v1.result(), "clear() (new block) drops everything");
+
+        // getrawtransaction: only confirmed txs are cached, and errors never are
+        const QString conf(64, 'c'), mem(64, 'e'), missing(64, '0');
+        bitcoind.confirmedTxs.insert(conf);
+        bitcoind.mempoolTxs.insert(mem);
+        const auto t1 = request("getrawtransaction", {conf, false});
+        TEST_CHECK_MESSAGE(request("getrawtransaction", {conf, false}).result() == t1.result(), "confirmed tx is cached");
+        TEST_CHECK_MESSAGE(request("getrawtransaction", {conf, true}).result() != t1.result(), "verbose flag is part of the key");
+        const auto t2 = request("getrawtransaction", {mem, false});
+        TEST_CHECK_MESSAGE(request("getrawtransaction", {mem, false}).result() != t2.result(), "mempool tx is not cached");
+        TEST_CHECK_MESSAGE(request("getrawtransaction", {missing, false}).isError() && request("getrawtransaction", {missing, false}).isError(),
+            "not-found reply is passed along");
+        TEST_CHECK_MESSAGE(bitcoind.nCalls["getrawtransaction"] == 6, "errors are not cached");
+
+        // a reply too big for the cache is simply not kept
+        Cache tiny(1'000);
+        const auto big = RPC::Message::makeResponse(RPC::Message::Id(1), QString(4'000, 'x'));
+        const auto *policy = Cache::policyFor("getblock");
+        const auto key = Cache::makeKey("getblock", {"hash"}, *policy, state);
+        tiny.put(key, big, *policy, now);
+        TEST_CHECK_MESSAGE(!tiny.get("getblock", key, now), "oversized reply is not cached");
+        QVariantList manyStrings;
+        for (int i = 0; i < 100'000; ++i) manyStrings.push_back(QString(64, 'x'));
+        const auto bigList = RPC::Message::makeResponse(RPC::Message::Id(2), manyStrings);
+        tiny.put(key, bigList, *policy, now);
+        TEST_CHECK_MESSAGE(!tiny.get("getblock", key, now), "oversized list reply is not cached");
+        Cache::Pending pending;
+        TEST_CHECK_MESSAGE(!tiny.lookup("sendrawtransaction", {"00"}, state, now, pending) && pending.key.isEmpty(),
+                           "uncacheable method: nothing pending");
+        tiny.maybeStore(pending, RPC::Message::makeResponse(RPC::Message::Id(3), 1), txHeight, now);
+        TEST_CHECK_MESSAGE(tiny.stats()["nItems"].toLongLong() == 0, "maybeStore with nothing pending stores nothing");
+
+        // per-method counters
+        const auto st = cache.stats();
+        const auto feeStats = st["methods"].toMap()["estimatesmartfee"].toMap();
+        TEST_CHECK_MESSAGE(feeStats["hits"].toULongLong() == 2 && feeStats["misses"].toULongLong() == 4, "hit/miss counters");
+        TEST_CHECK_MESSAGE(st["clears (new blocks)"].toULongLong() == 1, "clear counter");
+    };
+    TEST_SUITE_END()
+
+    TEST_SUITE(coalescing)
+    TEST_CASE(single_flight) {
+        using Coalescing::Outcome;
+        constexpr int N = 16;
+        const QByteArray key = QByteArrayLiteral("coalescing test key");
+        const QString method = QStringLiteral("test.coalescing");
+        QObject owner; // stands in for the server
+        ThreadPool pool; // runs the work again for the waiters of an abandoned leader
+        std::atomic_int nWorkCalls = 0; // stands in for the storage/daemon call the leader makes
+        const Coalescing::Runner runner{[&]() -> std::shared_ptr<const Outcome> {
+            ++nWorkCalls;
+            auto o = std::make_shared<Outcome>();
+            o->results = QStringLiteral("the result");
+            return o;
+        }, &pool, ThreadPool::Lane::Normal, &owner};
+        std::mutex outMut;
+        std::vector<std::shared_ptr<const Outcome>> outcomes; // guarded by outMut
+        const auto waiter = [&](const std::shared_ptr<const Outcome> &o) { std::unique_lock g(outMut); outcomes.push_back(o); };
+        const auto nOutcomes = [&] { std::unique_lock g(outMut); return outcomes.size(); };
+        const auto allGotTheResult = [&] {
+            std::unique_lock g(outMut);
+            return std::all_of(outcomes.begin(), outcomes.end(), [](const auto &o) {
+                return !o->error && o->results.toString() == QStringLiteral("the result");
+            });
+        };
+        const auto waitForOutcomes = [&](size_t n) {
+            for (int i = 0; i < 5000 && nOutcomes() < n; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return nOutcomes() == n;
+        };
+        const auto nCoalesced = [&] { return ServerBase::coalescingStats().value(method).toULongLong(); };
+        const auto n0 = nCoalesced();
+
+        // N identical requests arrive (from many threads) while the first is still in flight
+        auto leader = Coalescing::join(key, method, waiter, runner);
+        TEST_CHECK_MESSAGE(leader != nullptr, "the first request leads");
+        std::atomic_int nLeaders = 0;
+        std::vector<std::thread> threads;
+        for (int i = 1; i < N; ++i)
+            threads.emplace_back([&] { if (Coalescing::join(key, method, waiter, runner)) ++nLeaders; });
+        for (auto & t : threads) t.join();
+        TEST_CHECK_MESSAGE(nLeaders == 0, "all of the later requests join the in-flight one");
+        TEST_CHECK(nCoalesced() - n0 == qulonglong(N - 1));
+        TEST_CHECK_MESSAGE(Coalescing::join(QByteArrayLiteral("some other key"), method, waiter, runner) != nullptr,
+                           "a request with a different key is not coalesced");
+        TEST_CHECK_MESSAGE(nOutcomes() == 0u, "nobody is answered before the leader finishes");
+
+        // the leader does the work (what generic_do_async_coalesced does in its worker thread) and answers everyone
+        leader->finish(leader->runner.compute());
+        TEST_CHECK_MESSAGE(nWorkCalls == 1, "exactly 1 call for N identical in-flight requests");
+        TEST_CHECK(nOutcomes() == size_t(N - 1) && allGotTheResult());
+
+        // once finished, a new identical request does its own work rather than get a result that may be stale
+        leader = Coalescing::join(key, method, waiter, runner);
+        TEST_CHECK_MESSAGE(leader != nullptr, "a finished request is not joined");
+
+        // a leader whose work never ran (its client went away, or its job was refused): the work is run for the
+        // waiters instead, and they get the real result rather than an error
+        outcomes.clear();
+        TEST_CHECK(!Coalescing::join(key, method, waiter, runner));
+        TEST_CHECK(!Coalescing::join(key, method, waiter, runner));
+        const int nCallsBefore = nWorkCalls;
+        leader.reset();
+        TEST_CHECK_MESSAGE(waitForOutcomes(2u) && allGotTheResult(), "the waiters of an abandoned leader get the real result");
+        TEST_CHECK_MESSAGE(nWorkCalls == nCallsBefore + 1, "the work is run once for all of them");
+        TEST_CHECK_MESSAGE(Coalescing::join(key, method, waiter, runner) != nullptr, "a finished re-run is not joined");
+
+        // only if the server that started the request is gone too do the waiters get an error
+        outcomes.clear();
+        {
+            auto gone = std::make_unique<QObject>();
+            auto r = runner;
+            r.owner = gone.get();
+            auto orphan = Coalescing::join(QByteArrayLiteral("orphan key"), method, waiter, r);
+            TEST_CHECK(orphan && !Coalescing::join(QByteArrayLiteral("orphan key"), method, waiter, r));
+            gone.reset();
+            orphan.reset();
+        }
+        TEST_CHECK(nOutcomes() == 1u && outcomes.front()->error && outcomes.front()->errCode == RPC::Code_InternalError);
+        TEST_CHECK(pool.shutdownWaitForJobs());
+    };
+    TEST_SUITE_END()
+
+
 } // namespace
 #endif // ENABLE_TESTS
@@ -19,12 +19,15 @@
 #pragma once
 
 #include "Common.h"
+#include "CostCache.h"
+#include "LatencyHistogram.h"
 #include "Mixins.h"
 #include "Options.h"
 #include "PeerMgr.h"
 #include "RollingBloomFilter.h"
 #include "Rpa.h"
 #include "RPC.h"
+#include "ThreadPool.h"
 #include "Version.h"
 
 #include <QHash>
@@ -33,6 +36,8 @@
 #include <QThread>
 #include <QVector>
 
+#include <functional>
+#include <map>
 #include <memory> // for shared_ptr
 #include <mutex>
 #include <optional>
@@ -139,6 +144,78 @@ class Storage;
 class SubsMgr;
 class ThreadPool;
 
+/// Cache of bitcoind's replies to the idempotent calls that ServerBase::generic_async_to_bitcoind() passes through on
+/// behalf of clients (fee estimates, getrawtransaction for confirmed txs, the daemon.passthrough info calls, etc).
+/// Each method has its own TTL, and entries are keyed to the chain tip (and, where the reply depends on it, to the
+/// mempool state) that was current when the request was made, so a reply is never served across a block. Error
+/// replies are never cached. Owned by SrvMgr (if config option `daemon_cache` > 0) and shared by all the servers.
+/// Thread-safe.
+class DaemonResponseCache
+{
+public:
+    /// What a method's reply depends on, besides its params
+    enum class Dep : uint8_t { None, Tip, TipAndMempool };
+    struct Policy {
+        qint64 ttlMSec;
+        Dep dep;
+        /// If true, params[0] is a txid, and the reply is only cached if that tx is confirmed (a mempool tx may yet
+        /// be dropped, in which case bitcoind would stop returning it).
+        bool confirmedTxOnly = false;
+    };
+    /// The chain/mempool state that a request was made against. `generation` is Storage::stateGeneration(), which
+    /// changes whenever the mempool (or the chain) changes.
+    struct State {
+        BlockHash tipHash;
+        uint64_t generation = 0;
+    };
+
+    /// Filled in by lookup() on a miss, and later handed to maybeStore() along with bitcoind's reply. An empty key
+    /// means the reply is not to be cached.
+    struct Pending {
+        const Policy *policy = nullptr;
+        QByteArray key;
+        TxHash txHash; ///< if policy->confirmedTxOnly, the txid parsed from params[0] (may be invalid)
+    };
+    /// Returns the confirmed height of a tx, or 0 if it's in the mempool, or nullopt if not found. May throw.
+    using TxHeightFunc = std::function<std::optional<BlockHeight>(const TxHash &)>;
+
+    explicit DaemonResponseCache(unsigned maxBytes); ///< may throw if maxBytes is 0 or >= INT_MAX
+
+    /// Returns the caching policy for bitcoind RPC `method`, or nullptr if its replies must not be cached.
+    static const Policy *policyFor(const QString &method);
+    /// Returns the key under which the reply to `method(params)` made against `state` is cached.
+    static QByteArray makeKey(const QString &method, const QVariantList &params, const Policy &policy, const State &state);
+
+    /// Returns the cached reply to `method(params)` made against `state`, if any and if not expired. On a miss, fills
+    /// `pending` for the maybeStore() call that files bitcoind's reply. Counts a hit or a miss for cacheable methods.
+    std::optional<RPC::Message> lookup(const QString &method, const QVariantList &params, const State &state,
+                                       qint64 nowMSec, Pending &pending);
+    /// Remembers `reply` to a request that lookup() missed, if it is cacheable: it must be a successful response,
+    /// and for confirmedTxOnly methods, `txHeight` must report the tx as confirmed.
+    void maybeStore(const Pending &pending, const RPC::Message &reply, const TxHeightFunc &txHeight, qint64 nowMSec);
+
+    /// Returns the cached reply for `key`, if any and if not expired. Counts a hit or a miss for `method`.
+    std::optional<RPC::Message> get(const QString &method, const QByteArray &key, qint64 nowMSec);
+    /// Remember `reply` (which must be a successful response) for `policy.ttlMSec`.
+    void put(const QByteArray &key, const RPC::Message &reply, const Policy &policy, qint64 nowMSec);
+    /// Drops all entries. Called on each new block.
+    void clear();
+
+    QVariantMap stats() const;
+
+private:
+    struct Entry {
+        RPC::Message reply;
+        qint64 expiresMSec;
+    };
+    /// Rough in-memory size of `v`, without serializing it. Stops counting (and returns > limit) once past `limit`.
+    static size_t approxSize(const QVariant &v, size_t limit);
+    CostCache<QByteArray, Entry> cache;
+    mutable std::mutex mut;
+    std::map<QString, std::pair<qulonglong, qulonglong>> hitsMisses; ///< method -> (hits, misses), guarded by `mut`
+    qulonglong nClears = 0; ///< guarded by `mut`
+};
+
 /// Base class for the Electrum-server-style linefeed-based JSON-RPC service.
 ///
 /// This base class knows how to handle clients and how to dispatch messages. It offers all the facilities an RPC
@@ -179,6 +256,10 @@ public:
     /// From StatsMixin. This must be called in the thread context of this thread (use statsSafe() for the blocking, thread-safe version!)
     QVariant stats() const override;
 
+    /// Thread-safe. Returns a map of method -> number of requests that were served by joining an identical in-flight
+    /// request (see generic_do_async_coalesced), app-wide across all servers.
+    static QVariantMap coalescingStats();
+
     /// Default false.
     bool usesWebSockets() const { return usesWS; }
     /// This should be called/set once before we begin listening for connections.  Called by SrvMgr depending on options from config.
@@ -280,7 +361,21 @@ protected:
     /// the work for later and handles sending the response (returned from work) to the client as well as sending
     /// any errors to the client. The `work` functor may throw RPCError, in which case code and message will be
     /// sent instead.  Note that all other exceptions also end up sent to the client as "internal error: MESSAGE".
-    void generic_do_async(Client *client, RPC::BatchId, const RPC::Message::Id &reqId,  const AsyncWorkFunc & work, int priority = 0);
+    /// Work whose cost grows with the data it touches (e.g. long histories) should be submitted with
+    /// `lane` = ThreadPool::Lane::Heavy, so that it cannot crowd out the cheap requests.
+    void generic_do_async(Client *client, RPC::BatchId, const RPC::Message::Id &reqId,  const AsyncWorkFunc & work,
+                          ThreadPool::Lane lane = ThreadPool::Lane::Normal);
+    /// Like generic_do_async, but identical concurrent requests share 1 computation ("single-flight"): if a request
+    /// with the same `key` is already in flight (on any server), this request just waits for it and is sent the same
+    /// result (or error), rather than doing the work again. `key` must capture everything the result depends on,
+    /// including the state it is computed against (see scriptHashQueryKey). `method` is used only for stats.
+    void generic_do_async_coalesced(Client *client, RPC::BatchId, const RPC::Message::Id &reqId, const QString &method,
+                                    const QByteArray &key, const AsyncWorkFunc & work,
+                                    ThreadPool::Lane lane = ThreadPool::Lane::Normal);
+    /// Returns a generic_do_async_coalesced key for query `subKey` (method + params) on `scriptHash`, tied to the
+    /// current mempool/chain generation (Storage::stateGeneration), so that a request never joins a
+    /// computation that may have started before the last block or mempool change.
+    QByteArray scriptHashQueryKey(const HashX & scriptHash, const QByteArray & subKey) const;
     void generic_async_to_bitcoind(Client *client,
                                    RPC::BatchId batchId, ///< if running in batch context, will be !batchId.isNull()
                                    const RPC::Message::Id & reqId,  ///< the original client request id
@@ -293,6 +388,24 @@ protected:
     /// threadpool. Otherwise the app-global ::AppThreadPool()  will be used for generic_do_async().
     ThreadPool *asyncThreadPool = nullptr;
 
+    /// Set by onMessage() for the duration of a request's (synchronous) dispatch so that generic_do_async() and
+    /// generic_async_to_bitcoind() can attribute latency samples to the method being served. `deferred` is latched
+    /// to true by those two functions, telling onMessage() that the reply will be sent later. Only accessed in our
+    /// thread.
+    struct DispatchCtx {
+        LatencyStats::MethodHistograms *hists = nullptr;
+        bool deferred = false;
+    } dispatchCtx;
+
+    /// Shared with the callbacks of requests waiting on an in-flight identical request (see
+    /// generic_do_async_coalesced), which may be invoked from any thread. `server` is `this`, and is cleared by our
+    /// destructor; hold `mut` while using it.
+    struct LifeToken {
+        std::mutex mut;
+        ServerBase *server = nullptr;
+    };
+    const std::shared_ptr<LifeToken> lifeToken = std::make_shared<LifeToken>();
+
     /// pointer to the shared Options object -- app-wide configuration settings. Owned and controlled by the App instance.
     const std::shared_ptr<const Options> options;
     /// pointer to shared Storage object -- owned and controlled by the Controller instance
@@ -582,6 +695,7 @@ private:
     void rpc_clients(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_getinfo(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_kick(Client *, RPC::BatchId, const RPC::Message &);
+    void rpc_latency(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_listbanned(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_loglevel(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_maxbuffer(Client *, RPC::BatchId, const RPC::Message &);
@@ -43,6 +43,7 @@ SrvMgr::SrvMgr(const std::shared_ptr<const Options> & options,
                const std::shared_ptr<BitcoinDMgr> & bdm,
                QObject *parent)
     : Mgr(parent), options(options), sslCertMonitor(certMon), storage(s), bitcoindmgr(bdm),
+      daemonCache(options->daemonCacheBytes ? std::make_unique<DaemonResponseCache>(options->daemonCacheBytes) : nullptr),
       perIPData(this, tableSqueezeThreshold /* initialCapacity */, tableSqueezeThreshold)
 {
     addrIdMap.reserve(tableSqueezeThreshold); // initial capacity
@@ -54,6 +55,9 @@ SrvMgr::SrvMgr(const std::shared_ptr<const Options> & options,
     connect(this, &SrvMgr::liftPeerSuffixBan, this, &SrvMgr::on_liftPeerSuffixBan);
     connect(this, &SrvMgr::requestMaxBufferChange, app(), &App::on_requestMaxBufferChange, Qt::DirectConnection);
     connect(this, &SrvMgr::requestBitcoindThrottleParamsChange, app(), &App::on_bitcoindThrottleParamsChange, Qt::DirectConnection);
+    if (daemonCache)
+        // cached replies are keyed to the tip anyway, so this just frees the memory of the now-unreachable entries
+        connect(this, &SrvMgr::newHeader, this, [this]{ daemonCache->clear(); });
 }
 
 SrvMgr::~SrvMgr()
@@ -415,6 +419,7 @@ auto SrvMgr::stats() const -> Stats
     m["PeerMgr"] = peermgr ? peermgr->statsSafe(kDefaultTimeout/2) : QVariant();
     m["transactions sent"] = qulonglong(numTxBroadcasts.load());
     m["transactions sent (bytes)"] = qulonglong(txBroadcastBytesTotal.load());
+    m["Daemon Response Cache"] = daemonCache ? QVariant(daemonCache->stats()) : QVariant();
     m["number of clients"] = qulonglong(Client::numClients.load());
     m["number of clients (max lifetime)"] = qulonglong(Client::numClientsMax.load());
     m["number of clients (total lifetime connections)"] = qulonglong(Client::numClientsCtr.load());
@@ -50,6 +50,9 @@ public:
 
     int nServers() const { return int(servers.size()); }
 
+    /// Thread-safe. Returns the cache of bitcoind replies shared by all servers, or nullptr if disabled (daemon_cache = 0).
+    DaemonResponseCache *daemonResponseCache() const { return daemonCache.get(); }
+
     std::size_t txBroadcasts() const { return numTxBroadcasts.load(); }
     std::size_t txBroadcastBytes() const { return txBroadcastBytesTotal.load(); }
 
@@ -177,6 +180,7 @@ private:
     std::list<std::unique_ptr<Server>> servers;
     std::list<std::unique_ptr<AdminServer>> adminServers;
     std::shared_ptr<PeerMgr> peermgr; ///< will be nullptr if options->peerDiscovery is false
+    const std::unique_ptr<DaemonResponseCache> daemonCache; ///< will be nullptr if options->daemonCacheBytes is 0
 
     QMultiHash<QHostAddress, IdMixin::Id> addrIdMap;
 
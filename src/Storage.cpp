@@ -20,8 +20,10 @@
 #include "BTC.h"
 #include "BTC_Address.h"
 #include "ByteView.h"
+#include "Compat.h"
 #include "CostCache.h"
 #include "CoTask.h"
+#include "Eytzinger.h"
 #include "Mempool.h"
 #include "Merkle.h"
 #include "RecordFile.h"
@@ -31,6 +33,7 @@
 #include "SubsMgr.h"
 #include "VarInt.h"
 
+#include "bitcoin/crypto/common.h" // ReadLE32, WriteLE32, etc
 #include "bitcoin/crypto/endian.h"
 #include "bitcoin/hash.h"
 
@@ -41,6 +44,7 @@
 #include <rocksdb/advanced_cache.h>
 #endif
 #include <rocksdb/cache.h>
+#include <rocksdb/compaction_filter.h>
 #include <rocksdb/db.h>
 #include <rocksdb/iterator.h>
 #include <rocksdb/merge_operator.h>
@@ -52,20 +56,27 @@
 
 #include <QByteArray>
 #include <QDir>
+#include <QFile>
 #include <QFileInfo>
+#include <QSaveFile>
 #include <QSysInfo>
 #include <QVector> // we use this for the Height2Hash cache to save on memcopies since it's implicitly shared.
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstddef> // for std::byte, offsetof, ptrdiff_t
 #include <cstdlib>
 #include <cstring> // for memcpy
+#include <deque>
+#include <exception>
 #include <functional>
 #include <limits>
 #include <list>
 #include <map>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <shared_mutex>
@@ -76,6 +87,18 @@
 #include <utility>
 #include <vector>
 
+// ReadOptions fields that don't exist in older rocksdb releases (config.tests/rocksdb accepts as old as 6.6.4)
+#if ((ROCKSDB_MAJOR << 16)|(ROCKSDB_MINOR << 8)|(ROCKSDB_PATCH)) >= ((6 << 16)|(22 << 8)|(0)) // 6.22.0
+#define HAS_ROCKSDB_ADAPTIVE_READAHEAD 1
+#else
+#define HAS_ROCKSDB_ADAPTIVE_READAHEAD 0
+#endif
+#if ((ROCKSDB_MAJOR << 16)|(ROCKSDB_MINOR << 8)|(ROCKSDB_PATCH)) >= ((7 << 16)|(5 << 8)|(0)) // 7.5.0
+#define HAS_ROCKSDB_ASYNC_IO 1
+#else
+#define HAS_ROCKSDB_ASYNC_IO 0
+#endif
+
 DatabaseError::~DatabaseError(){} // weak vtable warning suppression
 DatabaseSerializationError::~DatabaseSerializationError() {} // weak vtable warning suppression
 DatabaseFormatError::~DatabaseFormatError() {} // weak vtable warning suppression
@@ -87,10 +110,14 @@ HistoryTooLarge::~HistoryTooLarge() {} // weak vtable warning suppression
 namespace {
     /// Encapsulates the 'meta' db table
     struct Meta {
-        static constexpr uint32_t kCurrentVersion = 0x3u;
+        static constexpr uint32_t kCurrentVersion = 0x5u;
         static constexpr uint32_t kMinSupportedVersion = 0x1u;
         static constexpr uint32_t kMinBCHUpgrade9Version = 0x2u;
         static constexpr uint32_t kMinHasExtraPlatformInfoVersion = 0x3u;
+        static constexpr uint32_t kMinCompactUTXOSetVersion = 0x4u;
+        /// From this version on, undo records are written in the columnar V4 undo format (UndoInfoSerHeader::v4Ver),
+        /// which older versions of Fulcrum cannot read. This bump is what makes them refuse to open such a db.
+        static constexpr uint32_t kMinUndoV4Version = 0x5u;
 
         static constexpr uint32_t kMagic = 0xf33db33fu;
         static constexpr uint16_t kPlatformBits = sizeof(void *)*8U;
@@ -131,6 +158,8 @@ namespace {
         bool isVersionSupported() const { return version >= kMinSupportedVersion && version <= kCurrentVersion; }
         bool isMagicOk() const { return magic == kMagic; }
         bool isMinimumExtraPlatformInfoVersion() const { return version >= kMinHasExtraPlatformInfoVersion; }
+        bool isMinimumCompactUTXOSetVersion() const { return version >= kMinCompactUTXOSetVersion; }
+        bool isMinimumUndoV4Version() const { return version >= kMinUndoV4Version; }
 
         // Set this instance's platform info to correspond to the current process's valid info.
         void makePlatformInfoCurrent();
@@ -151,6 +180,7 @@ namespace {
     // some database keys we use -- todo: if this grows large, move it elsewhere
     static const bool falseMem = false, trueMem = true;
     static const rocksdb::Slice kMeta{"meta"}, kDirty{"dirty"}, kUtxoCount{"utxo_count"}, kRpaNeedsFullCheck{"rpa_needs_full_check"},
+                                kRpaVersion{"rpa_version"},
                                 kTrue(reinterpret_cast<const char *>(&trueMem), sizeof(trueMem)),
                                 kFalse(reinterpret_cast<const char *>(&falseMem), sizeof(falseMem));
 
@@ -445,6 +475,18 @@ namespace {
                                 .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : "Error from WriteBatch::Delete")
                                 .arg(StatusString(st)));
     }
+    /// Throws on all errors. Otherwise enqueues a merge to the batch (db must have a merge operator).
+    template <bool safeScalar = false, typename KeyType, typename ValueType>
+    void GenericBatchMerge
+                (rocksdb::WriteBatch & batch, const KeyType & key, const ValueType & value,
+                 const QString & errorMsgPrefix = QString())  ///< used to specify a custom error message in the thrown exception
+    {
+        auto st = batch.Merge(ToSlice<safeScalar>(key), ToSlice<safeScalar>(value));
+        if (!st.ok())
+            throw DatabaseError(QString("%1: %2")
+                                .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : "Error from WriteBatch::Merge")
+                                .arg(StatusString(st)));
+    }
     /// A convenient wrapper to db->Write(batch...) which throws on all errors.
     void GenericBatchWrite(rocksdb::DB *db, rocksdb::WriteBatch & batch,
                         const QString & errorMsgPrefix = QString(),
@@ -529,11 +571,142 @@ namespace {
                 && addUndos == o.addUndos && delUndos == o.delUndos;
     }
 
-    // serialize as raw bytes mostly (no QDataStream)
+    // serialize as raw bytes mostly (no QDataStream). Always writes the latest (V4, columnar) format.
     template <> QByteArray Serialize(const UndoInfo &);
-    // serialize from raw bytes mostly (no QDataStream)
+    // serialize from raw bytes mostly (no QDataStream). Only reads the V1-V3 formats; use UndoRecord to read any version.
     template <> UndoInfo Deserialize(const QByteArray &, bool *);
 
+    /// An undo record as read back from the undo db, of any format version.
+    ///
+    /// V1-V3 records store full TXOs (tx hashes included) and are simply deserialized to an UndoInfo. V4 records are
+    /// columnar and TxNum-based: they store no tx hashes at all, and each hashX just once. Their columns are
+    /// kept as a single decompressed buffer and are only decoded while being applied (see forEachDelUndo and
+    /// forEachAddUndo), with the tx hashes being resolved from the txNumsFile in 1 batch per column.
+    class UndoRecord {
+    public:
+        /// Given sorted, unique txNums, must return their tx hashes in the same order (or throw).
+        using TxHashResolver = std::function<std::vector<TxHash>(const std::vector<TxNum> &)>;
+
+        BlockHeight height = 0;
+        BlockHash hash;
+        BlkInfo blkInfo;
+        uint16_t deserVersion = 0u;
+
+        bool isValid() const { return hash.size() == HashLen; }
+        size_t nScriptHashes() const { return legacy ? legacy->scriptHashes.size() : nSH; }
+        size_t nAddUndos() const { return legacy ? legacy->addUndos.size() : nAdd; }
+        size_t nDelUndos() const { return legacy ? legacy->delUndos.size() : nDel; }
+
+        /// Builds the set of scripthashes touched by this block.
+        UndoInfo::ScriptHashSet scriptHashes() const;
+        /// Calls f(const TXO &, const TXOInfo &) for each utxo spent by this block. May throw.
+        template <typename Func> void forEachDelUndo(const TxHashResolver &resolver, Func && f) const;
+        /// Calls f(const TXO &, const HashX &, const CompactTXO &) for each utxo added by this block. May throw.
+        template <typename Func> void forEachAddUndo(const TxHashResolver &resolver, Func && f) const;
+
+        /// Fully materializes this record (for tests and debugging). May throw.
+        UndoInfo toUndoInfo(const TxHashResolver &resolver) const;
+        QString toDebugString() const;
+
+        /// V4 columns, in serialization order. The first is the raw scripthash column, all others are VarInt arrays:
+        /// add txNum (as offset from txNum0), add outN, add scripthash index, del txNum (as distance back from
+        /// txNum0), del outN, del scripthash index, del amount, del confirmed height (as height + 1 - cheight, or 0 if
+        /// none), and del token data (as size, followed by the serialized token data, if any).
+        enum Col : unsigned { ShCol = 0, AddTxIdxCol, AddOutNCol, AddShCol, DelTxNumCol, DelOutNCol, DelShCol,
+                              DelAmountCol, DelHeightCol, DelTokenCol, NCols };
+
+    private:
+        friend UndoRecord Deserialize<UndoRecord>(const QByteArray &, bool *);
+
+        std::shared_ptr<const UndoInfo> legacy; ///< set iff deserVersion < V4
+        QByteArray body; ///< V4 only: the uncompressed columns
+        std::array<Span<const char>, NCols> cols; ///< V4 only: views into `body`
+        size_t nSH = 0, nAdd = 0, nDel = 0;
+
+        HashX shAt(uint64_t idx) const;
+        static TxHash hashFor(const std::vector<TxNum> &txNums, const std::vector<TxHash> &hashes, TxNum txNum);
+    };
+
+    template <> UndoRecord Deserialize(const QByteArray &, bool *);
+
+    /// Sequential reader over one of the VarInt columns of a V4 UndoRecord
+    struct UndoColReader {
+        Span<const char> sp;
+        uint64_t next() { return VarInt::deserialize(sp).value<uint64_t>(); } // may throw
+        bitcoin::token::OutputDataPtr nextTokenData() {
+            const auto len = next();
+            if (len > sp.size()) throw DatabaseFormatError("Undo token data column is truncated");
+            const QByteArray ba = QByteArray::fromRawData(sp.data(), int(len));
+            sp = sp.subspan(len);
+            return len ? BTC::DeserializeTokenDataWithPrefix(ba, 0) : bitcoin::token::OutputDataPtr{}; // may throw
+        }
+    };
+
+    template <typename Func>
+    void UndoRecord::forEachDelUndo(const TxHashResolver &resolver, Func && f) const {
+        if (legacy) {
+            for (const auto & [txo, info] : legacy->delUndos) f(txo, info);
+            return;
+        }
+        // 1st pass over just the txNum column, so that the prevout tx hashes can be resolved in 1 batch
+        const TxNum txNum0 = blkInfo.txNum0;
+        std::vector<TxNum> txNums;
+        txNums.reserve(nDel);
+        for (UndoColReader rd{cols[DelTxNumCol]}; txNums.size() < nDel; ) {
+            const auto dist = rd.next();
+            if (UNLIKELY(!dist || dist > txNum0)) throw DatabaseFormatError("Bad txNum in undo del column");
+            txNums.push_back(txNum0 - dist);
+        }
+        std::vector<TxNum> uniq = txNums;
+        std::sort(uniq.begin(), uniq.end());
+        uniq.erase(std::unique(uniq.begin(), uniq.end()), uniq.end());
+        const auto hashes = resolver(uniq);
+        UndoColReader outNs{cols[DelOutNCol]}, shs{cols[DelShCol]}, amounts{cols[DelAmountCol]},
+                      heights{cols[DelHeightCol]}, tokens{cols[DelTokenCol]};
+        TXO txo;
+        TXOInfo info;
+        for (const auto txNum : txNums) {
+            txo.txHash = hashFor(uniq, hashes, txNum);
+            txo.outN = IONum(outNs.next());
+            info.amount = int64_t(amounts.next()) * bitcoin::Amount::satoshi();
+            info.hashX = shAt(shs.next());
+            if (const auto h = heights.next(); h && h <= uint64_t(height) + 1u) info.confirmedHeight = BlockHeight(uint64_t(height) + 1u - h);
+            else info.confirmedHeight.reset();
+            info.txNum = txNum;
+            info.tokenDataPtr = tokens.nextTokenData();
+            f(std::as_const(txo), std::as_const(info));
+        }
+    }
+
+    template <typename Func>
+    void UndoRecord::forEachAddUndo(const TxHashResolver &resolver, Func && f) const {
+        if (legacy) {
+            for (const auto & [txo, hashX, ctxo] : legacy->addUndos) f(txo, hashX, ctxo);
+            return;
+        }
+        // All of these txNums are in this block, so the resolver usually gets 1 contiguous range
+        const TxNum txNum0 = blkInfo.txNum0;
+        std::vector<TxNum> txNums;
+        txNums.reserve(nAdd);
+        for (UndoColReader rd{cols[AddTxIdxCol]}; txNums.size() < nAdd; ) {
+            const auto idx = rd.next();
+            if (UNLIKELY(idx >= blkInfo.nTx)) throw DatabaseFormatError("Bad txNum in undo add column");
+            txNums.push_back(txNum0 + idx);
+        }
+        std::vector<TxNum> uniq = txNums;
+        std::sort(uniq.begin(), uniq.end());
+        uniq.erase(std::unique(uniq.begin(), uniq.end()), uniq.end());
+        const auto hashes = resolver(uniq);
+        UndoColReader outNs{cols[AddOutNCol]}, shs{cols[AddShCol]};
+        TXO txo;
+        for (const auto txNum : txNums) {
+            txo.txHash = hashFor(uniq, hashes, txNum);
+            txo.outN = IONum(outNs.next());
+            const HashX hashX = shAt(shs.next());
+            f(std::as_const(txo), hashX, CompactTXO(txNum, txo.outN));
+        }
+    }
+
 
     /// Associative merge operator used for scripthash history concatenation
     /// TODO: this needs to be made more efficient by implementing the real MergeOperator interface and combining
@@ -580,6 +753,181 @@ namespace {
         return true;
     }
 
+    /// The `utxoset` table schema (DB v4+, see Meta::kMinCompactUTXOSetVersion):
+    ///
+    /// Key: The first kUtxoSetTxHashPrefixLen (8) bytes of the txid, followed by the 2 or 3 byte little-endian IONum.
+    ///     This is 10 or 11 bytes total, as opposed to the 34 or 35 bytes of the legacy (v3 and below) TXO key.
+    /// Value: A "bucket" of 1 or more entries, since distinct txids may share the same truncated prefix. Each entry is:
+    ///     VarInt(bodyLen) | TxNum (6 bytes) | VarInt(height) | VarInt(amount) | HashX (32 bytes) | [token data]
+    ///     Should a bucket contain more than 1 entry, the entries are disambiguated by resolving their TxNums to
+    ///     TxHashes via the txnum2txhash RecordFile (see resolveUtxoSetBucket()).
+    ///
+    /// Buckets are only ever written-to via merge operands (see UtxoSetBucketOperator below), so that we never have to
+    /// do a read -> modify -> write cycle for a UTXO add or spend.
+    constexpr size_t kUtxoSetTxHashPrefixLen = 8;
+    constexpr size_t kUtxoSetEntryMinBodyLen = CompactTXO::compactTxNumSize() + 1 + 1 + HashLen;
+    constexpr uint32_t kUtxoSetNoHeight = std::numeric_limits<uint32_t>::max();
+    enum UtxoSetOp : char { UtxoSetOpAdd = 'a', UtxoSetOpRemove = 'r' }; ///< first byte of each merge operand
+
+    /// Returns the 10 or 11 byte utxoset key for a TXO. Throws if txo is not valid.
+    QByteArray mkUtxoSetKey(const TXO &txo) {
+        if (UNLIKELY(!txo.isValid()))
+            throw InternalError(QString("mkUtxoSetKey -- txo is not valid: %1").arg(txo.toString()));
+        const bool wide = txo.outN > IONum16Max;
+        QByteArray key(int(kUtxoSetTxHashPrefixLen) + (wide ? 3 : 2), Qt::Uninitialized);
+        std::memcpy(key.data(), txo.txHash.constData(), kUtxoSetTxHashPrefixLen);
+        std::byte * const buf = reinterpret_cast<std::byte *>(key.data() + kUtxoSetTxHashPrefixLen);
+        buf[0] = std::byte(txo.outN >> 0u & 0xffu);
+        buf[1] = std::byte(txo.outN >> 8u & 0xffu);
+        if (wide)
+            buf[2] = std::byte(txo.outN >> 16u & 0xffu);
+        return key;
+    }
+
+    /// Returns the IONum encoded in a utxoset key, or a nullopt if the key is not of the v4+ format.
+    std::optional<IONum> extractIONumFromUtxoSetKey(const rocksdb::Slice &key) {
+        std::optional<IONum> ret;
+        if (const auto ksz = key.size(); ksz == kUtxoSetTxHashPrefixLen + 2u || ksz == kUtxoSetTxHashPrefixLen + 3u) {
+            const auto * const buf = reinterpret_cast<const uint8_t *>(key.data() + kUtxoSetTxHashPrefixLen);
+            ret = IONum(buf[0]) | IONum(buf[1]) << 8u;
+            if (ksz == kUtxoSetTxHashPrefixLen + 3u)
+                *ret |= IONum(buf[2]) << 16u;
+        }
+        return ret;
+    }
+
+    /// Serializes a single bucket entry (including its VarInt length prefix). Throws if info is not valid.
+    QByteArray serializeUtxoSetEntry(const TXOInfo &info) {
+        if (UNLIKELY(!info.isValid()))
+            throw InternalError(QString("serializeUtxoSetEntry -- TXOInfo for TxNum %1 is not valid").arg(info.txNum));
+        const VarInt height(uint32_t(info.confirmedHeight.value_or(kUtxoSetNoHeight)));
+        const VarInt amount(int64_t(info.amount / bitcoin::Amount::satoshi()));
+        QByteArray body(int(CompactTXO::compactTxNumSize()), Qt::Uninitialized);
+        body.reserve(int(kUtxoSetEntryMinBodyLen + height.size() + amount.size())
+                     + (info.tokenDataPtr ? 1 + int(info.tokenDataPtr->EstimatedSerialSize()) : 0));
+        CompactTXO::txNumToCompactBytes(reinterpret_cast<std::byte *>(body.data()), info.txNum);
+        body.append(height.byteView().charData(), int(height.size()));
+        body.append(amount.byteView().charData(), int(amount.size()));
+        body.append(info.hashX);
+        BTC::SerializeTokenDataWithPrefix(body, info.tokenDataPtr.get());
+        return VarInt(uint32_t(body.size())).byteArray() + body;
+    }
+
+    /// Splits a bucket (or the payload of an "add" merge operand) into its entries, appending them to `out` as
+    /// (TxNum, entry bytes including the VarInt length prefix) pairs. Returns false if the data is malformed.
+    bool splitUtxoSetBucket(Span<const char> bucket, std::vector<std::pair<TxNum, Span<const char>>> &out) {
+        try {
+            while (!bucket.empty()) {
+                const char * const begin = bucket.data();
+                const auto bodyLen = VarInt::deserialize(bucket).value<uint32_t>(); // may throw
+                if (bodyLen < kUtxoSetEntryMinBodyLen || bodyLen > bucket.size())
+                    return false;
+                const TxNum txNum = CompactTXO::txNumFromCompactBytes(reinterpret_cast<const std::byte *>(bucket.data()));
+                bucket = bucket.subspan(bodyLen);
+                out.emplace_back(txNum, Span<const char>{begin, bucket.data()});
+            }
+        } catch (const std::exception &) {
+            return false;
+        }
+        return true;
+    }
+
+    /// Deserializes a single entry as produced by splitUtxoSetBucket(). Throws DatabaseSerializationError on failure.
+    TXOInfo deserializeUtxoSetEntry(Span<const char> entry) {
+        TXOInfo ret;
+        try {
+            if (VarInt::deserialize(entry).value<uint32_t>() != entry.size())
+                throw std::invalid_argument("entry size mismatch");
+            ret.txNum = CompactTXO::txNumFromCompactBytes(reinterpret_cast<const std::byte *>(entry.data()));
+            entry = entry.subspan(CompactTXO::compactTxNumSize());
+            if (const auto height = VarInt::deserialize(entry).value<uint32_t>(); height != kUtxoSetNoHeight)
+                ret.confirmedHeight.emplace(height);
+            ret.amount = VarInt::deserialize(entry).value<int64_t>() * bitcoin::Amount::satoshi();
+            if (entry.size() < HashLen)
+                throw std::invalid_argument("short hashX");
+            ret.hashX = QByteArray(entry.data(), HashLen);
+            entry = entry.subspan(HashLen);
+            if (!entry.empty())
+                ret.tokenDataPtr = BTC::DeserializeTokenDataWithPrefix(QByteArray::fromRawData(entry.data(), int(entry.size())), 0);
+        } catch (const std::exception &e) {
+            throw DatabaseSerializationError(QString("Failed to deserialize a utxoset entry: %1").arg(e.what()));
+        }
+        if (UNLIKELY(!ret.isValid()))
+            throw DatabaseSerializationError(QString("Deserialized utxoset entry for TxNum %1 is not valid").arg(ret.txNum));
+        return ret;
+    }
+
+    QByteArray mkUtxoSetAddOperand(const TXOInfo &info) { return char(UtxoSetOpAdd) + serializeUtxoSetEntry(info); }
+
+    QByteArray mkUtxoSetRemoveOperand(TxNum txNum) {
+        QByteArray ret(1 + int(CompactTXO::compactTxNumSize()), Qt::Uninitialized);
+        ret[0] = char(UtxoSetOpRemove);
+        CompactTXO::txNumToCompactBytes(reinterpret_cast<std::byte *>(ret.data() + 1), txNum);
+        return ret;
+    }
+
+    /// Merge operator for the `utxoset` table. Operands are either "add" (append an entry to the bucket) or "remove"
+    /// (delete the most recently appended entry in the bucket having a particular TxNum). We never do partial merges,
+    /// so the operands are always applied to the full existing value (if any). A bucket may end up empty, in which
+    /// case readers treat the key as missing and UtxoSetEmptyBucketFilter eventually drops it on compaction.
+    class UtxoSetBucketOperator : public rocksdb::MergeOperator {
+    public:
+        ~UtxoSetBucketOperator() override;
+
+        mutable std::atomic<unsigned> merges = 0;
+
+        bool FullMergeV2(const MergeOperationInput &merge_in, MergeOperationOutput *merge_out) const override;
+        const char* Name() const override { return "UtxoSetBucketOperator"; /* NOTE: this must be the same for the same db each time it is opened! */ }
+    };
+
+    UtxoSetBucketOperator::~UtxoSetBucketOperator() {} // weak vtable warning prevention
+
+    bool UtxoSetBucketOperator::FullMergeV2(const MergeOperationInput &merge_in, MergeOperationOutput *merge_out) const
+    {
+        ++merges;
+        std::vector<std::pair<TxNum, Span<const char>>> entries; // views into the existing value and the operands
+        entries.reserve(merge_in.operand_list.size() + 1u);
+        if (const auto *ev = merge_in.existing_value; ev && !splitUtxoSetBucket(Span<const char>{ev->data(), ev->size()}, entries))
+            return false;
+        for (const auto & op : merge_in.operand_list) {
+            if (op.empty()) return false;
+            const Span<const char> payload{op.data() + 1, op.size() - 1u};
+            if (op[0] == UtxoSetOpAdd) {
+                if (!splitUtxoSetBucket(payload, entries)) return false;
+            } else if (op[0] == UtxoSetOpRemove && payload.size() == CompactTXO::compactTxNumSize()) {
+                const TxNum txNum = CompactTXO::txNumFromCompactBytes(reinterpret_cast<const std::byte *>(payload.data()));
+                const auto rit = std::find_if(entries.rbegin(), entries.rend(), [txNum](const auto &e) { return e.first == txNum; });
+                if (rit != entries.rend())
+                    entries.erase(std::next(rit).base());
+            } else
+                return false;
+        }
+        size_t totalSize = 0u;
+        for (const auto & e : entries)
+            totalSize += e.second.size();
+        auto & nv = merge_out->new_value;
+        nv.clear();
+        nv.reserve(totalSize);
+        for (const auto & e : entries)
+            nv.append(e.second.data(), e.second.size());
+        return true;
+    }
+
+    /// Drops `utxoset` keys whose buckets have become empty (all of their UTXOs were spent).
+    class UtxoSetEmptyBucketFilter : public rocksdb::CompactionFilter {
+    public:
+        ~UtxoSetEmptyBucketFilter() override;
+
+        bool Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value, std::string *new_value,
+                    bool *value_changed) const override {
+            (void)level; (void)key; (void)new_value; (void)value_changed;
+            return existing_value.empty();
+        }
+        const char* Name() const override { return "UtxoSetEmptyBucketFilter"; }
+    };
+
+    UtxoSetEmptyBucketFilter::~UtxoSetEmptyBucketFilter() {} // weak vtable warning prevention
+
     /// Thrown if user hits Ctrl-C / app gets a signal while we run the slow db checks
     struct UserInterrupted : public Exception { using Exception::Exception; ~UserInterrupted() override; };
     UserInterrupted::~UserInterrupted() {} // weak vtable warning suppression
@@ -1058,13 +1406,523 @@ namespace {
 
     /* static */ const QByteArray TxHash2TxNumMgr::kLargestTxNumSeenKeyPrefix = "+largestTxNumSeen";
 
+    /// In-RAM copy of the headers file (config option: headers_in_ram). Headers are stored back-to-back in fixed-size
+    /// chunks which are allocated on demand and never moved or freed while this object lives, so that readers need
+    /// no lock: they just check the requested range against the published count.
+    ///
+    /// Locking contract: there must be only 1 writer at a time. Appends happen in addBlock (blocksLock exclusive),
+    /// truncation only in undoLatestBlock (rewindLock *and* blocksLock exclusive). Plain header reads take no lock. A
+    /// reorg truncates and then re-appends over the same slots, so the readers use a sequence counter ("seqlock") to
+    /// detect that a slot they copied from was overwritten (or dropped) meanwhile, and retry; a read thus returns
+    /// either the header from before or from after the reorg, never a mix. Readers that need the headers to stay
+    /// consistent with other data across several calls (e.g. the txNums of the same blocks) should hold rewindLock
+    /// (shared), as the other query paths do.
+    class HeadersRam {
+        static constexpr size_t kChunkHeaders = 1u << 16; ///< 64K headers per chunk (~5.2MB for 80-byte headers)
+        const size_t hdrSize;
+        const size_t nChunks;
+        std::unique_ptr<std::atomic<char *>[]> chunks;
+        std::atomic_size_t count{0u}, nAllocated{0u};
+        /// Odd while the writer is overwriting a slot that readers may have seen; bumped by 2 on truncate.
+        std::atomic_uint64_t seq{0u};
+        size_t highWater = 0u; ///< writer only: slots below this were published before (so appends to them overwrite)
+
+        const char *ptr(size_t height) const {
+            return chunks[height / kChunkHeaders].load(std::memory_order_relaxed) + (height % kChunkHeaders) * hdrSize;
+        }
+
+        /// Runs `read` (which should only copy), retrying until it ran without the writer overwriting or dropping any
+        /// slots meanwhile.
+        template <typename Func>
+        auto consistentRead(Func && read) const {
+            for (;;) {
+                const auto s1 = seq.load(std::memory_order_acquire);
+                if (UNLIKELY(s1 & 1u)) { std::this_thread::yield(); continue; } // overwrite in progress
+                auto ret = read();
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (LIKELY(seq.load(std::memory_order_relaxed) == s1)) return ret;
+            }
+        }
+    public:
+        explicit HeadersRam(size_t headerSize)
+            : hdrSize(headerSize), nChunks(Storage::MAX_HEADERS / kChunkHeaders + 1u),
+              chunks(std::make_unique<std::atomic<char *>[]>(nChunks)) {
+            for (size_t i = 0; i < nChunks; ++i) chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+        ~HeadersRam() { for (size_t i = 0; i < nChunks; ++i) delete [] chunks[i].load(std::memory_order_relaxed); }
+
+        size_t size() const { return count.load(std::memory_order_acquire); }
+        size_t memUsage() const { return nAllocated.load(std::memory_order_relaxed) * kChunkHeaders * hdrSize; }
+
+        /// Writer only. Throws InternalError on bad header size or if we are full.
+        void append(const QByteArray &h) {
+            const size_t n = count.load(std::memory_order_relaxed);
+            if (UNLIKELY(size_t(h.size()) != hdrSize || n >= Storage::MAX_HEADERS))
+                throw InternalError("HeadersRam::append: bad header size or too many headers");
+            auto & chunk = chunks[n / kChunkHeaders];
+            if (!chunk.load(std::memory_order_relaxed)) {
+                chunk.store(new char[kChunkHeaders * hdrSize], std::memory_order_relaxed);
+                ++nAllocated;
+            }
+            if (n < highWater) {
+                // re-using a slot after a truncate: a reader that saw the old count may still be copying from it
+                const auto s = seq.load(std::memory_order_relaxed);
+                seq.store(s + 1u, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                std::memcpy(const_cast<char *>(ptr(n)), h.constData(), hdrSize);
+                seq.store(s + 2u, std::memory_order_release);
+            } else {
+                std::memcpy(const_cast<char *>(ptr(n)), h.constData(), hdrSize);
+                highWater = n + 1u;
+            }
+            count.store(n + 1u, std::memory_order_release);
+        }
+        /// Writer only. Forgets all headers at index >= n (memory is kept for re-use).
+        void truncate(size_t n) {
+            if (n < count.load(std::memory_order_relaxed)) {
+                count.store(n, std::memory_order_release);
+                seq.fetch_add(2u, std::memory_order_release); // readers that got in before this retry, and see `n`
+            }
+        }
+
+        std::optional<QByteArray> get(size_t height) const {
+            return consistentRead([&] {
+                std::optional<QByteArray> ret;
+                if (height < size())
+                    ret.emplace(ptr(height), QByteArray::size_type(hdrSize));
+                return ret;
+            });
+        }
+        /// Returns up to `num` headers starting at `height` (fewer if we don't have them all)
+        std::vector<QByteArray> get(size_t height, size_t num) const {
+            return consistentRead([&] {
+                std::vector<QByteArray> ret;
+                const size_t sz = size();
+                if (height >= sz) return ret;
+                const size_t n = std::min(num, sz - height);
+                ret.reserve(n);
+                for (size_t i = 0; i < n; ++i)
+                    ret.emplace_back(ptr(height + i), QByteArray::size_type(hdrSize));
+                return ret;
+            });
+        }
+    }; // end class HeadersRam
+
+    /// A flat file holding a copy of all of the BlkInfos, written on clean shutdown so that the next startup may load
+    /// them with 1 sequential read rather than with 1 db read per block. On load it is only trusted if its checksum is
+    /// ok and it matches the headers we have (count, tip hash, and a hash of all of the headers, since the caller then
+    /// skips verifying them one by one); the caller also deletes it right after reading it, so that it can never be
+    /// used with a db that was modified after it was written.
+    ///
+    /// Format (little endian): magic (4), version (4), count (4), tip hash (32), headers hash (32),
+    /// count x { txNum0 (8), nTx (4) }, sha256d checksum of all preceding bytes (32).
+    struct BlkInfoSnapshot {
+        static constexpr uint32_t kMagic = 0xb1c1f0a5, kVersion = 2;
+        static constexpr size_t kHeaderBytes = 4u + 4u + 4u + HashLen + HashLen, kRecordBytes = 8u + 4u;
+
+        BlockHash tipHash; ///< BTC::Hash() of the tip header (bitcoind memory order)
+        QByteArray headersHash; ///< hashHeaders() of all of the headers, as they were in the headers file
+        std::vector<BlkInfo> blkInfos;
+
+        static QString path(const QString &datadir) { return datadir + QDir::separator() + "blkinfo_snapshot"; }
+
+        /// Single sha256 of all of `headers`, concatenated. This is a lot cheaper than verifying (and double-hashing)
+        /// every header, yet it catches any change to the headers file since the snapshot was taken.
+        static QByteArray hashHeaders(const std::vector<QByteArray> &headers) {
+            bitcoin::CHash256 h(true);
+            for (const auto & hdr : headers)
+                h.Write(reinterpret_cast<const uint8_t *>(hdr.constData()), size_t(hdr.size()));
+            QByteArray ret(QByteArray::size_type(h.OUTPUT_SIZE), Qt::Uninitialized);
+            h.Finalize(reinterpret_cast<uint8_t *>(ret.data()));
+            return ret;
+        }
+
+        static void save(const QString &path, const std::vector<BlkInfo> &blkInfos, const BlockHash &tipHash,
+                         const QByteArray &headersHash) {
+            if (tipHash.size() != HashLen) throw BadArgs("BlkInfoSnapshot::save: bad tip hash");
+            if (headersHash.size() != HashLen) throw BadArgs("BlkInfoSnapshot::save: bad headers hash");
+            QByteArray buf(qsizetype(kHeaderBytes + blkInfos.size() * kRecordBytes + HashLen), Qt::Uninitialized);
+            auto *d = reinterpret_cast<uint8_t *>(buf.data());
+            bitcoin::WriteLE32(d, kMagic);
+            bitcoin::WriteLE32(d + 4, kVersion);
+            bitcoin::WriteLE32(d + 8, uint32_t(blkInfos.size()));
+            std::memcpy(d + 12, tipHash.constData(), HashLen);
+            std::memcpy(d + 12 + HashLen, headersHash.constData(), HashLen);
+            d += kHeaderBytes;
+            for (const auto & bi : blkInfos) {
+                bitcoin::WriteLE64(d, bi.txNum0);
+                bitcoin::WriteLE32(d + 8, bi.nTx);
+                d += kRecordBytes;
+            }
+            const auto checksum = BTC::Hash(QByteArray::fromRawData(buf.constData(), buf.size() - qsizetype(HashLen)));
+            std::memcpy(d, checksum.constData(), HashLen);
+            QSaveFile f(path);
+            if (!f.open(QIODevice::WriteOnly) || f.write(buf) != buf.size() || !f.commit())
+                throw InternalError(QString("Failed to write %1: %2").arg(path, f.errorString()));
+        }
+
+        /// Returns an empty optional if the file does not exist. Throws on bad format or checksum.
+        static std::optional<BlkInfoSnapshot> load(const QString &path) {
+            std::optional<BlkInfoSnapshot> ret;
+            QFile f(path);
+            if (!f.exists()) return ret;
+            if (!f.open(QIODevice::ReadOnly))
+                throw InternalError(QString("Failed to open %1: %2").arg(path, f.errorString()));
+            const QByteArray buf = f.readAll();
+            if (size_t(buf.size()) < kHeaderBytes + HashLen)
+                throw InternalError("short file");
+            const auto *d = reinterpret_cast<const uint8_t *>(buf.constData());
+            const uint32_t count = bitcoin::ReadLE32(d + 8);
+            if (bitcoin::ReadLE32(d) != kMagic || bitcoin::ReadLE32(d + 4) != kVersion)
+                throw InternalError("bad magic or unsupported version");
+            if (size_t(buf.size()) != kHeaderBytes + size_t(count) * kRecordBytes + HashLen)
+                throw InternalError("bad file size");
+            const auto body = QByteArray::fromRawData(buf.constData(), buf.size() - qsizetype(HashLen));
+            if (BTC::Hash(body) != buf.right(HashLen))
+                throw InternalError("bad checksum");
+            auto & snap = ret.emplace();
+            snap.tipHash = buf.mid(12, HashLen);
+            snap.headersHash = buf.mid(12 + HashLen, HashLen);
+            snap.blkInfos.reserve(count);
+            d += kHeaderBytes;
+            for (uint32_t i = 0; i < count; ++i, d += kRecordBytes)
+                snap.blkInfos.emplace_back(bitcoin::ReadLE64(d), bitcoin::ReadLE32(d + 8));
+            return ret;
+        }
+
+        /// True if this snapshot was taken of the chain whose headers we have: same block count and same tip.
+        bool matches(size_t numHeaders, const BlockHash &tip) const { return blkInfos.size() == numHeaders && tipHash == tip; }
+        /// True if the headers file holds exactly the headers it held when this snapshot was taken.
+        bool matchesHeaders(const std::vector<QByteArray> &headers) const { return headersHash == hashHeaders(headers); }
+
+        /// True if `v` describes `nBlocks` non-empty blocks whose txNums are contiguous from 0 and add up to `txNumNext`,
+        /// which is exactly what reading them from the db (see loadCheckTxNumsFileAndBlkInfo) would have checked.
+        static bool isConsistent(const std::vector<BlkInfo> &v, size_t nBlocks, TxNum txNumNext) {
+            if (v.size() != nBlocks) return false;
+            TxNum ct = 0;
+            for (const auto & bi : v) {
+                if (bi.txNum0 != ct || bi.nTx == 0) return false;
+                ct += bi.nTx;
+            }
+            return ct == txNumNext;
+        }
+
+        /// Like load() but never throws on a bad file (just warns). The file is always deleted once read, since the db
+        /// may be modified from here on (it's re-written on clean shutdown). Throws only if it cannot be deleted.
+        static std::optional<BlkInfoSnapshot> loadAndDelete(const QString &path) {
+            std::optional<BlkInfoSnapshot> ret;
+            try {
+                ret = load(path);
+            } catch (const std::exception &e) {
+                Warning() << "Ignoring bad blkInfo snapshot file " << path << ": " << e.what();
+            }
+            if (QFile::exists(path) && !QFile::remove(path))
+                throw DatabaseError(QString("Unable to delete %1. Please check permissions and try again.").arg(path));
+            return ret;
+        }
+    };
+
+    /// Read profile for short prefix scans issued by the query paths (e.g. all the utxos for a scripthash). These are
+    /// usually a few keys, but for very "busy" scripthashes they can run into the thousands. Adaptive readahead lets
+    /// rocksdb's auto-readahead (which kicks in after a couple of sequential reads from the same SST file) carry its
+    /// ramped-up size across file boundaries, so long scans get big reads and short scans never pay for them.
+    rocksdb::ReadOptions MkPrefixScanReadOpts() {
+        rocksdb::ReadOptions ret;
+#if HAS_ROCKSDB_ADAPTIVE_READAHEAD
+        ret.adaptive_readahead = true;
+#endif
+        return ret;
+    }
+
+    /// Read profile for bulk full-table scans (startup consistency checks, admin-triggered stats/dumps). These read
+    /// everything once, so: don't let them evict the hot block cache (which would degrade client latency for a long
+    /// time afterwards), use a large fixed readahead, and let rocksdb prefetch asynchronously (ignored if rocksdb was
+    /// built without coroutine support).
+    rocksdb::ReadOptions MkBulkScanReadOpts() {
+        rocksdb::ReadOptions ret;
+        ret.fill_cache = false;
+        ret.readahead_size = 4u * 1024u * 1024u;
+#if HAS_ROCKSDB_ASYNC_IO
+        ret.async_io = true;
+#endif
+        return ret;
+    }
+
+    /// Returns the smallest key that is greater than every key starting with `prefix`, for use as an exclusive
+    /// `iterate_upper_bound`. Returns an empty array if there is no such key (prefix is empty or all 0xff).
+    QByteArray PrefixScanUpperBound(QByteArray prefix) {
+        while (!prefix.isEmpty()) {
+            const auto last = prefix.size() - 1;
+            if (uint8_t(prefix[last]) != 0xffu) {
+                prefix[last] = char(uint8_t(prefix[last]) + 1u);
+                return prefix;
+            }
+            prefix.truncate(last);
+        }
+        return prefix;
+    }
+
+    /// A fixed set of helper threads that Storage's parallel read paths (getRpaHistory, OrderedParallelScan) hand their
+    /// extra work to, so that the number of threads they use stays bounded no matter how many such requests are in
+    /// flight at once. Submitted jobs are "claimable": a caller that needs the result of a job that no helper has
+    /// started yet (because they are all busy with other requests' jobs) takes it back and does the work itself. Thus
+    /// callers never wait behind unrelated work, and jobs that wait on their caller can't deadlock the pool.
+    class HelperPool {
+    public:
+        class Job {
+            friend class HelperPool;
+            enum State { Queued, Running, Done };
+            std::mutex mut;
+            std::condition_variable cond;
+            State state = Queued;
+            std::function<void()> func;
+            std::exception_ptr error;
+
+            void run() {
+                try { func(); } catch (...) { error = std::current_exception(); }
+                std::lock_guard g(mut);
+                state = Done;
+                cond.notify_all();
+            }
+        public:
+            explicit Job(std::function<void()> && f) : func(std::move(f)) {}
+            /// Returns true if no helper had started this job, in which case no helper ever will: it is now up to the
+            /// caller to do (or skip) the work. Returns false if a helper is running or has run the job.
+            bool claim() {
+                std::lock_guard g(mut);
+                if (state != Queued) return false;
+                state = Done;
+                return true;
+            }
+            /// Waits for a helper to finish running this job, rethrowing any exception it threw.
+            /// Precondition: the job was not claimed.
+            void wait() {
+                std::unique_lock g(mut);
+                cond.wait(g, [this]{ return state == Done; });
+                if (error) std::rethrow_exception(error);
+            }
+            /// Runs the job on the calling thread if no helper has started it yet, otherwise waits for it. May throw.
+            void runHereOrWait() {
+                if (claim()) func();
+                else wait();
+            }
+            /// For cleanup paths: makes sure the job is no longer running (claiming it if possible). Never throws.
+            void cancelOrWait() noexcept {
+                if (claim()) return;
+                std::unique_lock g(mut);
+                cond.wait(g, [this]{ return state == Done; });
+            }
+        };
+        using JobPtr = std::shared_ptr<Job>;
+
+        HelperPool(const QString &name, unsigned nThreads) {
+            nThreads = std::max(nThreads, 1u);
+            threads.reserve(nThreads);
+            for (unsigned i = 0; i < nThreads; ++i)
+                threads.emplace_back([this, tname = QString("%1 %2").arg(name).arg(i + 1u)] {
+                    Util::ThreadName::Set(tname);
+                    thrFunc();
+                });
+        }
+        ~HelperPool() {
+            {
+                std::lock_guard g(mut);
+                pleaseStop = true;
+                cond.notify_all();
+            }
+            for (auto & t : threads) t.join();
+        }
+
+        unsigned nThreads() const { return unsigned(threads.size()); }
+
+        /// Enqueues `func` for the next free helper. The caller must call one of the Job's methods before anything
+        /// `func` references goes out of scope.
+        [[nodiscard]] JobPtr submit(std::function<void()> && func) {
+            auto job = std::make_shared<Job>(std::move(func));
+            std::lock_guard g(mut);
+            queue.push_back(job);
+            cond.notify_one();
+            return job;
+        }
+
+    private:
+        std::mutex mut;
+        std::condition_variable cond;
+        std::deque<JobPtr> queue;
+        bool pleaseStop = false;
+        std::vector<std::thread> threads;
+
+        void thrFunc() {
+            std::unique_lock g(mut);
+            for (;;) {
+                cond.wait(g, [this]{ return pleaseStop || !queue.empty(); });
+                if (queue.empty()) return; // pleaseStop and nothing left to do
+                const JobPtr job = std::move(queue.front());
+                queue.pop_front();
+                g.unlock();
+                bool mine = false;
+                {
+                    std::lock_guard jg(job->mut);
+                    if ((mine = job->state == Job::Queued)) job->state = Job::Running;
+                }
+                if (mine) job->run();
+                g.lock();
+            }
+        }
+    };
+
+    using ScanConsumer = std::function<bool(const rocksdb::Slice &key, const rocksdb::Slice &value)>;
+
+    /// Visits every key/value pair of `db` as of `snapshot`, calling `consume` on the calling thread in key order,
+    /// exactly as a single SeekToFirst()..Next() loop would. The key space is split into `nParts` ranges on the first
+    /// key byte (the big tables are keyed by hashes, so this spreads the work evenly). The calling thread iterates the
+    /// first range itself while `helpers` read the other ranges ahead into bounded buffers. So it is the rocksdb block
+    /// reads & decompression that run in parallel, while `consume` stays serial (and may thus e.g. maintain a running
+    /// hash). A range that no helper got around to reading ahead is simply iterated by the calling thread when its turn
+    /// comes. `consume` may return false to stop the scan early, in which case this returns false.
+    /// Throws DatabaseError on iterator failure; exceptions from the helper threads are rethrown here.
+    bool OrderedParallelScan(HelperPool &helpers, rocksdb::DB *db, const rocksdb::Snapshot *snapshot,
+                             const rocksdb::ReadOptions &baseOpts, unsigned nParts, const ScanConsumer &consume)
+    {
+        nParts = std::clamp(nParts, 1u, 256u);
+        // lowerBounds[i] is the first key byte of range i (range 0 also gets the empty key)
+        std::vector<std::string> lowerBounds(nParts);
+        for (unsigned i = 1; i < nParts; ++i)
+            lowerBounds[i] = std::string(1, char(256u * i / nParts));
+        // `upper` must outlive the returned iterator
+        const auto mkIter = [&](unsigned i, rocksdb::Slice &upper) {
+            auto opts = baseOpts;
+            opts.snapshot = snapshot;
+            if (i + 1u < nParts) {
+                upper = lowerBounds[i + 1u];
+                opts.iterate_upper_bound = &upper;
+            }
+            std::unique_ptr<rocksdb::Iterator> it{db->NewIterator(opts)};
+            if (!it) throw DatabaseError(QString("Failed to create a scan iterator for %1").arg(QString::fromStdString(db->GetName())));
+            if (i) it->Seek(lowerBounds[i]);
+            else it->SeekToFirst();
+            return it;
+        };
+        const auto checkStatus = [db](const rocksdb::Iterator &it) {
+            if (const auto st = it.status(); !st.ok())
+                throw DatabaseError(QString("Error scanning %1: %2").arg(QString::fromStdString(db->GetName()),
+                                                                         QString::fromStdString(st.ToString())));
+        };
+
+        // Read-ahead state for ranges 1..nParts-1. Each worker fills flat chunks of concatenated key+value bytes.
+        struct Chunk {
+            std::string data;
+            std::vector<std::pair<uint32_t, uint32_t>> lens; ///< (key, value) sizes of the pairs in `data`
+        };
+        struct Part {
+            std::mutex mut;
+            std::condition_variable cond;
+            std::deque<Chunk> chunks;
+            size_t bytes = 0; ///< total size of `chunks`
+            bool done = false;
+            std::exception_ptr error;
+        };
+        constexpr size_t kChunkBytes = 1u << 20, kMaxPartBytes = 8u << 20;
+        std::atomic_bool stop = false;
+        std::vector<Part> parts(nParts);
+
+        const auto readAhead = [&](unsigned i) {
+            Part &part = parts[i];
+            try {
+                rocksdb::Slice upper;
+                const auto it = mkIter(i, upper);
+                Chunk chunk;
+                const auto pushChunk = [&] {
+                    std::unique_lock g(part.mut);
+                    part.cond.wait(g, [&]{ return part.bytes < kMaxPartBytes || stop; });
+                    part.bytes += chunk.data.size();
+                    part.chunks.push_back(std::move(chunk));
+                    chunk = Chunk{};
+                    part.cond.notify_all();
+                };
+                for ( ; it->Valid() && !stop; it->Next()) {
+                    const auto k = it->key(), v = it->value();
+                    chunk.data.append(k.data(), k.size()).append(v.data(), v.size());
+                    chunk.lens.emplace_back(uint32_t(k.size()), uint32_t(v.size()));
+                    if (chunk.data.size() >= kChunkBytes) pushChunk();
+                }
+                checkStatus(*it);
+                if (!chunk.lens.empty()) pushChunk();
+            } catch (...) {
+                std::lock_guard g(part.mut);
+                part.error = std::current_exception();
+            }
+            std::lock_guard g(part.mut);
+            part.done = true;
+            part.cond.notify_all();
+        };
+
+        std::vector<HelperPool::JobPtr> jobs;
+        // On the way out (normally or not): wake up any helper blocked on a full buffer, then make sure none are still
+        // running, since they reference this stack frame.
+        Defer stopWorkers([&]{
+            stop = true;
+            for (auto & part : parts) {
+                std::lock_guard g(part.mut);
+                part.cond.notify_all();
+            }
+            for (auto & job : jobs) job->cancelOrWait();
+        });
+        jobs.reserve(nParts - 1u);
+        for (unsigned i = 1; i < nParts; ++i)
+            jobs.push_back(helpers.submit([&readAhead, i]{ readAhead(i); }));
+
+        // Iterates range i on this thread
+        const auto scanHere = [&](unsigned i) {
+            rocksdb::Slice upper;
+            const auto it = mkIter(i, upper);
+            for ( ; it->Valid(); it->Next())
+                if (!consume(it->key(), it->value())) return false;
+            checkStatus(*it);
+            return true;
+        };
+        if (!scanHere(0)) return false;
+        for (unsigned i = 1; i < nParts; ++i) {
+            if (jobs[i - 1u]->claim()) {
+                // no helper got to it (they are all busy), so no read-ahead happened: just do it here
+                if (!scanHere(i)) return false;
+                continue;
+            }
+            Part &part = parts[i];
+            for (;;) {
+                Chunk chunk;
+                {
+                    std::unique_lock g(part.mut);
+                    part.cond.wait(g, [&part]{ return !part.chunks.empty() || part.done; });
+                    if (part.chunks.empty()) {
+                        if (part.error) std::rethrow_exception(part.error);
+                        break;
+                    }
+                    chunk = std::move(part.chunks.front());
+                    part.chunks.pop_front();
+                    part.bytes -= chunk.data.size();
+                    part.cond.notify_all();
+                }
+                const char *pos = chunk.data.data();
+                for (const auto & [klen, vlen] : chunk.lens) {
+                    if (!consume(rocksdb::Slice(pos, klen), rocksdb::Slice(pos + klen, vlen))) return false;
+                    pos += klen + vlen;
+                }
+            }
+        }
+        return true;
+    }
+
+    class PrevoutFetcher; // defined below, after Storage::Pvt
+
 } // namespace
 
 struct Storage::Pvt
 {
-    Pvt(const unsigned cacheSizeBytes)
+    Pvt(const unsigned cacheSizeBytes, const unsigned merkleCacheSizeBytes)
         : lruNum2Hash(std::max(unsigned(cacheSizeBytes*kLruNum2HashCacheMemoryWeight), 1u)),
-          lruHeight2Hashes_BitcoindMemOrder(std::max(unsigned(cacheSizeBytes*kLruHeight2HashesCacheMemoryWeight), 1u))
+          lruHeight2Hashes_BitcoindMemOrder(std::max(unsigned(cacheSizeBytes*kLruHeight2HashesCacheMemoryWeight), 1u)),
+          lruHeight2MerkleTree(std::max(merkleCacheSizeBytes, 1u))
     {}
 
     Pvt(const Pvt &) = delete;
@@ -1079,14 +1937,18 @@ struct Storage::Pvt
     std::atomic<std::underlying_type_t<SaveItem>> pendingSaves{0};
 
     struct RocksDBs {
-        const rocksdb::ReadOptions defReadOpts; ///< avoid creating this each time
+        const rocksdb::ReadOptions defReadOpts; ///< avoid creating this each time; use for point lookups
+        const rocksdb::ReadOptions prefixScanReadOpts = MkPrefixScanReadOpts(); ///< use for query-path prefix and range scans
+        const rocksdb::ReadOptions bulkScanReadOpts = MkBulkScanReadOpts(); ///< use for full-table scans
         const rocksdb::WriteOptions defWriteOpts; ///< avoid creating this each time
 
-        rocksdb::Options opts, shistOpts, txhash2txnumOpts;
+        rocksdb::Options opts, shistOpts, txhash2txnumOpts, utxosetOpts;
         std::weak_ptr<rocksdb::Cache> blockCache; ///< shared across all dbs, caps total block cache size across all db instances
         std::weak_ptr<rocksdb::WriteBufferManager> writeBufferManager; ///< shared across all dbs, caps total memtable buffer size across all db instances
 
         std::shared_ptr<ConcatOperator> concatOperator, concatOperatorTxHash2TxNum;
+        std::shared_ptr<UtxoSetBucketOperator> utxoSetBucketOperator;
+        UtxoSetEmptyBucketFilter utxoSetEmptyBucketFilter; ///< must outlive the utxoset db (rocksdb takes a raw pointer to it)
 
         std::unique_ptr<rocksdb::DB> meta, blkinfo, utxoset,
                                      shist, shunspent, // scripthash_history and scripthash_unspent
@@ -1107,11 +1969,20 @@ struct Storage::Pvt
 
     std::unique_ptr<RecordFile> txNumsFile;
     std::unique_ptr<RecordFile> headersFile;
-
-    /// Big lock used for block/history updates. Public methods that read the history such as getHistory and listUnspent
-    /// take this as read-only (shared), and addBlock and undoLatestBlock take this as read/write (exclusively).
-    /// This is intended to be a coarse lock.  Currently the update code takes this along with headerVerifierLock and
-    /// blkInfoLock at the same time, so it's (as of now) equivalent to either of those two locks.
+    /// Only non-null if headers_in_ram = true, in which case all header reads are served from here rather than from
+    /// headersFile (which is still written-to, since it's what we load from on startup).
+    std::unique_ptr<HeadersRam> headersRam;
+
+    /// Taken exclusively only by undoLatestBlock, since a rewind truncates data (txNumsFile, blkInfos) that the query
+    /// paths rely on. The query paths (getHistory, listUnspent, getBalance, getFirstUse, getRpaHistory, utxoGet) take this in
+    /// shared mode (instead of blocksLock), so that they only ever wait on a reorg and never on addBlock.
+    /// Lock order: must be taken before any of the locks below.
+    mutable RWLock rewindLock;
+
+    /// Big lock used for block/history updates. addBlock and undoLatestBlock take this as read/write (exclusively).
+    /// This is intended to be a coarse lock. Currently the update code takes this along with headerVerifierLock at the
+    /// same time. undoLatestBlock also holds blkInfoLock and mempoolLock for its entire duration, whereas addBlock only
+    /// takes those two briefly at the end when it publishes its results (see `readView` below).
     /// TODO: See about removing all the other locks and keeping one general RWLock for all updates?
     mutable RWLock blocksLock;
 
@@ -1121,8 +1992,24 @@ struct Storage::Pvt
     std::atomic<TxNum> txNumNext{0};
 
     std::vector<BlkInfo> blkInfos;
-    std::map<TxNum, unsigned> blkInfosByTxNum; ///< ordered map of TxNum0 for a block -> index into above blkInfo array
-    RWLock blkInfoLock; ///< locks blkInfos and blkInfosByTxNum
+    /// The txNum0 of each block, indexed by height (always the same size as blkInfos). It's strictly increasing, so
+    /// the block containing a TxNum is the last one whose txNum0 is <= TxNum.
+    std::vector<TxNum> blkTxNum0s;
+    /// Search index over a prefix of blkTxNum0s (see heightForTxNum_nolock). It's only rebuilt once the un-indexed
+    /// tail grows past kBlkTxNum0sIndexSlack blocks (or if a block it covers is undone), so that addBlock stays cheap.
+    EytzingerArray<TxNum> blkTxNum0sIndex;
+    static constexpr size_t kBlkTxNum0sIndexSlack = 2016;
+    RWLock blkInfoLock; ///< locks blkInfos, blkTxNum0s and blkTxNum0sIndex
+
+    /// Call with blkInfoLock held exclusively, after modifying blkTxNum0s
+    void updateBlkTxNum0sIndex(bool force = false) {
+        const size_t sz = blkTxNum0s.size(), indexed = blkTxNum0sIndex.size();
+        if (force || sz < indexed || sz - indexed > kBlkTxNum0sIndexSlack)
+            blkTxNum0sIndex.build(blkTxNum0s.data(), sz);
+    }
+
+    /// Set by loadCheckHeadersInDB if it found a valid BlkInfoSnapshot, consumed by loadCheckTxNumsFileAndBlkInfo
+    std::optional<std::vector<BlkInfo>> snapshotBlkInfos;
 
     std::atomic<int64_t> utxoCt = 0;
 
@@ -1153,14 +2040,86 @@ struct Storage::Pvt
                          + decltype(lruHeight2Hashes_BitcoindMemOrder)::itemOverheadBytes() );
     }
 
+    /// Cache BlockHeight -> fully computed merkle tree for the block. Used by get_merkle and id_from_pos, which after
+    /// a new block tend to be hit by many clients asking for proofs in the *same* block. The tip block's tree is put
+    /// here by addBlock once we are synched. Entries for undone blocks are removed by undoLatestBlock.
+    /// Has its own budget (config option: merkle_cache), rather than a share of txhash_cache.
+    CostCache<BlockHeight, std::shared_ptr<const Merkle::Tree>> lruHeight2MerkleTree; // NOTE: max size in bytes initted in constructor
+    static unsigned lruHeight2MerkleTreeSizeCalc(const Merkle::Tree &tree) {
+        return unsigned( tree.byteSize() + decltype(lruHeight2MerkleTree)::itemOverheadBytes() );
+    }
+
     struct LRUCacheStats {
         std::atomic_size_t num2HashHits = 0, num2HashMisses = 0,
-                           height2HashesHits = 0, height2HashesMisses = 0;
+                           height2HashesHits = 0, height2HashesMisses = 0,
+                           height2MerkleTreeHits = 0, height2MerkleTreeMisses = 0;
     } lruCacheStats;
 
+    /// Optional cache of txHash -> serialized tx bytes, so that blockchain.transaction.get (non-verbose) may be
+    /// answered without a bitcoind round-trip. Only non-null if rawtx_cache > 0. Cleared by undoLatestBlock.
+    std::unique_ptr<CostCache<TxHash, QByteArray>> rawTxCache;
+    static constexpr unsigned rawTxCacheSizeCalc(qsizetype rawTxLen) {
+        return unsigned( decltype(rawTxCache)::element_type::itemOverheadBytes()
+                         + 2u * Util::qByteArrayPvtDataSize() + HashLen+1 + size_t(rawTxLen)+1 );
+    }
+    std::atomic_size_t rawTxCacheHits = 0, rawTxCacheMisses = 0;
+
+    /// Optional cache of scripthash -> (query -> final query result), so that repeated get_history & listunspent
+    /// requests for the same popular scripthash are computed only once. Keyed on the scripthash alone so that all of
+    /// its results can be dropped in 1 go when its history changes. Only non-null if result_cache > 0.
+    using ResultCacheEntries = QVector<std::pair<QByteArray, QVariant>>; ///< subKey -> result, for 1 scripthash
+    std::unique_ptr<CostCache<HashX, ResultCacheEntries>> resultCache;
+    /// Serializes puts vs. invalidations, so that a result computed before an invalidation can never be put after it.
+    std::mutex resultCacheMut;
+    /// Per-scripthash generations, so that invalidating one scripthash does not throw away the results being computed
+    /// for all of the others. Striped on the scripthash's leading bytes (it is a hash already) to keep this bounded: a
+    /// collision merely costs a put. The generation of `sh` is resultCacheClears + resultCacheStripes[stripe(sh)].
+    /// Guarded by resultCacheMut.
+    static constexpr size_t resultCacheNStripes = 4096;
+    std::array<uint64_t, resultCacheNStripes> resultCacheStripes{};
+    uint64_t resultCacheClears = 0; ///< guarded by resultCacheMut
+    static size_t resultCacheStripe(const HashX &sh) {
+        if (sh.size() < 2) return 0;
+        return (size_t(uint8_t(sh[0])) | size_t(uint8_t(sh[1])) << 8) % resultCacheNStripes;
+    }
+    std::atomic_size_t resultCacheHits = 0, resultCacheMisses = 0;
+    /// Rough estimate of the heap memory held by a query result (nested lists and maps of strings and scalars).
+    static size_t approxVariantBytes(const QVariant &v) {
+        size_t ret = sizeof(QVariant);
+        switch (Compat::GetVarType(v)) {
+        case QMetaType::QVariantList:
+            for (const auto & item : v.toList()) ret += approxVariantBytes(item);
+            break;
+        case QMetaType::QVariantMap: {
+            const auto m = v.toMap();
+            for (auto it = m.cbegin(); it != m.cend(); ++it)
+                ret += 4u * sizeof(void *) + sizeof(QString) + size_t(it.key().size()) * 2u + approxVariantBytes(it.value());
+            break;
+        }
+        case QMetaType::QString:
+            ret += sizeof(QString) + size_t(v.toString().size()) * 2u;
+            break;
+        case QMetaType::QByteArray:
+            ret += Util::qByteArrayPvtDataSize() + size_t(v.toByteArray().size());
+            break;
+        default:
+            break;
+        }
+        return ret;
+    }
+    static unsigned resultCacheSizeCalc(const ResultCacheEntries &entries) {
+        size_t ret = decltype(resultCache)::element_type::itemOverheadBytes() + Util::qByteArrayPvtDataSize() + HashLen;
+        for (const auto & [subKey, result] : entries)
+            ret += Util::qByteArrayPvtDataSize() + size_t(subKey.size()) + approxVariantBytes(result);
+        return unsigned(std::min<size_t>(ret, std::numeric_limits<unsigned>::max()));
+    }
+
     /// this object is thread safe, but it needs to be initialized with headers before allowing client connections.
     std::unique_ptr<Merkle::Cache> merkleCache;
 
+    /// Bumped whenever the confirmed or mempool history of any scripthash changes. See Storage::stateGeneration().
+    std::atomic_uint64_t stateGeneration = 0;
+
     HeaderHash genesisHash; // written-to once by either loadHeaders code or addBlock for block 0. Guarded by headerVerifierLock.
 
     Mempool mempool; ///< app-wide mempool data -- does not get saved to db. Controller.cpp writes to this
@@ -1170,6 +2129,7 @@ struct Storage::Pvt
     Tic lastWarned; ///< to rate-limit potentially spammy warning messages (guarded by blocksLock)
 
     std::unique_ptr<CoTask> blocksWorker; ///< work to be done in parallel can be submitted to this co-task in addBlock and undoLatestBlock
+    std::unique_ptr<PrevoutFetcher> prevoutFetcher; ///< used by addBlock to resolve block inputs when the UTXO Cache is not active
 
     /// Info specific to the `rpa` index
     struct RpaInfo {
@@ -1177,11 +2137,98 @@ struct Storage::Pvt
         std::atomic_uint64_t nReads{0u}, nWrites{0u}, nDeletions{0u}; // keep track of number of times we read/write/delete from this db
         std::atomic_uint64_t nBytesWritten{0u}, nBytesRead{0u}; // keep track of number of bytes written and read during Storage object lifetime
         mutable std::atomic_int rpaNeedsFullCheckCachedVal = -1; // if > -1, the last value written to the DB. If < 0, no cached val, just read from DB when querying isRpaNeedsFullCheck()
+        /// The row format version of the DB, persisted as "rpa_version" in the meta db. Version 1 DBs (which predate
+        /// the key) only ever contain Legacy rows, so that older Fulcrum can still read them, and we keep writing
+        /// Legacy rows to them. Version 2 DBs may contain RowGroups rows, which older Fulcrum cannot read. A DB moves
+        /// from 1 to 2 only once every row has been converted, by a -C (--checkdb) run (see loadCheckRpaDB).
+        std::atomic_uint32_t dbVersion = kDBVersionCurrent;
+        static constexpr uint32_t kDBVersionLegacy = 1, kDBVersionRowGroups = 2, kDBVersionCurrent = kDBVersionRowGroups;
     } rpaInfo;
 
+    /// Small LRU cache of height -> rpa PrefixTable data as returned by Rpa::PrefixTable::uncompress(), for the most
+    /// recent blocks only (those within rpa.historyBlockLimit of the tip). Nearly every wallet scan covers these, so
+    /// this saves getRpaHistory the db read (and, for Legacy-format rows, re-inflating the whole blob) over and over.
+    /// Cleared whenever rpa rows are deleted (undo, clamp).
+    CostCache<BlockHeight, QByteArray> rpaTableCache{kRpaTableCacheBytes};
+    static constexpr unsigned kRpaTableCacheBytes = 64u * 1024u * 1024u;
+    static constexpr unsigned rpaTableCacheSizeCalc(qsizetype uncompressedLen) {
+        return unsigned( decltype(rpaTableCache)::itemOverheadBytes() + Util::qByteArrayPvtDataSize() + size_t(uncompressedLen)+1 );
+    }
+    std::atomic_size_t rpaTableCacheHits = 0, rpaTableCacheMisses = 0;
+
+    /// getRpaHistory splits its height range into up to this many chunks (one scanned by the calling thread, the rest
+    /// handed to scanHelpers), with at least kRpaScanMinBlocksPerThread heights each, so short scans stay on 1 thread.
+    static constexpr unsigned kRpaScanMaxThreads = 4, kRpaScanMinBlocksPerThread = 8;
+
+    /// calcUTXOSetStats & dumpAllScriptHashes split their full-table scans into up to this many ranges (see
+    /// OrderedParallelScan).
+    static constexpr unsigned kFullScanMaxThreads = 8;
+    static unsigned fullScanThreads() { return std::clamp(Util::getNPhysicalProcessors(), 1u, kFullScanMaxThreads); }
+
+    /// Shared by all of the above: the extra threads used by getRpaHistory and OrderedParallelScan, beyond the calling
+    /// thread, come from here. Sized from the core count, so concurrent requests can't multiply the thread count.
+    HelperPool scanHelpers{"Storage Scan Helper", fullScanThreads()};
+
     /// Set of recent block txids seen, only valid if "notify" is enabled and if app-wide zmq "hashtx" notifs are enabled.
     /// Guarded by `blocksLock`.
     std::unordered_set<TxHash, HashHasher> recentBlockTxHashes;
+
+    /// State for the --utxo-ram mode, where initial sync keeps the whole UTXO set in db.utxoCache. The non-atomic
+    /// members are guarded by `blocksLock`; the atomics are also read by stats().
+    struct UtxoRamInfo {
+        bool active = false; ///< true while initial sync is using the in-RAM UTXO set
+        /// True if the last addBlock completed and the only thing missing from the DB is the in-RAM UTXO set. If we
+        /// shut down cleanly in this state, we can flush it and clear the dirty flag.
+        bool onlyUtxosPending = false;
+        unsigned blocksSinceCheckpoint = 0;
+        std::atomic_bool fellBack{false}; ///< true if we exceeded the budget and fell back to bounded UTXOCache behavior
+        std::atomic_size_t budget{0}, memUsage{0}, checkpoints{0};
+    } utxoRam;
+
+    /// An immutable view of the confirmed state as of the end of the last addBlock or undoLatestBlock. The query paths
+    /// read the db through this rather than taking blocksLock, so that they never wait for a block to be applied.
+    struct ReadView {
+        using CSnapshot = const rocksdb::Snapshot;
+        std::shared_ptr<CSnapshot> shistSnapshot, shunspentSnapshot, utxosetSnapshot; ///< released when the last reader lets go
+        rocksdb::ReadOptions shistReadOpts; ///< copy of db.defReadOpts pointing to the above
+        rocksdb::ReadOptions utxosetReadOpts; ///< copy of db.defReadOpts pointing to the above
+        rocksdb::ReadOptions shunspentReadOpts; ///< copy of db.prefixScanReadOpts pointing to the above (it's only ever scanned)
+        TxNum txNumNext = 0; ///< all TxNums below this one are confirmed in this view
+        std::optional<BlockHeight> tipHeight; ///< chain tip as of this view, or nullopt if no blocks
+    };
+    using ReadViewPtr = std::shared_ptr<const ReadView>;
+    /// Only ever replaced with mempoolLock held exclusively, at the same time as the mempool is updated for a block.
+    /// Thus a reader that grabs this while holding mempoolLock in shared mode gets a view consistent with the mempool.
+    ReadViewPtr readView; ///< guarded by readViewMut
+    mutable std::mutex readViewMut; ///< only ever held long enough to copy or replace the `readView` pointer
+
+    ReadViewPtr currentReadView() const {
+        std::unique_lock g(readViewMut);
+        if (UNLIKELY(!readView)) throw InternalError("No read view has been published yet");
+        return readView;
+    }
+
+    /// Snapshots the confirmed state and makes it the current `readView`. Caller must hold blocksLock, blkInfoLock and
+    /// mempoolLock exclusively (or be in startup, before any queries can run).
+    void publishReadView() {
+        auto v = std::make_shared<ReadView>();
+        const auto Snap = [](rocksdb::DB *rdb) {
+            return std::shared_ptr<ReadView::CSnapshot>(rdb->GetSnapshot(), [rdb](ReadView::CSnapshot *ss){ rdb->ReleaseSnapshot(ss); });
+        };
+        v->shistSnapshot = Snap(db.shist.get());
+        v->shunspentSnapshot = Snap(db.shunspent.get());
+        v->utxosetSnapshot = Snap(db.utxoset.get());
+        v->shistReadOpts = db.defReadOpts;
+        v->shistReadOpts.snapshot = v->shistSnapshot.get();
+        v->shunspentReadOpts = db.prefixScanReadOpts;
+        v->shunspentReadOpts.snapshot = v->shunspentSnapshot.get();
+        v->utxosetReadOpts = db.defReadOpts;
+        v->utxosetReadOpts.snapshot = v->utxosetSnapshot.get();
+        v->txNumNext = txNumNext;
+        if (!blkInfos.empty()) v->tipHeight = BlockHeight(blkInfos.size() - 1u);
+        std::unique_lock g(readViewMut);
+        readView = std::move(v);
+    }
 };
 
 namespace {
@@ -1222,6 +2269,127 @@ namespace {
         const CompactTXO ctxo = extractCompactTXOFromShunspentKey(key); // throws if wrong size
         return {DeepCpy(key.data(), HashLen), ctxo}; // if we get here size ok, can extract HashX
     }
+
+    /// Given a utxoset bucket read from the db for the key mkUtxoSetKey(txo), returns the entry belonging to `txo`, if
+    /// any. Entries are disambiguated by looking up their TxNums in the txnum2txhash RecordFile. If
+    /// `trustSingleCandidate` is true, a bucket with exactly 1 entry is assumed to be the one we want without
+    /// consulting the RecordFile. This is only safe if the caller knows that `txo` must exist (as is the case for the
+    /// prevouts of a block's inputs).
+    std::optional<TXOInfo> resolveUtxoSetBucket(const TXO &txo, const rocksdb::Slice &bucket, const RecordFile &txNumsFile,
+                                                bool trustSingleCandidate) {
+        std::vector<std::pair<TxNum, Span<const char>>> entries;
+        if (UNLIKELY(!splitUtxoSetBucket(Span<const char>{bucket.data(), bucket.size()}, entries)))
+            throw DatabaseSerializationError(QString("Failed to parse the utxoset bucket for TXO %1").arg(txo.toString()));
+        if (entries.empty())
+            return std::nullopt; // all utxos in this bucket were spent, key not yet compacted away
+        if (entries.size() == 1u && trustSingleCandidate)
+            return deserializeUtxoSetEntry(entries.front().second);
+        std::vector<uint64_t> recNums;
+        recNums.reserve(entries.size());
+        for (const auto & e : entries)
+            recNums.push_back(e.first);
+        QString errStr;
+        const auto recs = txNumsFile.readRandomRecords(recNums, &errStr);
+        if (UNLIKELY(recs.size() != recNums.size()))
+            throw DatabaseError(QString("Failed to read the txids for the utxoset bucket for TXO %1: %2").arg(txo.toString(), errStr));
+        // Scan in reverse so that the most recently added entry wins. This emulates the "overwrite" semantics of the
+        // legacy schema for the 2 dupe pre-BIP34 coinbase txids on BTC mainnet.
+        for (size_t i = entries.size(); i-- > 0u; /**/)
+            if (recs[i] == txo.txHash)
+                return deserializeUtxoSetEntry(entries[i].second);
+        return std::nullopt;
+    }
+
+    /// Used by addBlock when the UTXO Cache is not active. Resolves the prevouts of all of a block's inputs that were
+    /// not created in the same block with a single key-sorted MultiGet on the utxoset db, issued from a CoTask thread.
+    /// This way the reads overlap with the rest of addBlock's work and the spend loop does no per-input point reads.
+    class PrevoutFetcher {
+        const std::unique_ptr<rocksdb::DB> & db;
+        const std::unique_ptr<RecordFile> & txNumsFile; ///< used to disambiguate utxoset buckets having more than 1 entry
+        rocksdb::ReadOptions readOpts;
+        CoTask task;
+
+        // persistent data structures we use in order to avoid having to continually re-reserve memory
+        struct Req { QByteArray key; unsigned inum; };
+        std::vector<Req> reqs;
+        std::vector<rocksdb::Slice> keys;
+        std::vector<rocksdb::PinnableSlice> values;
+        std::vector<rocksdb::Status> statuses;
+        std::vector<std::optional<TXOInfo>> results; ///< indexed by input number
+
+        void do_fetch(const PreProcessedBlock & ppb) {
+            const Tic t0;
+            Defer d([&]{
+                reqs.clear();
+                keys.clear();
+                values.clear();
+                statuses.clear();
+            });
+            const size_t nIns = ppb.inputs.size();
+            results.resize(nIns);
+            for (size_t inum = 1 /* coinbase, skip */; inum < nIns; ++inum) {
+                const auto & in = ppb.inputs[inum];
+                if (in.parentTxOutIdx.has_value()) continue; // spent in this block, skip
+                reqs.push_back({mkUtxoSetKey(TXO{in.prevoutHash, in.prevoutN}), unsigned(inum)});
+            }
+            if (reqs.empty()) return; // nothing to do!
+            // Sorted input saves rocksdb from having to sort the keys itself, and it can then visit each SST file in order.
+            std::sort(reqs.begin(), reqs.end(), [](const Req &a, const Req &b) {
+                return ToSlice(a.key).compare(ToSlice(b.key)) < 0;
+            });
+            keys.reserve(reqs.size());
+            for (const auto & r : reqs)
+                keys.push_back(ToSlice(r.key));
+            values.resize(keys.size());
+            statuses.resize(keys.size());
+            db->MultiGet(readOpts, db->DefaultColumnFamily(), keys.size(), keys.data(), values.data(), statuses.data(),
+                         true /* sorted_input */);
+            size_t num_ok = 0u;
+            for (size_t index = 0, nIndices = reqs.size(); index < nIndices; ++index) {
+                const auto & s = statuses[index];
+                const unsigned inum = reqs[index].inum;
+                const TXO txo{ppb.inputs[inum].prevoutHash, ppb.inputs[inum].prevoutN};
+                if (s.ok()) {
+                    // block inputs always spend existing coins, so a single-entry bucket is necessarily the one we want
+                    if ((results[inum] = resolveUtxoSetBucket(txo, values[index], *txNumsFile, true)))
+                        ++num_ok;
+                } else if (!s.IsNotFound()) {
+                    throw DatabaseError(QString("Error reading TXO \"%1\" from %2 db: %3")
+                                        .arg(txo.toString(), DBName(db.get()), StatusString(s)));
+                }
+            }
+            if (t0.msec<int>() >= 50)
+                DebugM("Fetched ", num_ok, "/", reqs.size(), " prevouts from DB in ", t0.msecStr(3), " msec");
+        }
+
+    public:
+        PrevoutFetcher(const std::unique_ptr<rocksdb::DB> & pdb, const std::unique_ptr<RecordFile> & ptxNumsFile,
+                       const rocksdb::ReadOptions & ropts)
+            : db(pdb), txNumsFile(ptxNumsFile), readOpts(ropts), task("Storage Prevout Fetcher")
+        {
+            // Allows MultiGet to read from several SST files concurrently. This requires rocksdb to have been built
+            // with coroutine support; if it wasn't (or it's too old to have the flag), the reads are merely batched.
+#if HAS_ROCKSDB_ASYNC_IO
+            readOpts.async_io = true;
+#endif
+        }
+
+        /// Start fetching the prevouts for ppb's inputs. The returned future must be waited on before calling take().
+        /// While the fetch is active, ppb->inputs must not be mutated and the utxoset db must not be written-to.
+        /// Precondition: the future from the previous call to this function must have been waited on.
+        [[nodiscard]] CoTask::Future fetch(const PreProcessedBlockPtr & ppb) {
+            results.clear(); // don't let stale results from a previous block leak through
+            return task.submitWork([this, ppb]{ do_fetch(*ppb); });
+        }
+
+        /// Returns the prevout for input number `inum`, or a null optional if it was not found. Each input may only be
+        /// taken once.
+        std::optional<TXOInfo> take(unsigned inum) {
+            std::optional<TXOInfo> ret;
+            if (inum < results.size()) ret.swap(results[inum]);
+            return ret;
+        }
+    };
 } // namespace
 
 class Storage::UTXOCache
@@ -1238,7 +2406,7 @@ class Storage::UTXOCache
         size_t operator()(const NodeList::const_iterator &it) const noexcept { return std::hash<TXO>{}(it->first); }
     };
     using ItSet = robin_hood::unordered_flat_set<NodeList::const_iterator, ItSetHasher>;
-    using RmVec = std::vector<TXO>;
+    using RmVec = std::vector<std::pair<TXO, TxNum>>; ///< TxNum is needed to build the utxoset "remove" merge operand
 
     NodeList ordering;
     Table utxos; //< points to Nodes in `ordering`
@@ -1370,8 +2538,8 @@ class Storage::UTXOCache
                     break; // abort loop early
                 // enqueue delete from utxoset db -- may throw.
                 static const QString errMsgPrefix("Failed to issue a batch delete for a utxo");
-                const auto & txo = rms[i];
-                GenericBatchDelete(batch, txo, errMsgPrefix); // may throw on failure
+                const auto & [txo, txNum] = rms[i];
+                GenericBatchMerge(batch, mkUtxoSetKey(txo), mkUtxoSetRemoveOperand(txNum), errMsgPrefix); // may throw on failure
                 rms.resize(i);
                 --rmsSize;
                 ++rmCt;
@@ -1392,7 +2560,7 @@ class Storage::UTXOCache
                             {
                                 static const QString errMsgPrefix("Failed to add a utxo to the utxo batch");
                                 const auto & [txo, info] = **it;
-                                GenericBatchPut(batch, txo, info, errMsgPrefix); // may throw on failure
+                                GenericBatchMerge(batch, mkUtxoSetKey(txo), mkUtxoSetAddOperand(info), errMsgPrefix); // may throw on failure
                             }
                             it = adds.erase(it);
                             --addsSize;
@@ -1411,7 +2579,7 @@ class Storage::UTXOCache
                         {
                             static const QString errMsgPrefix("Failed to add a utxo to the utxo batch");
                             const auto & [txo, info] = **it;
-                            GenericBatchPut(batch, txo, info, errMsgPrefix); // may throw on failure
+                            GenericBatchMerge(batch, mkUtxoSetKey(txo), mkUtxoSetAddOperand(info), errMsgPrefix); // may throw on failure
                         }
                         it = adds.erase(it);
                         --addsSize;
@@ -1608,7 +2776,7 @@ class Storage::UTXOCache
         // (this is not checked for performance.)
     }
 
-    bool rm(const TXO &txo) {
+    bool rm(const TXO &txo, TxNum txNum) {
         bool ret = false;
         bool wasInAdds = false;
         if (auto it = utxos.find(txo); it != utxos.end()) {
@@ -1623,7 +2791,7 @@ class Storage::UTXOCache
             ordering.erase(oit);
             ret = true;
         }
-        if (!wasInAdds) rms.push_back(txo);
+        if (!wasInAdds) rms.emplace_back(txo, txNum);
         return ret;
     }
 
@@ -1650,6 +2818,7 @@ class Storage::UTXOCache
     CoTask::Future prefetcherFut, flusherShunspentFut;
 
     const std::unique_ptr<rocksdb::DB> & db, & shunspentdb;
+    const std::unique_ptr<RecordFile> & txNumsFile; ///< used to disambiguate utxoset buckets having more than 1 entry
     const rocksdb::ReadOptions & readOpts;
     const rocksdb::WriteOptions & writeOpts;
 
@@ -1692,7 +2861,7 @@ class Storage::UTXOCache
                 else if (TXO t{in.prevoutHash, in.prevoutN}; !contains(t)) {
                     ++cacheMisses;
                     const TXO & txo = txos.emplace_back(std::move(t));
-                    const auto & ser = keyData.emplace_back(Serialize(txo));
+                    const auto & ser = keyData.emplace_back(mkUtxoSetKey(txo));
                     keys.emplace_back(ser.constData(), size_t(ser.size()));
                     values.emplace_back();
                     statuses.emplace_back();
@@ -1706,14 +2875,12 @@ class Storage::UTXOCache
                 const auto & s = statuses[index];
                 TXO & txo = txos[index];
                 if (s.ok()) {
-                    bool ok;
-                    TXOInfo info = Deserialize<TXOInfo>(FromSlice(values[index]), &ok);
-                    if (!ok) throw DatabaseSerializationError(QString("%1: Failed to deserialize TXOInfo for TXO \"%2\"")
-                                                              .arg(name, txo.toString()));
-                    else {
-                        add(false, std::move(txo), std::move(info));
-                        ++num_ok;
-                    }
+                    // block inputs always spend existing coins, so a single-entry bucket is necessarily the one we want
+                    auto optInfo = resolveUtxoSetBucket(txo, values[index], *txNumsFile, true);
+                    if (!optInfo) throw DatabaseError(QString("%1: TXO \"%2\" missing from its utxoset bucket in %3 db")
+                                                      .arg(name, txo.toString(), DBName(db.get())));
+                    add(false, std::move(txo), std::move(*optInfo));
+                    ++num_ok;
                 } else {
                     throw DatabaseError(QString("%1: Error reading TXO \"%2\" from %3 db: %4")
                                         .arg(name, txo.toString(), DBName(db.get()), StatusString(s)));
@@ -1724,10 +2891,10 @@ class Storage::UTXOCache
 
 public:
     UTXOCache(const QString &name, const std::unique_ptr<rocksdb::DB> & pdb,
-              const std::unique_ptr<rocksdb::DB> & pshunspentdb, const rocksdb::ReadOptions & readOpts,
-              const rocksdb::WriteOptions & writeOpts)
+              const std::unique_ptr<rocksdb::DB> & pshunspentdb, const std::unique_ptr<RecordFile> & ptxNumsFile,
+              const rocksdb::ReadOptions & readOpts, const rocksdb::WriteOptions & writeOpts)
         : name{name}, prefetcher{name + ".Prefetcher"}, flusherShunspent{name + ".ShunspentFlusher"},
-          db{pdb}, shunspentdb{pshunspentdb}, readOpts{readOpts}, writeOpts{writeOpts} {
+          db{pdb}, shunspentdb{pshunspentdb}, txNumsFile{ptxNumsFile}, readOpts{readOpts}, writeOpts{writeOpts} {
         DebugM(name, ": created");
     }
 
@@ -1810,7 +2977,7 @@ public:
         return true;
     }
 
-    bool remove(const TXO & txo) { return rm(txo); }
+    bool remove(const TXO & txo, TxNum txNum) { return rm(txo, txNum); }
 
     void putShunspent(const ShunspentKey &key, const ShunspentValue &val) { addShunspent(key, val); }
     bool removeShunspent(const HashX & hashX, const CompactTXO & ctxo) { return rmShunspent(mkShunspentKey(hashX, ctxo)); }
@@ -1828,8 +2995,12 @@ Storage::Storage(const std::shared_ptr<const Options> & options_)
       subsmgr(new ScriptHashSubsMgr(options, this)),
       dspsubsmgr(new DSProofSubsMgr(options, this)),
       txsubsmgr(new TransactionSubsMgr(options, this)),
-      p(std::make_unique<Pvt>(options->txHashCacheBytes))
+      p(std::make_unique<Pvt>(options->txHashCacheBytes, options->merkleCacheBytes))
 {
+    if (options->rawTxCacheBytes)
+        p->rawTxCache = std::make_unique<CostCache<TxHash, QByteArray>>(options->rawTxCacheBytes);
+    if (options->resultCacheBytes)
+        p->resultCache = std::make_unique<CostCache<HashX, Pvt::ResultCacheEntries>>(options->resultCacheBytes);
     setObjectName("Storage");
     _thread.setObjectName(objectName());
 }
@@ -1918,12 +3089,16 @@ void Storage::startup()
         txhash2txnumOpts = opts;
         txhash2txnumOpts.merge_operator = p->db.concatOperatorTxHash2TxNum = std::make_shared<ConcatOperator>();
 
+        utxosetOpts = opts;
+        utxosetOpts.merge_operator = p->db.utxoSetBucketOperator = std::make_shared<UtxoSetBucketOperator>(); // utxos are added & spent via merge operands
+        utxosetOpts.compaction_filter = &p->db.utxoSetEmptyBucketFilter; // drops keys whose utxos were all spent
+
 
         using DBInfoTup = std::tuple<QString, std::unique_ptr<rocksdb::DB> &, const rocksdb::Options &, double>;
         const std::list<DBInfoTup> dbs2open = {
             { "meta", p->db.meta, opts, 0.0005 },
             { "blkinfo" , p->db.blkinfo , opts, 0.02 },
-            { "utxoset", p->db.utxoset, opts, 0.25 },
+            { "utxoset", p->db.utxoset, utxosetOpts, 0.25 },
             { "scripthash_history", p->db.shist, shistOpts, 0.30 },
             { "scripthash_unspent", p->db.shunspent, opts, 0.25 },
             { "undo", p->db.undo, opts, 0.0395 },
@@ -1973,6 +3148,11 @@ void Storage::startup()
                 opt.has_value())
         {
             const Meta &m_db = *opt;
+            if (m_db.isMagicOk() && m_db.version > Meta::kCurrentVersion)
+                throw DatabaseFormatError(QString("This datadir is DB version v%1, which was written by a newer version of "
+                                                  APPNAME " (this version supports up to v%2). Please run a newer version of "
+                                                  APPNAME ", or delete the datadir and resynch.")
+                                          .arg(m_db.version).arg(Meta::kCurrentVersion));
             if (!m_db.isMagicOk() || !m_db.isVersionSupported()
                     || (m_db.isMinimumExtraPlatformInfoVersion() && m_db.platformBits != p->meta.platformBits)) {
                 throw DatabaseFormatError(errMsg1);
@@ -2001,6 +3181,8 @@ void Storage::startup()
     loadCheckTxNumsFileAndBlkInfo();
     // construct the TxHash2TxNum manager -- depends on the above function having constructed the txNumFile
     loadCheckTxHash2TxNumMgr();
+    // rewrite the utxoset to the compact format if the db is older than v4 -- depends on the txNumsFile being loaded
+    loadCheckUpgradeUTXOSetFormat();
     // count utxos -- note this depends on "blkInfos" being filled in so it much be called after loadCheckTxNumsFileAndBlkInfo()
     loadCheckUTXOsInDB();
     // very slow check, only runs if -C -C (specified twice)
@@ -2014,10 +3196,14 @@ void Storage::startup()
 
     // start up the co-task we use in addBlock and undoLatestBlock
     p->blocksWorker = std::make_unique<CoTask>("Storage Worker");
+    p->prevoutFetcher = std::make_unique<PrevoutFetcher>(p->db.utxoset, p->txNumsFile, p->db.defReadOpts);
 
     // Detect old DB version and see if upgrade is permitted, and maybe do a DB upgrade...
     checkUpgradeDBVersion();
 
+    // publish the initial view of the db for the query paths (getHistory, listUnspent, etc)
+    p->publishReadView();
+
     start(); // starts our thread
 }
 
@@ -2026,7 +3212,12 @@ void Storage::checkUpgradeDBVersion()
     // Note: A precondition for this function is that database, headers, etc are already loaded.
 
     // Original Fulcrum DB version before 1.9.0 was v1, then there was v2 which added CashToken data for BCH.
-    // Now we are on v3 as of 1.11.0+, whose only difference vs v2 is additional platform info saved to `Meta`.
+    // Then there was v3 as of 1.11.0+, whose only difference vs v2 is additional platform info saved to `Meta`.
+    // Then there was v4, which uses the compact utxoset schema. Older db's have their utxoset rewritten to the new
+    // schema by loadCheckUpgradeUTXOSetFormat() before we get here.
+    // Now we are on v5, which writes the columnar V4 undo records. Existing undo records keep their older format (they
+    // are still read), and they age out as new blocks arrive. Older versions of Fulcrum refuse to open a v5 db, since
+    // they cannot read V4 undo records, so this upgrade is one-way.
     //
     // Going from v1 on BTC/LTC -> v2+ is ok without caveats. For BCH, we must warn the user if their DB is v1
     // and it's after the upgrade9 activation time, because then the DB will be missing token data and may have
@@ -2065,6 +3256,9 @@ void Storage::checkUpgradeDBVersion()
         }
 
         Log() << "DB version is older but compatible, updating version to v" << Meta::kCurrentVersion << " ...";
+        if (!p->meta.isMinimumUndoV4Version())
+            Log() << "Note: after this upgrade, older versions of " APPNAME " (that only support up to DB v"
+                  << (Meta::kMinUndoV4Version - 1u) << ") can no longer open this datadir.";
         p->meta.version = Meta::kCurrentVersion;
     }
     // Set the platform info from the current process, and re-save to DB
@@ -2102,7 +3296,18 @@ void Storage::compactAllDBs()
 
 void Storage::gentlyCloseAllDBs()
 {
-    p->db.utxoCache.reset(); // if was valid, implicitly flushes UTXO Cache pending writes to DB...
+    {
+        // same locks as setInitialSync(), which is the other place that tears down the UTXO Cache / --utxo-ram mode
+        std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
+        p->db.utxoCache.reset(); // if was valid, implicitly flushes UTXO Cache pending writes to DB...
+        endUtxoRamMode_nolock();
+    }
+    saveBlkInfoSnapshot(); // so that the next startup needn't read every blkInfo from the db (no-op if db is dirty)
+    {
+        // release db snapshots now since they must not outlive the dbs
+        std::unique_lock g(p->readViewMut);
+        p->readView.reset();
+    }
 
     // do FlushWAL() and Close() to gently close the dbs
     for (auto & [db] : p->db.openDBs) {
@@ -2130,6 +3335,7 @@ void Storage::cleanup()
 {
     stop(); // joins our thread
     if (p->blocksWorker) p->blocksWorker.reset(); // stop the co-task
+    if (p->prevoutFetcher) p->prevoutFetcher.reset(); // stop its co-task
     if (txsubsmgr) txsubsmgr->cleanup();
     if (dspsubsmgr) dspsubsmgr->cleanup();
     if (subsmgr) subsmgr->cleanup();
@@ -2145,6 +3351,7 @@ auto Storage::stats() const -> Stats
     auto & c = p->db.concatOperator, & c2 = p->db.concatOperatorTxHash2TxNum;
     ret["merge calls"] = c ? c->merges.load() : QVariant();
     ret["merge calls (txhash2txnum)"] = c2 ? c2->merges.load() : QVariant();
+    ret["merge calls (utxoset)"] = p->db.utxoSetBucketOperator ? p->db.utxoSetBucketOperator->merges.load() : QVariant();
     QVariantMap caches;
     {
         QVariantMap m;
@@ -2168,6 +3375,58 @@ auto Storage::stats() const -> Stats
         m["~misses"] = qlonglong(p->lruCacheStats.height2HashesMisses);
         caches["LRU Cache: Block Height -> TxHashes"] = m;
     }
+    {
+        QVariantMap m;
+        const auto & c = p->lruHeight2MerkleTree;
+        m["Size bytes"] = qlonglong(c.totalCost());
+        m["max bytes"] = qlonglong(c.maxCost());
+        m["nBlocks"] = qlonglong(c.size());
+        m["~hits"] = qlonglong(p->lruCacheStats.height2MerkleTreeHits);
+        m["~misses"] = qlonglong(p->lruCacheStats.height2MerkleTreeMisses);
+        caches["LRU Cache: Block Height -> Merkle Tree"] = m;
+    }
+    if (const auto & hr = p->headersRam) {
+        QVariantMap m;
+        m["Size bytes"] = qlonglong(hr->memUsage());
+        m["nItems"] = qlonglong(hr->size());
+        caches["Headers (in RAM)"] = m;
+    }
+    if (const auto & rc = p->rawTxCache) {
+        QVariantMap m;
+        m["Size bytes"] = qlonglong(rc->totalCost());
+        m["max bytes"] = qlonglong(rc->maxCost());
+        m["nItems"] = qlonglong(rc->size());
+        m["~hits"] = qlonglong(p->rawTxCacheHits);
+        m["~misses"] = qlonglong(p->rawTxCacheMisses);
+        caches["LRU Cache: TxHash -> Raw Tx"] = m;
+    }
+    if (const auto & rc = p->resultCache) {
+        QVariantMap m;
+        m["Size bytes"] = qlonglong(rc->totalCost());
+        m["max bytes"] = qlonglong(rc->maxCost());
+        m["nScriptHashes"] = qlonglong(rc->size());
+        m["~hits"] = qlonglong(p->resultCacheHits);
+        m["~misses"] = qlonglong(p->resultCacheMisses);
+        caches["LRU Cache: ScriptHash -> Query Results"] = m;
+    }
+    {
+        QVariantMap m;
+        const auto & c = p->rpaTableCache;
+        m["Size bytes"] = qlonglong(c.totalCost());
+        m["max bytes"] = qlonglong(c.maxCost());
+        m["nBlocks"] = qlonglong(c.size());
+        m["~hits"] = qlonglong(p->rpaTableCacheHits);
+        m["~misses"] = qlonglong(p->rpaTableCacheMisses);
+        caches["LRU Cache: Block Height -> RPA PrefixTable"] = m;
+    }
+    if (const auto & r = p->utxoRam; r.budget) {
+        QVariantMap m;
+        m["budget bytes"] = qulonglong(r.budget);
+        m["mem usage bytes"] = qulonglong(r.memUsage);
+        m["checkpoints"] = qulonglong(r.checkpoints);
+        m["fell back to bounded cache"] = r.fellBack.load();
+        caches["In-RAM UTXO Set"] = m;
+    }
     {
         const size_t nHashes = p->merkleCache->size(), bytes = nHashes * (HashLen + sizeof(HeaderHash));
         caches["merkleHeaders_Size"] = qulonglong(nHashes);
@@ -2242,6 +3501,7 @@ auto Storage::stats() const -> Stats
             rm["nBytesRead"] = qulonglong(p->rpaInfo.nBytesRead.load(std::memory_order_relaxed));
             rm["nBytesWritten"] = qulonglong(p->rpaInfo.nBytesWritten.load(std::memory_order_relaxed));
             rm["needsFullCheck"] = p->rpaInfo.rpaNeedsFullCheckCachedVal.load(std::memory_order_relaxed);
+            rm["dbVersion"] = p->rpaInfo.dbVersion.load(std::memory_order_relaxed);
             ret["RPA Index Info"] = rm;
         }
     }
@@ -2397,10 +3657,14 @@ void Storage::appendHeader(const Header &h, BlockHeight height)
         throw DatabaseError(QString("Failed to append header %1: %2").arg(height).arg(err));
     else if (UNLIKELY(!res.has_value() || *res != height))
         throw DatabaseError(QString("Failed to append header %1: returned count is bad").arg(height));
+    if (p->headersRam)
+        p->headersRam->append(h);
 }
 
 void Storage::deleteHeadersPastHeight(BlockHeight height)
 {
+    if (p->headersRam)
+        p->headersRam->truncate(height + 1); // do this first so that lock-free readers stop seeing the deleted headers
     QString err;
     const auto res = p->headersFile->truncate(height + 1, &err);
     if (!err.isEmpty())
@@ -2421,6 +3685,11 @@ auto Storage::headerForHeight(BlockHeight height, QString *err) const -> std::op
 auto Storage::headerForHeight_nolock(BlockHeight height, QString *err) const -> std::optional<Header>
 {
     std::optional<Header> ret;
+    if (p->headersRam) {
+        ret = p->headersRam->get(height);
+        if (!ret && err) *err = QString("failed to read header %1: not found").arg(height);
+        return ret;
+    }
     try {
         QString err1;
         ret.emplace( p->headersFile->readRecord(height, &err1) );
@@ -2437,7 +3706,7 @@ auto Storage::headerForHeight_nolock(BlockHeight height, QString *err) const ->
 auto Storage::headersFromHeight_nolock_nocheck(BlockHeight height, unsigned num, QString *err) const -> std::vector<Header>
 {
     if (err) err->clear();
-    std::vector<Header> ret = p->headersFile->readRecords(height, num, err);
+    std::vector<Header> ret = p->headersRam ? p->headersRam->get(height, num) : p->headersFile->readRecords(height, num, err);
 
     if (ret.size() != num && err && err->isEmpty())
         *err = "short header count returned from headers file";
@@ -2464,6 +3733,8 @@ void Storage::loadCheckHeadersInDB()
 {
     assert(p->blockHeaderSize() > 0);
     p->headersFile = std::make_unique<RecordFile>(options->datadir + QDir::separator() + "headers", size_t(p->blockHeaderSize()), 0x00f026a1); // may throw
+    if (options->headersInRam)
+        p->headersRam = std::make_unique<HeadersRam>(size_t(p->blockHeaderSize()));
 
     Log() << "Verifying headers ...";
 
@@ -2489,7 +3760,7 @@ Log() << c.toString(false) << " isValid? " << c.isValid() << " compatible? " <<
         if (num) {
             Debug() << "Verifying " << num << " " << Util::Pluralize("header", num) << " ...";
             QString err;
-            hVec = headersFromHeight_nolock_nocheck(0, num, &err);
+            hVec = p->headersFile->readRecords(0, num, &err); // NB: not headersFromHeight_nolock_nocheck: headersRam is still empty
             if (!err.isEmpty() || hVec.size() != num)
                 throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(err.isEmpty() ? "Could not read all headers" : err));
 
@@ -2497,20 +3768,43 @@ Log() << c.toString(false) << " isValid? " << c.isValid() << " compatible? " <<
             // set genesis hash
             p->genesisHash = BTC::HashRev(hVec.front());
 
-            err.clear();
-            // read db
-            for (uint32_t i = 0; i < num; ++i) {
-                auto & bytes = hVec[i];
-                if (!verif(bytes, &err))
-                    throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(err));
-                bytes = BTC::Hash(bytes); // replace the header in the vector with its hash because it will be needed below...
+            if (p->headersRam)
+                for (const auto & bytes : hVec)
+                    p->headersRam->append(bytes);
+
+            // If we were shut down cleanly last time, there is a snapshot of the blkInfos which we may use if it agrees
+            // with the headers we just read. Since it also carries a hash of all of the headers as they were when we
+            // last verified them, we then skip verifying and hashing every header. (-C forces the slow path.)
+            auto snap = BlkInfoSnapshot::loadAndDelete(BlkInfoSnapshot::path(options->datadir));
+            const auto tipHash = BTC::Hash(hVec.back());
+            if (snap && !options->doSlowDbChecks && snap->matches(num, tipHash) && snap->matchesHeaders(hVec)) {
+                verif.reset(num, hVec.back());
+                // The hash of each header is in the hashPrevBlock field of the next header, so only the tip needs hashing
+                constexpr int kHashPrevBlockOffset = 4; // after nVersion
+                for (uint32_t i = 0; i + 1u < num; ++i)
+                    hVec[i] = hVec[i + 1u].mid(kHashPrevBlockOffset, HashLen);
+                hVec.back() = tipHash;
+                p->snapshotBlkInfos = std::move(snap->blkInfos);
+            } else {
+                if (snap)
+                    Warning() << "The blkInfo snapshot does not match the headers in the db (or -C was specified), ignoring it"
+                                 " and verifying all headers";
+                err.clear();
+                // read db
+                for (uint32_t i = 0; i < num; ++i) {
+                    auto & bytes = hVec[i];
+                    if (!verif(bytes, &err))
+                        throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(err));
+                    bytes = BTC::Hash(bytes); // replace the header in the vector with its hash because it will be needed below...
+                }
             }
         }
     }
     if (num) {
         const auto elapsed = Util::getTimeNS();
 
-        Debug() << "Read & verified " << num << " " << Util::Pluralize("header", num) << " from db in " << QString::number((elapsed-t0)/1e6, 'f', 3) << " msec";
+        Debug() << "Read" << (p->snapshotBlkInfos ? "" : " & verified") << " " << num << " " << Util::Pluralize("header", num)
+                << " from db in " << QString::number((elapsed-t0)/1e6, 'f', 3) << " msec";
     }
 
     if (!p->merkleCache->isInitialized() && !hVec.empty())
@@ -2518,6 +3812,25 @@ Log() << c.toString(false) << " isValid? " << c.isValid() << " compatible? " <<
 
 }
 
+void Storage::saveBlkInfoSnapshot()
+{
+    if (!p->headersFile || !p->db.meta || p->blkInfos.empty() || p->blkInfos.size() != p->headersFile->numRecords()
+            || isDirty())
+        return; // startup didn't complete, or the db is in an inconsistent state
+    try {
+        const Tic t0;
+        QString err;
+        const auto hdrs = headersFromHeight_nolock_nocheck(0, unsigned(p->blkInfos.size()), &err);
+        if (!err.isEmpty() || hdrs.size() != p->blkInfos.size())
+            throw InternalError(QString("Could not read all headers: %1").arg(err));
+        BlkInfoSnapshot::save(BlkInfoSnapshot::path(options->datadir), p->blkInfos, BTC::Hash(hdrs.back()),
+                              BlkInfoSnapshot::hashHeaders(hdrs));
+        Debug() << "Saved blkInfo snapshot (" << p->blkInfos.size() << " blocks) in " << t0.msecStr() << " msec";
+    } catch (const std::exception &e) {
+        Warning() << "Failed to save blkInfo snapshot: " << e.what();
+    }
+}
+
 void Storage::loadCheckTxNumsFileAndBlkInfo()
 {
     // may throw.
@@ -2525,7 +3838,17 @@ void Storage::loadCheckTxNumsFileAndBlkInfo()
     p->txNumNext = p->txNumsFile->numRecords();
     Debug() << "Read TxNumNext from file: " << p->txNumNext.load();
     TxNum ct = 0;
-    if (const int height = latestTip().first; height >= 0)
+    if (auto snap = std::exchange(p->snapshotBlkInfos, std::nullopt); snap && latestTip().first >= 0) {
+        // Fast path: we were given the blkInfos from the snapshot file. They must add up exactly like the db's would;
+        // if they don't, just ignore them and read from the db below.
+        if (BlkInfoSnapshot::isConsistent(*snap, size_t(latestTip().first) + 1u, p->txNumNext)) {
+            p->blkInfos = std::move(*snap);
+            ct = p->txNumNext;
+            Debug() << "Loaded " << p->blkInfos.size() << " blkInfos from snapshot";
+        } else
+            Warning() << "The blkInfo snapshot is inconsistent with the db, ignoring it";
+    }
+    if (const int height = latestTip().first; height >= 0 && p->blkInfos.empty())
     {
         p->blkInfos.reserve(std::min(size_t(height+1), MAX_HEADERS));
         Log() << "Checking tx counts ...";
@@ -2538,8 +3861,14 @@ void Storage::loadCheckTxNumsFileAndBlkInfo()
                                           .arg(i).arg(ct));
             ct += blkInfo.nTx;
             p->blkInfos.emplace_back(blkInfo);
-            p->blkInfosByTxNum[blkInfo.txNum0] = unsigned(p->blkInfos.size()-1);
         }
+    }
+    if (!p->blkInfos.empty()) {
+        p->blkTxNum0s.clear();
+        p->blkTxNum0s.reserve(p->blkInfos.capacity());
+        for (const auto & bi : p->blkInfos)
+            p->blkTxNum0s.push_back(bi.txNum0);
+        p->updateBlkTxNum0sIndex(true);
         Log() << ct << " total transactions";
     }
     if (ct != p->txNumNext) {
@@ -2595,6 +3924,67 @@ void Storage::loadCheckTxHash2TxNumMgr()
     }
 }
 
+// NOTE: this must be called *before* loadCheckUTXOsInDB(), since that function expects the compact format.
+void Storage::loadCheckUpgradeUTXOSetFormat()
+{
+    FatalAssert(!!p->db.utxoset, __func__, ": Utxo set db is not open");
+
+    // Note: We don't bump p->meta.version here; checkUpgradeDBVersion() does that at the end of startup(). Should we be
+    // interrupted before then, the next run simply resumes the upgrade (legacy keys are deleted atomically with the
+    // write of their replacements, and keys already in the compact format are skipped).
+    if (p->meta.isMinimumCompactUTXOSetVersion())
+        return;
+
+    Log() << "Upgrading the utxo set to the compact DB v" << Meta::kMinCompactUTXOSetVersion << " format (this may take some time) ...";
+    const Tic t0;
+    std::unique_ptr<rocksdb::Iterator> iter(p->db.utxoset->NewIterator(p->db.bulkScanReadOpts));
+    if (!iter) throw DatabaseError("Unable to obtain an iterator to the utxo set db");
+
+    static const QString errMsgPrefix("Failed to upgrade a utxo"),
+                         errMsgBatchWrite("Error issuing batch write to utxoset db for the utxo set upgrade");
+    constexpr size_t batchSize = 100'000;
+    rocksdb::WriteBatch batch;
+    size_t ctr = 0, batchCount = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+        const auto key = iter->key();
+        if (key.size() != TXO::minSize() && key.size() != TXO::maxSize())
+            continue; // already upgraded by a previous, interrupted run
+        bool ok1, ok2;
+        const auto txo = Deserialize<TXO>(FromSlice(key), &ok1);
+        const auto info = Deserialize<TXOInfo>(FromSlice(iter->value()), &ok2);
+        if (!ok1 || !ok2 || !info.isValid())
+            throw DatabaseSerializationError("Read an invalid utxo from the utxo set database while upgrading it."
+                                             " This may be due to a database format mismatch."
+                                             "\n\nDelete the datadir and resynch to bitcoind.\n");
+        GenericBatchMerge(batch, mkUtxoSetKey(txo), mkUtxoSetAddOperand(info), errMsgPrefix);
+        GenericBatchDelete(batch, key, errMsgPrefix);
+        if (++batchCount >= batchSize) {
+            GenericBatchWrite(p->db.utxoset.get(), batch, errMsgBatchWrite, p->db.defWriteOpts); // may throw
+            batch.Clear();
+            batchCount = 0;
+            if (app() && app()->signalsCaught())
+                throw UserInterrupted("User interrupted, aborting utxo set upgrade");
+        }
+        if (0 == ++ctr % 2'500'000)
+            Log() << "Upgraded " << ctr << " utxos ...";
+    }
+    if (!iter->status().ok())
+        throw DatabaseError(QString("Error iterating the utxo set db: %1").arg(StatusString(iter->status())));
+    if (batchCount)
+        GenericBatchWrite(p->db.utxoset.get(), batch, errMsgBatchWrite, p->db.defWriteOpts); // may throw
+    iter.reset();
+    Log() << "Upgraded " << ctr << Util::Pluralize(" utxo", ctr) << " in " << t0.secsStr() << " secs, compacting the utxo set ...";
+
+    // reclaim the space taken up by the now-deleted legacy keys
+    const Tic t1;
+    rocksdb::CompactRangeOptions opts;
+    opts.allow_write_stall = true;
+    if (auto s = p->db.utxoset->CompactRange(opts, nullptr, nullptr); !s.ok())
+        Warning() << "Failed to compact the utxo set db: " << StatusString(s);
+    else
+        Log() << "Compacted the utxo set in " << t1.secsStr() << " secs";
+}
+
 // NOTE: this must be called *after* loadCheckTxNumsFileAndBlkInfo(), because it needs a valid p->txNumNext
 void Storage::loadCheckUTXOsInDB()
 {
@@ -2639,71 +4029,87 @@ void Storage::loadCheckUTXOsInDB()
         {
             const qint64 currentHeight = latestTip().first;
 
-            std::unique_ptr<rocksdb::Iterator> iter(p->db.utxoset->NewIterator(p->db.defReadOpts));
+            std::unique_ptr<rocksdb::Iterator> iter(p->db.utxoset->NewIterator(p->db.bulkScanReadOpts));
             if (!iter) throw DatabaseError("Unable to obtain an iterator to the utxo set db");
             p->utxoCt = 0;
+            std::vector<std::pair<TxNum, Span<const char>>> entries;
             for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-                // TODO: the below checks may be too slow. See about removing them and just counting the iter.
-                const auto txo = Deserialize<TXO>(FromSlice(iter->key()));
-                if (!txo.isValid()) {
-                    throw DatabaseSerializationError("Read an invalid txo from the utxo set database."
+                const auto optN = extractIONumFromUtxoSetKey(iter->key());
+                entries.clear();
+                if (!optN || !splitUtxoSetBucket(Span<const char>{iter->value().data(), iter->value().size()}, entries)) {
+                    throw DatabaseSerializationError("Read an invalid entry from the utxo set database."
                                                      " This may be due to a database format mismatch."
                                                      "\n\nDelete the datadir and resynch to bitcoind.\n");
                 }
-                auto info = Deserialize<TXOInfo>(FromSlice(iter->value()));
-                if (!info.isValid())
-                    throw DatabaseSerializationError(QString("Txo %1 has invalid metadata in the db."
-                                                            " This may be due to a database format mismatch."
-                                                            "\n\nDelete the datadir and resynch to bitcoind.\n")
-                                                     .arg(txo.toString()));
-
-                // compensate for counts being off due to historical bugs in blockchain
-                // these outpoints actually generate 2 entries in shunspent and 1 entry here
-                // we must tolerate counts being off if we see this utxo.
-                if (auto it = fudgeDueToBitcoinBugs.find(txo);
-                        it != fudgeDueToBitcoinBugs.end() && it->second.second.count(info.confirmedHeight.value_or(0))) {
-                    if (seenExceptions.insert(txo).second)
-                        Debug() << "Seen exception: " << txo.toString();
-                }
-                // this is a deep test: only happens if -C / --checkdb is specified on CLI or in conf.
-                const CompactTXO ctxo = CompactTXO(info.txNum, txo.outN);
-                const QByteArray shuKey = mkShunspentKey(info.hashX, ctxo);
-                static const QString errPrefix("Error reading scripthash_unspent");
-                QByteArray tmpBa;
-                SHUnspentValue shval;
-                if (bool fail1 = false, fail2 = false, fail3 = false, fail4 = false, fail5 = false;
-                        (fail1 = (!info.confirmedHeight.has_value() || qint64(*info.confirmedHeight) > currentHeight))
-                        || (fail2 = info.txNum >= p->txNumNext)
-                        || (fail3 = (tmpBa = GenericDBGet<QByteArray>(p->db.shunspent.get(), shuKey, true, errPrefix, false, p->db.defReadOpts).value_or("")).isEmpty())
-                        || (fail4 = (!(shval = Deserialize<SHUnspentValue>(tmpBa)).valid || info.amount != shval.amount))
-                        || (fail5 = (info.tokenDataPtr != shval.tokenDataPtr))) {
-                    // TODO: reorg? Inconsisent db?  FIXME
-                    QString msg;
-                    {
-                        QTextStream ts(&msg);
-                        ts << "Inconsistent database: txo " << txo.toString();
-                        if (info.confirmedHeight) ts << " (height: " << *info.confirmedHeight << ")";
-                        else ts << " (missing height)";
-                        if (fail1) {
-                            ts << " has unexpected height; current height: " << currentHeight << ".";
-                        } else if (fail2) {
-                            ts << ". TxNum: " << info.txNum << " >= " << p->txNumNext << ".";
-                        } else if (fail3) {
-                            ts << ". Failed to find ctxo " << ctxo.toString() << " in the scripthash_unspent db.";
-                        } else if (fail4) {
-                            ts << ". Utxo amount does not match the ctxo amount in the scripthash_unspent db.";
-                        } else if (fail5) {
-                            ts << ". Token data does not match the ctxo token_data in the scripthash_unspent db.";
+                for (const auto & [bucketTxNum, entry] : entries) {
+                    // TODO: the below checks may be too slow. See about removing them and just counting the iter.
+                    // The key only contains a prefix of the txid, so we must reconstruct the full TXO via the TxNum.
+                    const TXO txo{hashForTxNum(bucketTxNum, false, nullptr, true).value_or(QByteArray()), *optN};
+                    if (!txo.isValid() || std::memcmp(txo.txHash.constData(), iter->key().data(), kUtxoSetTxHashPrefixLen) != 0) {
+                        throw DatabaseSerializationError(QString("Read a utxo from the utxo set database with TxNum %1 whose txid"
+                                                                 " does not match its key. This may be due to a database format"
+                                                                 " mismatch.\n\nDelete the datadir and resynch to bitcoind.\n")
+                                                         .arg(bucketTxNum));
+                    }
+                    const auto info = [&] {
+                        try {
+                            return deserializeUtxoSetEntry(entry);
+                        } catch (const DatabaseSerializationError &) {
+                            throw DatabaseSerializationError(QString("Txo %1 has invalid metadata in the db."
+                                                                    " This may be due to a database format mismatch."
+                                                                    "\n\nDelete the datadir and resynch to bitcoind.\n")
+                                                             .arg(txo.toString()));
                         }
-                        ts << "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n";
+                    }();
+
+                    // compensate for counts being off due to historical bugs in blockchain
+                    // these outpoints actually generate 2 entries in shunspent and 1 entry here
+                    // we must tolerate counts being off if we see this utxo.
+                    if (auto it = fudgeDueToBitcoinBugs.find(txo);
+                            it != fudgeDueToBitcoinBugs.end() && it->second.second.count(info.confirmedHeight.value_or(0))) {
+                        if (seenExceptions.insert(txo).second)
+                            Debug() << "Seen exception: " << txo.toString();
+                    }
+                    // this is a deep test: only happens if -C / --checkdb is specified on CLI or in conf.
+                    const CompactTXO ctxo = CompactTXO(info.txNum, txo.outN);
+                    const QByteArray shuKey = mkShunspentKey(info.hashX, ctxo);
+                    static const QString errPrefix("Error reading scripthash_unspent");
+                    QByteArray tmpBa;
+                    SHUnspentValue shval;
+                    if (bool fail1 = false, fail2 = false, fail3 = false, fail4 = false, fail5 = false;
+                            (fail1 = (!info.confirmedHeight.has_value() || qint64(*info.confirmedHeight) > currentHeight))
+                            || (fail2 = info.txNum >= p->txNumNext)
+                            || (fail3 = (tmpBa = GenericDBGet<QByteArray>(p->db.shunspent.get(), shuKey, true, errPrefix, false, p->db.defReadOpts).value_or("")).isEmpty())
+                            || (fail4 = (!(shval = Deserialize<SHUnspentValue>(tmpBa)).valid || info.amount != shval.amount))
+                            || (fail5 = (info.tokenDataPtr != shval.tokenDataPtr))) {
+                        // TODO: reorg? Inconsisent db?  FIXME
+                        QString msg;
+                        {
+                            QTextStream ts(&msg);
+                            ts << "Inconsistent database: txo " << txo.toString();
+                            if (info.confirmedHeight) ts << " (height: " << *info.confirmedHeight << ")";
+                            else ts << " (missing height)";
+                            if (fail1) {
+                                ts << " has unexpected height; current height: " << currentHeight << ".";
+                            } else if (fail2) {
+                                ts << ". TxNum: " << info.txNum << " >= " << p->txNumNext << ".";
+                            } else if (fail3) {
+                                ts << ". Failed to find ctxo " << ctxo.toString() << " in the scripthash_unspent db.";
+                            } else if (fail4) {
+                                ts << ". Utxo amount does not match the ctxo amount in the scripthash_unspent db.";
+                            } else if (fail5) {
+                                ts << ". Token data does not match the ctxo token_data in the scripthash_unspent db.";
+                            }
+                            ts << "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n";
+                        }
+                        throw DatabaseError(msg);
+                    }
+                    if (0 == ++p->utxoCt % 100'000) {
+                        *(0 == p->utxoCt % 2'500'000 ? std::make_unique<Log>() : std::make_unique<Debug>())
+                                << "CheckDB: Verified " << p->utxoCt << " utxos ...";
+                    } else if (0 == p->utxoCt % 1'000 && app() && app()->signalsCaught()) {
+                        throw UserInterrupted("User interrupted, aborting check");
                     }
-                    throw DatabaseError(msg);
-                }
-                if (0 == ++p->utxoCt % 100'000) {
-                    *(0 == p->utxoCt % 2'500'000 ? std::make_unique<Log>() : std::make_unique<Debug>())
-                            << "CheckDB: Verified " << p->utxoCt << " utxos ...";
-                } else if (0 == p->utxoCt % 1'000 && app() && app()->signalsCaught()) {
-                    throw UserInterrupted("User interrupted, aborting check");
                 }
             }
 
@@ -2739,7 +4145,7 @@ void Storage::loadCheckShunspentInDB()
 
     const Tic t0;
 
-    std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
+    std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.bulkScanReadOpts));
     if (!iter) throw DatabaseError("Unable to obtain an iterator to the scripthash unspent db");
 
     // Note: Before the BIP that imposed uniqueness on coinbase tx's,
@@ -2778,7 +4184,7 @@ void Storage::loadCheckShunspentInDB()
         const TxHash txHash = hashForTxNum(ctxo.txNum(), true, nullptr, true).value_or(QByteArray()); // throws if missing
         const TXO txo{txHash, ctxo.N()};
         // look for this in the UTXO db
-        const auto optInfo = GenericDBGet<TXOInfo>(p->db.utxoset.get(), ToSlice(Serialize(txo)), true, "", false, p->db.defReadOpts);
+        const auto optInfo = utxoGetFromDB(txo, false);
         if (!optInfo) {
             // we permit the buggy utxos above to be off -- those are due to collisions in historical blockchain
             if (!exceptionsDueToBitcoinBugs.count(txo))
@@ -2832,15 +4238,26 @@ void Storage::loadCheckRpaDB()
         Log() << "Loading RPA db ...";
     }
 
+    using RpaInfo = Pvt::RpaInfo;
+    const std::optional<uint32_t> savedVersion = readRpaDBVersion(); // missing for DBs written by older Fulcrum
+    // Legacy rows are only converted to the RowGroups format if the user asked for it explicitly with -C, since after
+    // that, older Fulcrum versions can no longer read this DB (they would discard and rebuild the RPA index).
+    const bool upgradeRows = doSlowChecks || savedVersion.value_or(RpaInfo::kDBVersionLegacy) >= RpaInfo::kDBVersionRowGroups;
+    bool didUpgradeAllRows = false;
+
     Tic t0;
     bool blowAwayWholeDB = false;
     std::optional<QString> excMessage;
     try {
+        if (savedVersion && *savedVersion > RpaInfo::kDBVersionCurrent)
+            throw DatabaseFormatError(QString("RPA db has version %1, which is newer than this version of %2 supports (%3)."
+                                              " It was likely written by a newer %2.")
+                                      .arg(*savedVersion).arg(APPNAME).arg(RpaInfo::kDBVersionCurrent));
         auto & firstHeight = p->rpaInfo.firstHeight, & lastHeight = p->rpaInfo.lastHeight;
         firstHeight = lastHeight = -1;
         int forceDeleteAfterHeight = -1; // if >=0, force a delete after this height
 
-        std::unique_ptr<rocksdb::Iterator> iter(p->db.rpa->NewIterator(p->db.defReadOpts));
+        std::unique_ptr<rocksdb::Iterator> iter(p->db.rpa->NewIterator(fullCheck ? p->db.bulkScanReadOpts : p->db.defReadOpts));
         if (!iter) throw DatabaseError("Unable to obtain an iterator to the rpa db");
         auto ThrowIfNegativeIfCastedToSigned = [](uint32_t height) {
               if (height > uint32_t(std::numeric_limits<int>::max()))
@@ -2868,6 +4285,11 @@ void Storage::loadCheckRpaDB()
                 ThrowIfNegativeIfCastedToSigned(rk.height);
                 TryDeserializePFTAndUpdateCounts(rk.height, iter->value()); // this may throw; if it does we will blow away the whole DB below and Controller will do a full resynch of RPA index
                 firstHeight = rk.height;
+                if (savedVersion.value_or(RpaInfo::kDBVersionLegacy) < RpaInfo::kDBVersionRowGroups)
+                    Log() << "RPA db is in the legacy format, which remains readable but is slower to search. New rows"
+                          << " will also be written in the legacy format. To convert the db, restart once with -C"
+                          << " (--checkdb); note that older " << APPNAME << " versions cannot read the converted db"
+                          << " and would rebuild the RPA index from scratch.";
                 iter->SeekToLast();
                 if (UNLIKELY( ! iter->Valid())) throw DatabaseError("Unable to seek to last entry in RPA db. This is unexpected.");
                 rk = RpaDBKey::fromBytes(FromSlice(iter->key()), &ok, true);
@@ -2879,8 +4301,15 @@ void Storage::loadCheckRpaDB()
                     throw DatabaseSerializationError(QString("The last record has height less than the first record in the RPA db: first = %1, last = %2").arg(firstHeight.load()).arg(lastHeight.load()));
             }
         } else {
-            // Slower -- iterate through entire table to find gaps as well as verify data by deserializing it row by row
-            size_t ctr = 0;
+            // Slower -- iterate through entire table to find gaps as well as verify data by deserializing it row by row.
+            // While we are at it, rewrite any Legacy-format rows in the current (RowGroups) format, if upgradeRows.
+            size_t ctr = 0, nUpgraded = 0;
+            rocksdb::WriteBatch upgradeBatch;
+            auto FlushUpgradeBatch = [&] {
+                if (!upgradeBatch.Count()) return;
+                GenericBatchWrite(p->db.rpa.get(), upgradeBatch, "Error writing upgraded RPA rows", p->db.defWriteOpts);
+                upgradeBatch.Clear();
+            };
             for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
                 const auto & k = iter->key();
                 if (k.size() == sizeof(uint32_t)) {
@@ -2897,6 +4326,15 @@ void Storage::loadCheckRpaDB()
                     }
                     lastHeight = rk.height;
                     ++ctr;
+                    if (const auto v = FromSlice(iter->value());
+                            upgradeRows && Rpa::PrefixTable::formatOf(v) == Rpa::PrefixTable::Format::Legacy) {
+                        const auto ser = Rpa::PrefixTable(v).serialize();
+                        GenericBatchPut(upgradeBatch, rk, ser, "Error writing upgraded RPA row");
+                        ++nUpgraded;
+                        ++p->rpaInfo.nWrites;
+                        p->rpaInfo.nBytesWritten += sizeof(uint32_t) + ser.size();
+                        if (upgradeBatch.Count() >= 1'000u) FlushUpgradeBatch();
+                    }
                     if (0u == ctr % 1'000u && app() && app()->signalsCaught())
                         throw UserInterrupted("User interrupted, aborting check");
                 } else {
@@ -2904,6 +4342,10 @@ void Storage::loadCheckRpaDB()
                                               .arg(sizeof(uint32_t)).arg(QString(FromSlice(k).toHex())));
                 }
             }
+            FlushUpgradeBatch();
+            // Rows past a gap (if any) are not converted, but they are about to be deleted below.
+            didUpgradeAllRows = upgradeRows;
+            if (nUpgraded) Log() << "Converted " << nUpgraded << " legacy-format RPA rows to the current format";
             Debug () << "RPA db has " << ctr << " entries, " << p->rpaInfo.nBytesRead << " bytes; deserialized ok";
         }
         if (lastHeight < firstHeight || ((lastHeight <= -1 || firstHeight <= -1) && lastHeight != firstHeight)) // defensive programming: enforce invariant here
@@ -2939,6 +4381,18 @@ void Storage::loadCheckRpaDB()
         p->rpaInfo.firstHeight = p->rpaInfo.lastHeight = -1;
     }
 
+    // Decide the format of the rows we write from now on. An empty DB starts out in the current format. A non-empty DB
+    // that predates the "rpa_version" key only has Legacy rows, and stays that way until converted.
+    uint32_t version = savedVersion.value_or(RpaInfo::kDBVersionLegacy);
+    if (blowAwayWholeDB || p->rpaInfo.firstHeight < 0 || didUpgradeAllRows)
+        version = RpaInfo::kDBVersionCurrent;
+    if (version != savedVersion) {
+        if (savedVersion && version > *savedVersion && !blowAwayWholeDB)
+            Log() << "RPA db upgraded to version " << version << "; older " << APPNAME << " versions can no longer read it";
+        setRpaDBVersion(version);
+    }
+    p->rpaInfo.dbVersion = version;
+
     // Lastly, if we were in check mode, flag the DB as clean now
     if (fullCheck) setRpaNeedsFullCheck(false);
 
@@ -2964,6 +4418,7 @@ bool Storage::deleteRpaEntriesFromHeight(const BlockHeight height, bool flush, b
     }
     // Update deletion count and firstHeight and lastHeight as necessary
     p->rpaInfo.nDeletions += 1; // we have no idea how many records were deleted, just increment by 1 since most common case is the undo case, where we delete 1.
+    p->rpaTableCache.clear();
     auto & firstHeight = p->rpaInfo.firstHeight, & lastHeight = p->rpaInfo.lastHeight;
     if (lastHeight > -1 && BlockHeight(lastHeight) >= height)
         lastHeight = height > 0u ? int(height - 1u) : -1;
@@ -2994,6 +4449,7 @@ bool Storage::deleteRpaEntriesToHeight(const BlockHeight height, bool flush, boo
     }
     // Update deletion count and firstHeight and lastHeight as necessary
     p->rpaInfo.nDeletions += 1; // we have no idea how many records were deleted, just increment by 1 since most common case is the undo case, where we delete 1.
+    p->rpaTableCache.clear();
     auto & firstHeight = p->rpaInfo.firstHeight, & lastHeight = p->rpaInfo.lastHeight;
     if (firstHeight > -1 && BlockHeight(firstHeight) <= height)
         firstHeight = int(height + 1u);
@@ -3030,7 +4486,7 @@ void Storage::loadCheckEarliestUndo()
     using UIntSet = std::set<uint32_t>;
     UIntSet swissCheeseDetector;
     {
-        std::unique_ptr<rocksdb::Iterator> iter(p->db.undo->NewIterator(p->db.defReadOpts));
+        std::unique_ptr<rocksdb::Iterator> iter(p->db.undo->NewIterator(p->db.bulkScanReadOpts));
         if (!iter) throw DatabaseError("Unable to obtain an iterator to the undo db");
         for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
             const auto keySlice = iter->key();
@@ -3086,9 +4542,9 @@ void Storage::loadCheckEarliestUndo()
     if (!swissCheeseDetector.empty()) {
         const uint32_t height = *swissCheeseDetector.rbegin();
         const QString errMsg(QString("Unable to read undo data for height %1").arg(height));
-        const UndoInfo undoInfo = GenericDBGetFailIfMissing<UndoInfo>(p->db.undo.get(), height, errMsg);
-        if (!undoInfo.isValid()) throw DatabaseFormatError(errMsg);
-        Debug() << "Latest undo verified ok: " << undoInfo.toDebugString();
+        const UndoRecord undoRec = GenericDBGetFailIfMissing<UndoRecord>(p->db.undo.get(), height, errMsg);
+        if (!undoRec.isValid()) throw DatabaseFormatError(errMsg);
+        Debug() << "Latest undo verified ok: " << undoRec.toDebugString();
     }
     if (ctr > configuredUndoDepth()) {
         // User lowered undo config -- now configured for less undo depth than before.  Simply respect user wishes
@@ -3142,7 +4598,35 @@ void Storage::setInitialSync(bool b) {
     std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
     assert(bool(p->db.utxoset) && bool(p->db.shunspent));
     if (b && !p->db.utxoCache) {
-        if (options->utxoCache > 0) {
+        if (options->utxoRam > 0) {
+            // enforce that the limit should be the lesser of max size_t and the amount of physical RAM available
+            uint64_t bytes = options->utxoRam;
+            const uint64_t limit = std::min<uint64_t>(Util::getAvailablePhysicalRAM(), std::numeric_limits<size_t>::max());
+            if (bytes > limit) {
+                Warning() << "utxo-ram: Requested in-RAM UTXO set budget of " << bytes << " bytes exceeds available"
+                          << " physical memory; will limit the budget to not exceed physical RAM.";
+                bytes = limit;
+            }
+            Log() << "utxo-ram: Enabled; the UTXO set will be kept in RAM (budget: " << bytes << " bytes, available"
+                  << " physical RAM: " << limit << " bytes) and written to the DB "
+                  << (options->utxoRamCheckpoint ? QString("every %1 blocks").arg(options->utxoRamCheckpoint)
+                                                 : QString("at the end of initial sync"));
+            p->db.utxoCache.reset(new UTXOCache("Storage In-RAM UTXO Set", p->db.utxoset, p->db.shunspent, p->txNumsFile,
+                                                p->db.defReadOpts, p->db.defWriteOpts));
+            p->db.utxoCache->autoReserve(bytes);
+            if (const int64_t n = p->utxoCt; n > 0)
+                // Not preloaded: the utxoset db only has truncated txids, so this would mean resolving every one of them
+                // via the txnum2txhash file, most of them for utxos that the rest of the sync never spends.
+                Log() << "utxo-ram: Resuming with " << n << " utxos already in the DB; these are not loaded into RAM, but"
+                      << " read from the DB (in the background, by the block prefetcher) as blocks spend them";
+            auto & r = p->utxoRam;
+            r.active = true;
+            r.onlyUtxosPending = false;
+            r.blocksSinceCheckpoint = 0;
+            r.fellBack = false;
+            r.budget = bytes;
+            r.memUsage = 0;
+        } else if (options->utxoCache > 0) {
             // enforce that the limit should be the lesser of max size_t and the amount of physical RAM available
             uint64_t bytes = options->utxoCache;
             const uint64_t limit = std::min<uint64_t>(Util::getAvailablePhysicalRAM(), std::numeric_limits<size_t>::max());
@@ -3152,7 +4636,8 @@ void Storage::setInitialSync(bool b) {
                 bytes = limit;
             }
             Log() << "utxo-cache: Enabled; UTXO cache size set to " << bytes << " bytes (available physical RAM: " << limit << " bytes)";
-            p->db.utxoCache.reset(new UTXOCache("Storage UTXO Cache", p->db.utxoset, p->db.shunspent, p->db.defReadOpts, p->db.defWriteOpts));
+            p->db.utxoCache.reset(new UTXOCache("Storage UTXO Cache", p->db.utxoset, p->db.shunspent, p->txNumsFile,
+                                                p->db.defReadOpts, p->db.defWriteOpts));
             // Reserve about 3.6 million entries per GB of utxoCache memory given to us
             // We need to do this, despite the extra memory bloat, because it turns out rehashing is very painful.
             p->db.utxoCache->autoReserve(bytes);
@@ -3162,7 +4647,49 @@ void Storage::setInitialSync(bool b) {
     } else if (!b && p->db.utxoCache) {
         Log() << "Initial sync ended, flushing and deleting UTXO Cache ...";
         p->db.utxoCache.reset(); // implicitly flushes
+        endUtxoRamMode_nolock();
+        p->publishReadView(); // the db now has everything the cache had
+    }
+}
+
+void Storage::endUtxoRamMode_nolock()
+{
+    auto & r = p->utxoRam;
+    if (!r.active) return;
+    // Precondition: db.utxoCache was just reset (and thus flushed to the DB).
+    if (r.onlyUtxosPending) {
+        setDirty(false); // the DB now has the complete UTXO set
+        Log() << "utxo-ram: Wrote in-RAM UTXO set to DB";
+    }
+    r.active = r.onlyUtxosPending = false;
+    r.memUsage = 0;
+}
+
+bool Storage::utxoRamMaintenance_nolock(BlockHeight height)
+{
+    auto & r = p->utxoRam;
+    auto & cache = *p->db.utxoCache;
+    const size_t budget = r.budget;
+    size_t memUsage = cache.memUsage();
+    if (memUsage > budget) {
+        if (!r.fellBack) {
+            r.fellBack = true;
+            Warning() << "utxo-ram: In-RAM UTXO set size (" << memUsage << " bytes) exceeds the budget of " << budget
+                      << " bytes at height " << height << ", falling back to a bounded UTXO cache";
+        }
+        cache.limitSize(static_cast<size_t>(budget * 0.75) /* chop down to 3/4 size */);
+        memUsage = cache.memUsage();
     }
+    r.memUsage = memUsage;
+    if (const unsigned interval = options->utxoRamCheckpoint; !interval || ++r.blocksSinceCheckpoint < interval)
+        return false;
+    const Tic t0;
+    cache.flush();
+    r.blocksSinceCheckpoint = 0;
+    ++r.checkpoints;
+    r.memUsage = cache.memUsage();
+    Log() << "utxo-ram: Checkpoint at height " << height << ", wrote in-RAM UTXO set to DB in " << t0.secsStr(1) << " secs";
+    return true;
 }
 
 void Storage::UTXOBatch::add(const TXO &txo, const TXOInfo &info, const CompactTXO &ctxo)
@@ -3170,9 +4697,9 @@ void Storage::UTXOBatch::add(const TXO &txo, const TXOInfo &info, const CompactT
     const QByteArray shukey = mkShunspentKey(info.hashX, ctxo),
                      shuval = Serialize(info.amount, info.tokenDataPtr.get());
     if (!p->cache) {
-        // Update db utxoset, keyed off txo -> txoinfo
+        // Update db utxoset, keyed off txo -> txoinfo (appends to the bucket for this txo's key)
         static const QString errMsgPrefix("Failed to add a utxo to the utxo batch");
-        GenericBatchPut(p->utxosetBatch, txo, info, errMsgPrefix); // may throw on failure
+        GenericBatchMerge(p->utxosetBatch, mkUtxoSetKey(txo), mkUtxoSetAddOperand(info), errMsgPrefix); // may throw on failure
 
         // Update the scripthash unspent. This is a very simple table which we scan by hashX prefix using
         // an iterator in listUnspent.  Each entry's key is prefixed with the HashX bytes (32) but suffixed with the
@@ -3192,16 +4719,16 @@ void Storage::UTXOBatch::add(const TXO &txo, const TXOInfo &info, const CompactT
 void Storage::UTXOBatch::remove(const TXO &txo, const HashX &hashX, const CompactTXO &ctxo)
 {
     if (!p->cache) {
-        // enqueue delete from utxoset db -- may throw.
+        // enqueue delete from utxoset db (removes the entry for ctxo.txNum() from this txo's bucket) -- may throw.
         static const QString errMsgPrefix("Failed to issue a batch delete for a utxo");
-        GenericBatchDelete(p->utxosetBatch, txo, errMsgPrefix);
+        GenericBatchMerge(p->utxosetBatch, mkUtxoSetKey(txo), mkUtxoSetRemoveOperand(ctxo.txNum()), errMsgPrefix);
 
         // enqueue delete from scripthash_unspent db
         static const QString errMsgPrefix2("Failed to issue a batch delete for a utxo to the scripthash_unspent db");
         GenericBatchDelete(p->shunspentBatch, mkShunspentKey(hashX, ctxo), errMsgPrefix2);
     } else {
         // use cache which may end up doing no actual work if the utxo & shunspent was in cache and not yet committed to db
-        p->cache->remove(txo);
+        p->cache->remove(txo, ctxo.txNum());
         p->cache->removeShunspent(hashX, ctxo);
     }
     ++p->rmCt;
@@ -3211,15 +4738,27 @@ void Storage::UTXOBatch::remove(const TXO &txo, const HashX &hashX, const Compac
 /// Thread-safe. Query db for a UTXO, and return it if found.  May throw on database error.
 std::optional<TXOInfo> Storage::utxoGetFromDB(const TXO &txo, bool throwIfMissing)
 {
-    assert(bool(p->db.utxoset));
+    return utxoGetFromDB_impl(txo, throwIfMissing, false);
+}
+
+std::optional<TXOInfo> Storage::utxoGetFromDB_impl(const TXO &txo, bool throwIfMissing, bool trustSingleCandidate)
+{
+    assert(bool(p->db.utxoset) && bool(p->txNumsFile));
     static const QString errMsgPrefix("Failed to read a utxo from the utxo db");
-    return GenericDBGet<TXOInfo>(p->db.utxoset.get(), txo, !throwIfMissing, errMsgPrefix, false, p->db.defReadOpts);
+    std::optional<TXOInfo> ret;
+    if (const auto optBucket = GenericDBGet<QByteArray>(p->db.utxoset.get(), mkUtxoSetKey(txo), true, errMsgPrefix, false,
+                                                        p->db.defReadOpts))
+        ret = resolveUtxoSetBucket(txo, ToSlice(*optBucket), *p->txNumsFile, trustSingleCandidate);
+    if (!ret && throwIfMissing)
+        throw DatabaseKeyNotFound(QString("%1: %2 not found").arg(errMsgPrefix, txo.toString()));
+    return ret;
 }
 
 int64_t Storage::utxoSetSize() const { return p->utxoCt; }
 double Storage::utxoSetSizeMB() const {
     // TODO: the below is inaccurate because it does not account for any bitcoin::token::OutputDataPtr that may be in TXOInfo
-    constexpr int64_t elemSize = TXOInfo::minSerSize() + TXO::minSize() /*<-- assumption is most utxos use 16-bit IONums */;
+    // Assumption is most utxos use 16-bit IONums, live alone in their bucket, and have ~3 byte heights & ~4 byte amounts.
+    constexpr int64_t elemSize = kUtxoSetTxHashPrefixLen + 2 + 1 + kUtxoSetEntryMinBodyLen + 2 + 3;
     return (utxoSetSize()*elemSize) / 1e6;
 }
 
@@ -3230,9 +4769,14 @@ std::optional<TXOInfo> Storage::utxoGet(const TXO &txo)
     std::optional<TXOInfo> ret;
     bool mempoolHit = false;
 
+    // take shared lock (ensure the txNumsFile that resolving a utxoset bucket reads doesn't get rewound from underneath
+    // our feet)
+    SharedLockGuard g(p->rewindLock);
     // take shared lock (ensure mempool doesn't mutate from underneath our feet)
-    // note that this lock is also taken by addBlock (so this is atomic w.r.t new blocks arriving).
     auto [mempool, lock] = this->mempool(); // shared (read only) lock is held until scope end
+    // The confirmed state we read from. addBlock only takes mempoolLock briefly at the end, when it also replaces the
+    // read view, so grabbing the view while we hold the mempool lock gets us a db state that agrees with the mempool.
+    const auto view = p->currentReadView();
 
     // first, check mempool
     if (auto txsIt = mempool.txs.find(txo.txHash); txsIt != mempool.txs.end()) {
@@ -3258,8 +4802,10 @@ std::optional<TXOInfo> Storage::utxoGet(const TXO &txo)
     }
     // next check DB if no mempool hit
     if (!mempoolHit) {
-        // it's ok to call this with the mempool lock held (Controller also does this)
-        ret = utxoGetFromDB(txo, false);
+        static const QString errMsgPrefix("Failed to read a utxo from the utxo db");
+        if (const auto optBucket = GenericDBGet<QByteArray>(p->db.utxoset.get(), mkUtxoSetKey(txo), true, errMsgPrefix,
+                                                            false, view->utxosetReadOpts))
+            ret = resolveUtxoSetBucket(txo, ToSlice(*optBucket), *p->txNumsFile, false);
         if (ret.has_value()) {
             // DB hit; but we need to check the mempool now to ensure TXO wasn't spent.
             if (auto hxTxIt = mempool.hashXTxs.find(ret->hashX); hxTxIt != mempool.hashXTxs.end()) {
@@ -3309,57 +4855,22 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
     }
 
     {
-        // take all locks now.. since this is a Big Deal. TODO: add more locks here?
-        std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
-
-        if (p->db.utxoCache && p->db.utxoCache->cacheMisses) {
-            p->db.utxoCache->prefetch(ppb); // will prefetch inputs in a thread
+        // Take the big locks now.. since this is a Big Deal. Note that blkInfoLock and mempoolLock are only taken at
+        // the end, when we publish the new block, so that the query paths aren't held up while we apply it.
+        std::scoped_lock guard(p->blocksLock, p->headerVerifierLock);
+
+        // NB: if valid, will auto-wait for us on scope end (even if we throw)
+        CoTask::Future prevoutsFut;
+        if (p->db.utxoCache) {
+            if (p->db.utxoCache->cacheMisses)
+                p->db.utxoCache->prefetch(ppb); // will prefetch inputs in a thread
+        } else if (ppb->inputs.size() > 1u) {
+            // resolve all inputs with 1 MultiGet in a thread; the utxoset db isn't written-to until issueUpdates() below
+            prevoutsFut = p->prevoutFetcher->fetch(ppb);
         }
 
         const auto blockTxNum0 = p->txNumNext.load();
 
-        p->recentBlockTxHashes.clear();
-        if (notify) {
-            // Txs in block can never be in mempool. Ensure they are gone from mempool right away so that notifications
-            // to clients are as accurate as possible (notifications may happen after this function returns).
-            const auto sz = ppb->txInfos.size();
-            const auto rsvsz = static_cast<Mempool::TxHashNumMap::size_type>(sz > 0 ? sz-1 : 0);
-            Mempool::TxHashNumMap txidMap(/* bucket_count: */ rsvsz);
-            notify->txidsAffected.reserve(rsvsz);
-            if (trackRecentBlockTxHashes) {
-                p->recentBlockTxHashes.reserve(sz);
-                if (sz > 0u) [[likely]]
-                    p->recentBlockTxHashes.insert(ppb->txInfos[0].hash); // add coinbase txhash to recent set
-            }
-            for (std::size_t i = 1 /* skip coinbase */; i < sz; ++i) {
-                const auto & txHash = ppb->txInfos[i].hash;
-                txidMap.emplace(txHash, blockTxNum0 + i);
-                notify->txidsAffected.insert(txHash); // add to notify set for txSubsMgr
-                if (trackRecentBlockTxHashes)
-                    // add to "recently seen" set for the hashtx zmq notifier spam suppressor
-                    p->recentBlockTxHashes.insert(txHash);
-            }
-            Mempool::ScriptHashesAffectedSet affected;
-            // Pre-reserve some capacity for the tmp affected set to avoid much rehashing.
-            // Use the heuristic 3 x numtxs capped at the SubsMgr::kRecommendedPendingNotificationsReserveSize (2048).
-            affected.reserve(std::min(txidMap.size()*3, SubsMgr::kRecommendedPendingNotificationsReserveSize));
-            auto res = p->mempool.confirmedInBlock(affected, txidMap, ppb->height,
-                                                   Trace::isEnabled(), 0.5f /* shrink to fit load_factor threshold */);
-            if (const auto diff = res.oldSize - res.newSize; (diff || res.elapsedMsec > 5.) && Debug::isEnabled()) {
-                Debug d;
-                d << "addBlock: removed " << diff << " txs from mempool involving "
-                  << affected.size() << " addresses";
-                if (res.dspRmCt || res.dspTxRmCt)
-                    d << " (also removed dsps: " << res.dspRmCt << ", dspTxs: " << res.dspTxRmCt << ")";
-                if (res.rpaRmCt)
-                    d << " (also removed rpa entries: " << res.rpaRmCt << ")";
-                d << " in " << QString::number(res.elapsedMsec, 'f', 3) << " msec";
-            }
-            notify->scriptHashesAffected.merge(std::move(affected));
-            notify->dspTxsAffected.merge(std::move(res.dspTxsAffected));
-            // ^^ notify->txidsAffected is updated in the above loop
-        }
-
         const auto verifUndo = p->headerVerifier; // keep a copy of verifier state for undo purposes in case this fails
         // This object ensures that if an exception is thrown while we are in the below code, we undo the header verifier
         // and return it to its previous state.  Note the defer'd functor is called with the above scoped_lock held.
@@ -3381,6 +4892,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             }
 
             setDirty(true); // <--  no turning back. if the app crashes unexpectedly while this is set, on next restart it will refuse to run and insist on a clean resynch.
+            p->utxoRam.onlyUtxosPending = false;
 
             {  // add txnum -> txhash association to the TxNumsFile...
                 auto batch = p->txNumsFile->beginBatchAppend(); // may throw if io error in c'tor here.
@@ -3462,6 +4974,8 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                         // we need the inputs resolved now, so end the prefetch
                         // note this may stall and also will empty out p->db.utxoCache->deferredAdds
                         p->db.utxoCache->waitForPrefetchToComplete();
+                    else if (prevoutsFut.future.valid())
+                        prevoutsFut.future.get(); // likewise, we need the prevouts fetched now (may stall or throw)
 
                     // add spends (process inputs)
                     unsigned inum = 0;
@@ -3474,7 +4988,8 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                             if constexpr (debugPrt)
                                 Debug() << "Skipping input " << txo.toString() << ", spent in this block (output # " << *in.parentTxOutIdx << ")";
                         } else if (std::optional<TXOInfo> opt;
-                                   (p->db.utxoCache && (opt = p->db.utxoCache->get(txo))) || (opt = utxoGetFromDB(txo))) {
+                                   (opt = p->db.utxoCache ? p->db.utxoCache->get(txo) : p->prevoutFetcher->take(inum))
+                                   || (opt = utxoGetFromDB_impl(txo, false, true /* prevouts of block inputs always exist */))) {
                             const auto & info = *opt;
                             if (info.confirmedHeight.has_value() && *info.confirmedHeight != ppb->height) {
                                 // was a prevout from a previos block.. so the ppb didn't have it in the 'involving hashx' set..
@@ -3555,27 +5070,19 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             }
 
 
+            // BlkInfo for this block; it is added to p->blkInfos at the end (see below)
+            const BlkInfo blkInfo(
+                blockTxNum0, // .txNum0
+                unsigned(ppb->txInfos.size())
+            );
             {
-                // update BlkInfo
-                if (nReserve) {
-                    if (const auto size = p->blkInfos.size(); size + 1 > p->blkInfos.capacity())
-                        p->blkInfos.reserve(size + nReserve); // reserve space for new blkinfos in 1 go to save on copying
-                }
-
-                const auto & blkInfo = p->blkInfos.emplace_back(
-                    blockTxNum0, // .txNum0
-                    unsigned(ppb->txInfos.size())
-                );
-
-                p->blkInfosByTxNum[blkInfo.txNum0] = unsigned(p->blkInfos.size()-1);
-
                 // save BlkInfo to db
                 static const QString blkInfoErrMsg("Error writing BlkInfo to db");
                 GenericDBPut(p->db.blkinfo.get(), uint32_t(ppb->height), blkInfo, blkInfoErrMsg, p->db.defWriteOpts);
 
                 if (undo) {
                     // save blkInfo to undo information, if in saveUndo mode
-                    undo->blkInfo = p->blkInfos.back();
+                    undo->blkInfo = blkInfo;
                 }
             }
 
@@ -3603,7 +5110,13 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                     QByteArray ba = Serialize(*undo);
                     Debug() << "Undo info 1 serSize: " << ba.length();
                     bool ok;
-                    auto undo2 = Deserialize<UndoInfo>(ba, &ok);
+                    auto undo2 = Deserialize<UndoRecord>(ba, &ok).toUndoInfo([&](const std::vector<TxNum> &txNums) {
+                        // this block's hashes are not yet in the txNumsFile, so take them from the ppb
+                        std::vector<TxHash> ret = p->txNumsFile->readRandomRecords(txNums, nullptr, true);
+                        for (size_t i = 0; i < txNums.size(); ++i)
+                            if (txNums[i] >= blockTxNum0) ret[i] = ppb->txInfos.at(txNums[i] - blockTxNum0).hash;
+                        return ret;
+                    });
                     ba.fill('z'); // ensure no shallow copies of buffer exist in deserialized object. if they do below tests will fail
                     FatalAssert(ok && undo2.isValid(), "Deser of undo info failed!");
                     Debug() << "Undo info 2: " << undo2.toDebugString();
@@ -3611,7 +5124,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                 } else {
                     const auto elapsedms = (Util::getTimeNS() - t0)/1e6;
                     const size_t nTx = undo->blkInfo.nTx, nSH = undo->scriptHashes.size();
-                    Debug() << "Saved V3 undo for block " << undo->height << ", "
+                    Debug() << "Saved V4 undo for block " << undo->height << ", "
                             << nTx << " " << Util::Pluralize("transaction", nTx)
                             << " involving " << nSH << " " << Util::Pluralize("scripthash", nSH)
                             << ", in " << QString::number(elapsedms, 'f', 2) << " msec.";
@@ -3640,16 +5153,102 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                 p->genesisHash = BTC::HashRev(rawHeader); // this variable is guarded by p->headerVerifierLock
             }
 
-            if (size_t limit; p->db.utxoCache && (limit = options->utxoCache) && p->db.utxoCache->memUsage() > limit)
+            // In --utxo-ram mode the DB lacks the in-RAM UTXO set until the next checkpoint, so we must stay dirty.
+            bool utxoSetInDB = true;
+            if (p->utxoRam.active)
+                utxoSetInDB = utxoRamMaintenance_nolock(ppb->height);
+            else if (size_t limit; p->db.utxoCache && (limit = options->utxoCache) && p->db.utxoCache->memUsage() > limit)
                 p->db.utxoCache->limitSize(static_cast<size_t>(limit * 0.75) /* chop down to 3/4 size */);
 
             saveUtxoCt();
-            setDirty(false);
+            if (utxoSetInDB)
+                setDirty(false);
+            else
+                p->utxoRam.onlyUtxosPending = true;
+
+            {
+                // Now briefly take the remaining locks to update the in-memory state that the query paths rely on, and
+                // to publish the new view of the db to them atomically with respect to the mempool.
+                std::scoped_lock guard2(p->blkInfoLock, p->mempoolLock);
+
+                // update BlkInfo
+                if (nReserve) {
+                    if (const auto size = p->blkInfos.size(); size + 1 > p->blkInfos.capacity()) {
+                        p->blkInfos.reserve(size + nReserve); // reserve space for new blkinfos in 1 go to save on copying
+                        p->blkTxNum0s.reserve(size + nReserve);
+                    }
+                }
+                p->blkInfos.push_back(blkInfo);
+                p->blkTxNum0s.push_back(blkInfo.txNum0);
+                p->updateBlkTxNum0sIndex();
+
+                p->recentBlockTxHashes.clear();
+                if (notify) {
+                    // Txs in block can never be in mempool. Ensure they are gone from mempool now, in the same critical
+                    // section that publishes the new read view, so that queries never see a tx in neither or both places.
+                    // This also keeps notifications to clients as accurate as possible (they happen after we return).
+                    const auto sz = ppb->txInfos.size();
+                    const auto rsvsz = static_cast<Mempool::TxHashNumMap::size_type>(sz > 0 ? sz-1 : 0);
+                    Mempool::TxHashNumMap txidMap(/* bucket_count: */ rsvsz);
+                    notify->txidsAffected.reserve(rsvsz);
+                    if (trackRecentBlockTxHashes) {
+                        p->recentBlockTxHashes.reserve(sz);
+                        if (sz > 0u) [[likely]]
+                            p->recentBlockTxHashes.insert(ppb->txInfos[0].hash); // add coinbase txhash to recent set
+                    }
+                    for (std::size_t i = 1 /* skip coinbase */; i < sz; ++i) {
+                        const auto & txHash = ppb->txInfos[i].hash;
+                        txidMap.emplace(txHash, blockTxNum0 + i);
+                        notify->txidsAffected.insert(txHash); // add to notify set for txSubsMgr
+                        if (trackRecentBlockTxHashes)
+                            // add to "recently seen" set for the hashtx zmq notifier spam suppressor
+                            p->recentBlockTxHashes.insert(txHash);
+                    }
+                    Mempool::ScriptHashesAffectedSet affected;
+                    // Pre-reserve some capacity for the tmp affected set to avoid much rehashing.
+                    // Use the heuristic 3 x numtxs capped at the SubsMgr::kRecommendedPendingNotificationsReserveSize (2048).
+                    affected.reserve(std::min(txidMap.size()*3, SubsMgr::kRecommendedPendingNotificationsReserveSize));
+                    auto res = p->mempool.confirmedInBlock(affected, txidMap, ppb->height,
+                                                           Trace::isEnabled(), 0.5f /* shrink to fit load_factor threshold */);
+                    if (const auto diff = res.oldSize - res.newSize; (diff || res.elapsedMsec > 5.) && Debug::isEnabled()) {
+                        Debug d;
+                        d << "addBlock: removed " << diff << " txs from mempool involving "
+                          << affected.size() << " addresses";
+                        if (res.dspRmCt || res.dspTxRmCt)
+                            d << " (also removed dsps: " << res.dspRmCt << ", dspTxs: " << res.dspTxRmCt << ")";
+                        if (res.rpaRmCt)
+                            d << " (also removed rpa entries: " << res.rpaRmCt << ")";
+                        d << " in " << QString::number(res.elapsedMsec, 'f', 3) << " msec";
+                    }
+                    notify->scriptHashesAffected.merge(std::move(affected));
+                    notify->dspTxsAffected.merge(std::move(res.dspTxsAffected));
+                    // ^^ notify->txidsAffected is updated in the above loop
+                }
+
+                p->publishReadView();
+                // Drop cached query results for everything this block touched (without a notify set, we don't know
+                // what that is, but we are not serving clients yet either, so just drop everything).
+                if (notify) resultCacheInvalidate(notify->scriptHashesAffected);
+                else resultCacheClear();
+            }
 
             undoVerifierOnScopeEnd.disable(); // indicate to the "Defer" object declared at the top of this function that it shouldn't undo anything anymore as we are happy now with the db state now.
         }
     } /// release locks
 
+    if (notify && !ppb->txInfos.empty()) {
+        // We are synched, so clients will shortly be asking for proofs for txs in this block. Precompute its merkle tree
+        // now, before notifying them. It's safe to do this with no locks held since only the caller of this function
+        // may undo this block.
+        Merkle::HashVec hashes;
+        hashes.reserve(ppb->txInfos.size());
+        for (const auto & txInfo : ppb->txInfos)
+            hashes.push_back(Util::reversedCopy(txInfo.hash)); // bitcoind memory order
+        auto tree = std::make_shared<const Merkle::Tree>(hashes);
+        const auto cost = p->lruHeight2MerkleTreeSizeCalc(*tree);
+        p->lruHeight2MerkleTree.insert(ppb->height, std::move(tree), cost);
+    }
+
     // now, do notifications with locks NOT held (we are being defensive: in the future we may modify below to take e.g. mempool lock)
     if (notify) {
         if (subsmgr && !notify->scriptHashesAffected.empty())
@@ -3667,7 +5266,13 @@ void Storage::addRpaDataForHeight_nolock(const BlockHeight height, const QByteAr
     Tic t0;
 
     static const QString rpaErrMsg("Error writing block RPA data to db");
-    GenericDBPut(p->db.rpa.get(), RpaDBKey(height), ser, rpaErrMsg, p->db.defWriteOpts);
+    QByteArray legacySer;
+    if (UNLIKELY(p->rpaInfo.dbVersion < Pvt::RpaInfo::kDBVersionRowGroups
+                 && Rpa::PrefixTable::formatOf(ser) != Rpa::PrefixTable::Format::Legacy))
+        // Not yet converted (see loadCheckRpaDB): keep this DB readable by older Fulcrum by writing the legacy format
+        legacySer = Rpa::PrefixTable(ser).serialize(Rpa::PrefixTable::Format::Legacy);
+    const QByteArray & toWrite = legacySer.isNull() ? ser : legacySer;
+    GenericDBPut(p->db.rpa.get(), RpaDBKey(height), toWrite, rpaErrMsg, p->db.defWriteOpts);
     // Update RpaInfo stats: latest height, etc.
     if (const int lh = p->rpaInfo.lastHeight; UNLIKELY(lh > -1 && lh != int(height) - 1)) {
         // This should never happen. Warn if this invariant is violated to detect bugs.
@@ -3685,10 +5290,10 @@ void Storage::addRpaDataForHeight_nolock(const BlockHeight height, const QByteAr
     p->rpaInfo.lastHeight = height;
     if (p->rpaInfo.firstHeight < 0) p->rpaInfo.firstHeight = height;
     ++p->rpaInfo.nWrites;
-    p->rpaInfo.nBytesWritten += sizeof(uint32_t) + ser.size();
+    p->rpaInfo.nBytesWritten += sizeof(uint32_t) + toWrite.size();
 
-    if (Debug::isEnabled() && (ser.size() >= 200'000 || t0.msec() >= 20))
-        Debug() << "Saved RPA height: " << height << ", size: " << ser.size() << ", elapsed: " << t0.msecStr() << " msec";
+    if (Debug::isEnabled() && (toWrite.size() >= 200'000 || t0.msec() >= 20))
+        Debug() << "Saved RPA height: " << height << ", size: " << toWrite.size() << ", elapsed: " << t0.msecStr() << " msec";
 }
 
 void Storage::addRpaDataForHeight(BlockHeight height, const QByteArray &serializedRpaPrefixTable)
@@ -3714,6 +5319,8 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
 
     {
         // take all locks now.. since this is a Big Deal. TODO: add more locks here?
+        // Note: we also take rewindLock since we truncate data that in-flight queries may be reading via the read view.
+        ExclusiveLockGuard rewindGuard(p->rewindLock);
         std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
 
         const auto t0 = Util::getTimeNS();
@@ -3722,6 +5329,7 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
         // We must do this because the way the UTXO Cache works is fundamentally at odds with assumption we have
         // while we undo.
         p->db.utxoCache.reset(); // if valid, delete causes implicit flush to DB
+        endUtxoRamMode_nolock();
 
         // NOTE: For very full mempools, this clear has the potential to stall the app after the reorg
         // completes since the app will have to re-download the whole mempool state again.
@@ -3759,10 +5367,10 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
             prevHeader = *opt;
         }
         const QString errMsg1 = QStringLiteral("Unable to retrieve undo info for %1").arg(tip);
-        auto undoOpt = GenericDBGet<UndoInfo>(p->db.undo.get(), uint32_t(tip), true, errMsg1, false, p->db.defReadOpts);
+        auto undoOpt = GenericDBGet<UndoRecord>(p->db.undo.get(), uint32_t(tip), true, errMsg1, false, p->db.defReadOpts);
         if (!undoOpt.has_value())
             throw UndoInfoMissing(errMsg1);
-        auto & undo = *undoOpt; // non-const because we swap out its scripthashes potentially below if notifySubs == true
+        const auto & undo = *undoOpt;
 
         // ensure undo info sanity
         if (!undo.isValid() || undo.height != unsigned(tip) || undo.hash != BTC::HashRev(header)
@@ -3780,7 +5388,8 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
 
             // undo the blkInfo from the back
             p->blkInfos.pop_back();
-            p->blkInfosByTxNum.erase(undo.blkInfo.txNum0);
+            p->blkTxNum0s.pop_back();
+            p->updateBlkTxNum0sIndex();
             GenericDBDelete(p->db.blkinfo.get(), uint32_t(undo.height), "Failed to delete blkInfo in undoLatestBlock");
             deleteRpaEntriesFromHeight(undo.height); // delete RPA >= undo.height (iff index is enabled)
 
@@ -3788,6 +5397,9 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
             p->lruNum2Hash.clear();
             // remove block from txHashes cache
             p->lruHeight2Hashes_BitcoindMemOrder.remove(undo.height);
+            p->lruHeight2MerkleTree.remove(undo.height);
+            // the undone block's txs may not come back (and the ones that do will be re-fed by the mempool synch)
+            if (p->rawTxCache) p->rawTxCache->clear();
 
             const auto txNum0 = undo.blkInfo.txNum0;
 
@@ -3797,7 +5409,8 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
             CoTask::Future fut = p->blocksWorker->submitWork([&]{ p->db.txhash2txnumMgr->truncateForUndo(txNum0);});
 
             // undo the scripthash histories
-            for (const auto & sh : undo.scriptHashes) {
+            auto scriptHashes = undo.scriptHashes(); // non-const because we swap it out below if notifySubs == true
+            for (const auto & sh : scriptHashes) {
                 const QString shHex = Util::ToHexFast(sh);
                 const auto vec = GenericDBGetFailIfMissing<TxNumVec>(p->db.shist.get(), sh, QStringLiteral("Undo failed because we failed to retrieve the scripthash history for %1").arg(shHex), false, p->db.defReadOpts);
                 TxNumVec newVec;
@@ -3831,17 +5444,31 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
                 // UTXO set update
                 UTXOBatch utxoBatch;
 
+                // V4 undo records are TxNum-based; their tx hashes are looked up here (the txNumsFile is not truncated
+                // until further below)
+                const UndoRecord::TxHashResolver resolveTxHashes = [this](const std::vector<TxNum> &txNums) {
+                    QString err;
+                    std::vector<TxHash> ret;
+                    if (!txNums.empty() && txNums.back() - txNums.front() + 1u == txNums.size())
+                        ret = p->txNumsFile->readRecords(txNums.front(), txNums.size(), &err); // contiguous: 1 read
+                    else
+                        ret = p->txNumsFile->readRandomRecords(txNums, &err);
+                    if (ret.size() != txNums.size())
+                        throw DatabaseError(QString("Undo failed because we failed to read tx hashes from the txNumsFile: %1").arg(err));
+                    return ret;
+                };
+
                 // now, undo the utxo deletions by re-adding them
-                for (const auto & [txo, info] : undo.delUndos) {
+                undo.forEachDelUndo(resolveTxHashes, [&utxoBatch](const TXO &txo, const TXOInfo &info) {
                     // note that deletions may have an info with a txnum before this block, for obvious reasons
                     utxoBatch.add(txo, info, CompactTXO(info.txNum, txo.outN)); // may throw
-                }
+                });
 
                 // now, undo the utxo additions by deleting them
-                for (const auto & [txo, hashx, ctxo] : undo.addUndos) {
+                undo.forEachAddUndo(resolveTxHashes, [&](const TXO &txo, const HashX &hashx, const CompactTXO &ctxo) {
                     assert(ctxo.txNum() >= txNum0); // all of the additions must have been in this block or newer
                     utxoBatch.remove(txo, hashx, ctxo); // may throw
-                }
+                });
 
                 issueUpdates(utxoBatch); // may throw, updates p->utxoCt and issues write to db.
             }
@@ -3872,13 +5499,16 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
             saveUtxoCt();
             setDirty(false); // phew. done.
 
-            nSH = undo.scriptHashes.size();
+            p->publishReadView(); // let the query paths see the rewound state
+            resultCacheClear(); // reorgs are rare and the mempool was cleared above; just drop all cached query results
+
+            nSH = scriptHashes.size();
 
             if (notify) {
                 if (notify->scriptHashesAffected.empty())
-                    notify->scriptHashesAffected.swap(undo.scriptHashes);
+                    notify->scriptHashesAffected.swap(scriptHashes);
                 else
-                    notify->scriptHashesAffected.merge(std::move(undo.scriptHashes));
+                    notify->scriptHashesAffected.merge(std::move(scriptHashes));
             }
         }
 
@@ -3939,6 +5569,19 @@ bool Storage::isRpaNeedsFullCheck() const
     return dbVal;
 }
 
+std::optional<uint32_t> Storage::readRpaDBVersion() const
+{
+    static const QString errPrefix("Error reading rpa_version from the meta db");
+    return GenericDBGet<uint32_t>(p->db.meta.get(), kRpaVersion, true, errPrefix, false, p->db.defReadOpts);
+}
+
+void Storage::setRpaDBVersion(const uint32_t version)
+{
+    static const QString errPrefix("Error saving rpa_version to the meta db");
+    GenericDBPut(p->db.meta.get(), kRpaVersion, version, errPrefix, p->db.defWriteOpts);
+    DebugM("Wrote rpa_version = ", version, " to db");
+}
+
 // public version of above, always latches to true
 void Storage::flagRpaIndexAsPotentiallyInconsistent()
 {
@@ -4011,14 +5654,45 @@ std::optional<unsigned> Storage::heightForTxNum(TxNum n) const
 }
 
 std::optional<unsigned> Storage::heightForTxNum_nolock(TxNum n) const
+{
+    const auto & v = p->blkTxNum0s;
+    int64_t idx = p->blkTxNum0sIndex.lastLessOrEqual(n); // O(logN) search of the indexed prefix of v
+    if (size_t(idx + 1) == p->blkTxNum0sIndex.size())
+        // n is at or past the last indexed block, so the block we want may be in the un-indexed (short) tail
+        idx = int64_t(std::upper_bound(v.begin() + (idx + 1), v.end(), n) - v.begin()) - 1;
+    return heightForTxNumCheck_nolock(n, idx);
+}
+
+std::optional<unsigned> Storage::heightForTxNumCheck_nolock(TxNum n, int64_t idx) const
 {
     std::optional<unsigned> ret;
-    auto it = p->blkInfosByTxNum.upper_bound(n);  // O(logN) search; find the block *AFTER* n, then go back one to find the block in range
-    if (it != p->blkInfosByTxNum.begin()) {
-        --it;
-        const auto & bi = p->blkInfos[it->second];
+    if (idx >= 0) {
+        const auto & bi = p->blkInfos[size_t(idx)];
         if (n >= bi.txNum0 && n < bi.txNum0+bi.nTx)
-            ret = it->second;
+            ret = unsigned(idx);
+    }
+    return ret;
+}
+
+std::vector<std::optional<unsigned>> Storage::heightsForTxNums(const std::vector<TxNum> &nums) const
+{
+    std::vector<std::optional<unsigned>> ret;
+    ret.reserve(nums.size());
+    SharedLockGuard g(p->blkInfoLock);
+    const auto & v = p->blkTxNum0s;
+    int64_t idx = -1;
+    TxNum prev = 0;
+    for (const auto n : nums) {
+        if (idx < 0 || n < prev) {
+            // first item, or input not sorted: do a full search
+            const auto opt = heightForTxNum_nolock(n);
+            idx = opt ? int64_t(*opt) : int64_t(std::upper_bound(v.begin(), v.end(), n) - v.begin()) - 1;
+        } else {
+            // sorted input: just move forward from where we were
+            idx = gallopLastLessOrEqual(v.data(), v.size(), idx, n);
+        }
+        prev = n;
+        ret.push_back(heightForTxNumCheck_nolock(n, idx));
     }
     return ret;
 }
@@ -4046,14 +5720,14 @@ std::vector<std::optional<TxHash>> Storage::hashesForHeightAndPosVec(BlockHeight
     SharedLockGuard maybeLockedByUs;
     if (existingBlocksLock == nullptr) {
         maybeLockedByUs = SharedLockGuard(p->blocksLock);
-    } else if (UNLIKELY(existingBlocksLock->mutex() != &p->blocksLock)) {
-        Error() << "Internal Error: expected the `existingBlocksLock` to be holding `p->blocksLock` (but it is not) in "
-                << __func__ << ". FIXME!";
+    } else if (UNLIKELY(existingBlocksLock->mutex() != &p->blocksLock && existingBlocksLock->mutex() != &p->rewindLock)) {
+        Error() << "Internal Error: expected the `existingBlocksLock` to be holding `p->blocksLock` or `p->rewindLock`"
+                << " (but it is not) in " << __func__ << ". FIXME!";
         return ret;
     }
 
-    // At this point p->blocksLock is held for the rest of the function (either by caller or by us).
-    // We need to hold p->blocksLock here to get a consistent view (so that data doesn't mutate from beneath us).
+    // At this point p->blocksLock or p->rewindLock is held for the rest of the function (either by caller or by us).
+    // We need to hold one of them here to get a consistent view (so that data doesn't get truncated from beneath us).
 
     {
         SharedLockGuard g(p->blkInfoLock);
@@ -4076,10 +5750,15 @@ std::vector<std::optional<TxHash>> Storage::hashesForHeightAndPosVec(BlockHeight
 
 // NOTE: the returned vector has hashes in bitcoind memory order (little endian -- unlike every other function in this file!)
 std::vector<TxHash> Storage::txHashesForBlockInBitcoindMemoryOrder(BlockHeight height) const
+{
+    SharedLockGuard g(p->rewindLock); // guarantee a consistent view (so that data doesn't mutate from underneath us)
+    return txHashesForBlockInBitcoindMemoryOrder_nolock(height);
+}
+
+std::vector<TxHash> Storage::txHashesForBlockInBitcoindMemoryOrder_nolock(BlockHeight height) const
 {
     std::vector<TxHash> ret;
     std::pair<TxNum, size_t> startCount{0,0};
-    SharedLockGuard(p->blocksLock); // guarantee a consistent view (so that data doesn't mutate from underneath us)
     {
         // check cache
         auto opt = p->lruHeight2Hashes_BitcoindMemOrder.object(height);
@@ -4123,6 +5802,124 @@ std::vector<TxHash> Storage::txHashesForBlockInBitcoindMemoryOrder(BlockHeight h
     return ret;
 }
 
+std::shared_ptr<const Merkle::Tree> Storage::merkleTreeForBlock(BlockHeight height) const
+{
+    std::shared_ptr<const Merkle::Tree> ret;
+    SharedLockGuard g(p->rewindLock); // so that the block can't be undone while we compute its tree
+    if (auto opt = p->lruHeight2MerkleTree.object(height)) {
+        ++p->lruCacheStats.height2MerkleTreeHits;
+        return std::move(*opt);
+    }
+    ++p->lruCacheStats.height2MerkleTreeMisses;
+    const auto hashes = txHashesForBlockInBitcoindMemoryOrder_nolock(height);
+    if (hashes.empty())
+        return ret;
+    try {
+        ret = std::make_shared<const Merkle::Tree>(hashes);
+    } catch (const std::exception &e) {
+        Warning() << "Failed to build merkle tree for height " << height << ": " << e.what();
+        return ret;
+    }
+    p->lruHeight2MerkleTree.insert(height, ret, p->lruHeight2MerkleTreeSizeCalc(*ret));
+    return ret;
+}
+
+bool Storage::isRawTxCacheEnabled() const { return bool(p->rawTxCache); }
+
+void Storage::rawTxCachePut(const TxHash &txHash, const QByteArray &rawTx)
+{
+    if (!p->rawTxCache || txHash.size() != HashLen || rawTx.isEmpty()) return;
+    p->rawTxCache->insert(txHash, rawTx, p->rawTxCacheSizeCalc(rawTx.size())); // replaces any existing entry
+}
+
+std::optional<QByteArray> Storage::rawTxCacheGet(const TxHash &txHash) const
+{
+    std::optional<QByteArray> ret;
+    if (!p->rawTxCache) return ret;
+    ret = p->rawTxCache->object(txHash);
+    ++(ret ? p->rawTxCacheHits : p->rawTxCacheMisses);
+    return ret;
+}
+
+void Storage::rawTxCacheRemove(const Mempool::TxHashSet &txHashes)
+{
+    if (!p->rawTxCache) return;
+    for (const auto & hash : txHashes)
+        p->rawTxCache->remove(hash);
+}
+
+bool Storage::isResultCacheEnabled() const { return bool(p->resultCache); }
+
+uint64_t Storage::resultCacheGeneration(const HashX &sh) const
+{
+    std::unique_lock g(p->resultCacheMut);
+    return p->resultCacheClears + p->resultCacheStripes[p->resultCacheStripe(sh)];
+}
+
+uint64_t Storage::stateGeneration() const { return p->stateGeneration.load(); }
+
+std::optional<QVariant> Storage::resultCacheGet(const HashX &sh, const QByteArray &subKey) const
+{
+    std::optional<QVariant> ret;
+    if (!p->resultCache) return ret;
+    if (const auto entries = p->resultCache->object(sh)) {
+        for (const auto & [k, result] : *entries) {
+            if (k == subKey) {
+                ret = result;
+                break;
+            }
+        }
+    }
+    ++(ret ? p->resultCacheHits : p->resultCacheMisses);
+    return ret;
+}
+
+void Storage::resultCachePut(const HashX &sh, const QByteArray &subKey, const QVariant &result, const uint64_t generation)
+{
+    if (!p->resultCache) return;
+    std::unique_lock g(p->resultCacheMut);
+    if (generation != p->resultCacheClears + p->resultCacheStripes[p->resultCacheStripe(sh)])
+        return; // `sh` was invalidated while `result` was being computed
+    auto entries = p->resultCache->object(sh).value_or(Pvt::ResultCacheEntries{});
+    auto it = std::find_if(entries.begin(), entries.end(), [&subKey](const auto &e){ return e.first == subKey; });
+    if (it != entries.end()) it->second = result;
+    else entries.emplace_back(subKey, result);
+    const auto cost = p->resultCacheSizeCalc(entries);
+    p->resultCache->insert(sh, std::move(entries), cost); // replaces any existing entry
+}
+
+QVariant Storage::resultCacheGetOrCompute(const HashX &sh, const QByteArray &subKey,
+                                          const std::function<QVariant()> &compute)
+{
+    if (auto opt = resultCacheGet(sh, subKey))
+        return std::move(*opt);
+    const auto generation = resultCacheGeneration(sh); // must be read before computing, see resultCachePut
+    QVariant ret = compute(); // may throw
+    resultCachePut(sh, subKey, ret, generation);
+    return ret;
+}
+
+void Storage::resultCacheInvalidate(const Mempool::ScriptHashesAffectedSet &scriptHashes)
+{
+    if (scriptHashes.empty()) return;
+    ++p->stateGeneration;
+    if (!p->resultCache) return;
+    std::unique_lock g(p->resultCacheMut);
+    for (const auto & sh : scriptHashes) {
+        ++p->resultCacheStripes[p->resultCacheStripe(sh)];
+        p->resultCache->remove(sh);
+    }
+}
+
+void Storage::resultCacheClear()
+{
+    ++p->stateGeneration;
+    if (!p->resultCache) return;
+    std::unique_lock g(p->resultCacheMut);
+    ++p->resultCacheClears;
+    p->resultCache->clear();
+}
+
 /// Returns a lambda that can be called to increment the counter. If the counter exceeds maxHistory, lambda will throw.
 /// Used below in getHistory(), listUnspent(), getBalance()
 static auto GetMaxHistoryCtrFunc(const QString &name, const QString &itemName, size_t maxHistory)
@@ -4145,23 +5942,38 @@ Log() << "Storage::getHistory ";
     auto IncrementCtrAndThrowIfExceedsMaxHistory = GetMaxHistoryCtrFunc("History", QString("scripthash %1").arg(QString(hashX.toHex())),
                                                                         options->maxHistory);
     try {
-        SharedLockGuard g(p->blocksLock);  // makes sure history doesn't mutate from underneath our feet
+        SharedLockGuard g(p->rewindLock);  // makes sure history doesn't get rewound from underneath our feet
+        Pvt::ReadViewPtr view; // the confirmed state we read from; consistent with the mempool state we see below
+        History unconfItems;
+        {
+            auto [mempool, lock] = this->mempool();
+            view = p->currentReadView();
+            if (unconf) {
+Log() << "Storage::getHistory - unconf ";
+                if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
+                    const auto & txvec = it->second;
+                    IncrementCtrAndThrowIfExceedsMaxHistory(txvec.size());
+                    unconfItems.reserve(txvec.size());
+                    for (const auto & tx : txvec)
+                        unconfItems.emplace_back(/* HistoryItem: */ tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, tx->fee);
+                }
+            }
+        } // release mempool lock
         if (conf) {
 Log() << "Storage::getHistory - conf ";
             static const QString err("Error retrieving history for a script hash");
-            auto nums_opt = GenericDBGet<TxNumVec>(p->db.shist.get(), hashX, true, err, false, p->db.defReadOpts);
+            auto nums_opt = GenericDBGet<TxNumVec>(p->db.shist.get(), hashX, true, err, false, view->shistReadOpts);
             if (nums_opt.has_value()) {
                 const auto & nums = *nums_opt;
                 IncrementCtrAndThrowIfExceedsMaxHistory(nums.size());
-                ret.reserve(nums.size());
-                // TODO: The below could use some optimization.  A batched version of both hashForTxNum and
-                // heightForTxNum are low-hanging fruit for optimization.  Each call to the below takes a shared lock
-                // then releases it, for each item.  I imagine batched versions would have significantly less overhead
-                // per item, which could add up to huge performance savings on large histories.  This is a very
-                // low hanging fruit for optimization -- thus I am leaving this comment here so I can remember to come
-                // back and optmize the below.  /TODO
-                for (auto num : nums) {
-                    const BlockHeight height = heightForTxNum(num).value(); // may throw, same deal
+                ret.reserve(nums.size() + unconfItems.size());
+                // TODO: The below could use some optimization.  A batched version of hashForTxNum is low-hanging
+                // fruit for optimization.  Each call to the below takes a shared lock then releases it, for each item.
+                // Heights, however, are looked up all at once in 1 merge pass, since the nums are sorted.
+                const auto heights = heightsForTxNums(nums);
+                for (size_t i = 0; i < nums.size(); ++i) {
+                    const auto num = nums[i];
+                    const BlockHeight height = heights[i].value(); // may throw, same deal
 
                     // Assumption for this loop: the nums are in order!
                     if (optToHeight && height >= *optToHeight) break; // threshold of "to height" reached
@@ -4172,17 +5984,7 @@ Log() << "Storage::getHistory - conf ";
                 }
             }
         }
-        if (unconf) {
-Log() << "Storage::getHistory - unconf ";
-            auto [mempool, lock] = this->mempool();
-            if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
-                const auto & txvec = it->second;
-                IncrementCtrAndThrowIfExceedsMaxHistory(txvec.size());
-                ret.reserve(ret.size() + txvec.size());
-                for (const auto & tx : txvec)
-                    ret.emplace_back(/* HistoryItem: */ tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, tx->fee);
-            }
-        }
+        ret.insert(ret.end(), std::make_move_iterator(unconfItems.begin()), std::make_move_iterator(unconfItems.end()));
     } catch (const std::exception &e) {
         Warning(Log::Magenta) << __func__ << ": " << e.what();
     }
@@ -4198,7 +6000,7 @@ auto Storage::getRpaHistory(const Rpa::Prefix &prefix, bool includeConfirmed, bo
     double tReadDb = 0., tPfxSearch = 0., tResolveTxIdx = 0., tWaitForLock = 0., tBuildRes = 0.;
 
     Tic t0;
-    SharedLockGuard g(p->blocksLock);  // makes sure history doesn't mutate from underneath our feet
+    SharedLockGuard g(p->rewindLock);  // makes sure history doesn't get rewound from underneath our feet
     tWaitForLock += t0.msec<double>();
 
     const int rpaStartHeight = getConfiguredRpaStartHeight();
@@ -4209,7 +6011,9 @@ auto Storage::getRpaHistory(const Rpa::Prefix &prefix, bool includeConfirmed, bo
         throw InternalError("RPA is disabled");
     }
 
-    const auto tipHeight = latestHeight();
+    // Use the tip of the published read view rather than latestHeight() so that we never look past the last
+    // fully-applied block (rows for a block being added may not all be in the db yet).
+    const auto tipHeight = p->currentReadView()->tipHeight;
     if (UNLIKELY( ! tipHeight)) throw InternalError("No blockchain");
     if (unsigned(rpaStartHeight) > *tipHeight) {
         // Nothing to do! Index not yet enabled! Warn here since likely the admin has misconfigured his server.
@@ -4227,53 +6031,113 @@ auto Storage::getRpaHistory(const Rpa::Prefix &prefix, bool includeConfirmed, bo
             fromHeight = std::max<unsigned>(rpaStartHeight, fromHeight); // restrict `from` to be >= configured height
             endHeight = std::min(endHeight.value_or(*tipHeight + 1u), *tipHeight + 1u); // define and restrict `end` to be <= tip height + 1
 
-            // We use an iterator and seek forward each time because this is far faster since our table rows are in order
-            // of height (serialized as big endian). Note that the assumption here is that the rpa table contains
-            // *only* records of the form: Key = 4-byte big endian height, Value = serialized Rpa::PrefixTable.
-            // If this assumption changes, update this code to not use this assumption as an optimization.
-            std::unique_ptr<rocksdb::Iterator> iter{p->db.rpa->NewIterator(p->db.defReadOpts)};
-            if (UNLIKELY(!iter)) throw DatabaseError("Unable to obtain an iterator to the rpa db");
+            const size_t blockLimit = std::max(options->rpa.historyBlockLimit, 1u); // use configured limit (default: 60)
+            const BlockHeight scanEnd = std::max<BlockHeight>(fromHeight, std::min<uint64_t>(*endHeight, fromHeight + blockLimit));
+            const bool needSort = prefix.range().size() > 1u; // if prefix spans multiple rows of table, sort and uniqueify
+
+            // Split [fromHeight, scanEnd) into contiguous chunks, each scanned by its own thread (the first one by this
+            // thread). Inflating and searching the tables is the expensive part, and it is independent per height.
+            struct Chunk {
+                BlockHeight begin{}, end{};
+                std::vector<std::pair<BlockHeight, Rpa::VecTxIdx>> matches; ///< in height order, non-empty only
+                std::optional<BlockHeight> missingHeight; ///< set if a row was missing; scanning stopped there
+                double tReadDb = 0., tPfxSearch = 0.;
+            };
+            const unsigned nBlocks = scanEnd - fromHeight;
+            const unsigned nChunks = std::clamp(nBlocks / p->kRpaScanMinBlocksPerThread, 1u, p->kRpaScanMaxThreads);
+            std::vector<Chunk> chunks(nChunks);
+            for (unsigned i = 0, h = fromHeight; i < nChunks; ++i) {
+                chunks[i].begin = h;
+                h += nBlocks / nChunks + unsigned(i < nBlocks % nChunks);
+                chunks[i].end = h;
+            }
 
-            BlockHeight height = fromHeight;
-            size_t blockScansRemaining = std::max(options->rpa.historyBlockLimit, 1u); // use configured limit (default: 60)
-            for ( /* */; blockScansRemaining && height < *endHeight; ++height, --blockScansRemaining) {
-                Tic t1;
-                const RpaDBKey dbKey(height);
-                if (height == fromHeight)
-                    iter->Seek(ToSlice(dbKey));
-                else
-                    iter->Next(); // bump iterator one item... this is the secret sauce to make this fast.
-                bool ok{};
-                if (UNLIKELY(!iter->Valid() || RpaDBKey::fromBytes(FromSlice(iter->key()), &ok, true) != dbKey || !ok)) {
-                    // This should never happen -- error to console just in case we have bugs and/or missing data.
-                    Error() << "Missing RPA PrefixTable for height: " << height << ". This should never happen."
-                            << " Report this to situation to the developers.";
-                    break;
+            auto scanChunk = [&](Chunk &c) {
+                // We use an iterator and step forward each time because this is far faster since our table rows are in
+                // order of height (serialized as big endian). Note that the assumption here is that the rpa table
+                // contains *only* records of the form: Key = 4-byte big endian height, Value = serialized
+                // Rpa::PrefixTable. If this assumption changes, update this code to not use this assumption as an
+                // optimization. Heights served from the cache leave the iterator where it was, so we re-seek after those.
+                std::unique_ptr<rocksdb::Iterator> iter;
+                std::optional<BlockHeight> iterHeight;
+                for (BlockHeight height = c.begin; height < c.end; ++height) {
+                    Tic t1;
+                    QByteArray uncompressed;
+                    if (auto opt = p->rpaTableCache.object(height)) {
+                        ++p->rpaTableCacheHits;
+                        uncompressed = std::move(*opt);
+                    } else {
+                        ++p->rpaTableCacheMisses;
+                        const RpaDBKey dbKey(height);
+                        if (!iter) {
+                            iter.reset(p->db.rpa->NewIterator(p->db.prefixScanReadOpts));
+                            if (UNLIKELY(!iter)) throw DatabaseError("Unable to obtain an iterator to the rpa db");
+                        }
+                        if (iterHeight && *iterHeight + 1u == height)
+                            iter->Next(); // bump iterator one item... this is the secret sauce to make this fast.
+                        else
+                            iter->Seek(ToSlice(dbKey));
+                        iterHeight = height;
+                        bool ok{};
+                        if (UNLIKELY(!iter->Valid() || RpaDBKey::fromBytes(FromSlice(iter->key()), &ok, true) != dbKey || !ok)) {
+                            // This should never happen -- error to console just in case we have bugs and/or missing data.
+                            Error() << "Missing RPA PrefixTable for height: " << height << ". This should never happen."
+                                    << " Report this to situation to the developers.";
+                            c.missingHeight = height;
+                            break;
+                        }
+                        const auto valueSlice = iter->value(); // NB: slice is invalidated when iter is modified
+                        uncompressed = Rpa::PrefixTable::uncompress(FromSlice(valueSlice)); // Throws on failure to decompress.
+                        // Update RpaInfo stats
+                        p->rpaInfo.nReads.fetch_add(1, std::memory_order_relaxed);
+                        p->rpaInfo.nBytesRead.fetch_add(sizeof(uint32_t) + valueSlice.size(), std::memory_order_relaxed);
+                        if (height + blockLimit > *tipHeight) // only cache the "hot" recent blocks that most scans cover
+                            p->rpaTableCache.insert(height, uncompressed, p->rpaTableCacheSizeCalc(uncompressed.size()));
+                    }
+                    // Note: This read-only Rpa::PrefixTable is "lazy loaded" and populated only for records we access
+                    // on-demand. It shares `uncompressed` (and thus possibly the cached buffer) without copying it.
+                    const auto prefixTable = Rpa::PrefixTable::fromUncompressed(uncompressed); // Throws on bad data.
+                    c.tReadDb += t1.msec<double>();
+
+                    t1 = Tic();
+                    auto txIdxVec = prefixTable.searchPrefix(prefix, needSort);
+                    c.tPfxSearch += t1.msec<double>();
+                    if (!txIdxVec.empty()) c.matches.emplace_back(height, std::move(txIdxVec));
                 }
-                // Note: This read-only Rpa::PrefixTable is "lazy loaded" and populated only for records we access on-demand
-                const auto valueSlice = iter->value(); // NB: slice is invalidated when iter is modified
-                const auto prefixTable = Deserialize<Rpa::PrefixTable>(FromSlice(valueSlice)); // Throws on failure to deserialize.
-                tReadDb += t1.msec<double>();
-                // Update RpaInfo stats
-                p->rpaInfo.nReads.fetch_add(1, std::memory_order_relaxed);
-                p->rpaInfo.nBytesRead.fetch_add(sizeof(uint32_t) + valueSlice.size(), std::memory_order_relaxed);
-
-                t1 = Tic();
-                const bool needSort = prefix.range().size() > 1u; // if prefix spans multiple rows of table, sort and uniqueify
-                auto txIdxVec = prefixTable.searchPrefix(prefix, needSort);
-                tPfxSearch += t1.msec<double>();
-                if (txIdxVec.empty()) continue; // no match for this prefix at this height, keep going
-
-                IncrementCtrAndThrowIfExceedsMaxHistory(txIdxVec.size());
+            };
+            {
+                // The other chunks go to the shared scan helpers; any that no helper has started by the time we get to
+                // them are scanned by this thread. The Defer makes sure none are still running if we leave via throw.
+                std::vector<HelperPool::JobPtr> jobs;
+                Defer waitJobs([&jobs]{ for (auto & job : jobs) job->cancelOrWait(); });
+                jobs.reserve(nChunks - 1u);
+                for (unsigned i = 1; i < nChunks; ++i)
+                    jobs.push_back(p->scanHelpers.submit([&scanChunk, &c = chunks[i]]{ scanChunk(c); }));
+                scanChunk(chunks[0]);
+                for (auto & job : jobs) job->runHereOrWait(); // rethrows if the helper threw
+            }
 
-                t1 = Tic();
-                const auto vecOfOptHashes = hashesForHeightAndPosVec(height, txIdxVec, &g /* <-- tell callee not to re-lock blocksLock */);
-                tResolveTxIdx += t1.msec<double>();
-                t1 = Tic();
-                for (const auto & optHash : vecOfOptHashes) {
-                    if (LIKELY(optHash)) ret.emplace_back(*optHash, int(height));
+            // Merge, in height order, stopping at the first missing height (if any)
+            BlockHeight height = scanEnd;
+            for (const auto & c : chunks) {
+                tReadDb += c.tReadDb;
+                tPfxSearch += c.tPfxSearch;
+                for (const auto & [h, txIdxVec] : c.matches) {
+                    IncrementCtrAndThrowIfExceedsMaxHistory(txIdxVec.size());
+
+                    Tic t1;
+                    const auto vecOfOptHashes = hashesForHeightAndPosVec(h, txIdxVec, &g /* <-- tell callee not to take blocksLock */);
+                    tResolveTxIdx += t1.msec<double>();
+                    t1 = Tic();
+                    for (const auto & optHash : vecOfOptHashes) {
+                        if (LIKELY(optHash)) ret.emplace_back(*optHash, int(h));
+                    }
+                    tBuildRes += t1.msec<double>();
+                }
+                if (c.missingHeight) {
+                    height = *c.missingHeight;
+                    break;
                 }
-                tBuildRes += t1.msec<double>();
             }
 
             // Special behavior: disable mempool append if we didn't reach past tipHeight
@@ -4360,12 +6224,14 @@ auto Storage::listUnspent(const HashX & hashX, const TokenFilterOption tokenFilt
         mempoolConfirmedSpends.reserve(iota);
         ret.reserve(iota);
         {
-            // take shared lock (ensure history doesn't mutate from underneath our feet)
-            SharedLockGuard g(p->blocksLock);
-            const TxNum veryHighTxNum = getTxNum() + 100000000;  // pick an absurdly high TxNum that is 100 million past current. This is a fudge so sorting works ok for unconfirmed tx's so that they appear at the end.
+            // take shared lock (ensure history doesn't get rewound from underneath our feet)
+            SharedLockGuard g(p->rewindLock);
+            Pvt::ReadViewPtr view; // the confirmed state we read from; consistent with the mempool state we see below
             {
                 // grab mempool utxos for scripthash -- we do mempool first so as to build the "mempoolConfirmedSpends" set as we iterate.
                 auto [mempool, lock] = this->mempool(); // shared lock
+                view = p->currentReadView();
+                const TxNum veryHighTxNum = view->txNumNext + 100000000;  // pick an absurdly high TxNum that is 100 million past current. This is a fudge so sorting works ok for unconfirmed tx's so that they appear at the end.
                 if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
                     const auto & txvec = it->second;
                     for (const auto & tx : txvec) {
@@ -4412,7 +6278,12 @@ auto Storage::listUnspent(const HashX & hashX, const TokenFilterOption tokenFilt
                 }
             } // release mempool lock
             { // begin confirmed/db search
-                std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
+                // Bound the scan to this scripthash's keys, so that rocksdb never reads (or reads ahead) past them
+                const QByteArray upperBound = PrefixScanUpperBound(hashX);
+                const rocksdb::Slice upperBoundSlice = ToSlice(upperBound);
+                auto readOpts = view->shunspentReadOpts;
+                if (!upperBound.isEmpty()) readOpts.iterate_upper_bound = &upperBoundSlice;
+                std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(readOpts));
                 if (UNLIKELY(!iter)) throw DatabaseError("Unable to obtain an iterator to the shunspent db"); // should never happen
                 const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
 
@@ -4462,7 +6333,7 @@ auto Storage::listUnspent(const HashX & hashX, const TokenFilterOption tokenFilt
                     });
                 }
             } // end confirmed/db search
-        } // release blocks lock
+        } // release rewind lock
         std::sort(ret.begin(), ret.end());
         if (const auto sz = ret.size(), cap = ret.capacity(); cap - sz > iota && sz > 0 && double(cap)/double(sz) > 1.20)
             // we only do this if we're wasting enough space (at least iota, and at least 20% space wasted),
@@ -4485,38 +6356,13 @@ auto Storage::getBalance(const HashX &hashX, TokenFilterOption tokenFilter) cons
                                                                         QString("scripthash %1").arg(QString(hashX.toHex())),
                                                                         options->maxHistory);
     try {
-        // take shared lock (ensure history doesn't mutate from underneath our feet)
-        SharedLockGuard g(p->blocksLock);
-        {
-            // confirmed -- read from db using an iterator
-            std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
-            if (UNLIKELY(!iter)) throw DatabaseError("Unable to obtain an iterator to the shunspent db"); // should never happen
-            const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
-
-            // Search table for all keys that start with hashx's bytes. Note: the loop end-condition is strange.
-            // See: https://github.com/facebook/rocksdb/wiki/Prefix-Seek-API-Changes#transition-to-the-new-usage
-            rocksdb::Slice key;
-            for (iter->Seek(prefix); iter->Valid() && (key = iter->key()).starts_with(prefix); iter->Next()) {
-                IncrementCtrAndThrowIfExceedsMaxHistory(); // throw if we are iterating too much
-                const CompactTXO ctxo = extractCompactTXOFromShunspentKey(key); // may throw if key has the wrong size, etc
-                bool ok;
-                const auto & [valid, amount, tokenDataPtr] = Deserialize<SHUnspentValue>(FromSlice(iter->value()), &ok);
-                if (UNLIKELY(!ok || !valid))
-                    throw InternalError(QString("Bad SHUnspentValue in db for ctxo %1 (%2)").arg(ctxo.toString(), QString(hashX.toHex())));
-                if (UNLIKELY(!bitcoin::MoneyRange(amount)))
-                    throw InternalError(QString("Out-of-range amount in db for ctxo %1: %2").arg(ctxo.toString()).arg(amount / amount.satoshi()));
-                if ( ! ShouldFilter(tokenDataPtr)) {
-                    ret.first += amount; // tally the result
-                }
-            }
-            if (UNLIKELY(!bitcoin::MoneyRange(ret.first))) {
-                ret.first = bitcoin::Amount::zero();
-                throw InternalError(QString("Out-of-range total in db for getBalance on scripthash: %1").arg(QString(hashX.toHex())));
-            }
-        }
+        // take shared lock (ensure history doesn't get rewound from underneath our feet)
+        SharedLockGuard g(p->rewindLock);
+        Pvt::ReadViewPtr view; // the confirmed state we read from; consistent with the mempool state we see below
         {
             // unconfirmed -- check mempool
             auto [mempool, lock] = this->mempool(); // shared (read only) lock is held until scope end
+            view = p->currentReadView(); // grab the confirmed view while we hold the mempool lock so the two agree
             if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
                 // for all tx's involving scripthash
                 bitcoin::Amount utxos, spends;
@@ -4547,6 +6393,38 @@ auto Storage::getBalance(const HashX &hashX, TokenFilterOption tokenFilter) cons
                 ret.second = utxos - spends; // note this may not be MoneyRange (may be negative), which is ok.
             }
         }
+        {
+            // confirmed -- read from db using an iterator
+            // Bound the scan to this scripthash's keys, so that rocksdb never reads (or reads ahead) past them
+            const QByteArray upperBound = PrefixScanUpperBound(hashX);
+            const rocksdb::Slice upperBoundSlice = ToSlice(upperBound);
+            auto readOpts = view->shunspentReadOpts;
+            if (!upperBound.isEmpty()) readOpts.iterate_upper_bound = &upperBoundSlice;
+            std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(readOpts));
+            if (UNLIKELY(!iter)) throw DatabaseError("Unable to obtain an iterator to the shunspent db"); // should never happen
+            const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
+
+            // Search table for all keys that start with hashx's bytes. Note: the loop end-condition is strange.
+            // See: https://github.com/facebook/rocksdb/wiki/Prefix-Seek-API-Changes#transition-to-the-new-usage
+            rocksdb::Slice key;
+            for (iter->Seek(prefix); iter->Valid() && (key = iter->key()).starts_with(prefix); iter->Next()) {
+                IncrementCtrAndThrowIfExceedsMaxHistory(); // throw if we are iterating too much
+                const CompactTXO ctxo = extractCompactTXOFromShunspentKey(key); // may throw if key has the wrong size, etc
+                bool ok;
+                const auto & [valid, amount, tokenDataPtr] = Deserialize<SHUnspentValue>(FromSlice(iter->value()), &ok);
+                if (UNLIKELY(!ok || !valid))
+                    throw InternalError(QString("Bad SHUnspentValue in db for ctxo %1 (%2)").arg(ctxo.toString(), QString(hashX.toHex())));
+                if (UNLIKELY(!bitcoin::MoneyRange(amount)))
+                    throw InternalError(QString("Out-of-range amount in db for ctxo %1: %2").arg(ctxo.toString()).arg(amount / amount.satoshi()));
+                if ( ! ShouldFilter(tokenDataPtr)) {
+                    ret.first += amount; // tally the result
+                }
+            }
+            if (UNLIKELY(!bitcoin::MoneyRange(ret.first))) {
+                ret.first = bitcoin::Amount::zero();
+                throw InternalError(QString("Out-of-range total in db for getBalance on scripthash: %1").arg(QString(hashX.toHex())));
+            }
+        }
     } catch (const std::exception &e) {
         Warning(Log::Magenta) << __func__ << ": " << e.what();
     }
@@ -4557,10 +6435,31 @@ auto Storage::getFirstUse(const HashX & hashX) const -> std::optional<FirstUse>
 {
     static const QString err("Database error retrieving history for a script hash");
     try {
-        SharedLockGuard g(p->blocksLock);  // makes sure history doesn't mutate from underneath our feet
+        SharedLockGuard g(p->rewindLock);  // makes sure history doesn't get rewound from underneath our feet
+        Pvt::ReadViewPtr view; // the confirmed state we read from; consistent with the mempool state we see below
+        std::optional<FirstUse> mempoolFirstUse;
+        {
+            // check unconfirmed (mempool) first, while grabbing the view, so that the two agree. This result is only
+            // used if there is no confirmed history.
+            auto [mempool, lock] = this->mempool();
+            view = p->currentReadView();
+            if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
+                for (const auto & tx : it->second) { // Note: txs are sorted by (hasUnfonfirmedParentTx, hash)
+                    for (const auto & txoinfo : tx->txos) {
+                        if (txoinfo.hashX == hashX) {
+                            // found a mempool tx that sends an output to `hashX`
+                            static const QByteArray zeroes32(QByteArray::size_type(HashLen), char(0));
+                            mempoolFirstUse.emplace(tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, zeroes32);
+                            break;
+                        }
+                    }
+                    if (mempoolFirstUse) break;
+                }
+            }
+        }
 
         // try confirmed txns from db
-        if (const auto optba = GenericDBGet<QByteArray>(p->db.shist.get(), hashX, true, err, true, p->db.defReadOpts)) {
+        if (const auto optba = GenericDBGet<QByteArray>(p->db.shist.get(), hashX, true, err, true, view->shistReadOpts)) {
             // the history is a bunch of CompactTXO TxNums concatenated, grab the first one
             if (size_t(optba->size()) < CompactTXO::compactTxNumSize()) {
                 throw DatabaseSerializationError(QString("Scripthash %1 has a db entry in scripthash_history that is too short: %2")
@@ -4569,24 +6468,12 @@ auto Storage::getFirstUse(const HashX & hashX) const -> std::optional<FirstUse>
             const TxNum txNum = CompactTXO::txNumFromCompactBytes(reinterpret_cast<const std::byte *>(optba->constData()));
             // NB: Below opt.value() calls may throw, which is what we want.
             const BlockHeight blockHeight = heightForTxNum(txNum).value(); // may throw
+            // NB: we know blockHeight <= view->tipHeight, so we can skip the tip check (and its lock) in headerForHeight
             return FirstUse(hashForTxNum(txNum).value(), /* .txHash */
                             blockHeight, /* .height */
-                            BTC::HashRev(headerForHeight(blockHeight).value()) /* .blockHash */);
-        } else {
-            // try unconfirmed (mempool)
-            auto [mempool, lock] = this->mempool();
-            if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
-                for (const auto & tx : it->second) { // Note: txs are sorted by (hasUnfonfirmedParentTx, hash)
-                    for (const auto & txoinfo : tx->txos) {
-                        if (txoinfo.hashX == hashX) {
-                            // found a mempool tx that sends an output to `hashX`
-                            static const QByteArray zeroes32(QByteArray::size_type(HashLen), char(0));
-                            return FirstUse(tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, zeroes32);
-                        }
-                    }
-                }
-            }
+                            BTC::HashRev(headerForHeight_nolock(blockHeight).value()) /* .blockHash */);
         }
+        return mempoolFirstUse;
     } catch (const std::exception &e) {
         Warning(Log::Magenta) << __func__ << ": " << e.what();
     }
@@ -4749,11 +6636,14 @@ auto Storage::getConfirmedTxBlockHeightAndHeader(const TxHash &h) const -> std::
 size_t Storage::dumpAllScriptHashes(QIODevice *outDev, unsigned int indent, unsigned int ilvl,
                                     const DumpProgressFunc &progFunc, size_t progInterval) const
 {
-    if (!outDev || !outDev->isWritable())
+    if (!outDev || !outDev->isWritable() || !p->db.shist)
         return 0;
-    SharedLockGuard g{p->blocksLock};
-    std::unique_ptr<rocksdb::Iterator> it {p->db.shist->NewIterator(p->db.defReadOpts)};
-    if (!it) return 0;
+    using CSnapshot = const rocksdb::Snapshot;
+    const auto snapshot = [&] {
+        SharedLockGuard g{p->blocksLock};
+        return std::shared_ptr<CSnapshot>(p->db.shist->GetSnapshot(),
+                                          [this](CSnapshot *ss){ p->db.shist->ReleaseSnapshot(ss); });
+    }();
 
     const auto INDENT = [outDev, &ilvl, spaces = QByteArray(int(indent), ' ')] {
         for (size_t i = 0; i < ilvl; ++i)
@@ -4772,8 +6662,8 @@ size_t Storage::dumpAllScriptHashes(QIODevice *outDev, unsigned int indent, unsi
     NL();
     if (progFunc) progFunc(0); // 0 = indicate operator began
     qint64 lastWriteCt = 0;
-    for (it->SeekToFirst(); it->Valid() && outDev && lastWriteCt > -1; it->Next()) {
-        const auto sh = it->key();
+    OrderedParallelScan(p->scanHelpers, p->db.shist.get(), snapshot.get(), p->db.bulkScanReadOpts,
+                        p->fullScanThreads(), [&](const rocksdb::Slice &sh, const rocksdb::Slice &) {
         if (sh.size() == HashLen) {
             if (LIKELY(ctr)) {
                 outDev->putChar(',');
@@ -4785,7 +6675,8 @@ size_t Storage::dumpAllScriptHashes(QIODevice *outDev, unsigned int indent, unsi
             if (UNLIKELY(!(++ctr % progInterval) && progFunc))
                 progFunc(ctr);
         }
-    }
+        return lastWriteCt > -1;
+    });
     --ilvl;
     if (ctr) NL();
     outDev->putChar(']');
@@ -4799,23 +6690,16 @@ auto Storage::calcUTXOSetStats(const DumpProgressFunc & progFunc, size_t progInt
 {
     UTXOSetStats ret;
     if (!p->db.utxoset || !p->db.shunspent) return ret;
-    auto readOpts_utxo = p->db.defReadOpts;
-    auto readOpts_shunspent = p->db.defReadOpts;
     const auto [ss_utxo, ss_shunspent, bheight, bhash] = [&] {
         SharedLockGuard g{p->blocksLock};
         using CSnapshot = const rocksdb::Snapshot;
         auto s1 = std::shared_ptr<CSnapshot>(p->db.utxoset->GetSnapshot(),
                                              [this](CSnapshot *ss){ p->db.utxoset->ReleaseSnapshot(ss); });
-        auto s2 = std::shared_ptr<CSnapshot>(p->db.utxoset->GetSnapshot(),
+        auto s2 = std::shared_ptr<CSnapshot>(p->db.shunspent->GetSnapshot(),
                                              [this](CSnapshot *ss){ p->db.shunspent->ReleaseSnapshot(ss); });
         const auto & [height, hash] = latestTip(); // takes a subordinate lock to blocksLock
         return std::tuple(s1, s2, height, hash);
     }();
-    readOpts_utxo.snapshot = ss_utxo.get();
-    readOpts_shunspent.snapshot = ss_shunspent.get();
-    std::unique_ptr<rocksdb::Iterator> it_utxo {p->db.utxoset->NewIterator(readOpts_utxo)};
-    std::unique_ptr<rocksdb::Iterator> it_shu {p->db.shunspent->NewIterator(readOpts_shunspent)};
-    if (!it_utxo || !it_shu) return ret;
 
     ret.block_height = bheight >= 0 ? BlockHeight(bheight) : 0;
     ret.block_hash = bhash;
@@ -4831,32 +6715,44 @@ auto Storage::calcUTXOSetStats(const DumpProgressFunc & progFunc, size_t progInt
         if (progInterval && (++ctr % progInterval == 0u) && progFunc) progFunc(ctr);
         return !quitting;
     };
+    // Each table is read by several threads, but the pairs still arrive here in key order, so the sums below are
+    // the same as those of a plain serial scan.
+    const unsigned nThreads = p->fullScanThreads();
     {
         bitcoin::CHash256 hasher;
-        for (it_utxo->SeekToFirst(); it_utxo->Valid(); it_utxo->Next()) {
-            auto const k = it_utxo->key();
-            auto const v = it_utxo->value();
+        std::vector<std::pair<TxNum, Span<const char>>> entries; // reused for each bucket
+        const bool finished = OrderedParallelScan(p->scanHelpers, p->db.utxoset.get(), ss_utxo.get(), p->db.bulkScanReadOpts,
+                                                  nThreads,
+                                                  [&](const rocksdb::Slice &k, const rocksdb::Slice &v) {
+            if (v.empty()) return true; // bucket whose utxos were all spent, not yet dropped by compaction
             hasher.Write(reinterpret_cast<const uint8_t *>(k.data()), k.size());
             hasher.Write(reinterpret_cast<const uint8_t *>(v.data()), v.size());
-            ++ret.utxo_db_ct;
+            entries.clear();
+            if (UNLIKELY(!splitUtxoSetBucket(Span<const char>{v.data(), v.size()}, entries)))
+                throw DatabaseSerializationError(QString("Failed to parse the utxoset bucket for key %1")
+                                                 .arg(QString::fromLatin1(FromSlice(k).toHex())));
+            ret.utxo_db_ct += entries.size();
+            ++ret.utxo_db_bucket_ct;
             ret.utxo_db_size_bytes += k.size() + v.size();
-            if (UNLIKELY(!UpdateProgress())) { ret = UTXOSetStats{}; return ret; }
-        }
+            return UpdateProgress();
+        });
+        if (UNLIKELY(!finished)) { ret = UTXOSetStats{}; return ret; }
         ret.utxo_db_shasum.resize(HashLen);
         hasher.Finalize(reinterpret_cast<uint8_t *>(ret.utxo_db_shasum.data()));
     }
 
     {
         bitcoin::CHash256 hasher;
-        for (it_shu->SeekToFirst(); it_shu->Valid(); it_shu->Next()) {
-            auto const k = it_shu->key();
-            auto const v = it_shu->value();
+        const bool finished = OrderedParallelScan(p->scanHelpers, p->db.shunspent.get(), ss_shunspent.get(), p->db.bulkScanReadOpts,
+                                                  nThreads,
+                                                  [&](const rocksdb::Slice &k, const rocksdb::Slice &v) {
             hasher.Write(reinterpret_cast<const uint8_t *>(k.data()), k.size());
             hasher.Write(reinterpret_cast<const uint8_t *>(v.data()), v.size());
             ++ret.shunspent_db_ct;
             ret.shunspent_db_size_bytes += k.size() + v.size();
-            if (UNLIKELY(!UpdateProgress())) { ret = UTXOSetStats{}; return ret; }
-        }
+            return UpdateProgress();
+        });
+        if (UNLIKELY(!finished)) { ret = UTXOSetStats{}; return ret; }
         ret.shunspent_db_shasum.resize(HashLen);
         hasher.Finalize(reinterpret_cast<uint8_t *>(ret.shunspent_db_shasum.data()));
     }
@@ -4986,8 +6882,8 @@ namespace {
     }
 
     struct UndoInfoSerHeader {
-        static constexpr uint16_t defMagic = 0xf12cu, v1Ver = 0x1u, v2Ver = 0x2u, v3Ver = 0x3u;
-        static constexpr auto defVer = v3Ver;
+        static constexpr uint16_t defMagic = 0xf12cu, v1Ver = 0x1u, v2Ver = 0x2u, v3Ver = 0x3u, v4Ver = 0x4u;
+        static constexpr auto defVer = v4Ver;
         uint16_t magic = defMagic; ///< sanity check
         uint16_t ver = defVer; ///< sanity check
         uint32_t len = 0; ///< the length of the entire buffer, including this struct and all data to follow. A sanity check.
@@ -5025,6 +6921,11 @@ namespace {
         /// computes the minimum size given the ser size of the blkInfo struct. Requires that nScriptHashes, nAddUndos, and nDelUndos be already filled-in.
         size_t computeMinimumSize_V3() const { return computeTotalSize_V2(); }
         bool isLenMinimallySane_V3() const { return size_t(len) >= computeMinimumSize_V3(); }
+
+        /* ----------- V4 format (fixed-size height, hash & blkInfo, followed by the qCompress'd UndoRecord columns) */
+        static constexpr size_t fixedSize_V4() { return sizeof(UndoInfoSerHeader) + sizeof(UndoInfo::height) + HashLen + sizeof(BlkInfo); }
+        /// +4 for the uncompressed size that qCompress() prepends
+        bool isLenMinimallySane_V4() const { return size_t(len) >= fixedSize_V4() + 4u; }
     };
 
     static_assert(std::has_unique_object_representations_v<UndoInfoSerHeader>, "This type is serialized as bytes to db");
@@ -5041,9 +6942,11 @@ namespace {
         return ret;
     }
 
-    // UndoInfo -- serialize to V3 format (fixed 3-byte IONums, dynamically-sized TXOInfo objects)
-    template <> QByteArray Serialize(const UndoInfo &u) {
+    // UndoInfo -- serialize to V3 format (fixed 3-byte IONums, dynamically-sized TXOInfo objects). We no longer write
+    // this format; this is kept for the tests and the "undo" bench.
+    [[maybe_unused]] QByteArray SerializeUndoInfoV3(const UndoInfo &u) {
         UndoInfoSerHeader hdr;
+        hdr.ver = hdr.v3Ver;
         // fill these in now so that hdr.computeTotalSize works
         hdr.nScriptHashes = uint32_t(u.scriptHashes.size());
         hdr.nAddUndos = uint32_t(u.addUndos.size());
@@ -5215,6 +7118,213 @@ namespace {
         return ret;
     }
 
+    // UndoInfo -- serialize to V4 format: the fixed-size fields, followed by the qCompress'd, columnar, TxNum-based
+    // UndoRecord columns (see UndoRecord::Col). Tx hashes are not saved; on undo they are looked up by TxNum instead.
+    template <> QByteArray Serialize(const UndoInfo &u) {
+        using Col = UndoRecord::Col;
+        UndoInfoSerHeader hdr;
+        hdr.nScriptHashes = uint32_t(u.scriptHashes.size());
+        hdr.nAddUndos = uint32_t(u.addUndos.size());
+        hdr.nDelUndos = uint32_t(u.delUndos.size());
+        QByteArray ret;
+        const auto fail = [&ret](const char *what) {
+            Warning() << "Serialize UndoInfo fail: " << what << ". FIXME!";
+            ret.clear();
+            return ret;
+        };
+        if (u.hash.length() != HashLen) return fail("bad block hash");
+        const TxNum txNum0 = u.blkInfo.txNum0;
+
+        std::array<QByteArray, Col::NCols> cols;
+        const auto putVI = [&cols](Col c, uint64_t val) {
+            const VarInt vi(val);
+            cols[c].append(reinterpret_cast<const char *>(vi.data()), int(vi.size()));
+        };
+        // scripthashes, each one written once; adds & dels refer to them by index
+        std::unordered_map<HashX, uint32_t, HashHasher> shIdx;
+        shIdx.reserve(u.scriptHashes.size());
+        cols[Col::ShCol].reserve(int(u.scriptHashes.size() * size_t(HashLen)));
+        for (const auto & sh : u.scriptHashes) {
+            if (UNLIKELY(sh.length() != HashLen)) return fail("bad scripthash");
+            shIdx.emplace(sh, uint32_t(shIdx.size()));
+            cols[Col::ShCol].append(sh);
+        }
+        for (auto c : {Col::AddTxIdxCol, Col::AddOutNCol, Col::AddShCol}) cols[c].reserve(int(u.addUndos.size() * 3u));
+        for (const auto & [txo, hashX, ctxo] : u.addUndos) {
+            const auto it = shIdx.find(hashX);
+            if (UNLIKELY(it == shIdx.end())) return fail("add undo scripthash missing from scripthash set");
+            if (UNLIKELY(ctxo.txNum() < txNum0 || ctxo.txNum() - txNum0 >= u.blkInfo.nTx)) return fail("add undo txNum not in block");
+            putVI(Col::AddTxIdxCol, ctxo.txNum() - txNum0);
+            putVI(Col::AddOutNCol, txo.outN);
+            putVI(Col::AddShCol, it->second);
+        }
+        for (auto c : {Col::DelTxNumCol, Col::DelOutNCol, Col::DelShCol, Col::DelHeightCol, Col::DelTokenCol})
+            cols[c].reserve(int(u.delUndos.size() * 3u));
+        cols[Col::DelAmountCol].reserve(int(u.delUndos.size() * 5u));
+        QByteArray tokenBuf;
+        for (const auto & [txo, info] : u.delUndos) {
+            const auto it = shIdx.find(info.hashX);
+            if (UNLIKELY(it == shIdx.end())) return fail("del undo scripthash missing from scripthash set");
+            if (UNLIKELY(info.txNum >= txNum0)) return fail("del undo txNum not before block");
+            const int64_t sats = info.amount / bitcoin::Amount::satoshi();
+            if (UNLIKELY(sats < 0)) return fail("del undo has a negative amount");
+            if (UNLIKELY(info.confirmedHeight && *info.confirmedHeight > u.height)) return fail("del undo has a bad height");
+            putVI(Col::DelTxNumCol, txNum0 - info.txNum);
+            putVI(Col::DelOutNCol, txo.outN);
+            putVI(Col::DelShCol, it->second);
+            putVI(Col::DelAmountCol, uint64_t(sats));
+            putVI(Col::DelHeightCol, info.confirmedHeight ? uint64_t(u.height) + 1u - *info.confirmedHeight : 0u);
+            tokenBuf.clear();
+            BTC::SerializeTokenDataWithPrefix(tokenBuf, info.tokenDataPtr.get());
+            putVI(Col::DelTokenCol, uint64_t(tokenBuf.size()));
+            cols[Col::DelTokenCol].append(tokenBuf);
+        }
+        // body: the byte length of each column, then the columns
+        QByteArray body;
+        size_t bodyLen = 0;
+        for (const auto & col : cols) bodyLen += size_t(col.size()) + VarInt::maxSize;
+        body.reserve(int(bodyLen));
+        for (const auto & col : cols) body.append(VarInt(uint64_t(col.size())).byteArray(false));
+        for (const auto & col : cols) body.append(col);
+        const QByteArray compressed = qCompress(body);
+
+        ret.reserve(int(UndoInfoSerHeader::fixedSize_V4() + size_t(compressed.size())));
+        ret.append(ShallowTmp(&hdr));
+        ret.append(SerializeScalarNoCopy(u.height));
+        ret.append(u.hash);
+        ret.append(Serialize(u.blkInfo));
+        if (UNLIKELY(size_t(ret.size()) != UndoInfoSerHeader::fixedSize_V4())) return fail("unexpected fixed-size length");
+        ret.append(compressed);
+        hdr.len = uint32_t(ret.size());
+        std::memcpy(ret.data() + offsetof(UndoInfoSerHeader, len), &hdr.len, sizeof(hdr.len));
+        return ret;
+    }
+
+    // UndoRecord -- reads any version. For V4 this just decompresses and validates the column layout; the columns'
+    // contents are decoded later, as they are applied.
+    template <> UndoRecord Deserialize(const QByteArray &ba, bool *ok) {
+        using Col = UndoRecord::Col;
+        UndoRecord ret;
+        bool myok = false;
+        const UndoInfoSerHeader hdr = Deserialize<UndoInfoSerHeader>(ba, &myok);
+        if (myok && hdr.magic == hdr.defMagic && hdr.ver < hdr.v4Ver) {
+            // V1-V3: materialize the whole thing, as before
+            auto u = std::make_shared<UndoInfo>(Deserialize<UndoInfo>(ba, &myok));
+            if (myok) {
+                ret.height = u->height;
+                ret.hash = u->hash;
+                ret.blkInfo = u->blkInfo;
+                ret.deserVersion = u->deserVersion;
+                ret.legacy = std::move(u);
+            }
+            if (ok) *ok = myok;
+            return ret;
+        }
+        const auto fail = [&ok](const char *extra) {
+            Warning() << "Deserialize UndoRecord called with an invalid byte array! FIXME! " << extra;
+            if (ok) *ok = false;
+            return UndoRecord{};
+        };
+        if (!myok || hdr.magic != hdr.defMagic || hdr.ver != hdr.v4Ver || int(hdr.len) != ba.size() || !hdr.isLenMinimallySane_V4())
+            return fail("Header sanity check fail");
+        ret.deserVersion = hdr.ver;
+        ret.nSH = hdr.nScriptHashes;
+        ret.nAdd = hdr.nAddUndos;
+        ret.nDel = hdr.nDelUndos;
+        const char *cur = ba.constData() + sizeof(hdr), *const end = ba.constData() + ba.size();
+        std::memcpy(&ret.height, cur, sizeof(ret.height));
+        cur += sizeof(ret.height);
+        ret.hash = DeepCpy(cur, size_t(HashLen));
+        cur += HashLen;
+        ret.blkInfo = Deserialize<BlkInfo>(ShallowTmp(cur, sizeof(BlkInfo)), &myok);
+        if (!myok) return fail("Bad BlkInfo");
+        cur += sizeof(BlkInfo);
+        ret.body = qUncompress(reinterpret_cast<const uchar *>(cur), int(end - cur));
+        if (ret.body.isEmpty()) return fail("Failed to uncompress columns");
+
+        // Check the column layout, so that forEach*Undo can't run into a truncated or mis-sized column halfway through
+        // applying the record. This just walks the VarInts without decoding them.
+        try {
+            Span<const char> sp{ret.body.constData(), size_t(ret.body.size())};
+            std::array<uint64_t, Col::NCols> lens;
+            for (auto & len : lens) len = VarInt::deserialize(sp).value<uint64_t>();
+            for (unsigned c = 0; c < Col::NCols; ++c) {
+                if (lens[c] > sp.size()) return fail("Column is truncated");
+                ret.cols[c] = sp.first(lens[c]);
+                sp = sp.subspan(lens[c]);
+            }
+            if (!sp.empty()) return fail("Extra bytes at end");
+            if (ret.cols[Col::ShCol].size() != ret.nSH * size_t(HashLen)) return fail("Scripthash column size mismatch");
+            for (unsigned c = Col::AddTxIdxCol; c < Col::NCols; ++c) {
+                const size_t n = c < Col::DelTxNumCol ? ret.nAdd : ret.nDel;
+                Span<const char> csp = ret.cols[c];
+                for (size_t i = 0; i < n; ++i) {
+                    const auto val = VarInt::deserialize(csp).value<uint64_t>();
+                    if (c == Col::DelTokenCol) {
+                        if (val > csp.size()) return fail("Token data column is truncated");
+                        csp = csp.subspan(val);
+                    }
+                }
+                if (!csp.empty()) return fail("Column item count mismatch");
+            }
+        } catch (const std::exception &e) {
+            return fail(e.what());
+        }
+        if (ok) *ok = true;
+        return ret;
+    }
+
+    HashX UndoRecord::shAt(uint64_t idx) const {
+        if (UNLIKELY(idx >= nSH)) throw DatabaseFormatError("Bad scripthash index in undo record");
+        return DeepCpy(cols[ShCol].data() + idx * size_t(HashLen), size_t(HashLen)); // deep copy since `body` may not outlive it
+    }
+
+    TxHash UndoRecord::hashFor(const std::vector<TxNum> &txNums, const std::vector<TxHash> &hashes, TxNum txNum) {
+        const auto it = std::lower_bound(txNums.begin(), txNums.end(), txNum);
+        const auto idx = size_t(it - txNums.begin());
+        if (UNLIKELY(it == txNums.end() || *it != txNum || idx >= hashes.size() || hashes[idx].size() != HashLen))
+            throw DatabaseError(QString("Unable to resolve the tx hash for txNum %1 while reading undo info").arg(txNum));
+        return hashes[idx];
+    }
+
+    UndoInfo::ScriptHashSet UndoRecord::scriptHashes() const {
+        if (legacy) return legacy->scriptHashes;
+        UndoInfo::ScriptHashSet ret;
+        ret.reserve(nSH);
+        for (size_t i = 0; i < nSH; ++i)
+            ret.insert(shAt(i));
+        return ret;
+    }
+
+    UndoInfo UndoRecord::toUndoInfo(const TxHashResolver &resolver) const {
+        if (legacy) return *legacy;
+        UndoInfo ret;
+        ret.height = height;
+        ret.hash = hash;
+        ret.blkInfo = blkInfo;
+        ret.deserVersion = deserVersion;
+        ret.scriptHashes = scriptHashes();
+        ret.addUndos.reserve(nAdd);
+        forEachAddUndo(resolver, [&ret](const TXO &txo, const HashX &hashX, const CompactTXO &ctxo) {
+            ret.addUndos.emplace_back(txo, hashX, ctxo);
+        });
+        ret.delUndos.reserve(nDel);
+        forEachDelUndo(resolver, [&ret](const TXO &txo, const TXOInfo &info) {
+            ret.delUndos.emplace_back(txo, info);
+        });
+        return ret;
+    }
+
+    QString UndoRecord::toDebugString() const {
+        QString ret;
+        QTextStream ts(&ret);
+        ts  << "<Undo record for height: " << height << " addUndos: " << nAddUndos() << " delUndos: " << nDelUndos()
+            << " scriptHashes: " << nScriptHashes() << " nTx: " << blkInfo.nTx << " txNum0: " << blkInfo.txNum0
+            << " hash: " << hash.toHex() << " deserVersion: " << int(deserVersion)
+            << (legacy ? "" : QStringLiteral(" columnBytes: %1").arg(body.size())) << ">";
+        return ret;
+    }
+
     template <> QByteArray Serialize(const TxNumVec &v)
     {
         // this serializes a vector of TxNums to a compact representation (6 bytes, eg 48 bits per TxNum), in little endian byte order
@@ -5290,6 +7400,12 @@ namespace {
 
 #ifdef ENABLE_TESTS
 #include "robin_hood/robin_hood.h"
+#include "tests/Tests.h"
+
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+
+#include <chrono>
 namespace {
 
     template<size_t NB>
@@ -5374,4 +7490,977 @@ namespace {
     }
     const auto b1 = App::registerBench("txcol", findCollisions);
 } // end anon namespace
+
+namespace {
+    QByteArray randomHash() {
+        QByteArray ret(HashLen, Qt::Uninitialized);
+        QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(ret.data()), HashLen / sizeof(quint32));
+        return ret;
+    }
+
+    /// A synthetic chain's tx hashes (indexed by TxNum), standing in for the txNumsFile
+    struct FakeTxNums {
+        std::vector<TxHash> hashes;
+        explicit FakeTxNums(size_t n) { hashes.reserve(n); while (hashes.size() < n) hashes.push_back(randomHash()); }
+        UndoRecord::TxHashResolver resolver() const {
+            return [this](const std::vector<TxNum> &txNums) {
+                std::vector<TxHash> ret;
+                ret.reserve(txNums.size());
+                for (const auto n : txNums) ret.push_back(hashes.at(n));
+                return ret;
+            };
+        }
+    };
+
+    /// Returns an UndoInfo shaped like that of a real block: outputs spread over `nTx` txs, and inputs spending
+    /// older outputs, all involving a pool of scripthashes (some reused within the block).
+    UndoInfo makeUndoInfo(const FakeTxNums &txs, BlockHeight height, TxNum txNum0, unsigned nTx, unsigned nAdds,
+                          unsigned nDels, bool withTokens) {
+        auto *rng = QRandomGenerator::global();
+        UndoInfo u;
+        u.height = height;
+        u.hash = randomHash();
+        u.blkInfo = BlkInfo(txNum0, nTx);
+        std::vector<HashX> shs;
+        for (unsigned i = 0; i < std::max(1u, (nAdds + nDels) * 2u / 3u); ++i) shs.push_back(randomHash());
+        u.scriptHashes.insert(shs.begin(), shs.end());
+        for (unsigned i = 0; i < nAdds; ++i) {
+            const TxNum txNum = txNum0 + rng->bounded(nTx);
+            const IONum n = rng->bounded(8u) == 0 ? IONum(rng->bounded(70'000u)) : IONum(rng->bounded(4u));
+            u.addUndos.emplace_back(TXO{txs.hashes.at(txNum), n}, shs[rng->bounded(quint32(shs.size()))], CompactTXO(txNum, n));
+        }
+        for (unsigned i = 0; i < nDels; ++i) {
+            TXOInfo info;
+            info.txNum = txNum0 - 1u - rng->bounded(quint32(std::min<TxNum>(txNum0, 1'000'000u)));
+            info.amount = int64_t(rng->bounded(quint64(21'000'000'00000000ull))) * bitcoin::Amount::satoshi();
+            info.hashX = shs[rng->bounded(quint32(shs.size()))];
+            if (rng->bounded(50u)) info.confirmedHeight = height - std::min<BlockHeight>(height, rng->bounded(100'000u));
+            if (withTokens && !rng->bounded(10u))
+                info.tokenDataPtr.emplace(bitcoin::token::Id{}, *bitcoin::token::SafeAmount::fromInt(1 + rng->bounded(1000)));
+            u.delUndos.emplace_back(TXO{txs.hashes.at(info.txNum), IONum(rng->bounded(3u))}, std::move(info));
+        }
+        return u;
+    }
+
+    TEST_SUITE(undo)
+    TEST_CASE(v4_round_trip) {
+        const FakeTxNums txs(200'000);
+        const auto resolver = txs.resolver();
+        using Shape = std::tuple<unsigned, unsigned, unsigned>; // nTx, nAdds, nDels
+        for (const auto & [nTx, nAdds, nDels] : std::vector<Shape>{{1, 1, 0}, {1, 0, 0}, {50, 120, 90}, {2000, 5000, 4000}}) {
+            const UndoInfo u = makeUndoInfo(txs, 150'000, 100'000, nTx, nAdds, nDels, true);
+            // V4 round trip
+            const QByteArray v4 = Serialize(u);
+            bool ok = false;
+            const auto rec = Deserialize<UndoRecord>(v4, &ok);
+            TEST_CHECK_MESSAGE(ok && rec.isValid() && rec.deserVersion == UndoInfoSerHeader::v4Ver, "V4 deserializes");
+            TEST_CHECK_MESSAGE(rec.nAddUndos() == nAdds && rec.nDelUndos() == nDels && rec.nScriptHashes() == u.scriptHashes.size(), "V4 counts");
+            TEST_CHECK_MESSAGE(rec.scriptHashes() == u.scriptHashes, "V4 scripthashes");
+            TEST_CHECK_MESSAGE(rec.toUndoInfo(resolver) == u, "V4 round trip");
+            // V3 records must still be readable
+            const QByteArray v3 = SerializeUndoInfoV3(u);
+            const auto rec3 = Deserialize<UndoRecord>(v3, &ok);
+            TEST_CHECK_MESSAGE(ok && rec3.deserVersion == UndoInfoSerHeader::v3Ver && rec3.toUndoInfo(resolver) == u, "V3 round trip");
+            Log() << "nTx: " << nTx << ", adds: " << nAdds << ", dels: " << nDels << " -> V3: " << v3.size()
+                  << " bytes, V4: " << v4.size() << " bytes";
+            // corrupt V4 records are rejected up front
+            TEST_CHECK_MESSAGE(!Deserialize<UndoRecord>(v4.left(v4.size() - 1), &ok).isValid() && !ok, "truncated V4 rejected");
+            QByteArray bad = v4;
+            const uint32_t badCount = uint32_t(u.addUndos.size()) + 1u;
+            std::memcpy(bad.data() + offsetof(UndoInfoSerHeader, nAddUndos), &badCount, sizeof(badCount));
+            TEST_CHECK_MESSAGE(!Deserialize<UndoRecord>(bad, &ok).isValid() && !ok, "V4 count mismatch rejected");
+        }
+        // a resolver that can't find a hash must make the apply fail, rather than apply junk
+        {
+            const UndoInfo u = makeUndoInfo(txs, 150'000, 100'000, 10, 10, 10, false);
+            const auto rec = Deserialize<UndoRecord>(Serialize(u));
+            bool threw = false;
+            try {
+                rec.forEachDelUndo([](const std::vector<TxNum> &) { return std::vector<TxHash>{}; }, [](const TXO &, const TXOInfo &) {});
+            } catch (const DatabaseError &) { threw = true; }
+            TEST_CHECK_MESSAGE(threw, "unresolved tx hash throws");
+        }
+    };
+    TEST_SUITE_END()
+
+    /// Replays (deserializes + applies to a dummy UTXO sink) a deep reorg's worth of undo records, in both formats
+    void undoBench() {
+        constexpr unsigned nBlocks = 100, nTx = 3'000, nAdds = 7'000, nDels = 6'500;
+        constexpr TxNum txNum0Start = 2'000'000;
+        Log() << "Generating " << nBlocks << " synthetic undo records (" << nTx << " txs, " << nAdds << " adds, "
+              << nDels << " dels each) ...";
+        const FakeTxNums txs(txNum0Start + nBlocks * nTx);
+        const auto resolver = txs.resolver();
+        std::vector<UndoInfo> undos;
+        for (unsigned i = 0; i < nBlocks; ++i)
+            undos.push_back(makeUndoInfo(txs, 800'000 + i, txNum0Start + i * nTx, nTx, nAdds, nDels, true));
+
+        const auto run = [&](const char *name, auto && serFunc) {
+            std::vector<QByteArray> sers;
+            size_t bytes = 0;
+            Tic t0;
+            for (const auto & u : undos) bytes += size_t(sers.emplace_back(serFunc(u)).size());
+            Log() << name << ": serialize: " << t0.msecStr() << " msec, " << bytes << " bytes";
+            t0 = Tic();
+            uint64_t sum = 0;
+            for (auto it = sers.rbegin(); it != sers.rend(); ++it) { // a reorg walks back from the tip
+                bool ok = false;
+                const auto rec = Deserialize<UndoRecord>(*it, &ok);
+                if (!ok) throw Exception("Deserialize failed");
+                for (const auto & sh : rec.scriptHashes()) sum += uint8_t(sh[0]);
+                rec.forEachDelUndo(resolver, [&sum](const TXO &txo, const TXOInfo &info) {
+                    sum += uint8_t(txo.txHash[0]) + txo.outN + uint64_t(info.amount / bitcoin::Amount::satoshi()) + info.txNum;
+                });
+                rec.forEachAddUndo(resolver, [&sum](const TXO &txo, const HashX &hashX, const CompactTXO &ctxo) {
+                    sum += uint8_t(txo.txHash[0]) + txo.outN + uint8_t(hashX[0]) + ctxo.txNum();
+                });
+            }
+            Log() << name << ": replay: " << t0.msecStr() << " msec (" << sum << ")";
+            return sum;
+        };
+        const auto sum3 = run("V3", [](const UndoInfo &u) { return SerializeUndoInfoV3(u); });
+        const auto sum4 = run("V4", [](const UndoInfo &u) { return Serialize(u); });
+        if (sum3 != sum4) throw Exception("V3 vs V4 replay mismatch");
+    }
+
+    const auto b_undo = App::registerBench("undo", undoBench);
+
+    TEST_SUITE(fullscan)
+    TEST_CASE(ordered_parallel_scan) {
+        QTemporaryDir tmpDir;
+        if (!tmpDir.isValid()) throw Exception("Failed to create a temporary directory");
+        rocksdb::Options opts;
+        opts.create_if_missing = true;
+        rocksdb::DB *pdb{};
+        if (auto st = rocksdb::DB::Open(opts, tmpDir.filePath("fullscan").toStdString(), &pdb); !st.ok())
+            throw Exception(QString("Failed to open db: %1").arg(QString::fromStdString(st.ToString())));
+        const std::unique_ptr<rocksdb::DB> db{pdb};
+        auto *rng = QRandomGenerator::global();
+        const auto put = [&](const QByteArray &k, const QByteArray &v) {
+            if (!db->Put(rocksdb::WriteOptions{}, ToSlice(k), ToSlice(v)).ok()) throw Exception("Put failed");
+        };
+        // hash-like keys of assorted value sizes (some empty, some large enough to fill a read-ahead chunk quickly),
+        // plus keys right at and around the range boundaries
+        for (int i = 0; i < 30'000; ++i)
+            put(randomHash(), QByteArray(int(i % 97 ? rng->bounded(200) : rng->bounded(100'000)), char(i)));
+        for (const char *hex : {"", "00", "3fff", "40", "80", "ff", "ffffff"})
+            put(QByteArray::fromHex(hex), QByteArray("boundary"));
+
+        using CSnapshot = const rocksdb::Snapshot;
+        const std::shared_ptr<CSnapshot> snapshot(db->GetSnapshot(), [&db](CSnapshot *ss){ db->ReleaseSnapshot(ss); });
+        put(randomHash(), QByteArray("written after the snapshot")); // must not be seen by any scan below
+        rocksdb::ReadOptions readOpts;
+        const auto deepCopy = [](const rocksdb::Slice &sl) { return QByteArray(sl.data(), int(sl.size())); };
+
+        // reference: a plain serial scan, exactly as calcUTXOSetStats used to do it
+        const auto hashOf = [](const std::vector<std::pair<QByteArray, QByteArray>> &kvs) {
+            bitcoin::CHash256 hasher;
+            for (const auto & [k, v] : kvs) {
+                hasher.Write(reinterpret_cast<const uint8_t *>(k.constData()), size_t(k.size()));
+                hasher.Write(reinterpret_cast<const uint8_t *>(v.constData()), size_t(v.size()));
+            }
+            QByteArray ret(HashLen, Qt::Uninitialized);
+            hasher.Finalize(reinterpret_cast<uint8_t *>(ret.data()));
+            return ret;
+        };
+        std::vector<std::pair<QByteArray, QByteArray>> expected;
+        {
+            auto ro = readOpts;
+            ro.snapshot = snapshot.get();
+            std::unique_ptr<rocksdb::Iterator> it{db->NewIterator(ro)};
+            for (it->SeekToFirst(); it->Valid(); it->Next())
+                expected.emplace_back(deepCopy(it->key()), deepCopy(it->value()));
+        }
+        TEST_CHECK_MESSAGE(expected.size() == 30'000 + 7, "serial scan sees exactly the pre-snapshot keys");
+        const auto expectedHash = hashOf(expected);
+
+        // fewer helpers than ranges, so that ranges nobody read ahead (claimed back by the consumer) are covered too
+        HelperPool helpers("Test Scan Helper", 3);
+        for (const unsigned nParts : {1u, 2u, 3u, 4u, 7u, 16u, 256u}) {
+            std::vector<std::pair<QByteArray, QByteArray>> got;
+            got.reserve(expected.size());
+            const bool finished = OrderedParallelScan(helpers, db.get(), snapshot.get(), readOpts, nParts,
+                                                      [&](const rocksdb::Slice &k, const rocksdb::Slice &v) {
+                got.emplace_back(deepCopy(k), deepCopy(v));
+                return true;
+            });
+            TEST_CHECK_MESSAGE(finished, "scan ran to completion");
+            TEST_CHECK_MESSAGE(got == expected, "parallel scan yields the same pairs in the same order");
+            TEST_CHECK_MESSAGE(hashOf(got) == expectedHash, "parallel scan yields the same hash");
+
+            // stopping early: exactly as many pairs as were accepted are consumed, and the workers wind down
+            const size_t stopAt = rng->bounded(quint32(expected.size()));
+            size_t ct = 0;
+            TEST_CHECK_MESSAGE(!OrderedParallelScan(helpers, db.get(), snapshot.get(), readOpts, nParts,
+                                                    [&](const rocksdb::Slice &, const rocksdb::Slice &) { return ++ct <= stopAt; }),
+                               "early stop is reported");
+            TEST_CHECK_MESSAGE(ct == stopAt + 1u, "early stop halts the scan immediately");
+        }
+
+        // many concurrent scans sharing a single helper thread: all complete, correctly, without extra threads
+        HelperPool oneHelper("Test Scan Helper", 1);
+        std::vector<QByteArray> hashes(6);
+        std::vector<std::thread> scanners;
+        for (auto & h : hashes)
+            scanners.emplace_back([&, &h = h] {
+                std::vector<std::pair<QByteArray, QByteArray>> got;
+                OrderedParallelScan(oneHelper, db.get(), snapshot.get(), readOpts, 16, [&](const rocksdb::Slice &k, const rocksdb::Slice &v) {
+                    got.emplace_back(deepCopy(k), deepCopy(v));
+                    return true;
+                });
+                h = hashOf(got);
+            });
+        for (auto & t : scanners) t.join();
+        TEST_CHECK_MESSAGE(std::all_of(hashes.begin(), hashes.end(), [&](const QByteArray &h) { return h == expectedHash; }),
+                           "concurrent scans on a shared helper pool yield the same hash");
+    };
+    TEST_SUITE_END()
+
+    TEST_SUITE(prevoutfetch)
+    TEST_CASE(batched_matches_per_key) {
+        QTemporaryDir tmpDir;
+        if (!tmpDir.isValid()) throw Exception("Failed to create a temporary directory");
+        rocksdb::Options opts;
+        opts.create_if_missing = true;
+        opts.merge_operator = std::make_shared<UtxoSetBucketOperator>();
+        rocksdb::DB *pdb{};
+        if (auto st = rocksdb::DB::Open(opts, tmpDir.filePath("utxoset").toStdString(), &pdb); !st.ok())
+            throw Exception(QString("Failed to open db: %1").arg(QString::fromStdString(st.ToString())));
+        const std::unique_ptr<rocksdb::DB> db{pdb};
+        const auto txNumsFile = std::make_unique<RecordFile>(tmpDir.filePath("txnum2txhash"), HashLen);
+        const auto merge = [&](const QByteArray &k, const QByteArray &operand) {
+            if (!db->Merge(rocksdb::WriteOptions{}, ToSlice(k), ToSlice(operand)).ok()) throw Exception("Merge failed");
+        };
+
+        // 2000 txs with 1-3 outputs each. Every 10th txid shares its utxoset key prefix with the preceding one so that
+        // multi-entry buckets (which need the txnum2txhash file to disambiguate) are exercised too.
+        constexpr TxNum nTxs = 2000;
+        std::vector<TxHash> txids;
+        std::map<TXO, std::optional<TXOInfo>> expected; // nullopt = spent
+        for (TxNum txNum = 0; txNum < nTxs; ++txNum) {
+            TxHash txid = randomHash();
+            const bool collides = txNum % 10u == 9u;
+            if (collides)
+                std::memcpy(txid.data(), txids.back().constData(), kUtxoSetTxHashPrefixLen);
+            txids.push_back(txid);
+            if (!txNumsFile->appendRecord(txid)) throw Exception("Failed to append to the txnum2txhash file");
+            for (IONum n = 0; n <= txNum % 3u; ++n) {
+                const TXO txo{txid, txNum % 50u ? n : IONum(IONum16Max + 1u + n)}; // sometimes a "wide" key
+                TXOInfo info;
+                info.amount = int64_t(txNum * 7u + n + 1u) * bitcoin::Amount::satoshi();
+                info.hashX = randomHash();
+                info.confirmedHeight.emplace(BlockHeight(txNum / 10u));
+                info.txNum = txNum;
+                merge(mkUtxoSetKey(txo), mkUtxoSetAddOperand(info));
+                // spend some, but never out of a shared bucket (the fetcher relies on block prevouts existing)
+                if (txNum % 13u == 0u && !collides && txNum % 10u != 8u) {
+                    merge(mkUtxoSetKey(txo), mkUtxoSetRemoveOperand(txNum));
+                    expected[txo] = std::nullopt;
+                } else
+                    expected[txo] = info;
+            }
+        }
+        if (!db->Flush(rocksdb::FlushOptions{}).ok()) throw Exception("Flush failed"); // so MultiGet has SST files to read
+
+        // a "block" spending all of the above (shuffled), plus some unknown prevouts and some in-block spends
+        auto *rng = QRandomGenerator::global();
+        auto ppb = std::make_shared<PreProcessedBlock>();
+        ppb->inputs.emplace_back(); // coinbase
+        for (const auto & [txo, info] : expected)
+            ppb->inputs.push_back({0u, txo.txHash, txo.outN, std::nullopt});
+        for (int i = 0; i < 100; ++i)
+            ppb->inputs.push_back({0u, randomHash(), IONum(i), std::nullopt});
+        for (int i = 0; i < 100; ++i)
+            ppb->inputs.push_back({0u, txids[rng->bounded(int(nTxs))], 0u, unsigned(i)}); // spent in this block: skipped
+        std::shuffle(ppb->inputs.begin() + 1, ppb->inputs.end(), *rng);
+
+        PrevoutFetcher fetcher(db, txNumsFile, rocksdb::ReadOptions{});
+        for (int round = 0; round < 2; ++round) { // a second round on the same fetcher must not see stale results
+            fetcher.fetch(ppb).future.get();
+            size_t nFound = 0u, nMismatch = 0u, nWrong = 0u;
+            for (unsigned inum = 1; inum < ppb->inputs.size(); ++inum) {
+                const auto & in = ppb->inputs[inum];
+                const TXO txo{in.prevoutHash, in.prevoutN};
+                const auto got = fetcher.take(inum);
+                // the per-key path, as used by addBlock before the fetcher (see utxoGetFromDB_impl)
+                std::optional<TXOInfo> ref;
+                if (std::string v; !in.parentTxOutIdx && db->Get(rocksdb::ReadOptions{}, ToSlice(mkUtxoSetKey(txo)), &v).ok())
+                    ref = resolveUtxoSetBucket(txo, v, *txNumsFile, true);
+                nMismatch += got != ref;
+                if (auto it = expected.find(txo); !in.parentTxOutIdx && it != expected.end())
+                    nWrong += got != it->second;
+                else
+                    nWrong += got.has_value();
+                nFound += got.has_value();
+                TEST_CHECK_MESSAGE(!fetcher.take(inum), "each result can only be taken once");
+            }
+            Log() << "prevouts found: " << nFound << " / " << (ppb->inputs.size() - 1u);
+            TEST_CHECK_MESSAGE(nFound > 0u, "some prevouts were found");
+            TEST_CHECK_MESSAGE(nMismatch == 0u, "batched fetch matches the per-key path for every input");
+            TEST_CHECK_MESSAGE(nWrong == 0u, "batched fetch matches what was written");
+        }
+    };
+    TEST_SUITE_END()
+
+    TEST_SUITE(headersram)
+    TEST_CASE(concurrent_reads_vs_truncate_and_append) {
+        // Each fake header is its height and a "version" (bumped on each simulated reorg) repeated over all 80 bytes,
+        // so that a read that mixes bytes from before and after an overwrite is easy to spot.
+        constexpr size_t kHdrSize = 80, kTip = 2000, kMaxReorg = 50;
+        const auto mkHeader = [](uint64_t height, uint64_t version) {
+            QByteArray h(int(kHdrSize), Qt::Uninitialized);
+            const uint64_t word = height << 32u | version;
+            for (size_t i = 0; i < kHdrSize; i += sizeof(word))
+                std::memcpy(h.data() + i, &word, sizeof(word));
+            return h;
+        };
+        // Returns the version if `h` is a well-formed header for `height`, else nullopt
+        const auto checkHeader = [](const QByteArray &h, uint64_t height) -> std::optional<uint64_t> {
+            uint64_t word0;
+            if (size_t(h.size()) != kHdrSize) return std::nullopt;
+            std::memcpy(&word0, h.constData(), sizeof(word0));
+            for (size_t i = sizeof(word0); i < kHdrSize; i += sizeof(word0))
+                if (std::memcmp(h.constData() + i, &word0, sizeof(word0)) != 0) return std::nullopt; // torn
+            if (word0 >> 32u != height) return std::nullopt;
+            return word0 & 0xffffffffu;
+        };
+        HeadersRam hr(kHdrSize);
+        for (size_t h = 0; h < kTip; ++h)
+            hr.append(mkHeader(h, 0));
+
+        std::atomic_bool stop = false;
+        std::atomic_size_t nReads = 0, nBad = 0, nMissing = 0;
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t)
+            readers.emplace_back([&] {
+                auto *rng = QRandomGenerator::global();
+                while (!stop) {
+                    const size_t height = kTip - 1u - rng->bounded(quint32(2 * kMaxReorg));
+                    if (const auto opt = hr.get(height)) {
+                        nBad += !checkHeader(*opt, height);
+                    } else
+                        ++nMissing; // truncated away at the moment, fine
+                    // a range read must be internally consistent too: all from the same version of the chain tip
+                    const auto vec = hr.get(height - kMaxReorg, 2 * kMaxReorg);
+                    std::optional<uint64_t> lastVersion;
+                    for (size_t i = 0; i < vec.size(); ++i) {
+                        const auto v = checkHeader(vec[i], height - kMaxReorg + i);
+                        nBad += !v || (lastVersion && *v < *lastVersion);
+                        lastVersion = v;
+                    }
+                    nReads += 2;
+                }
+            });
+        // the writer: simulated reorgs of random depth, each replacing the tip with new versions of the headers
+        auto *rng = QRandomGenerator::global();
+        const Tic t0;
+        unsigned nReorgs = 0;
+        for (uint64_t version = 1; t0.msec<int>() < 500 || nReads < 10'000u; ++version, ++nReorgs) {
+            const size_t depth = 1u + rng->bounded(quint32(kMaxReorg));
+            hr.truncate(kTip - depth);
+            for (size_t h = kTip - depth; h < kTip; ++h)
+                hr.append(mkHeader(h, version));
+            if (t0.msec<int>() > 10'000) break; // paranoia: don't hang if the readers are starved
+        }
+        stop = true;
+        for (auto & t : readers) t.join();
+        Log() << nReorgs << " reorgs, " << nReads.load() << " reads, " << nMissing.load() << " found truncated";
+        TEST_CHECK_MESSAGE(nBad == 0u, "no read returned a torn or misplaced header, or a mix of chain versions");
+        TEST_CHECK(hr.size() == kTip);
+        TEST_CHECK((checkHeader(hr.get(kTip - 1u).value_or(QByteArray{}), kTip - 1u).has_value()));
+    };
+    TEST_SUITE_END()
+
+    /// A Storage on a throwaway datadir, for tests that need the real startup(), addBlock() and undoLatestBlock()
+    /// paths. Blocks are coinbase-only: the coinbase pays 1 output to each of the scripts named in addBlock(), so each
+    /// block adds exactly 1 tx (and 1 utxo) to the history of each of those scripthashes.
+    struct TestChain {
+        QTemporaryDir tmpDir;
+        std::shared_ptr<Options> options;
+        std::shared_ptr<Storage> storage;
+        std::vector<bitcoin::uint256> blockHashes; ///< of the blocks currently in `storage`, by height
+        int salt = 0; ///< bumped by undo() so that a re-added height gets a different block (and coinbase txid)
+
+        explicit TestChain(const std::function<void(Options &)> &tweakOptions = {}) {
+            if (!tmpDir.isValid()) throw Exception("Failed to create a temporary directory");
+            auto opts = std::make_shared<Options>();
+            opts->datadir = tmpDir.path();
+            opts->db.maxMem = Options::DBOpts::maxMemMin;
+            opts->rpa.enabledSpec = Options::Rpa::EnabledSpec::Disabled;
+            if (tweakOptions) tweakOptions(*opts);
+            options = std::move(opts);
+            open();
+        }
+        ~TestChain() { close(); }
+
+        void open() { storage = std::make_shared<Storage>(options); storage->startup(); }
+        void close() { storage.reset(); } ///< clean shutdown, which also writes the blkInfo snapshot
+
+        static bitcoin::CScript script(const QString &name) {
+            const QByteArray b = name.toUtf8();
+            const auto *d = reinterpret_cast<const uint8_t *>(b.constData());
+            return bitcoin::CScript(d, d + b.size());
+        }
+        static HashX hashX(const QString &name) { return BTC::HashXFromCScript(script(name)); }
+
+        /// Adds the next block, paying to the scripts in `payTo` (or to "miner" if empty). Returns its coinbase txid.
+        TxHash addBlock(const QStringList &payTo = {}, bool notifySubs = false) {
+            const auto height = BlockHeight(blockHashes.size());
+            bitcoin::CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout.SetNull();
+            tx.vin[0].scriptSig = bitcoin::CScript() << int64_t(height) << int64_t(salt);
+            for (const auto & name : payTo.isEmpty() ? QStringList{"miner"} : payTo)
+                tx.vout.emplace_back(bitcoin::COIN, script(name));
+            bitcoin::CBlock block;
+            block.nVersion = 4;
+            if (!blockHashes.empty()) block.hashPrevBlock = blockHashes.back();
+            block.nTime = 1'700'000'000u + height * 600u;
+            block.nBits = 0x207fffffu;
+            block.vtx.push_back(bitcoin::MakeTransactionRef(std::move(tx)));
+            block.hashMerkleRoot = block.vtx.front()->GetHashRef();
+            const auto ppb = PreProcessedBlock::makeShared(height, size_t(BTC::Serialize(block).size()), block, nullptr);
+            storage->addBlock(ppb, true /* save undo */, 0, notifySubs);
+            blockHashes.push_back(block.GetHash());
+            return ppb->txInfos.front().hash;
+        }
+        void undo() {
+            storage->undoLatestBlock();
+            blockHashes.pop_back();
+            ++salt;
+        }
+    };
+
+    /// Returns the number of scripthash_history entries and scripthash_unspent utxos of `sh` in the given dbs, as of
+    /// the snapshots in `shistOpts` and `shunspentOpts` (e.g. those of a read view)
+    std::pair<size_t, size_t> scriptHashCounts(rocksdb::DB *shist, rocksdb::DB *shunspent, const HashX &sh,
+                                               const rocksdb::ReadOptions &shistOpts,
+                                               const rocksdb::ReadOptions &shunspentOpts) {
+        static const QString err("Error reading scripthash_history");
+        const auto nums = GenericDBGet<std::vector<TxNum>>(shist, sh, true, err, false, shistOpts);
+        size_t nUtxos = 0;
+        std::unique_ptr<rocksdb::Iterator> it(shunspent->NewIterator(shunspentOpts));
+        for (it->Seek(ToSlice(sh)); it->Valid() && it->key().starts_with(ToSlice(sh)); it->Next())
+            ++nUtxos;
+        return {nums ? nums->size() : 0u, nUtxos};
+    }
+
+    TEST_SUITE(blkinfosnapshot)
+    TEST_CASE(file_format) {
+        QTemporaryDir tmpDir;
+        if (!tmpDir.isValid()) throw Exception("Failed to create a temporary directory");
+        const QString path = BlkInfoSnapshot::path(tmpDir.path());
+        TEST_CHECK_MESSAGE(!BlkInfoSnapshot::load(path), "no file: nothing to load");
+
+        std::vector<BlkInfo> infos;
+        TxNum total = 0;
+        while (infos.size() < 1'000u) {
+            const uint32_t nTx = 1u + QRandomGenerator::global()->bounded(5'000u);
+            infos.emplace_back(total, nTx);
+            total += nTx;
+        }
+        const BlockHash tip = randomHash();
+        std::vector<QByteArray> hdrs;
+        for (int i = 0; i < 100; ++i) hdrs.push_back(randomHash() + randomHash() + randomHash().left(16));
+        BlkInfoSnapshot::save(path, infos, tip, BlkInfoSnapshot::hashHeaders(hdrs));
+        QFile f(path);
+        TEST_CHECK(f.open(QIODevice::ReadOnly));
+        const QByteArray good = f.readAll();
+        f.close();
+        TEST_CHECK(size_t(good.size()) == BlkInfoSnapshot::kHeaderBytes + infos.size() * BlkInfoSnapshot::kRecordBytes + HashLen);
+        const auto snap = BlkInfoSnapshot::load(path);
+        TEST_CHECK_MESSAGE(snap && snap->blkInfos == infos && snap->tipHash == tip
+                           && snap->headersHash == BlkInfoSnapshot::hashHeaders(hdrs), "round trip");
+        if (!snap) return;
+
+        // what the startup code checks before trusting a (well-formed) snapshot
+        TEST_CHECK_MESSAGE(snap->matches(infos.size(), tip), "matches the chain it was taken of");
+        TEST_CHECK_MESSAGE(!snap->matches(infos.size() - 1u, tip), "rejected if the block count differs");
+        TEST_CHECK_MESSAGE(!snap->matches(infos.size(), randomHash()), "rejected if the tip differs");
+        TEST_CHECK_MESSAGE(snap->matchesHeaders(hdrs), "matches the headers it was taken of");
+        auto otherHdrs = hdrs;
+        otherHdrs[50][70] = char(otherHdrs[50].at(70) ^ 0x1);
+        TEST_CHECK_MESSAGE(!snap->matchesHeaders(otherHdrs), "rejected if any header differs");
+        TEST_CHECK_MESSAGE(!snap->matchesHeaders({hdrs.begin(), hdrs.end() - 1}), "rejected if a header is missing");
+        TEST_CHECK_MESSAGE(BlkInfoSnapshot::isConsistent(infos, infos.size(), total), "consistent with the db");
+        TEST_CHECK_MESSAGE(!BlkInfoSnapshot::isConsistent(infos, infos.size() + 1u, total), "wrong number of blocks");
+        TEST_CHECK_MESSAGE(!BlkInfoSnapshot::isConsistent(infos, infos.size(), total + 1u), "wrong number of txs");
+        auto gap = infos;
+        ++gap[500].txNum0;
+        TEST_CHECK_MESSAGE(!BlkInfoSnapshot::isConsistent(gap, gap.size(), total), "txNums not contiguous");
+        auto empty = infos;
+        empty.back().nTx = 0;
+        TEST_CHECK_MESSAGE(!BlkInfoSnapshot::isConsistent(empty, empty.size(), total - infos.back().nTx), "empty block");
+
+        // corrupt, truncated, or foreign files are rejected by load()
+        const auto write = [&path](const QByteArray &bytes) {
+            QFile out(path);
+            if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate) || out.write(bytes) != bytes.size())
+                throw Exception("Failed to write test file");
+        };
+        const auto rejected = [&](const QByteArray &bytes) {
+            write(bytes);
+            try { BlkInfoSnapshot::load(path); } catch (const std::exception &) { return true; }
+            return false;
+        };
+        // re-checksums `bytes` (minus its old checksum), so that only the field under test is wrong
+        const auto rechecksummed = [](QByteArray bytes) {
+            bytes.chop(HashLen);
+            return bytes + BTC::Hash(bytes);
+        };
+        auto flipped = good;
+        const int flipPos = int(BlkInfoSnapshot::kHeaderBytes) + 100;
+        flipped[flipPos] = char(flipped.at(flipPos) ^ 0x1);
+        TEST_CHECK_MESSAGE(rejected(flipped), "bad checksum");
+        TEST_CHECK_MESSAGE(rejected(good.left(good.size() - 1)), "truncated");
+        TEST_CHECK_MESSAGE(rejected(rechecksummed(good.left(good.size() - qsizetype(HashLen)) + QByteArray(1 + HashLen, '\0'))),
+                           "size does not match the count");
+        TEST_CHECK_MESSAGE(rejected(good.left(10)), "short");
+        auto badMagic = good, badVersion = good;
+        bitcoin::WriteLE32(reinterpret_cast<uint8_t *>(badMagic.data()), BlkInfoSnapshot::kMagic + 1u);
+        bitcoin::WriteLE32(reinterpret_cast<uint8_t *>(badVersion.data()) + 4, BlkInfoSnapshot::kVersion + 1u);
+        TEST_CHECK_MESSAGE(rejected(rechecksummed(badMagic)), "bad magic");
+        TEST_CHECK_MESSAGE(rejected(rechecksummed(badVersion)), "unknown version");
+
+        // loadAndDelete() never throws on a bad file, and never leaves the file behind
+        write(flipped);
+        TEST_CHECK_MESSAGE(!BlkInfoSnapshot::loadAndDelete(path) && !QFile::exists(path), "bad file ignored and deleted");
+        write(good);
+        const auto snap2 = BlkInfoSnapshot::loadAndDelete(path);
+        TEST_CHECK_MESSAGE(snap2 && snap2->blkInfos == infos && !QFile::exists(path), "good file loaded and deleted");
+
+        bool threw = false;
+        try { BlkInfoSnapshot::save(path, infos, tip.left(10), snap->headersHash); } catch (const BadArgs &) { threw = true; }
+        TEST_CHECK_MESSAGE(threw && !QFile::exists(path), "save() refuses a bad tip hash");
+        threw = false;
+        try { BlkInfoSnapshot::save(path, infos, tip, {}); } catch (const BadArgs &) { threw = true; }
+        TEST_CHECK_MESSAGE(threw && !QFile::exists(path), "save() refuses a bad headers hash");
+    };
+    TEST_CASE(restart) {
+        TestChain chain;
+        const QString path = BlkInfoSnapshot::path(chain.options->datadir);
+        // With coinbase-only blocks, txNum == height, so any blkInfos that don't match the db show up here
+        const auto checkBlkInfos = [&chain](const char *what) {
+            const size_t n = chain.blockHashes.size();
+            bool ok = chain.storage->latestTip().first == int(n) - 1 && chain.storage->getTxNum() == n;
+            for (size_t h = 0; ok && h < n; ++h)
+                ok = chain.storage->heightForTxNum(TxNum(h)) == std::optional<unsigned>(h);
+            TEST_CHECK_MESSAGE(ok, std::string("blkInfos are correct after restart: ") + what);
+            TEST_CHECK_MESSAGE(!QFile::exists(BlkInfoSnapshot::path(chain.options->datadir)),
+                               std::string("snapshot is deleted on startup: ") + what);
+        };
+        for (int i = 0; i < 30; ++i) chain.addBlock();
+        chain.close();
+        TEST_CHECK_MESSAGE(QFile::exists(path), "clean shutdown writes a snapshot");
+        const auto before = BlkInfoSnapshot::load(path).value();
+        chain.open();
+        checkBlkInfos("good snapshot");
+
+        // well-formed, but disagrees with the db: must not be used
+        chain.close();
+        auto bad = before.blkInfos;
+        bad[10].nTx = 2;
+        bad[11].txNum0 = 12;
+        BlkInfoSnapshot::save(path, bad, before.tipHash, before.headersHash);
+        chain.open();
+        checkBlkInfos("inconsistent snapshot");
+
+        // taken before a reorg (with an older Fulcrum, or restored from a backup): must not be used
+        chain.undo();
+        chain.undo();
+        for (int i = 0; i < 3; ++i) chain.addBlock();
+        chain.close();
+        TEST_CHECK(BlkInfoSnapshot::load(path).value().tipHash != before.tipHash);
+        BlkInfoSnapshot::save(path, before.blkInfos, before.tipHash, before.headersHash);
+        chain.open();
+        checkBlkInfos("stale snapshot, longer chain");
+        chain.undo();
+        chain.close();
+        const auto sameLength = BlkInfoSnapshot::load(path).value();
+        chain.open();
+        chain.undo();
+        chain.addBlock();
+        chain.close();
+        TEST_CHECK(BlkInfoSnapshot::load(path).value().tipHash != sameLength.tipHash);
+        BlkInfoSnapshot::save(path, sameLength.blkInfos, sameLength.tipHash, sameLength.headersHash);
+        chain.open();
+        checkBlkInfos("stale snapshot, same length chain");
+
+        // garbage
+        chain.close();
+        QFile f(path);
+        TEST_CHECK(f.open(QIODevice::WriteOnly | QIODevice::Truncate) && f.write(QByteArray(1000, 'x')) == 1000);
+        f.close();
+        chain.open();
+        checkBlkInfos("corrupt snapshot");
+
+        // a good snapshot, but a header in the middle of the headers file changed since it was taken: the snapshot
+        // must not let that go unverified, so startup falls back to verifying every header, which catches it
+        chain.close();
+        TEST_CHECK(QFile::exists(path));
+        QFile hf(chain.options->datadir + QDir::separator() + "headers");
+        TEST_CHECK(hf.open(QIODevice::ReadWrite));
+        const qint64 hdrSize = BTC::GetBlockHeaderSize(), nTimeOffset = 4 + HashLen + HashLen; // after nVersion, hashPrevBlock, hashMerkleRoot
+        const qint64 nHdrs = qint64(chain.blockHashes.size());
+        const qint64 pos = hf.size() - nHdrs * hdrSize + 10 * hdrSize + nTimeOffset; // header 10's nTime
+        TEST_CHECK(hf.seek(pos));
+        const QByteArray orig = hf.read(1);
+        TEST_CHECK(orig.size() == 1 && hf.seek(pos) && hf.write(QByteArray(1, char(orig.at(0) ^ 0x1))) == 1);
+        hf.close();
+        bool refused = false;
+        try { chain.open(); } catch (const std::exception &) { refused = true; }
+        TEST_CHECK_MESSAGE(refused, "a changed header is caught even with a good snapshot");
+    };
+    TEST_SUITE_END()
+
+    TEST_SUITE(resultcache)
+    TEST_CASE(invalidation) {
+        TestChain chain([](Options &o) { o.resultCacheBytes = Options::resultCacheBytesMin; });
+        Storage & st = *chain.storage;
+        const HashX a = TestChain::hashX("a"), b = TestChain::hashX("b");
+        chain.addBlock({"a", "b"}, true);
+        // what get_history does: returns the history size (as of when it was computed), counting the computations
+        unsigned nComputed = 0;
+        const auto historySize = [&](const HashX &sh) {
+            return st.resultCacheGetOrCompute(sh, QByteArrayLiteral("h"), [&] {
+                ++nComputed;
+                return QVariant(qulonglong(st.getHistory(sh, true, true).size()));
+            }).toULongLong();
+        };
+        TEST_CHECK(historySize(a) == 1u && historySize(b) == 1u && nComputed == 2u);
+        TEST_CHECK_MESSAGE(historySize(a) == 1u && nComputed == 2u, "repeat query is served from the cache");
+
+        // new tip: a block touching `a` advances the mempool/chain generation, and drops a's results but not b's
+        const auto gen0 = st.stateGeneration();
+        chain.addBlock({"a"}, true);
+        TEST_CHECK_MESSAGE(st.stateGeneration() != gen0, "a new block advances the mempool/chain generation");
+        TEST_CHECK_MESSAGE(historySize(a) == 2u && nComputed == 3u, "a stale result is not served after a new block");
+        TEST_CHECK_MESSAGE(historySize(b) == 1u && nComputed == 3u, "results for scripthashes the block didn't touch stay");
+
+        // mempool change: what the mempool synch does when txs involving `b` arrive or are dropped
+        const auto gen1 = st.stateGeneration();
+        const auto bGen1 = st.resultCacheGeneration(b);
+        st.resultCacheInvalidate({b});
+        TEST_CHECK_MESSAGE(st.stateGeneration() != gen1, "a mempool change advances the mempool/chain generation");
+        TEST_CHECK_MESSAGE(historySize(b) == 1u && nComputed == 4u, "a stale result is not served after a mempool change");
+        TEST_CHECK_MESSAGE(historySize(a) == 2u && nComputed == 4u, "other scripthashes stay cached");
+
+        // a result whose computation overlapped an invalidation of its scripthash may be stale, so it is returned but
+        // not cached
+        const QByteArray racy = QByteArrayLiteral("racy");
+        const auto r = st.resultCacheGetOrCompute(b, racy, [&] {
+            st.resultCacheInvalidate({b}); // as if a mempool tx involving `b` arrived while we were computing
+            return QVariant(42);
+        });
+        TEST_CHECK(r.toInt() == 42);
+        TEST_CHECK_MESSAGE(!st.resultCacheGet(b, racy), "result computed across an invalidation of its scripthash is not cached");
+        st.resultCachePut(b, racy, QVariant(43), bGen1);
+        TEST_CHECK_MESSAGE(!st.resultCacheGet(b, racy), "resultCachePut with an old generation is a no-op");
+
+        // ... but a mempool change that does not involve `a` does not throw away a result being computed for `a`
+        const auto a2 = st.resultCacheGetOrCompute(a, racy, [&] {
+            st.resultCacheInvalidate({b});
+            return QVariant(44);
+        });
+        TEST_CHECK(a2.toInt() == 44);
+        TEST_CHECK_MESSAGE(st.resultCacheGet(a, racy).value_or(QVariant()).toInt() == 44,
+                           "an invalidation of another scripthash does not stop the put");
+
+        // reorg: drops everything
+        chain.undo();
+        TEST_CHECK_MESSAGE(historySize(a) == 1u && historySize(b) == 1u && nComputed == 6u, "nothing is served across a reorg");
+    };
+    TEST_SUITE_END()
+
+    TEST_SUITE(rawtxcache)
+    TEST_CASE(bounds_and_invalidation) {
+        {
+            TestChain chain([](Options &o) { o.rawTxCacheBytes = 0; });
+            Storage & st = *chain.storage;
+            const TxHash h = randomHash();
+            st.rawTxCachePut(h, QByteArrayLiteral("raw"));
+            TEST_CHECK_MESSAGE(!st.isRawTxCacheEnabled() && !st.rawTxCacheGet(h), "a disabled cache stores nothing");
+        }
+        TestChain chain([](Options &o) { o.rawTxCacheBytes = Options::rawTxCacheBytesMin; });
+        Storage & st = *chain.storage;
+        TEST_CHECK(st.isRawTxCacheEnabled());
+        const auto cacheStats = [&st] {
+            return st.stats().toMap().value("caches").toMap().value("LRU Cache: TxHash -> Raw Tx").toMap();
+        };
+
+        // put no-ops: bad hash length, empty raw tx
+        st.rawTxCachePut(QByteArrayLiteral("short"), QByteArrayLiteral("raw"));
+        st.rawTxCachePut(randomHash(), QByteArray());
+        TEST_CHECK_MESSAGE(cacheStats().value("nItems").toLongLong() == 0, "invalid puts are ignored");
+
+        // size bound: put ~3x the budget in 100 KB txs; the oldest get evicted, the newest stay
+        std::vector<TxHash> hashes;
+        bool withinBudget = true;
+        for (int i = 0; i < 300; ++i) {
+            hashes.push_back(randomHash());
+            st.rawTxCachePut(hashes.back(), QByteArray(100'000, char(i)));
+            const auto m = cacheStats();
+            withinBudget = withinBudget && m.value("Size bytes").toLongLong() <= m.value("max bytes").toLongLong();
+        }
+        TEST_CHECK_MESSAGE(withinBudget, "the cache never exceeds its byte budget");
+        TEST_CHECK_MESSAGE(!st.rawTxCacheGet(hashes.front()), "the least recently used tx was evicted");
+        const auto newest = st.rawTxCacheGet(hashes.back());
+        TEST_CHECK_MESSAGE(newest && *newest == QByteArray(100'000, char(299)), "the most recent tx is cached");
+        TEST_CHECK(cacheStats().value("nItems").toLongLong() < 300);
+
+        // mempool drop: what the mempool synch does with the txids it dropped
+        const TxHash a = randomHash(), b = randomHash();
+        st.rawTxCachePut(a, QByteArrayLiteral("tx a"));
+        st.rawTxCachePut(b, QByteArrayLiteral("tx b"));
+        st.rawTxCacheRemove(Mempool::TxHashSet{a});
+        TEST_CHECK_MESSAGE(!st.rawTxCacheGet(a), "a dropped mempool tx is no longer served");
+        TEST_CHECK_MESSAGE(st.rawTxCacheGet(b) == QByteArrayLiteral("tx b"), "other txs stay cached");
+
+        // reorg: a tx from the undone block (and anything else) must not be served afterwards
+        chain.addBlock();
+        const TxHash cb = chain.addBlock();
+        st.rawTxCachePut(cb, QByteArrayLiteral("coinbase"));
+        TEST_CHECK(st.rawTxCacheGet(cb).has_value());
+        chain.undo();
+        TEST_CHECK_MESSAGE(!st.rawTxCacheGet(cb) && !st.rawTxCacheGet(b), "nothing is served across a reorg");
+        TEST_CHECK(cacheStats().value("nItems").toLongLong() == 0);
+    };
+    TEST_SUITE_END()
+
+    TEST_SUITE(utxosetstats)
+    TEST_CASE(counts) {
+        TestChain chain;
+        const QStringList names = {"a", "b", "c", "miner"};
+        chain.addBlock({"a", "b", "c"});
+        chain.addBlock({"a", "miner"});
+        chain.addBlock();
+        size_t nUtxos = 0;
+        for (const auto & name : names)
+            nUtxos += chain.storage->listUnspent(TestChain::hashX(name), Storage::TokenFilterOption::IncludeTokens).size();
+        const auto stats = chain.storage->calcUTXOSetStats();
+        TEST_CHECK(nUtxos == 6u);
+        TEST_CHECK_MESSAGE(stats.utxo_db_ct == nUtxos, "utxo_db_ct counts UTXOs, not utxoset keys");
+        TEST_CHECK_MESSAGE(stats.shunspent_db_ct == nUtxos, "both dbs agree");
+        TEST_CHECK(stats.utxo_db_bucket_ct >= 1u && stats.utxo_db_bucket_ct <= stats.utxo_db_ct);
+        TEST_CHECK(stats.block_height == 2u && stats.block_hash == chain.storage->latestTip().second);
+    };
+    TEST_SUITE_END()
+
+} // end anon namespace
+
+/* static */
+void Storage::utxoRamTest()
+{
+    QTemporaryDir tmpDir;
+    if (!tmpDir.isValid()) throw Exception("Failed to create a temporary directory");
+    auto openDB = [&tmpDir](const QString &name, bool isUtxoSet) {
+        rocksdb::Options opts;
+        opts.create_if_missing = true;
+        if (isUtxoSet) opts.merge_operator = std::make_shared<UtxoSetBucketOperator>();
+        rocksdb::DB *pdb{};
+        if (auto st = rocksdb::DB::Open(opts, tmpDir.filePath(name).toStdString(), &pdb); !st.ok())
+            throw Exception(QString("Failed to open db %1: %2").arg(name, QString::fromStdString(st.ToString())));
+        return std::unique_ptr<rocksdb::DB>(pdb);
+    };
+    const auto utxosetNormal = openDB("utxoset_normal", true), shunspentNormal = openDB("shunspent_normal", false),
+               utxosetRam = openDB("utxoset_ram", true), shunspentRam = openDB("shunspent_ram", false);
+    const auto txNumsFile = std::make_unique<RecordFile>(tmpDir.filePath("txnum2txhash"), HashLen);
+    const rocksdb::ReadOptions readOpts;
+    const rocksdb::WriteOptions writeOpts;
+    auto cache = std::make_unique<UTXOCache>("Test In-RAM UTXO Set", utxosetRam, shunspentRam, txNumsFile, readOpts,
+                                             writeOpts);
+
+    // Apply the same random blocks both directly to the "normal" dbs, and to the "ram" dbs via the UTXOCache, the way
+    // addBlock + utxoRamMaintenance_nolock do it: checkpoint flushes, and past a certain height a budget that is too
+    // small, so that the bounded (fall-back) behavior gets exercised too.
+    auto *rng = QRandomGenerator::global();
+    std::vector<std::tuple<TXO, HashX, CompactTXO>> unspent;
+    constexpr unsigned nBlocks = 300, checkpointInterval = 40, fallBackHeight = 200;
+    size_t budget = 0;
+    TxNum txNum = 0;
+    for (unsigned height = 0; height < nBlocks; ++height) {
+        UTXOBatch normal, ram(cache.get());
+        const size_t nSpends = rng->bounded(quint32(std::min<size_t>(unspent.size(), 60u) + 1u));
+        for (size_t i = 0; i < nSpends; ++i) {
+            const size_t idx = rng->bounded(quint32(unspent.size()));
+            const auto [txo, hashX, ctxo] = unspent[idx];
+            unspent[idx] = unspent.back();
+            unspent.pop_back();
+            normal.remove(txo, hashX, ctxo);
+            ram.remove(txo, hashX, ctxo);
+        }
+        for (unsigned t = 0, nTxs = 1u + rng->bounded(20u); t < nTxs; ++t, ++txNum) {
+            const TxHash txid = randomHash();
+            if (!txNumsFile->appendRecord(txid)) throw Exception("Failed to append to the txnum2txhash file");
+            for (IONum n = 0, nOuts = 1u + rng->bounded(4u); n < nOuts; ++n) {
+                TXOInfo info;
+                info.amount = int64_t(rng->bounded(100'000'000)) * bitcoin::Amount::satoshi();
+                info.hashX = randomHash();
+                info.confirmedHeight.emplace(height);
+                info.txNum = txNum;
+                const TXO txo{txid, n};
+                const CompactTXO ctxo(txNum, n);
+                normal.add(txo, info, ctxo);
+                ram.add(txo, info, ctxo);
+                unspent.emplace_back(txo, info.hashX, ctxo);
+            }
+        }
+        GenericBatchWrite(utxosetNormal.get(), normal.p->utxosetBatch, "utxoset", writeOpts);
+        GenericBatchWrite(shunspentNormal.get(), normal.p->shunspentBatch, "shunspent", writeOpts);
+        if (height == fallBackHeight) budget = cache->memUsage() / 2u;
+        if (budget && cache->memUsage() > budget) cache->limitSize(budget * 3u / 4u);
+        if ((height + 1u) % checkpointInterval == 0u) cache->flush();
+    }
+    cache.reset(); // implicitly flushes, as at the end of initial sync
+
+    // Buckets may list their entries in a different order (the cache flushes in its own order), and fully-spent
+    // buckets only exist on the normal side (until compaction drops them), so compare the entry sets per key.
+    auto dump = [](rocksdb::DB *db, bool isUtxoSet) {
+        std::map<QByteArray, QByteArray> ret;
+        std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(rocksdb::ReadOptions{}));
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            QByteArray val(it->value().data(), int(it->value().size()));
+            if (isUtxoSet) {
+                std::vector<std::pair<TxNum, Span<const char>>> entries;
+                if (!splitUtxoSetBucket(Span<const char>{val.constData(), size_t(val.size())}, entries))
+                    throw Exception("Failed to parse a utxoset bucket");
+                if (entries.empty()) continue;
+                std::vector<QByteArray> sorted;
+                for (const auto & e : entries)
+                    sorted.emplace_back(e.second.data(), int(e.second.size()));
+                std::sort(sorted.begin(), sorted.end());
+                val.clear();
+                for (const auto & e : sorted)
+                    val += e;
+            }
+            ret.emplace(QByteArray(it->key().data(), int(it->key().size())), std::move(val));
+        }
+        if (!it->status().ok()) throw Exception("Iteration failed");
+        return ret;
+    };
+    const auto utxosNormal = dump(utxosetNormal.get(), true), utxosRam = dump(utxosetRam.get(), true);
+    const auto shunspentsNormal = dump(shunspentNormal.get(), false), shunspentsRam = dump(shunspentRam.get(), false);
+    Log() << "utxoset keys: " << utxosNormal.size() << ", scripthash_unspent keys: " << shunspentsNormal.size()
+          << ", unspent: " << unspent.size();
+    TEST_CHECK_MESSAGE(shunspentsNormal.size() == unspent.size(), "scripthash_unspent has every unspent coin");
+    TEST_CHECK_MESSAGE(utxosRam == utxosNormal, "utxoset contents are the same in both modes");
+    TEST_CHECK_MESSAGE(shunspentsRam == shunspentsNormal, "scripthash_unspent contents are the same in both modes");
+}
+
+/* static */
+void Storage::readViewReorgTest()
+{
+    TestChain chain;
+    Storage & st = *chain.storage;
+    const HashX sh = TestChain::hashX("a");
+    const auto countsInView = [&](const Pvt::ReadViewPtr &view) {
+        return scriptHashCounts(st.p->db.shist.get(), st.p->db.shunspent.get(), sh, view->shistReadOpts,
+                                view->shunspentReadOpts);
+    };
+
+    for (int i = 0; i < 10; ++i) chain.addBlock({"a"});
+    const auto before = st.p->currentReadView();
+    TEST_CHECK(before->tipHeight == 9u && before->txNumNext == 10u);
+    TEST_CHECK((countsInView(before) == std::pair<size_t, size_t>{10u, 10u}));
+
+    // undoLatestBlock takes rewindLock exclusively, so it waits for a reader that is still using the current view
+    // (and would go on to resolve its txNums to heights via the blkInfos that the undo truncates).
+    std::thread undoer;
+    {
+        SharedLockGuard g(st.p->rewindLock);
+        undoer = std::thread([&chain] { chain.undo(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        TEST_CHECK_MESSAGE(st.p->currentReadView() == before, "undo waits for readers holding rewindLock");
+        TEST_CHECK_MESSAGE(st.heightsForTxNums({9u}).front() == std::optional<unsigned>(9u), "the reader can still resolve the tip's txNums");
+    }
+    undoer.join();
+    chain.undo();
+
+    const auto after = st.p->currentReadView();
+    TEST_CHECK_MESSAGE(after->tipHeight == 7u && after->txNumNext == 8u, "undo publishes the rewound view");
+    TEST_CHECK_MESSAGE((countsInView(after) == std::pair<size_t, size_t>{8u, 8u}), "the rewound view doesn't see the undone blocks");
+    TEST_CHECK_MESSAGE((countsInView(before) == std::pair<size_t, size_t>{10u, 10u}), "a view taken before the reorg still sees the old chain");
+    TEST_CHECK_MESSAGE(st.getHistory(sh, true, false).size() == 8u, "queries see the rewound chain");
+    TEST_CHECK_MESSAGE(st.listUnspent(sh, TokenFilterOption::IncludeTokens).size() == 8u, "utxos of the undone blocks are gone");
+
+    chain.addBlock({"a"});
+    const auto readded = st.p->currentReadView();
+    TEST_CHECK_MESSAGE(readded->tipHeight == 8u && readded->txNumNext == 9u, "the chain grows again after the reorg");
+    TEST_CHECK((countsInView(readded) == std::pair<size_t, size_t>{9u, 9u}));
+}
+
+/* static */
+void Storage::readViewConcurrentAddTest()
+{
+    TestChain chain;
+    Storage & st = *chain.storage;
+    const HashX sh = TestChain::hashX("a");
+    std::mutex txidsMut;
+    std::vector<TxHash> txids{chain.addBlock({"a"})}; ///< coinbase txids of the blocks added so far, guarded by txidsMut
+    const auto lastTxid = [&] { std::unique_lock g(txidsMut); return txids.back(); };
+
+    // Readers do what getHistory & co do: take rewindLock (shared) and the current view, then make several reads
+    // through it. Every block pays `sh` exactly once, so everything read must agree with the view's tip.
+    std::atomic_bool stop = false;
+    std::atomic_size_t nReads = 0, nBad = 0, nBadQueries = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t)
+        readers.emplace_back([&] {
+            while (!stop) {
+                {
+                    SharedLockGuard g(st.p->rewindLock);
+                    const auto view = st.p->currentReadView();
+                    const size_t n = view->tipHeight.value_or(0u) + 1u;
+                    // 1 tx per block, so the view's txNumNext must be 1 past its tip
+                    bool ok = view->tipHeight && view->txNumNext == n;
+                    // several reads through the same view: history and utxos of `sh` both stop at the view's tip,
+                    // even if blocks were added in between them
+                    const auto [nHist, nUtxos] = scriptHashCounts(st.p->db.shist.get(), st.p->db.shunspent.get(), sh,
+                                                                  view->shistReadOpts, view->shunspentReadOpts);
+                    std::this_thread::yield();
+                    const auto again = scriptHashCounts(st.p->db.shist.get(), st.p->db.shunspent.get(), sh,
+                                                        view->shistReadOpts, view->shunspentReadOpts);
+                    ok = ok && nHist == n && nUtxos == n && again == std::pair(nHist, nUtxos);
+                    // ... and the view's last txNum resolves to the view's tip
+                    ok = ok && st.heightsForTxNums({view->txNumNext - 1u}).front() == view->tipHeight;
+                    nBad += !ok;
+                }
+                // the public query, which must never see a partially-applied block either
+                const auto hist = st.getHistory(sh, true, false);
+                bool ok = !hist.empty();
+                for (size_t i = 0; ok && i < hist.size(); ++i)
+                    ok = hist[i].height == int(i);
+                // ... and neither may utxoGet: the last block added is fully applied, so its coinbase output is there
+                const auto optInfo = st.utxoGet(TXO{lastTxid(), 0});
+                ok = ok && optInfo && optInfo->hashX == sh;
+                nBadQueries += !ok;
+                ++nReads;
+            }
+        });
+    const Tic t0;
+    unsigned nAdded = 0;
+    for (; nAdded < 200u || (nReads < 1'000u && t0.msec<int>() < 10'000); ++nAdded) {
+        const auto txid = chain.addBlock({"a"});
+        std::unique_lock g(txidsMut);
+        txids.push_back(txid);
+    }
+    stop = true;
+    for (auto & t : readers) t.join();
+    Log() << nAdded << " blocks added, " << nReads.load() << " reads";
+    TEST_CHECK_MESSAGE(nBad == 0u, "reads within a view agree with that view's tip, even while blocks are added");
+    TEST_CHECK_MESSAGE(nBadQueries == 0u, "getHistory and utxoGet always see whole blocks only");
+    const auto view = st.p->currentReadView();
+    TEST_CHECK(view->tipHeight == nAdded && view->txNumNext == nAdded + 1u);
+}
+
+namespace {
+    TEST_SUITE(utxoram)
+    TEST_CASE(flush_matches_normal_mode) { Storage::utxoRamTest(); };
+    TEST_SUITE_END()
+
+    TEST_SUITE(readview)
+    TEST_CASE(reorg) { Storage::readViewReorgTest(); };
+    TEST_CASE(concurrent_add) { Storage::readViewConcurrentAddTest(); };
+    TEST_SUITE_END()
+} // namespace
 #endif
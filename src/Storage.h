@@ -38,6 +38,7 @@
 #include <QByteArray>
 #include <QFlags>
 #include <QPointer>
+#include <QVariant>
 
 #include <atomic>
 #include <functional>
@@ -194,6 +195,9 @@ public:
     /// Given a TxNum, returns the block height for the TxNum's block (if it exists).
     /// Used to resolve scripthash_history -> block height for get_history. (thread safe, takes blkInfo lock)
     std::optional<unsigned> heightForTxNum(TxNum) const;
+    /// Batched version of the above: returns the height for each of `nums`, taking the blkInfo lock just once. If
+    /// `nums` is sorted (as scripthash histories are), all the heights are found in 1 forward merge pass.
+    std::vector<std::optional<unsigned>> heightsForTxNums(const std::vector<TxNum> &nums) const;
     /// Given a block height and a position in the block (txIdx), return a TxHash.  Never throws. Returns !has_value if
     /// height/posInBlock pair is not found (or in very unlikely cases, if there was an underlying low-level error).
     /// Thread safe, takes class-level locks.
@@ -205,7 +209,7 @@ public:
     /// Never throws. Missing or not found positions are marked with an empty optional in the resultant vector.
     /// Returns an empty vector if height exceeds the chain tip height.
     /// Thread safe, takes class-level locks.
-    /// @param existingBlocksLock - set to non-nullptr if you already took the class-level `blocksLock` from calling code (this param is for internal use only)
+    /// @param existingBlocksLock - set to non-nullptr if you already took the class-level `blocksLock` (or `rewindLock`) from calling code (this param is for internal use only)
     std::vector<std::optional<TxHash>> hashesForHeightAndPosVec(BlockHeight height, Span<const uint32_t> positionsInBlock,
                                                                 const SharedLockGuard *existingBlocksLock = nullptr) const;
 
@@ -221,6 +225,54 @@ public:
     /// Thread safe, takes class-level locks.
     std::vector<TxHash> txHashesForBlockInBitcoindMemoryOrder(BlockHeight height) const;
 
+    /// Given a block height, return the fully-computed merkle tree of the block's txs (leaves in bitcoind memory
+    /// order). Used by get_merkle and id_from_pos so that each proof is just a lookup plus O(log n) hash copies.
+    /// Results are cached (the tip block's tree is precomputed by addBlock once we are synched).
+    ///
+    /// Never throws. Returns nullptr if height is not found (or if there was an underlying low-level error).
+    ///
+    /// Thread safe, takes class-level locks.
+    std::shared_ptr<const Merkle::Tree> merkleTreeForBlock(BlockHeight height) const;
+
+    //-- raw tx cache (config option: rawtx_cache)
+    /// Returns true iff the raw tx cache is enabled (rawtx_cache > 0). Thread-safe.
+    bool isRawTxCacheEnabled() const;
+    /// Remember the serialized bytes `rawTx` for tx `txHash` (reversed, hex-encode-ready memory order). No-op if the
+    /// cache is disabled. Fed by the mempool synch and by the block downloader (for blocks near the tip). Thread-safe.
+    void rawTxCachePut(const TxHash &txHash, const QByteArray &rawTx);
+    /// Returns the cached serialized bytes for `txHash`, if any. Thread-safe.
+    std::optional<QByteArray> rawTxCacheGet(const TxHash &txHash) const;
+    /// Forget the txs in `txHashes` (called when txs are dropped from the mempool without being confirmed). Thread-safe.
+    void rawTxCacheRemove(const Mempool::TxHashSet &txHashes);
+
+    //-- query result cache (config option: result_cache)
+    /// Returns true iff the result cache is enabled (result_cache > 0). Thread-safe.
+    bool isResultCacheEnabled() const;
+    /// Returns the result cache generation of `sh`, which changes whenever its cached results are invalidated.
+    /// Callers must read this *before* computing a result they intend to pass to resultCachePut(). Thread-safe.
+    uint64_t resultCacheGeneration(const HashX &sh) const;
+    /// Returns the cached result of query `subKey` (which identifies the method and its params) for `sh`, if any.
+    /// Thread-safe.
+    std::optional<QVariant> resultCacheGet(const HashX &sh, const QByteArray &subKey) const;
+    /// Remember `result` for query `subKey` on `sh`. `generation` is the value of resultCacheGeneration(sh) from
+    /// before the result was computed; if `sh` was invalidated since then, the result may be stale and is not cached.
+    /// No-op if the cache is disabled. Thread-safe.
+    void resultCachePut(const HashX &sh, const QByteArray &subKey, const QVariant &result, uint64_t generation);
+    /// Returns the cached result of query `subKey` on `sh` if there is one, otherwise returns `compute()` (which may
+    /// throw), caching it per resultCachePut(). Thread-safe; `compute` runs on the calling thread with no locks held.
+    QVariant resultCacheGetOrCompute(const HashX &sh, const QByteArray &subKey, const std::function<QVariant()> &compute);
+    /// Forget all cached results for the scripthashes in `scriptHashes`. Must be called after any change to the
+    /// confirmed or mempool history of those scripthashes (addBlock, undoLatestBlock and the mempool synch do this).
+    /// Also advances stateGeneration(), even if the cache is disabled. Thread-safe.
+    void resultCacheInvalidate(const Mempool::ScriptHashesAffectedSet &scriptHashes);
+    /// Forget all cached results, and advance stateGeneration(). Thread-safe.
+    void resultCacheClear();
+
+    /// Returns the mempool/chain generation, which changes whenever the confirmed or mempool history of any
+    /// scripthash changes (a new block, a reorg, mempool txs added or dropped). Used by the servers to tell apart
+    /// requests made against different states (request coalescing, the daemon response cache). Thread-safe.
+    uint64_t stateGeneration() const;
+
     /// Returns the known size of the utxo set (for now this is a signed value -- to debug underflow errors)
     int64_t utxoSetSize() const;
     /// Returns the known size of the utxo set in millions of bytes
@@ -356,19 +408,21 @@ public:
     /// Thread-safe. Call this from any thread, but ideally call it from a threadPool worker thread, since it may take
     /// a while. Dumps all scripthashes as JSON data to output device outDev as an array of hex-encoded JSON strings,
     /// optionally indented by `indent*indentLevel` spaces. If indent is 0, the output will all be on 1 line with no
-    /// padding.
+    /// padding. The table is read by several threads from a common snapshot; the output is still in key order.
     size_t dumpAllScriptHashes(QIODevice *outDev, unsigned indent=0, unsigned indentLevel=0, const DumpProgressFunc & = {}, size_t progInterval = 100000) const;
 
     struct UTXOSetStats {
         BlockHeight block_height;
         BlockHash block_hash;
-        size_t utxo_db_ct{}, shunspent_db_ct{};
+        size_t utxo_db_ct{}, shunspent_db_ct{}; ///< number of UTXOs in each db (these should be equal)
+        size_t utxo_db_bucket_ct{}; ///< number of (non-empty) utxoset keys; each holds 1 or more of the utxo_db_ct UTXOs
         size_t utxo_db_size_bytes{}, shunspent_db_size_bytes{};
         QByteArray utxo_db_shasum, shunspent_db_shasum; // sha256d sum of all key/value pairs in both dbs
     };
     /// Thread-safe. Call this from any thread, but ideally call it from a threadPool worker thread, since it may take
     /// a while. Will iterate over the entire utxoset db and scripthash_unspent db and return some stats. Used by
-    /// the /debug HTTP endpoint.
+    /// the /debug HTTP endpoint. Each db is read by several threads from a snapshot, but the sums are identical to
+    /// those of a serial scan.
     UTXOSetStats calcUTXOSetStats(const DumpProgressFunc & = {}, size_t progInterval = 100000) const;
 
     // --- Initial synch support ---
@@ -514,6 +568,10 @@ protected:
     /// If this is true on startup, we know the RPA index must be inconsistent and we will run a full health check on
     /// the rpa table and attempt to fix it. Thread-safe, may throw.
     bool isRpaNeedsFullCheck() const;
+    /// The "rpa_version" key in the meta table: the row format version of the RPA db (see Pvt::RpaInfo::dbVersion).
+    /// Missing for DBs written by older Fulcrum. May throw.
+    std::optional<uint32_t> readRpaDBVersion() const;
+    void setRpaDBVersion(uint32_t version); ///< May throw.
 
 private:
     const std::shared_ptr<const Options> options;
@@ -528,10 +586,14 @@ private:
     void saveMeta_impl(); ///< This may throw if db error. Caller should hold locks or be in single-threaded mode.
 
     void loadCheckHeadersInDB(); ///< may throw -- called from startup()
+    void loadCheckUpgradeUTXOSetFormat(); ///< may throw -- called from startup() before loadCheckUTXOsInDB()
     void loadCheckUTXOsInDB(); ///< may throw -- called from startup()
     void loadCheckShunspentInDB(); ///< may throw -- called from startup()
     void loadCheckRpaDB(); ///< may throw -- called from startup()
     void loadCheckTxNumsFileAndBlkInfo(); ///< may throw -- called from startup()
+    /// Writes the blkInfos to a flat snapshot file (if the db is consistent), for loadCheckTxNumsFileAndBlkInfo to use
+    /// on next startup. Never throws. Called on shutdown from gentlyCloseAllDBs().
+    void saveBlkInfoSnapshot();
     void loadCheckTxHash2TxNumMgr(); ///< may throw -- called from startup()
     void loadCheckEarliestUndo(); ///< may throw -- called from startup()
     void checkUpgradeDBVersion(); ///< may throw -- called from startup() as the last thing
@@ -548,11 +610,39 @@ private:
     /// Only does something if options->compactDBs is true (iff --compact-dbs specified on CLI)
     void compactAllDBs();
 
+    /// Implementation for utxoGetFromDB. If trustSingleCandidate is true, skips resolving the TxHash of utxoset buckets
+    /// having a single entry. Only addBlock should use that mode, since it knows that the TXO in question must exist.
+    std::optional<TXOInfo> utxoGetFromDB_impl(const TXO &, bool throwIfMissing, bool trustSingleCandidate);
+
+    /// Called from addBlock with all locks held while in --utxo-ram mode. Enforces the memory budget (falling back to
+    /// bounded UTXOCache behavior if exceeded) and writes the in-RAM UTXO set to the DB at checkpoints. Returns true if
+    /// the DB now has the complete UTXO set (so that the dirty flag may be cleared).
+    bool utxoRamMaintenance_nolock(BlockHeight height);
+    /// Called after db.utxoCache has been reset (flushed) to leave --utxo-ram mode, clearing the dirty flag if safe.
+    void endUtxoRamMode_nolock();
+
     // Called by heightForTxNum which calls this with the blockInfo lock held
     std::optional<unsigned> heightForTxNum_nolock(TxNum) const;
+    // Returns idx if `idx` is the height of the block containing n, else nullopt. Call with the blockInfo lock held.
+    std::optional<unsigned> heightForTxNumCheck_nolock(TxNum n, int64_t idx) const;
+
+    /// Called by txHashesForBlockInBitcoindMemoryOrder and merkleTreeForBlock with p->rewindLock held (shared)
+    std::vector<TxHash> txHashesForBlockInBitcoindMemoryOrder_nolock(BlockHeight height) const;
 
     /// Writes to the RPA table. Called from addBlock()
     void addRpaDataForHeight_nolock(BlockHeight height, const QByteArray &serializedRpaPrefixTable);
+
+#ifdef ENABLE_TESTS
+public:
+    /// Checks that the --utxo-ram mode (UTXOCache + checkpoints + budget fall-back) leaves the utxoset and
+    /// scripthash_unspent dbs with the same contents as the direct, uncached path. Throws on setup failure.
+    static void utxoRamTest();
+    /// Checks that undoLatestBlock waits for readers holding rewindLock, then publishes a read view without the undone
+    /// blocks, while views taken before it stay intact.
+    static void readViewReorgTest();
+    /// Checks that, while blocks are being added, every read made through one read view agrees with that view's tip.
+    static void readViewConcurrentAddTest();
+#endif
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(Storage::SaveSpec)
@@ -17,17 +17,120 @@
 // <https://www.gnu.org/licenses/>.
 //
 #include "ThreadPool.h"
+#include "LatencyHistogram.h"
 #include "Util.h"
 
-#include <QThreadPool>
+#include <QThread>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace {
     constexpr bool debugPrt = false;
-}
 
+    /// The jobs waiting in 1 lane. Jobs are queued per context, and the contexts are served round-robin.
+    struct LaneQueue {
+        struct Entry {
+            Job *job;
+            qint64 tEnqueued; ///< usec, for the wait time histogram
+        };
+        std::unordered_map<const QObject *, std::deque<Entry>> byContext;
+        std::deque<const QObject *> order; ///< the contexts in byContext, in the order they will next be served
+        size_t depth = 0, depthMaxSeen = 0;
+        int running = 0;
+        uint64_t nRun = 0;
+        LatencyHistogram waitUsec; ///< thread-safe, so it's recorded-to without the lock held
+
+        void push(const QObject *context, Job *job, qint64 now) {
+            auto & q = byContext[context];
+            if (q.empty()) order.push_back(context);
+            q.push_back({job, now});
+            depthMaxSeen = std::max(depthMaxSeen, ++depth);
+        }
+        Entry pop() { // precondition: depth > 0
+            const QObject *context = order.front();
+            order.pop_front();
+            const auto it = byContext.find(context);
+            auto & q = it->second;
+            const Entry ret = q.front();
+            q.pop_front();
+            if (q.empty()) byContext.erase(it);
+            else order.push_back(context); // go to the back of the line
+            --depth;
+            return ret;
+        }
+        void clear(std::vector<Job *> &jobsOut) {
+            for (auto & [context, q] : byContext)
+                for (const auto & e : q)
+                    jobsOut.push_back(e.job);
+            byContext.clear();
+            order.clear();
+            depth = 0;
+        }
+    };
+} // namespace
+
+struct ThreadPool::Pvt {
+    /// While the Heavy lane may run, every this many picks prefer it over the Normal lane (so it can't starve)
+    static constexpr unsigned kHeavyPickInterval = 4;
+
+    std::mutex mut;
+    std::condition_variable workCond; ///< signaled when there is new work (or on quit)
+    std::condition_variable idleCond; ///< signaled when nRunning drops to 0 or a thread exits
+    // all of the below are guarded by mut
+    std::array<LaneQueue, NumLanes> lanes;
+    std::vector<std::thread> threads;
+    std::vector<std::thread::id> exited; ///< threads that exited because setMaxThreadCount() shrank us, to be joined
+    int nThreads = 0, nIdle = 0, nRunning = 0;
+    unsigned pickCtr = 0;
+    bool quit = false;
+    std::atomic_int maxThreads = std::max(QThread::idealThreadCount(), 1); ///< written with mut held
+
+    LaneQueue & lane(Lane l) { return lanes[size_t(l)]; }
+    /// Call with mut held. The number of jobs waiting in all lanes.
+    size_t queued() const {
+        size_t n = 0;
+        for (const auto & lq : lanes) n += lq.depth;
+        return n;
+    }
+
+    static int heavyLimit(int nMax) { return nMax > 1 ? std::max(1, nMax - std::max(1, nMax / 4)) : 1; }
+
+    /// Call with mut held. Joins and forgets the threads in `exited`. Those threads released mut for the last time
+    /// just before returning, so this never waits for long.
+    void reapExited() {
+        for (const auto id : exited) {
+            const auto it = std::find_if(threads.begin(), threads.end(), [id](const std::thread &t){ return t.get_id() == id; });
+            if (it == threads.end()) continue; // paranoia
+            it->join();
+            threads.erase(it);
+        }
+        exited.clear();
+    }
+
+    /// Call with mut held. Returns the next job to run and the lane it came from, if any job may run now.
+    std::optional<std::pair<LaneQueue::Entry, Lane>> takeNext() {
+        auto & normal = lane(Lane::Normal), & heavy = lane(Lane::Heavy);
+        const bool heavyOk = heavy.depth && heavy.running < heavyLimit(maxThreads);
+        if (heavyOk && (!normal.depth || ++pickCtr % kHeavyPickInterval == 0))
+            return std::pair{heavy.pop(), Lane::Heavy};
+        if (normal.depth)
+            return std::pair{normal.pop(), Lane::Normal};
+        return std::nullopt;
+    }
+};
 
 ThreadPool::ThreadPool(QObject *parent)
-    : QObject(parent), pool(std::make_unique<QThreadPool>(this))
+    : QObject(parent), p(std::make_unique<Pvt>())
 {
 }
 
@@ -36,16 +139,26 @@ ThreadPool::~ThreadPool()
     shutdownWaitForJobs();
 }
 
+/* static */
+const char *ThreadPool::laneName(Lane l) noexcept
+{
+    switch (l) {
+    case Lane::Normal: return "normal";
+    case Lane::Heavy: return "heavy";
+    }
+    return "unknown";
+}
+
 
-Job::Job(QObject *context, ThreadPool *pool, const VoidFunc & work, const VoidFunc & completion, const FailFunc &fail) noexcept
-    : QObject(nullptr), pool(pool), work(work), weakContextRef(context ? context : pool)
+Job::Job(QObject *context, ThreadPool *pool, VoidFunc && work, VoidFunc && completion, FailFunc && fail) noexcept
+    : QObject(nullptr), pool(pool), work(std::move(work)), weakContextRef(context ? context : pool)
 {
     if (!context && (completion || fail))
         Debug(Log::Magenta) << "Warning: use of ThreadPool jobs without a context is not recommended, FIXME!";
     if (completion)
-        connect(this, &Job::completed, context ? context : pool, [completion]{ completion(); });
+        connect(this, &Job::completed, context ? context : pool, [completion = std::move(completion)]{ completion(); });
     if (fail)
-        connect(this, &Job::failed, context ? context : pool, [fail](const QString &err){ fail(err); });
+        connect(this, &Job::failed, context ? context : pool, [fail = std::move(fail)](const QString &err){ fail(err); });
 }
 Job::~Job() {}
 
@@ -77,7 +190,7 @@ void Job::run() {
     emit completed();
 }
 
-void ThreadPool::submitWork(QObject *context, const VoidFunc & work, const VoidFunc & completion, const FailFunc & fail, int priority)
+void ThreadPool::submitWork(QObject *context, VoidFunc work, VoidFunc completion, FailFunc fail, Lane lane)
 {
     if (blockNewWork) {
         Debug() << __func__ << ": Ignoring new work submitted because blockNewWork = true";
@@ -86,14 +199,11 @@ void ThreadPool::submitWork(QObject *context, const VoidFunc & work, const VoidF
     static const FailFunc defaultFail = [](const QString &msg) {
             Warning() << "A ThreadPool job failed with the error message: " << msg;
     };
-    const FailFunc & failFuncToUse (fail ? fail : defaultFail);
-    Job *job = new Job(context, this, work, completion, failFuncToUse);
-    QObject::connect(job, &QObject::destroyed, this, [this](QObject *){ --extant;}, Qt::DirectConnection);
+    if (!fail) fail = defaultFail;
     if (const auto njobs = ++extant; njobs > extantLimit) {
+        --extant;
         ++noverflows;
-        delete job; // will decrement extant on delete
-        const auto msg = QString("Job limit exceeded (%1)").arg(njobs);
-        failFuncToUse(msg);
+        fail(QString("Job limit exceeded (%1)").arg(njobs));
         return;
     } else if (UNLIKELY(njobs < 0)) {
         // should absolutely never happen.
@@ -101,7 +211,8 @@ void ThreadPool::submitWork(QObject *context, const VoidFunc & work, const VoidF
     } else if (njobs > extantMaxSeen)
         // FIXME: this isn't entirely atomic but this value is for diagnostic purposes and doesn't need to be strictly correct
         extantMaxSeen = njobs;
-    job->setAutoDelete(true);
+    Job *job = new Job(context, this, std::move(work), std::move(completion), std::move(fail));
+    QObject::connect(job, &QObject::destroyed, this, [this](QObject *){ --extant;}, Qt::DirectConnection); // balances the ++extant above
     const auto num = ++ctr;
     job->setObjectName(QStringLiteral("Job %1 for '%2'").arg(num).arg( context ? context->objectName() : QStringLiteral("<no context>")));
     if constexpr (debugPrt) {
@@ -115,7 +226,50 @@ void ThreadPool::submitWork(QObject *context, const VoidFunc & work, const VoidF
             Debug() << n << " -- failed: " << msg;
         }, Qt::DirectConnection);
     }
-    pool->start(job, priority);
+    {
+        std::unique_lock g(p->mut);
+        p->reapExited();
+        p->lane(lane).push(context, job, Util::getTimeMicros());
+        // Start threads on demand, up to maxThreads, as long as there are more jobs waiting than idle threads to take
+        // them. NB: a woken thread stays in nIdle until it gets mut back and takes a job, so each idle thread can
+        // absorb exactly 1 of the queued jobs; don't let a burst queue up behind a single one of them.
+        if (p->queued() > size_t(p->nIdle) && p->nThreads < p->maxThreads) {
+            ++p->nThreads;
+            p->threads.emplace_back([this]{ workerThreadFunc(); });
+        }
+    }
+    p->workCond.notify_one();
+}
+
+void ThreadPool::workerThreadFunc()
+{
+    std::unique_lock g(p->mut);
+    while (!p->quit && p->nThreads <= p->maxThreads) { // exit if quitting or if setMaxThreadCount() shrank us
+        auto next = p->takeNext();
+        if (!next) {
+            ++p->nIdle;
+            p->workCond.wait(g);
+            --p->nIdle;
+            continue;
+        }
+        auto & [entry, lane] = *next;
+        auto & lq = p->lane(lane);
+        ++lq.running;
+        ++p->nRunning;
+        g.unlock();
+        lq.waitUsec.record(Util::getTimeMicros() - entry.tEnqueued);
+        entry.job->run();
+        delete entry.job;
+        g.lock();
+        --lq.running;
+        ++lq.nRun;
+        if (!--p->nRunning)
+            p->idleCond.notify_all();
+    }
+    --p->nThreads;
+    if (!p->quit)
+        p->exited.push_back(std::this_thread::get_id()); // we can't join ourselves, so leave it to reapExited()
+    p->idleCond.notify_all();
 }
 
 bool ThreadPool::shutdownWaitForJobs(int timeout_ms)
@@ -124,8 +278,31 @@ bool ThreadPool::shutdownWaitForJobs(int timeout_ms)
     if constexpr (debugPrt) {
         Debug() << __func__ << ": waiting for jobs ...";
     }
-    pool->clear();
-    return pool->waitForDone(timeout_ms);
+    std::vector<Job *> discarded;
+    std::vector<std::thread> threads;
+    bool ok;
+    {
+        std::unique_lock g(p->mut);
+        for (auto & lq : p->lanes)
+            lq.clear(discarded);
+        const auto pred = [this]{ return !p->nRunning; };
+        if (timeout_ms < 0) {
+            p->idleCond.wait(g, pred);
+            ok = true;
+        } else
+            ok = p->idleCond.wait_for(g, std::chrono::milliseconds(timeout_ms), pred);
+        if (ok) {
+            p->quit = true;
+            p->exited.clear(); // they are all joined below
+            threads.swap(p->threads);
+        }
+    }
+    p->workCond.notify_all();
+    for (auto & t : threads)
+        t.join();
+    for (Job *job : discarded)
+        delete job;
+    return ok;
 }
 
 int ThreadPool::extantJobs() const noexcept { return extant.load(); }
@@ -139,13 +316,19 @@ bool ThreadPool::setExtantJobLimit(int limit)  noexcept {
 }
 uint64_t ThreadPool::numJobsSubmitted() const noexcept { return ctr.load(); }
 uint64_t ThreadPool::overflows() const noexcept { return noverflows.load(); }
-int ThreadPool::maxThreadCount() const noexcept { return pool->maxThreadCount(); }
+int ThreadPool::maxThreadCount() const noexcept { return p->maxThreads.load(); }
 bool ThreadPool::setMaxThreadCount(int max) {
     if (max < 1)
         return false;
-    pool->setMaxThreadCount(max);
-    return pool->maxThreadCount() == max;
+    {
+        std::unique_lock g(p->mut);
+        p->reapExited();
+        p->maxThreads = max;
+    }
+    p->workCond.notify_all(); // so that surplus idle threads (if any) exit
+    return true;
 }
+int ThreadPool::heavyLaneThreadLimit() const noexcept { return Pvt::heavyLimit(p->maxThreads); }
 
 QVariantMap ThreadPool::stats() const noexcept
 {
@@ -156,5 +339,208 @@ QVariantMap ThreadPool::stats() const noexcept
     m["job count (lifetime)"] = qulonglong(numJobsSubmitted());
     m["job queue overflows (lifetime)"] = qulonglong(overflows());
     m["thread count (max)"] = maxThreadCount();
+    m["thread count (heavy lane max)"] = heavyLaneThreadLimit();
+    QVariantMap lanes;
+    {
+        std::unique_lock g(p->mut);
+        m["thread count"] = p->nThreads;
+        m["thread count (exited, not yet joined)"] = int(p->exited.size());
+        for (unsigned i = 0; i < NumLanes; ++i) {
+            const auto & lq = p->lanes[i];
+            lanes[laneName(Lane(i))] = QVariantMap{
+                { "queue depth", qulonglong(lq.depth) },
+                { "queue depth (max lifetime)", qulonglong(lq.depthMaxSeen) },
+                { "queued clients", qulonglong(lq.byContext.size()) },
+                { "running", lq.running },
+                { "job count (lifetime)", qulonglong(lq.nRun) },
+                { "queue wait usec", lq.waitUsec.toMap() },
+            };
+        }
+    }
+    m["lanes"] = lanes;
     return m;
 }
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+#include "tests/Tests.h"
+
+namespace {
+    /// Blocks the jobs that call wait() until open() is called
+    class Gate {
+        std::mutex mut;
+        std::condition_variable cond;
+        bool isOpen = false;
+        int nWaiting = 0;
+    public:
+        void wait() {
+            std::unique_lock g(mut);
+            ++nWaiting;
+            cond.notify_all();
+            cond.wait(g, [this]{ return isOpen; });
+        }
+        void open() { std::lock_guard g(mut); isOpen = true; cond.notify_all(); }
+        /// Waits for n jobs to be blocked in wait(). Returns false on timeout.
+        bool waitForWaiters(int n, int timeout_ms = 5000) {
+            std::unique_lock g(mut);
+            return cond.wait_for(g, std::chrono::milliseconds(timeout_ms), [&]{ return nWaiting >= n; });
+        }
+    };
+
+    /// Polls pred() until it is true. Returns false on timeout.
+    template <typename Pred>
+    bool waitUntil(Pred && pred, int timeout_ms = 5000) {
+        for (const Tic t0; !pred(); std::this_thread::sleep_for(std::chrono::milliseconds(1)))
+            if (t0.msec<int>() > timeout_ms) return false;
+        return true;
+    }
+
+    /// Records the order in which jobs ran
+    struct Order {
+        std::mutex mut;
+        std::vector<QString> tags;
+        void add(const QString &tag) { std::lock_guard g(mut); tags.push_back(tag); }
+    };
+
+    TEST_SUITE(threadpool)
+
+    TEST_CASE(contexts_round_robin) {
+        ThreadPool pool;
+        pool.setMaxThreadCount(1);
+        Gate gate;
+        Order order;
+        QObject a, b, c;
+        pool.submitWork(&a, [&]{ gate.wait(); });
+        TEST_CHECK(gate.waitForWaiters(1));
+        // `a` queues a big batch before the others show up, yet they must not have to wait for all of it
+        for (int i = 0; i < 6; ++i) pool.submitWork(&a, [&, i]{ order.add(QString("a%1").arg(i)); });
+        for (int i = 0; i < 3; ++i) pool.submitWork(&b, [&, i]{ order.add(QString("b%1").arg(i)); });
+        for (int i = 0; i < 2; ++i) pool.submitWork(&c, [&, i]{ order.add(QString("c%1").arg(i)); });
+        gate.open();
+        TEST_CHECK(waitUntil([&]{ return pool.extantJobs() == 0; }));
+        const QStringList got(order.tags.begin(), order.tags.end());
+        Log() << "order: " << got.join(" ");
+        TEST_CHECK_EQUAL(got.join(" "), QString("a0 b0 c0 a1 b1 c1 a2 b2 a3 a4 a5"));
+    };
+
+    TEST_CASE(heavy_lane_cannot_starve_or_monopolize) {
+        ThreadPool pool;
+        pool.setMaxThreadCount(1);
+        Gate gate;
+        Order order;
+        pool.submitWork(nullptr, [&]{ gate.wait(); });
+        TEST_CHECK(gate.waitForWaiters(1));
+        QObject ctx;
+        for (int i = 0; i < 4; ++i) pool.submitWork(&ctx, [&]{ order.add("H"); }, {}, {}, ThreadPool::Lane::Heavy);
+        for (int i = 0; i < 8; ++i) pool.submitWork(&ctx, [&]{ order.add("N"); }, {}, {}, ThreadPool::Lane::Normal);
+        gate.open();
+        TEST_CHECK(waitUntil([&]{ return pool.extantJobs() == 0; }));
+        const QStringList got(order.tags.begin(), order.tags.end());
+        Log() << "order: " << got.join("");
+        // the Normal lane goes first, but every 4th pick goes to the waiting Heavy lane
+        TEST_CHECK_EQUAL(got.join(""), QString("NNNHNNNHNNHH"));
+
+        // with more threads, Heavy jobs may only occupy heavyLaneThreadLimit() of them, leaving the rest for Normal
+        ThreadPool pool2;
+        pool2.setMaxThreadCount(4);
+        TEST_CHECK_EQUAL(pool2.heavyLaneThreadLimit(), 3);
+        Gate gate2;
+        std::atomic_int heavyRunning = 0, heavyMaxSeen = 0;
+        for (int i = 0; i < 10; ++i)
+            pool2.submitWork(&ctx, [&]{
+                const int n = ++heavyRunning;
+                for (int m = heavyMaxSeen; n > m && !heavyMaxSeen.compare_exchange_weak(m, n); ) {}
+                gate2.wait();
+                --heavyRunning;
+            }, {}, {}, ThreadPool::Lane::Heavy);
+        TEST_CHECK(gate2.waitForWaiters(3));
+        std::atomic_bool normalRan = false;
+        pool2.submitWork(&ctx, [&]{ normalRan = true; });
+        TEST_CHECK_MESSAGE(waitUntil([&]{ return normalRan.load(); }), "Normal job runs while Heavy jobs saturate their limit");
+        gate2.open();
+        TEST_CHECK(waitUntil([&]{ return pool2.extantJobs() == 0; }));
+        TEST_CHECK_EQUAL(heavyMaxSeen.load(), 3);
+    };
+
+    TEST_CASE(thread_and_backlog_limits) {
+        ThreadPool pool;
+        pool.setMaxThreadCount(4);
+        Gate gate;
+        std::atomic_int running = 0, maxSeen = 0;
+        const auto job = [&]{
+            const int n = ++running;
+            for (int m = maxSeen; n > m && !maxSeen.compare_exchange_weak(m, n); ) {}
+            gate.wait();
+            --running;
+        };
+        TEST_CHECK(pool.setExtantJobLimit(10));
+        TEST_CHECK(!pool.setExtantJobLimit(9));
+        int nFailed = 0;
+        const auto fail = [&nFailed](const QString &) { ++nFailed; }; // called synchronously on overflow
+        for (int i = 0; i < 15; ++i)
+            pool.submitWork(nullptr, job, {}, fail);
+        TEST_CHECK(gate.waitForWaiters(4));
+        TEST_CHECK_EQUAL(nFailed, 5);
+        TEST_CHECK_EQUAL(pool.overflows(), uint64_t(5));
+        TEST_CHECK_EQUAL(pool.extantJobs(), 10);
+        TEST_CHECK_EQUAL(pool.stats().value("thread count").toInt(), 4);
+        gate.open();
+        TEST_CHECK(waitUntil([&]{ return pool.extantJobs() == 0; }));
+        TEST_CHECK_EQUAL(maxSeen.load(), 4);
+
+        // shrinking: the surplus threads exit and are joined on the next submit (or setMaxThreadCount)
+        TEST_CHECK(!pool.setMaxThreadCount(0));
+        TEST_CHECK(pool.setMaxThreadCount(1));
+        TEST_CHECK(waitUntil([&]{ return pool.stats().value("thread count").toInt() == 1; }));
+        std::atomic_bool ran = false;
+        pool.submitWork(nullptr, [&]{ ran = true; });
+        TEST_CHECK(waitUntil([&]{ return ran.load(); }));
+        const auto stats = pool.stats();
+        TEST_CHECK_EQUAL(stats.value("thread count").toInt(), 1);
+        TEST_CHECK_EQUAL(stats.value("thread count (exited, not yet joined)").toInt(), 0);
+    };
+
+    TEST_CASE(burst_spawns_threads) {
+        // 1 idle worker, then a burst of blocking jobs submitted back-to-back, with nothing after it: each job must get
+        // its own thread, rather than queue up behind the idle one (which won't have woken up yet)
+        constexpr int N = 6;
+        ThreadPool pool;
+        pool.setMaxThreadCount(8);
+        std::atomic_bool ran = false;
+        pool.submitWork(nullptr, [&]{ ran = true; });
+        TEST_CHECK(waitUntil([&]{ return ran.load() && pool.extantJobs() == 0; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)); // let the worker go idle
+        TEST_CHECK_EQUAL(pool.stats().value("thread count").toInt(), 1);
+        Gate gate;
+        for (int i = 0; i < N; ++i)
+            pool.submitWork(nullptr, [&]{ gate.wait(); });
+        TEST_CHECK_MESSAGE(gate.waitForWaiters(N), "all of the burst's jobs run at once");
+        TEST_CHECK_EQUAL(pool.stats().value("thread count").toInt(), N);
+        gate.open();
+        TEST_CHECK(waitUntil([&]{ return pool.extantJobs() == 0; }));
+    };
+
+    TEST_CASE(shutdown_wait_for_jobs) {
+        ThreadPool pool;
+        pool.setMaxThreadCount(1);
+        Gate gate;
+        std::atomic_int nRan = 0;
+        pool.submitWork(nullptr, [&]{ gate.wait(); ++nRan; });
+        TEST_CHECK(gate.waitForWaiters(1));
+        for (int i = 0; i < 5; ++i) pool.submitWork(nullptr, [&]{ ++nRan; });
+        TEST_CHECK_MESSAGE(!pool.shutdownWaitForJobs(50), "times out while a job is still running");
+        TEST_CHECK(pool.isShuttingDown());
+        TEST_CHECK_MESSAGE(pool.extantJobs() == 1, "queued jobs that never started were discarded");
+        pool.submitWork(nullptr, [&]{ ++nRan; });
+        TEST_CHECK_MESSAGE(pool.extantJobs() == 1, "new work is rejected once shutting down");
+        gate.open();
+        TEST_CHECK(pool.shutdownWaitForJobs());
+        TEST_CHECK_EQUAL(nRan.load(), 1);
+        TEST_CHECK_EQUAL(pool.extantJobs(), 0);
+        TEST_CHECK(pool.shutdownWaitForJobs(0)); // idempotent
+    };
+
+    TEST_SUITE_END()
+} // namespace
+#endif
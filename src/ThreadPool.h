@@ -20,20 +20,23 @@
 
 #include <QObject>
 #include <QPointer>
-#include <QRunnable>
+#include <QVariantMap>
 
 #include <atomic>
+#include <cstdint>
 #include <functional>
 #include <memory>
 
-class QThreadPool;
-
-/// A wrapper around QThreadPool, whereby all work is submitted via lambdas.  It also keeps some stats and
+/// A purpose-built pool of worker threads, whereby all work is submitted via lambdas.  It also keeps some stats and
 /// provides some limits on number of jobs that can be enqueued.  Currently, there is one of these globally
 /// owned by the 'App' object and accessible via ::AppThreadPool() (declared in App.h).
 ///
-/// Each instance of this class internally creates its own QThreadPool instance, thus each instance never conflicts with
-/// other thread pools such as the Qt-provided QThreadPool::globalInstance().
+/// Queued work is split into lanes (see Lane below), so that a burst of expensive requests cannot starve the cheap
+/// ones. Within a lane, work is queued per `context` object (typically a Client) and the contexts are served
+/// round-robin, so that one client's large batch cannot monopolize the workers while other clients wait.
+///
+/// Each instance of this class has its own threads, thus each instance never conflicts with other thread pools such
+/// as the Qt-provided QThreadPool::globalInstance().
 ///
 /// All of the public methods of this class are thread-safe.  None of the methods of this class throw.
 class ThreadPool : public QObject
@@ -49,11 +52,21 @@ public:
     using FailFunc = std::function<void(const QString &)>;
     using VoidFunc = std::function<void()>;
 
+    /// Which queue a job waits in. Workers serve the Normal lane first, and at most heavyLaneThreadLimit() workers may
+    /// be running Heavy jobs at once, so that some workers are always left for the Normal lane. (So that a Heavy lane
+    /// that is long can't wait forever behind a never-empty Normal lane, every few picks prefer the Heavy lane.)
+    enum class Lane : uint8_t {
+        Normal, ///< cheap and/or bounded work (headers, balance, merkle proofs, etc), and anything unclassified
+        Heavy,  ///< potentially expensive work whose cost grows with the data (get_history, listunspent, etc)
+    };
+    static constexpr unsigned NumLanes = 2;
+    static const char *laneName(Lane) noexcept;
+
     /// Submit work to be performed asynchronously from a thread pool thread.
     ///
-    /// `work` is called in the context of one of this instance's QThreadPool threads (it should lambda-capture all
-    /// data it needs to compute its results). It may throw, in which case `fail` (if specified) is invoked with the
-    /// exception.what() message.
+    /// `work` is called in the context of one of this instance's threads (it should lambda-capture all data it needs
+    /// to compute its results). It may throw, in which case `fail` (if specified) is invoked with the exception.what()
+    /// message.
     ///
     /// `completion` will be called in the context of `context`'s thread. If `context` dies before the work
     /// is completed, completion will never be called.
@@ -71,8 +84,11 @@ public:
     ///
     /// Using shared_ptr to share data between `work` and `completion` (via lambda-capture) is thus the intended
     /// way to use this mechanism.
-    void submitWork(QObject *context, const VoidFunc & work, const VoidFunc & completion = VoidFunc(),
-                    const FailFunc & fail = FailFunc(), int priority = 0);
+    ///
+    /// `lane` selects the queue the job waits in (see Lane). Within a lane, jobs for the same `context` run in FIFO
+    /// order relative to each other (though they may run concurrently).
+    void submitWork(QObject *context, VoidFunc work, VoidFunc completion = VoidFunc(),
+                    FailFunc fail = FailFunc(), Lane lane = Lane::Normal);
 
     /// Call this on app or pool shutdown to wait for extant jobs that may be running to complete. This prevents jobs
     /// that are currently running from referencing data that may go away during shutdown (a situation that would cause
@@ -86,10 +102,9 @@ public:
     /// Returns true if the jobs completed before timeout_ms expired, or false otherwise.
     /// Negative timeout_ms indicates "wait forever" for jobs to complete.
     ///
-    /// This function should only ever be called once. After it is called, no more work can ever again be successfully
-    /// submitted to the ThreadPool instance (it latches a boolean that permanently blocks the creation of new jobs once
-    /// called). Note that after this function is called all extant jobs that may begin to run will exit immediately as
-    /// well (as a consequence of said "shutting down" boolean being true).
+    /// After this function is called, no more work can ever again be successfully submitted to the ThreadPool instance
+    /// (it latches a boolean that permanently blocks the creation of new jobs once called). Jobs that were queued but
+    /// had not started yet are discarded (their completion and fail functions are never called).
     ///
     /// Despite the lack of a noexcept declaration, this does not throw (however I cannot guarantee Qt code we call
     /// does not throw, hence the lack of noexcept here).
@@ -107,6 +122,8 @@ public:
     int maxThreadCount() const noexcept;
     /// Sets the maximum number of threads used by the pool. Cannot be set <1.  Returns true on success (usually this is the case).
     bool setMaxThreadCount(int max);
+    /// Returns the maximum number of workers that may be running Heavy lane jobs at once (a function of maxThreadCount).
+    int heavyLaneThreadLimit() const noexcept;
     /// Returns the number of lifetime job overflows (the number of times the job queue was full and work was rejected).
     /// Ideally this number is always 0 even under load.
     uint64_t overflows() const noexcept;
@@ -118,21 +135,25 @@ public:
     inline bool isShuttingDown() const noexcept { return blockNewWork.load(); }
 
     /// Thred-safe.  Returns some stats suitable for placing into a JSON object, etc. Used by the Controller as
-    /// well as the AdminServer classes.
+    /// well as the AdminServer classes. Includes per-lane queue depths and queue wait times.
     QVariantMap stats() const noexcept;
 
 private:
-    const std::unique_ptr<QThreadPool> pool;
+    struct Pvt;
+    const std::unique_ptr<Pvt> p;
     std::atomic_uint64_t ctr = 0, noverflows = 0;
     std::atomic_int extant = 0, extantMaxSeen = 0;
     std::atomic_bool blockNewWork = false;
     /// maximum number of extant jobs we allow before failing and not enqueuing more.
     std::atomic_int extantLimit = 15'000;
+
+    void workerThreadFunc();
 };
 
 /// Semi-private class not intended to be constructed by client code, but used inside ThreadPool::SubmitWork.
 /// We put it here because the meta object compiler needs to see it for signal/slot glue code generation.
-class Job : public QObject, public QRunnable {
+/// The signal connections to `context` are what guarantee that completion/fail are never called on a deleted context.
+class Job : public QObject {
     Q_OBJECT
 
     friend class ::ThreadPool;
@@ -145,12 +166,12 @@ class Job : public QObject, public QRunnable {
 
 
     Job(QObject *context, ThreadPool *pool,
-        const VoidFunc & work,
-        const VoidFunc & completion = VoidFunc(),
-        const FailFunc & = FailFunc()) noexcept;
+        VoidFunc && work,
+        VoidFunc && completion = VoidFunc(),
+        FailFunc && = FailFunc()) noexcept;
 
 public:
-    void run() override;
+    void run();
     ~Job() override;
 
 signals:
@@ -158,4 +179,3 @@ signals:
     void completed(); ///< calls completion in QObject context via a signal emit
     void failed(const QString &); ///< called if work() throws.
 };
-
@@ -36,12 +36,19 @@
 #include <QUrl>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstddef>
 #include <cstring>
 #include <limits>
 #include <memory>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace WebSocket
 {
     Error::~Error() {} // for vtable
@@ -49,6 +56,41 @@ namespace WebSocket
 
     using Byte = quint8;
 
+    namespace {
+        /// Writes src[i] ^ mask[i % 4] to dest[i], for all i < len (see RFC 6455, section 5.3). `dest` may equal `src`
+        /// (in-place) but they may not otherwise overlap. Works a SIMD register or machine word at a time, falling back
+        /// to single bytes only for the tail.
+        void maskCopy(Byte *dest, const Byte *src, std::size_t len, const Byte *mask) noexcept
+        {
+            std::size_t i = 0; // stays a multiple of 4 until the tail, so the mask stays lined up
+            quint32 m4;
+            std::memcpy(&m4, mask, 4);
+#if defined(__AVX2__)
+            const __m256i m32 = _mm256_set1_epi32(int(m4));
+            for ( ; i + 32u <= len; i += 32u) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + i), _mm256_xor_si256(v, m32));
+            }
+#endif
+#if defined(__SSE2__)
+            const __m128i m16 = _mm_set1_epi32(int(m4));
+            for ( ; i + 16u <= len; i += 16u) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), _mm_xor_si128(v, m16));
+            }
+#endif
+            const quint64 m8 = quint64(m4) << 32u | quint64(m4); // both halves equal, so byte order doesn't matter
+            for ( ; i + 8u <= len; i += 8u) {
+                quint64 w;
+                std::memcpy(&w, src + i, 8);
+                w ^= m8;
+                std::memcpy(dest + i, &w, 8);
+            }
+            for ( ; i < len; ++i)
+                dest[i] = src[i] ^ mask[i % 4u];
+        }
+    } // namespace
+
     QString frameTypeName(FrameType ft)
     {
         switch(ft) {
@@ -63,7 +105,46 @@ namespace WebSocket
     }
 
     namespace Ser {
+        namespace {
+            constexpr std::size_t kMaxHeaderLen = 2u + 8u + 4u; ///< opcode, length, extended length, mask
+
+            /// Writes a frame header (including the mask, if `pmask` is not null) to `dest`, which must have room for
+            /// kMaxHeaderLen bytes. Returns the number of bytes written.
+            std::size_t writeHeader(Byte *dest, Byte opcode, bool fin, std::size_t payloadLen, const Byte *pmask)
+            {
+                Byte * const begin = dest;
+                const Byte maskBit = pmask ? 0x80 : 0x0;
+                // FIN-bit is the MSB bit. It is set if this is the last (or only) frame
+                *dest++ = Byte( opcode | (fin ? 0x80 : 0x0) );
+                // write length byte(s)
+                if (payloadLen <= 125)
+                    *dest++ = Byte(payloadLen) | maskBit;
+                else if (payloadLen <= std::numeric_limits<std::uint16_t>::max()) {
+                    // >= 126, <= 65535
+                    *dest++ = Byte(126) | maskBit; // indicate extended payload (2 bytes)
+                    qToBigEndian(quint16(payloadLen), dest);
+                    dest += 2;
+                } else {
+                    // >= 65536
+                    *dest++ = Byte(127) | maskBit; // indicate extended payload (8 bytes)
+                    qToBigEndian(quint64(payloadLen), dest);
+                    dest += 8;
+                }
+                if (pmask) {
+                    // write the 4 mask bytes themselves to the header so that the other end can decode
+                    std::memcpy(dest, pmask, 4);
+                    dest += 4;
+                }
+                return std::size_t(dest - begin);
+            }
+        } // namespace
+
         QByteArray wrapPayload(const QByteArray &data, FrameType type, bool isMasked, std::size_t fragmentSize)
+        {
+            return wrapPayload(data.constData(), std::size_t(data.size()), type, isMasked, fragmentSize);
+        }
+
+        QByteArray wrapPayload(const char *data, std::size_t dataLen, FrameType type, bool isMasked, std::size_t fragmentSize)
         {
             const bool isCtl = type & 0x08;
             if (isCtl)
@@ -73,9 +154,9 @@ namespace WebSocket
                 throw BadArgs("fragmentSize may not be 0");
             if (fragmentSize > std::uint64_t(std::numeric_limits<std::int64_t>::max()))
                 throw BadArgs("fragmentSize cannot exceed a 63-bit size");
-            if (isCtl && data.size() > 125)
+            if (isCtl && dataLen > 125)
                 throw BadArgs("control frames may not exceed 125 bytes of payload data");
-            const auto dsize = std::size_t(data.size());
+            const auto dsize = dataLen;
             constexpr int maxUShort = std::numeric_limits<std::uint16_t>::max();
             fragmentSize = std::max(std::min(dsize, fragmentSize), std::size_t(1));
             const auto nFragments = std::max(std::size_t(1), std::size_t((dsize / fragmentSize) + (fragmentSize > 1UL && dsize % fragmentSize ? 1UL : 0UL)));
@@ -93,50 +174,24 @@ namespace WebSocket
             QByteArray ret(int(retSize), Qt::Uninitialized); // the last fragment here may contain too much data (at most 8 extra bytes)
             int nBytesRemain = int(dsize);
             Byte *dest = reinterpret_cast<Byte *>(ret.data());
-            const Byte *src = reinterpret_cast<const Byte *>(data.constData());
+            const Byte *src = reinterpret_cast<const Byte *>(data);
             Byte opcode = Byte(type); // we intentionally made the enum type match the opcodes defined in the RFC
-            const Byte maskBit = isMasked ? 0x80 : 0x0;
             assert(nFragments == 1 || type == Text || type == Binary);
             for (std::size_t i = 0; i < nFragments; ++i) {
                 const quint32 mask = isMasked ? QRandomGenerator::global()->generate() : 0U;
                 const Byte *pmask = reinterpret_cast<const Byte *>(isMasked ? &mask : nullptr);
-                // write opcode byte
-                *dest++ = Byte( opcode
-                                // FIN-bit is the MSB bit. It is set if this is the last (or only) frame
-                                | (i == nFragments-1 ? 0x80 : 0x0) );
-
                 const int bytes2write = std::min(nBytesRemain, int(fragmentSize));
-                // write length byte(s)
-                if (bytes2write <= 125)
-                    *dest++ = Byte(bytes2write) | maskBit;
-                else if (bytes2write <= maxUShort) {
-                    // >= 126, <= 65535
-                    *dest++ = Byte(126) | maskBit; // indicate extended payload (2 bytes)
-                    qToBigEndian(quint16(bytes2write), dest);
-                    dest += 2;
-                } else {
-                    // >= 65536
-                    *dest++ = Byte(127) | maskBit; // indicate extended payload (8 bytes)
-                    qToBigEndian(quint64(bytes2write), dest);
-                    dest += 8;
-                }
-                if (pmask == nullptr) {
-                    assert(!maskBit);
+                // header goes straight into the preallocated output buffer
+                dest += writeHeader(dest, opcode, i == nFragments-1, std::size_t(bytes2write), pmask);
+                if (pmask == nullptr)
                     // no mask, just write the frame data directly
                     std::memcpy(dest, src, std::size_t(bytes2write));
-                    // update positions
-                    dest += bytes2write;
-                    src += bytes2write;
-                } else {
-                    assert(maskBit);
+                else
                     // mask is set -- write the octets xor'd with the mask
-                    // first: write the 4 mask bytes themselves to the header so that the other end can decode
-                    std::memcpy(dest, pmask, 4);
-                    dest += 4;
-                    // next: write the payload xor'd with the mask bytes
-                    for (int j = 0; j < bytes2write; ++j)
-                        *dest++ = *src++ ^ pmask[j % 4];
-                }
+                    maskCopy(dest, src, std::size_t(bytes2write), pmask);
+                // update positions
+                dest += bytes2write;
+                src += bytes2write;
 
                 // update bytes remaining
                 nBytesRemain -= bytes2write;
@@ -173,8 +228,7 @@ namespace WebSocket
             inline constexpr auto kMessageTooBig1 = "invalid payload length (>INT_MAX!)";
 
             inline void applyMask(Byte *buf, unsigned bufLen, const Byte *mask) {
-                for (unsigned i = 0; i < bufLen; ++i)
-                    buf[i] = buf[i] ^ mask[i % 4];
+                maskCopy(buf, buf, bufLen, mask);
             }
 
             struct PartialFrame : public Frame {
@@ -1049,7 +1103,7 @@ namespace WebSocket
         TraceM("sending TEXT ", data.size(), " bytes");
         qint64 res = -1;
         try {
-            res = socket->write(Ser::wrapText(data, isMasked()));
+            res = writeFramed(data.constData(), std::size_t(data.size()), FrameType::Text);
         } catch (const std::exception & e) {
             ::Error() << "Wrapper::sendText caught exception: " << e.what();
         }
@@ -1064,7 +1118,7 @@ namespace WebSocket
         TraceM("sending BINARY ", data.size(), " bytes");
         qint64 res = -1;
         try {
-            res = socket->write(Ser::wrapBinary(data, isMasked()));
+            res = writeFramed(data.constData(), std::size_t(data.size()), FrameType::Binary);
         } catch (const std::exception & e) {
             ::Error() << "Wrapper::sendBinary caught exception: " << e.what();
         }
@@ -1075,6 +1129,31 @@ namespace WebSocket
         return -1;
     }
 
+    qint64 Wrapper::writeFramed(const char *data, std::size_t len, FrameType type)
+    {
+        if (isMasked())
+            // client mode: each fragment gets its own random mask, so the payload must be transformed anyway
+            return socket->write(Ser::wrapPayload(data, len, type, true));
+        // server mode: no mask, so write each fragment's header followed by the payload bytes as-is
+        constexpr std::size_t fragSize = DefaultFragmentSize;
+        const std::size_t nFragments = std::max<std::size_t>(1u, (len + fragSize - 1u) / fragSize);
+        std::array<Byte, Ser::kMaxHeaderLen> hdr;
+        Byte opcode = Byte(type);
+        qint64 total = 0;
+        for (std::size_t i = 0, pos = 0; i < nFragments; ++i) {
+            const std::size_t n = std::min(len - pos, fragSize);
+            const std::size_t hlen = Ser::writeHeader(hdr.data(), opcode, i == nFragments-1, n, nullptr);
+            const qint64 r1 = socket->write(reinterpret_cast<const char *>(hdr.data()), qint64(hlen));
+            const qint64 r2 = n ? socket->write(data + pos, qint64(n)) : 0;
+            if (r1 < 0 || r2 < 0)
+                return -1;
+            total += r1 + r2;
+            pos += n;
+            opcode = FrameType::_Continuation;
+        }
+        return total;
+    }
+
     void Wrapper::on_readyRead()
     {
         if (!isValid())
@@ -1181,7 +1260,7 @@ namespace WebSocket
             Warning() << "Wrapper::writeData: len " << len << " exceeds max " << max << ", will do a short write.";
             len = max;
         }
-        auto res = socket->write(Ser::wrapPayload(QByteArray(data, int(len)), FrameType(_messageMode), isMasked()));
+        auto res = writeFramed(data, std::size_t(len), FrameType(_messageMode));
         if (res > -1) {
             // Note: When socket->write() succeeds, it always returns the full buffer length (infinite write buffer!).
             emit bytesWritten(len);
@@ -1550,3 +1629,93 @@ namespace WebSocket {
 } // end namespace WebSocket
 
 #endif
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+#include "tests/Tests.h"
+
+#include <vector>
+
+namespace {
+    using WebSocket::Byte;
+
+    // the byte-at-a-time loop that Ser::wrapPayload and Deser::applyMask used before maskCopy()
+    void refMask(Byte *dest, const Byte *src, std::size_t len, const Byte *mask) {
+        for (std::size_t i = 0; i < len; ++i)
+            dest[i] = src[i] ^ mask[i % 4];
+    }
+
+    QByteArray randBytes(int n) {
+        QByteArray ret(n, Qt::Uninitialized);
+        for (auto & c : ret) c = char(QRandomGenerator::global()->generate());
+        return ret;
+    }
+
+    TEST_SUITE(websocket)
+    TEST_CASE(mask_and_framing) {
+        const Byte mask[4] = {0x12, 0x34, 0xab, 0xcd};
+
+        // maskCopy must agree with the reference loop for every length around the SIMD/word boundaries, for every
+        // misalignment of src/dest, and when done in-place
+        const QByteArray src = randBytes(300);
+        for (std::size_t off = 0; off < 8; ++off) {
+            for (std::size_t len = 0; len + off <= 280; ++len) {
+                const Byte *s = reinterpret_cast<const Byte *>(src.constData()) + off;
+                std::vector<Byte> a(len + 1, 0xee), b(len + 1, 0xee);
+                refMask(a.data(), s, len, mask);
+                WebSocket::maskCopy(b.data(), s, len, mask);
+                TEST_CHECK_MESSAGE(a == b, "maskCopy matches the reference byte loop (and writes no further than len)");
+                std::vector<Byte> c(s, s + len);
+                WebSocket::maskCopy(c.data(), c.data(), len, mask);
+                TEST_CHECK_MESSAGE(std::equal(c.begin(), c.end(), a.begin()), "in-place maskCopy matches the reference byte loop");
+            }
+        }
+
+        // frames produced by Ser must round-trip through Deser, masked or not, for sizes that exercise all 3 length
+        // encodings and fragmentation
+        for (const int size : {0, 1, 125, 126, 4095, 4096, 4097, 65535, 65536, 200'000}) {
+            const QByteArray payload = randBytes(size);
+            for (const bool masked : {false, true}) {
+                for (const std::size_t frag : {std::size_t(7), std::size_t(4096), std::size_t(1) << 20}) {
+                    QByteArray buf = WebSocket::Ser::wrapBinary(payload, masked, frag);
+                    const auto frames = WebSocket::Deser::parseBuffer(buf, masked ? WebSocket::Deser::RequireMasked
+                                                                                  : WebSocket::Deser::RequireUnmasked);
+                    TEST_CHECK_MESSAGE(buf.isEmpty(), "parseBuffer consumed the whole buffer");
+                    TEST_CHECK_MESSAGE(frames.size() == 1, "exactly 1 message parsed");
+                    if (frames.empty()) continue;
+                    TEST_CHECK_MESSAGE(frames.front().type == WebSocket::FrameType::Binary, "message type preserved");
+                    TEST_CHECK_MESSAGE(frames.front().payload == payload, "payload preserved");
+                }
+            }
+            // the raw-buffer overload is byte-for-byte identical to the QByteArray one when unmasked
+            TEST_CHECK_MESSAGE(WebSocket::Ser::wrapPayload(payload.constData(), std::size_t(payload.size()), WebSocket::FrameType::Text, false)
+                == WebSocket::Ser::wrapText(payload, false), "wrapPayload overloads agree");
+        }
+    };
+    TEST_SUITE_END()
+
+    void bench() {
+        constexpr int bufSize = 1 << 20, iters = 256; // 256 MiB in total per run
+        const QByteArray src = randBytes(bufSize);
+        QByteArray dst(bufSize, Qt::Uninitialized);
+        const Byte mask[4] = {0x12, 0x34, 0xab, 0xcd};
+        const auto *s = reinterpret_cast<const Byte *>(src.constData());
+        auto *d = reinterpret_cast<Byte *>(dst.data());
+        const auto run = [&](const char *what, auto && fn) {
+            const auto t0 = Util::getTimeNS();
+            for (int i = 0; i < iters; ++i) fn();
+            const double secs = (Util::getTimeNS() - t0) / 1e9;
+            Log() << what << ": " << QString::number(double(bufSize) * iters / (1024.0 * 1024.0) / secs, 'f', 1) << " MiB/sec";
+        };
+        run("mask, byte loop", [&]{ refMask(d, s, bufSize, mask); });
+        run("mask, maskCopy", [&]{ WebSocket::maskCopy(d, s, bufSize, mask); });
+        std::size_t nOut = 0;
+        run("wrapBinary, unmasked", [&]{ nOut += std::size_t(WebSocket::Ser::wrapBinary(src, false).size()); });
+        run("wrapBinary, masked", [&]{ nOut += std::size_t(WebSocket::Ser::wrapBinary(src, true).size()); });
+        Log() << "(" << nOut << " framed bytes produced)";
+    }
+
+    const auto bench_ = App::registerBench("websocket", &bench);
+} // namespace
+#endif // ENABLE_TESTS
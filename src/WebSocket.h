@@ -150,6 +150,9 @@ namespace WebSocket
         /// May also throw MessageTooBigError if:
         /// - the resuling data would exceed the maximum size of a QByteArray (currently INT_MAX)
         QByteArray wrapPayload(const QByteArray &data, FrameType type, bool isMasked, std::size_t fragmentSize = DefaultFragmentSize);
+        /// Identical to the above, but takes a raw buffer (avoids having to first copy `data` into a QByteArray).
+        QByteArray wrapPayload(const char *data, std::size_t dataLen, FrameType type, bool isMasked,
+                               std::size_t fragmentSize = DefaultFragmentSize);
 
         /// Convenience function that wraps 'data' using the 'Text' data frame opcode. Note that 'data' must be Utf8 encoded
         /// text or else the other side may terminate the connection.
@@ -564,6 +567,10 @@ namespace WebSocket
 
         void on_readyRead();
         inline bool isMasked() const { return _mode == ClientMode; }
+        /// Frames `data` as a Text or Binary message and writes it to the socket. In server mode (unmasked) the frame
+        /// headers and the payload slices are handed to the socket directly, without first assembling the whole
+        /// frame in a temporary buffer. Returns the socket->write() result (-1 on error). May throw.
+        qint64 writeFramed(const char *data, std::size_t len, FrameType type);
         QTimer *getPingTimer();
         static constexpr auto kPingTimer = "_Auto_Ping_";
         void miscCleanup();